@@ -19,6 +19,8 @@
 
 #include <vde3/common.h>
 #include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/pool.h>
 
 #include <limits.h>
 
@@ -49,7 +51,11 @@ int vde_connection_init(vde_connection *conn, vde_context *ctx,
   vde_assert(be_priv != NULL);
 
   conn->context = ctx;
+  conn->id = ++ctx->conn_ids;
   conn->max_pload = payload_size;
+  conn->offloads = 0;
+  conn->queue_maxbytes = VDE_CONNECTION_QUEUE_MAXBYTES;
+  conn->queue_maxlen = VDE_CONNECTION_QUEUE_MAXLEN;
   conn->be_write = be_write;
   conn->be_close = be_close;
   conn->be_priv = be_priv;
@@ -86,6 +92,30 @@ void vde_connection_set_callbacks(vde_connection *conn,
   conn->cb_priv = cb_priv;
 }
 
+void vde_connection_set_read_batch_cb(vde_connection *conn,
+                                      conn_read_batch_cb read_batch_cb)
+{
+  vde_assert(conn != NULL);
+
+  conn->read_batch_cb = read_batch_cb;
+}
+
+void vde_connection_set_write_batch_cb(vde_connection *conn,
+                                       conn_write_batch_cb write_batch_cb)
+{
+  vde_assert(conn != NULL);
+
+  conn->write_batch_cb = write_batch_cb;
+}
+
+void vde_connection_set_be_write_batch(vde_connection *conn,
+                                       conn_be_write_batch be_write_batch)
+{
+  vde_assert(conn != NULL);
+
+  conn->be_write_batch = be_write_batch;
+}
+
 unsigned int vde_connection_max_payload(vde_connection *conn)
 {
   vde_assert(conn != NULL);
@@ -93,6 +123,77 @@ unsigned int vde_connection_max_payload(vde_connection *conn)
   return conn->max_pload;
 }
 
+void vde_connection_set_max_payload(vde_connection *conn,
+                                    unsigned int payload_size)
+{
+  vde_assert(conn != NULL);
+  vde_assert(payload_size > 0 && payload_size <= conn->max_pload);
+
+  conn->max_pload = payload_size;
+}
+
+void vde_connection_set_offloads(vde_connection *conn, unsigned int offloads)
+{
+  vde_assert(conn != NULL);
+  vde_assert((offloads & ~VDE_PKT_META_OFFLOAD) == 0);
+
+  conn->offloads = offloads;
+}
+
+int vde_connection_write_offload(vde_connection *conn, vde_pkt *pkt)
+{
+  vde_pkt *linear, *seg;
+  unsigned int i, count;
+  int ret = 0;
+
+  vde_assert(conn != NULL);
+
+  // a private copy, offloads are done in place
+  linear = vde_pkt_dup(pkt, vde_pkt_get_headsize(pkt), 0);
+  if (linear == NULL) {
+    vde_warning("%s: cannot copy packet, discarding", __PRETTY_FUNCTION__);
+    return -1;
+  }
+
+  if (!(linear->meta.flags & VDE_PKT_META_GSO) ||
+      (conn->offloads & VDE_PKT_META_GSO)) {
+    if (!(conn->offloads & VDE_PKT_META_CSUM) &&
+        (linear->meta.flags & VDE_PKT_META_CSUM) &&
+        vde_pkt_csum_complete(linear)) {
+      vde_warning("%s: invalid checksum offload, discarding",
+                  __PRETTY_FUNCTION__);
+      vde_pkt_put(linear);
+      return -1;
+    }
+    ret = conn->be_write(conn, linear);
+    vde_pkt_put(linear);
+    return ret;
+  }
+
+  count = vde_pkt_gso_count(linear);
+  if (count == 0) {
+    vde_warning("%s: invalid segmentation offload, discarding",
+                __PRETTY_FUNCTION__);
+    vde_pkt_put(linear);
+    errno = EINVAL;
+    return -1;
+  }
+  // segments have their checksums computed
+  for (i = 0; i < count && ret == 0; i++) {
+    seg = vde_pkt_gso_segment(linear, i);
+    if (seg == NULL) {
+      vde_warning("%s: cannot segment packet, discarding",
+                  __PRETTY_FUNCTION__);
+      ret = -1;
+      break;
+    }
+    ret = conn->be_write(conn, seg);
+    vde_pkt_put(seg);
+  }
+  vde_pkt_put(linear);
+  return ret;
+}
+
 void vde_connection_set_pkt_properties(vde_connection *conn,
                                        unsigned int head_sz,
                                        unsigned int tail_sz)
@@ -115,6 +216,43 @@ void vde_connection_set_send_properties(vde_connection *conn,
   timeradd(&conn->send_maxtimeout, max_timeout, &conn->send_maxtimeout);
 }
 
+void vde_connection_set_queue_properties(vde_connection *conn,
+                                         unsigned long max_bytes,
+                                         unsigned int max_len)
+{
+  vde_assert(conn != NULL);
+  vde_assert(max_len > 0);
+
+  conn->queue_maxbytes = max_bytes;
+  conn->queue_maxlen = max_len;
+}
+
+int vde_connection_queue_reserve(vde_connection *conn, unsigned int len)
+{
+  vde_assert(conn != NULL);
+
+  if (conn->queue_maxbytes && conn->queue_bytes + len > conn->queue_maxbytes) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  if (vde_pool_queue_charge(vde_context_get_pool(conn->context), len,
+                            conn->queue_bytes)) {
+    return -1;
+  }
+  conn->queue_bytes += len;
+  return 0;
+}
+
+void vde_connection_queue_release(vde_connection *conn, unsigned int len)
+{
+  vde_assert(conn != NULL);
+  vde_assert(conn->queue_bytes >= len);
+
+  conn->queue_bytes -= len;
+  vde_pool_queue_uncharge(vde_context_get_pool(conn->context), len,
+                          conn->queue_bytes);
+}
+
 void vde_connection_set_attributes(vde_connection *conn,
                                    vde_attributes *attributes)
 {
@@ -59,6 +59,37 @@ static vde_module *vde_context_lookup_module(vde_context *ctx,
   return NULL;
 }
 
+/**
+ * @brief Raise queue_watermark on the components which have it when the queues
+ * of the context cross the watermark
+ *
+ * @param over Nonzero if early drops started, zero if they stopped
+ * @param bytes The bytes queued
+ * @param arg The context
+ */
+static void vde_context_queue_watermark(int over, unsigned long bytes,
+                                        void *arg)
+{
+  vde_ordhash_entry *components_iter;
+  vde_component *component;
+  vde_sobj *info;
+  vde_context *ctx = (vde_context *)arg;
+
+  info = vde_sobj_new_array();
+  // XXX check info not null
+  vde_sobj_array_add(info, vde_sobj_new_bool(over));
+  vde_sobj_array_add(info, vde_sobj_new_double(bytes));
+
+  components_iter = vde_ordhash_first(ctx->components);
+  while (components_iter != NULL) {
+    component = (vde_component *)vde_ordhash_entry_lookup(ctx->components,
+                                                          components_iter);
+    vde_component_signal_raise(component, "queue_watermark", info);
+    components_iter = vde_ordhash_next(components_iter);
+  }
+  vde_sobj_put(info);
+}
+
 int vde_context_new(vde_context **ctx)
 {
   if (!ctx) {
@@ -76,7 +107,7 @@ int vde_context_new(vde_context **ctx)
 }
 
 int vde_context_init(vde_context *ctx, vde_event_handler *handler,
-                     char **modules_path)
+                     char **modules_path, vde_pool_params *pool_params)
 {
   int tmp_errno;
 
@@ -93,10 +124,19 @@ int vde_context_init(vde_context *ctx, vde_event_handler *handler,
     errno = EINVAL;
     return -1;
   }
+  ctx->pool = vde_pool_new(pool_params);
+  if (ctx->pool == NULL) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create packet pool", __PRETTY_FUNCTION__);
+    errno = tmp_errno;
+    return -1;
+  }
   memcpy(&ctx->event_handler, handler, sizeof(vde_event_handler));
   ctx->modules = NULL;
   ctx->components = vde_ordhash_new();
   ctx->initialized = 1;
+  vde_pool_set_watermark_cb(ctx->pool, &vde_context_queue_watermark,
+                            (void *)ctx);
 
   if (vde_modules_load(ctx, modules_path)) {
     tmp_errno = errno;
@@ -122,6 +162,8 @@ void vde_context_fini(vde_context *ctx)
   ctx->event_handler.event_del = NULL;
   ctx->event_handler.timeout_add = NULL;
   ctx->event_handler.timeout_del = NULL;
+  // queues are emptied while components go away
+  vde_pool_set_watermark_cb(ctx->pool, NULL, NULL);
 
   /*
    * Finishing components in two steps: first fini connection managers and then
@@ -169,6 +211,10 @@ void vde_context_fini(vde_context *ctx)
   vde_list_delete(ctx->modules);
   ctx->modules = NULL;
 
+  // all components are gone, no packet should be referenced anymore
+  vde_pool_delete(ctx->pool);
+  ctx->pool = NULL;
+
   ctx->initialized = 0;
   return;
 }
@@ -70,6 +70,7 @@ typedef struct {
 static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
   const char *out_str;
   vde_pkt *new_pkt, *send_pkt;
+  vde_pool *pool;
   unsigned int out_len, payload_sz, last_chunk_sz, num_chunks, sent_chunks,
                cpy_sz, rv;
 
@@ -92,6 +93,7 @@ static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
   }
 
   // create packets
+  pool = vde_context_get_pool(vde_connection_get_context(cc->conn));
   sent_chunks = 0;
   while (num_chunks > sent_chunks) {
 
@@ -102,8 +104,18 @@ static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
       cpy_sz = payload_sz;
     }
 
-    new_pkt = vde_pkt_new(cpy_sz, 0, 0);
-    // XXX check pkt NULL
+    new_pkt = vde_pool_pkt_new(pool, cpy_sz, 0, 0);
+    if (!new_pkt) {
+      // a truncated message would be garbage, drop the chunks queued so far
+      vde_error("%s: cannot allocate packet, reply not sent: %s",
+                __PRETTY_FUNCTION__, strerror(errno));
+      while (sent_chunks > 0) {
+        vde_pkt_put(vde_queue_pop_head(cc->out_queue));
+        sent_chunks--;
+      }
+      errno = ENOMEM;
+      return -1;
+    }
     new_pkt->hdr->pkt_len = cpy_sz;
     // XXX: set type and version
     memcpy(new_pkt->payload, out_str + (sent_chunks*payload_sz), cpy_sz);
@@ -122,7 +134,7 @@ static int ctrl_engine_conn_write(ctrl_conn *cc, vde_sobj *out_obj) {
       vde_queue_push_tail(cc->out_queue, send_pkt);
       break;
     }
-    vde_free(send_pkt);
+    vde_pkt_put(send_pkt);
     send_pkt = vde_queue_pop_tail(cc->out_queue);
   }
 
@@ -442,6 +454,71 @@ out:
   return rv;
 }
 
+// unsigned long counters are reported as doubles: json ints are 32 bits and
+// would wrap past 2 GiB, a double is exact up to 2^53
+static vde_sobj *pool_stats_to_sobj(vde_pool_stats *stats)
+{
+  vde_sobj *out = vde_sobj_new_hash();
+
+  // XXX check out not NULL
+  vde_sobj_hash_insert(out, "data_size", vde_sobj_new_int(stats->data_size));
+  vde_sobj_hash_insert(out, "total", vde_sobj_new_int(stats->total));
+  vde_sobj_hash_insert(out, "free", vde_sobj_new_int(stats->free));
+  vde_sobj_hash_insert(out, "hits", vde_sobj_new_double(stats->hits));
+  vde_sobj_hash_insert(out, "misses", vde_sobj_new_double(stats->misses));
+  vde_sobj_hash_insert(out, "exhausted",
+                       vde_sobj_new_double(stats->exhausted));
+  vde_sobj_hash_insert(out, "mem", vde_sobj_new_double(stats->mem));
+  vde_sobj_hash_insert(out, "mem_hugetlb",
+                       vde_sobj_new_double(stats->mem_hugetlb));
+  vde_sobj_hash_insert(out, "mem_thp", vde_sobj_new_double(stats->mem_thp));
+  return out;
+}
+
+static vde_sobj *pool_queue_stats_to_sobj(vde_pool_queue_stats *stats)
+{
+  vde_sobj *out = vde_sobj_new_hash();
+
+  // XXX check out not NULL
+  vde_sobj_hash_insert(out, "bytes", vde_sobj_new_double(stats->bytes));
+  vde_sobj_hash_insert(out, "limit", vde_sobj_new_double(stats->limit));
+  vde_sobj_hash_insert(out, "watermark",
+                       vde_sobj_new_double(stats->watermark));
+  vde_sobj_hash_insert(out, "queues", vde_sobj_new_int(stats->queues));
+  vde_sobj_hash_insert(out, "over_watermark",
+                       vde_sobj_new_bool(stats->over_watermark));
+  vde_sobj_hash_insert(out, "drops", vde_sobj_new_double(stats->drops));
+  vde_sobj_hash_insert(out, "early_drops",
+                       vde_sobj_new_double(stats->early_drops));
+  return out;
+}
+
+int engine_ctrl_memstats(vde_component *component, vde_sobj **out)
+{
+  vde_pool_stats stats;
+  vde_pool_queue_stats queue_stats;
+  vde_pool *pool;
+  static char const * const class_names[VDE_POOL_CLASSES] = {
+    "ctrl", "eth", "jumbo"
+  };
+  int cls;
+
+  pool = vde_context_get_pool(vde_component_get_context(component));
+
+  *out = vde_sobj_new_hash();
+  // XXX check out not NULL
+  vde_sobj_hash_insert(*out, "arena",
+                       vde_sobj_new_bool(vde_pool_is_arena(pool)));
+  for (cls = 0; cls < VDE_POOL_CLASSES; cls++) {
+    vde_pool_get_stats(pool, cls, &stats);
+    vde_sobj_hash_insert(*out, class_names[cls], pool_stats_to_sobj(&stats));
+  }
+  vde_pool_get_queue_stats(pool, &queue_stats);
+  vde_sobj_hash_insert(*out, "queues", pool_queue_stats_to_sobj(&queue_stats));
+
+  return 0;
+}
+
 int engine_ctrl_notify_del(vde_component *component, const char *full_path,
                            vde_sobj **out)
 {
@@ -702,7 +779,7 @@ static void ctrl_conn_fini_noengine(ctrl_conn *cc)
   // cleanup outgoing packets
   pkt = vde_queue_pop_tail(cc->out_queue);
   while (pkt != NULL) {
-    vde_free(pkt);
+    vde_pkt_put(pkt);
     pkt = vde_queue_pop_tail(cc->out_queue);
   }
   vde_queue_delete(cc->out_queue);
@@ -756,12 +833,18 @@ static void ctrl_conn_fini(ctrl_conn *cc)
 
 int ctrl_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
 {
+  vde_pkt *seg;
+  int rv = 0;
   ctrl_conn *cc = (ctrl_conn *)arg;
 
   // XXX check pkt type is CTRL
 
-  if (ctrl_split_payload(pkt, cc->inbuf, &cc->inbuf_len, MAX_INBUF_SZ,
-                        ctrl_engine_deserialize_string, (void *)cc)) {
+  // partial strings are kept in inbuf, so segments can be split one by one
+  for (seg = pkt; seg != NULL && rv == 0; seg = seg->next) {
+    rv = ctrl_split_payload(seg, cc->inbuf, &cc->inbuf_len, MAX_INBUF_SZ,
+                            ctrl_engine_deserialize_string, (void *)cc);
+  }
+  if (rv) {
 
     // XXX gracefully handle cases where payload cannot fit in inbuf
     vde_debug("%s: error splitting payload, closing", __PRETTY_FUNCTION__);
@@ -790,7 +873,7 @@ int ctrl_engine_writecb(vde_connection *conn, vde_pkt *pkt, void *arg)
       vde_queue_push_tail(cc->out_queue, q_pkt);
       break;
     }
-    vde_free(q_pkt);
+    vde_pkt_put(q_pkt);
     q_pkt = vde_queue_pop_tail(cc->out_queue);
   }
 
@@ -67,24 +67,116 @@ int engine_hub_printport(vde_component *component, int port, vde_sobj **out)
   return 0;
 }
 
+/*
+ * Ports can have different mtus, frames larger than what a port can carry are
+ * not sent to it.
+ */
+static inline int hub_port_fits(vde_connection *port, unsigned int len)
+{
+  unsigned int max_payload = vde_connection_max_payload(port);
+
+  return max_payload == 0 || len <= max_payload;
+}
+
+/*
+ * A TCP burst with VDE_PKT_META_GSO is segmented when it is written to a port
+ * which can't take it whole, so it is its segments which must fit.
+ */
+static inline unsigned int hub_pkt_fit_len(vde_pkt *pkt)
+{
+  unsigned int seg_len;
+
+  if (pkt->meta.flags & VDE_PKT_META_GSO) {
+    seg_len = vde_pkt_gso_seg_len(pkt);
+    if (seg_len != 0) {
+      return seg_len;
+    }
+  }
+  return vde_pkt_len(pkt);
+}
+
 int hub_engine_readcb(vde_connection *conn, vde_pkt *pkt, void *arg)
 {
   vde_list *iter;
   vde_connection *port;
+  vde_pkt *shared;
+
+  hub_engine *hub = (hub_engine *)arg;
+
+  /*
+   * Take a reference once so that ports queueing the packet get a reference
+   * to it instead of a copy each.
+   */
+  shared = vde_pkt_share(pkt);
+  if (shared == NULL) {
+    vde_warning("%s: cannot share packet, dropping", __PRETTY_FUNCTION__);
+    return 0;
+  }
+
+  /* Send to all the ports */
+  iter = vde_list_first(hub->ports);
+  while (iter != NULL) {
+    port = vde_list_get_data(iter);
+    if (port != conn && hub_port_fits(port, hub_pkt_fit_len(shared))) {
+      // XXX: check write retval
+      vde_connection_write(port, shared);
+    }
+    iter = vde_list_next(iter);
+  }
+
+  vde_pkt_put(shared);
+
+  return 0;
+}
+
+int hub_engine_readbatchcb(vde_connection *conn, vde_pkt_batch *batch,
+                           void *arg)
+{
+  unsigned int i, max_len = 0;
+  vde_list *iter;
+  vde_connection *port;
+  vde_pkt *pkt;
+  vde_pkt_batch shared;
 
   hub_engine *hub = (hub_engine *)arg;
 
+  // as in hub_engine_readcb, take one reference for all the ports
+  vde_pkt_batch_init(&shared);
+  for (i = 0; i < batch->count; i++) {
+    if (i + 1 < batch->count) {
+      vde_pkt_prefetch(batch->pkts[i + 1]);
+    }
+    pkt = vde_pkt_share(batch->pkts[i]);
+    if (pkt == NULL) {
+      vde_warning("%s: cannot share packet, dropping", __PRETTY_FUNCTION__);
+      continue;
+    }
+    vde_pkt_batch_add(&shared, pkt);
+    if (hub_pkt_fit_len(pkt) > max_len) {
+      max_len = hub_pkt_fit_len(pkt);
+    }
+  }
+
   /* Send to all the ports */
   iter = vde_list_first(hub->ports);
   while (iter != NULL) {
     port = vde_list_get_data(iter);
-    if (port != conn) {
+    if (port != conn && hub_port_fits(port, max_len)) {
       // XXX: check write retval
-      vde_connection_write(port, pkt);
+      vde_connection_write_batch(port, &shared);
+    } else if (port != conn) {
+      // some frames exceed the port mtu, send the others one by one
+      for (i = 0; i < shared.count; i++) {
+        if (hub_port_fits(port, hub_pkt_fit_len(shared.pkts[i]))) {
+          vde_connection_write(port, shared.pkts[i]);
+        }
+      }
     }
     iter = vde_list_next(iter);
   }
 
+  vde_pkt_batch_put(&shared);
+
   return 0;
 }
 
@@ -123,8 +215,9 @@ int hub_engine_newconn(vde_component *component, vde_connection *conn,
   hub_engine *hub = vde_component_get_priv(component);
 
   max_payload = vde_connection_max_payload(conn);
-  if (max_payload != 0 && max_payload < sizeof(struct eth_frame)) {
-    vde_warning("%s: connection can't handle full eth frames, rejecting");
+  if (max_payload != 0 && max_payload < ETH_FRAME_LEN(ETH_MIN_MTU)) {
+    vde_warning("%s: connection mtu is too small, rejecting",
+                __PRETTY_FUNCTION__);
     return -1;
   }
 
@@ -135,6 +228,7 @@ int hub_engine_newconn(vde_component *component, vde_connection *conn,
   /* Setup connection */
   vde_connection_set_callbacks(conn, &hub_engine_readcb, NULL,
                                &hub_engine_errorcb, (void *)hub);
+  vde_connection_set_read_batch_cb(conn, &hub_engine_readbatchcb);
   vde_connection_set_pkt_properties(conn, 0, 0);
   send_timeout.tv_sec = TIMEOUT;
   send_timeout.tv_usec = 0;
@@ -264,6 +264,36 @@ int vde_conn_manager_connect(vde_component *cm, vde_request *local,
                              vde_connect_error_cb error_cb, void *arg);
 
 
+/*
+ * packet pool
+ *
+ */
+
+/**
+ * @brief The size classes of the packet pool
+ */
+typedef enum {
+  VDE_POOL_CTRL, //!< Control messages
+  VDE_POOL_ETH, //!< Standard ethernet frames
+  VDE_POOL_JUMBO, //!< Jumbo frames
+  VDE_POOL_CLASSES
+} vde_pool_class;
+
+/**
+ * @brief Parameters of the packet pool of a context
+ */
+typedef struct {
+  int prewarm; //!< Preallocate prewarm_pkts packets during context init
+  int arena; //!< Map packet memory with huge pages if available
+  //! Packets allocated by prewarm, a warm start not a reservation: they can
+  //! be taken by any user and the class still grows on demand
+  unsigned int prewarm_pkts[VDE_POOL_CLASSES];
+  unsigned int limit[VDE_POOL_CLASSES]; //!< Max packets, 0 for unlimited
+  unsigned long queue_limit; //!< Max queued bytes, 0 for unlimited
+  unsigned long queue_watermark; //!< Early drops above, 0 for none
+} vde_pool_params;
+
+
 /*
  * context
  *
@@ -289,11 +319,12 @@ int vde_context_new(vde_context **ctx);
  * @param ctx The context to initialize
  * @param handler An implementation of vde_event_handler to use
  * @param modules_path A NULL-terminated array of paths to load modules from
+ * @param pool_params The parameters of the packet pool, NULL for defaults
  *
  * @return zero on success, -1 on error (and errno is set appropriately)
  */
 int vde_context_init(vde_context *ctx, vde_event_handler *handler,
-                     char **modules_path);
+                     char **modules_path, vde_pool_params *pool_params);
 
 /**
  * @brief Stop and reset a VDE 3 context
@@ -24,21 +24,15 @@
 #include <glib.h>
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifdef VDE3_DEBUG
 #include <assert.h>
 #endif
 
-#define vde_cached_alloc(s) g_malloc(s)
-#define vde_cached_calloc(s) g_slice_alloc0(s)
-#define vde_cached_free_type(t, d) g_free(d)
-/*
- * XXX(shammash):
- *  This cannot be easily remapped to a non-sliced allocator, so let's not use
- *  it until we're sure sliced-stuff will give us a good speedup.
-#define vde_cached_free_chunk(s, d) g_slice_free1(s, d)
- */
-
 /*
  * NOTE: g_malloc _aborts_ if the underlying malloc fails and
  * returns NULL only if s == 0
@@ -47,6 +41,33 @@
 #define vde_calloc(s) g_malloc0(s)
 #define vde_free(s) g_free(s)
 
+/*
+ * Memory aligned to a (power of two) boundary, unlike vde_alloc() these return
+ * NULL on failure. Must be freed with vde_free_aligned().
+ */
+static inline void *vde_calloc_aligned(size_t align, size_t s)
+{
+  void *ptr;
+
+  if (posix_memalign(&ptr, align, s)) {
+    return NULL;
+  }
+  memset(ptr, 0, s);
+  return ptr;
+}
+#define vde_free_aligned(s) free(s)
+
+/*
+ * Monotonic time in nanoseconds, used to timestamp packets.
+ */
+static inline uint64_t vde_clock_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 typedef GList vde_list;
 #define vde_list_first(list) g_list_first(list)
 #define vde_list_last(list) g_list_last(list)
@@ -61,6 +82,7 @@ typedef GList vde_list;
 
 typedef GHashTable vde_hash;
 #define vde_hash_init() g_hash_table_new(NULL, NULL)
+#define vde_hash_init_string() g_hash_table_new(g_str_hash, g_str_equal)
 #define vde_hash_insert(h, k, v) g_hash_table_insert(h, (gpointer)k, v)
 #define vde_hash_remove(h, k) g_hash_table_remove(h, (gconstpointer)k)
 #define vde_hash_lookup(h, k) g_hash_table_lookup(h, (gconstpointer)k)
@@ -123,4 +145,12 @@ struct eth_frame {
   unsigned char data[ETH_DATA_LEN + ETH_TRAILER_LEN];
 };
 
+// smallest mtu an IPv4 host must accept
+#define ETH_MIN_MTU 68
+// largest frame which fits into a vde packet (vde_hdr pkt_len is 16 bits)
+#define ETH_MAX_FRAME_LEN 65535
+#define ETH_FRAME_LEN(mtu) (sizeof(struct eth_hdr) + (mtu) + ETH_TRAILER_LEN)
+#define ETH_MAX_MTU (ETH_MAX_FRAME_LEN - sizeof(struct eth_hdr) - \
+                     ETH_TRAILER_LEN)
+
 #endif /* __VDE3_COMMON_H__ */
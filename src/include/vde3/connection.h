@@ -28,6 +28,10 @@
 #include <vde3/packet.h>
 #include <vde3/common.h>
 
+// default limits of the bytes and of the packets queued for sending by a
+// connection backend
+#define VDE_CONNECTION_QUEUE_MAXBYTES (256 * 1024)
+#define VDE_CONNECTION_QUEUE_MAXLEN 1024
 
 /**
  * @brief An error code passed to conn_error_cb
@@ -54,20 +58,29 @@ typedef struct vde_connection vde_connection;
  * @brief Backend implementation for writing a packet
  *
  * @param conn The connection to send the packet to
- * @param pkt The packet to send, if the backend doesn't send the packet
- * immediately it must reserve its own copy of the packet.
+ * @param pkt The packet to send, lent for the duration of the call. If the
+ * backend doesn't send the packet immediately it must keep a reference
+ * obtained with vde_pkt_share() (see "Memory management" below).
  *
  * @return zero on success, an error code otherwise
  */
-/*
- * XXX(shammash): add a flag here to tell the connection backend if the packet
- * needs to be copied or the same memory area / pointer can be used? This can be
- * useful if, for instance, we have a send-queue in the engine and in the
- * connection: right now the engine would have its own copy of the packet which
- * needs to be copied again in the connection.
- */
 typedef int (*conn_be_write)(vde_connection *conn, vde_pkt *pkt);
 
+/**
+ * @brief (Optional) Backend implementation for writing a batch of packets
+ *
+ * @param conn The connection to send the packets to
+ * @param batch The packets to send, lent for the duration of the call. The
+ * same rules of conn_be_write apply to each packet.
+ *
+ * @return The number of packets accepted, always the first ones of the batch.
+ * If less than batch->count errno is set appropriately. A packet handed to the
+ * other end counts as accepted even if it was dropped there, the caller must
+ * not send it again.
+ */
+typedef unsigned int (*conn_be_write_batch)(vde_connection *conn,
+                                            vde_pkt_batch *batch);
+
 /**
  * @brief Backend implementation for closing a connection, when called the
  * backend must free all its resources for this connection.
@@ -89,34 +102,64 @@ typedef void (*conn_be_close)(vde_connection *conn);
 
 /**
  * @brief Callback called when a connection has a packet ready to serve, after
- * this callback returns the pkt will be free()d
+ * this callback returns the connection releases the pkt
  *
  * @param conn The connection with the packet ready
- * @param pkt The new packet
+ * @param pkt The new packet, lent for the duration of the call. The callee
+ * must use vde_pkt_share() to keep it and vde_pkt_cow() to modify it.
  * @param arg The argument which has previously been set by connection user
  *
  * @return zero on success, -1 on error (and errno is set appropriately)
  */
 typedef int (*conn_read_cb)(vde_connection *conn, vde_pkt *pkt, void *arg);
 
+/**
+ * @brief (Optional) Callback called when a connection has a batch of packets
+ * ready to serve, after this callback returns the connection releases them.
+ * When it is not set read_cb is called for each packet.
+ *
+ * @param conn The connection with the packets ready
+ * @param batch The new packets, lent for the duration of the call. The same
+ * rules of conn_read_cb apply to each packet.
+ * @param arg The argument which has previously been set by connection user
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+typedef int (*conn_read_batch_cb)(vde_connection *conn, vde_pkt_batch *batch,
+                                  void *arg);
+
 /**
  * @brief (Optional) Callback called when a packet has been sent by the
- * connection, after this callback returns the pkt will be free()d.
+ * connection, after this callback returns the connection releases the pkt.
  *
  * @param conn The connection which has sent the packet
- * @param pkt The sent packet
+ * @param pkt The sent packet, lent for the duration of the call
  * @param arg The argument which has previously been set by connection user
  *
  * @return zero on success, -1 on error (and errno is set appropriately)
  */
 typedef int (*conn_write_cb)(vde_connection *conn, vde_pkt *pkt, void *arg);
 
+/**
+ * @brief (Optional) Callback called when a batch of packets has been sent by
+ * the connection, after this callback returns the connection releases them.
+ * When it is not set write_cb is called for each packet.
+ *
+ * @param conn The connection which has sent the packets
+ * @param batch The sent packets, lent for the duration of the call
+ * @param arg The argument which has previously been set by connection user
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+typedef int (*conn_write_batch_cb)(vde_connection *conn, vde_pkt_batch *batch,
+                                   void *arg);
+
 /**
  * @brief Callback called when an error occur.
  *
  * @param conn The connection generating the error
- * @param pkt The packet which was being sent when the error occurred, can be
- * NULL.
+ * @param pkt The packet which was being sent when the error occurred, lent for
+ * the duration of the call, can be NULL.
  * @param err The error type
  * @param arg The argument which has previously been set by connection user
  *
@@ -136,16 +179,24 @@ typedef int (*conn_error_cb)(vde_connection *conn, vde_pkt *pkt,
 struct vde_connection {
   vde_attributes *attributes;
   vde_context *context;
+  unsigned int id;
   unsigned int max_pload;
+  unsigned int offloads;
   unsigned int pkt_head_sz;
   unsigned int pkt_tail_sz;
   unsigned int send_maxtries;
   struct timeval send_maxtimeout;
+  unsigned long queue_maxbytes;
+  unsigned long queue_bytes;
+  unsigned int queue_maxlen;
   conn_be_write be_write;
+  conn_be_write_batch be_write_batch;
   conn_be_close be_close;
   void *be_priv;
   conn_read_cb read_cb;
+  conn_read_batch_cb read_batch_cb;
   conn_write_cb write_cb;
+  conn_write_batch_cb write_batch_cb;
   conn_error_cb error_cb;
   void *cb_priv;
 };
@@ -192,27 +243,93 @@ void vde_connection_fini(vde_connection *conn);
 void vde_connection_delete(vde_connection *conn);
 
 /**
- * @brief Function used by connection user to send a packet
+ * @brief Send a packet whose offloads are not supported by the backend, they
+ * are done in software first. Called by vde_connection_write().
  *
  * @param conn The connection to send the packet into
  * @param pkt The packet to send
  *
  * @return zero on success, an error code otherwise
  */
+int vde_connection_write_offload(vde_connection *conn, vde_pkt *pkt);
+
+/**
+ * @brief Function used by connection user to send a packet
+ *
+ * @param conn The connection to send the packet into
+ * @param pkt The packet to send, the caller still owns its reference after
+ * the call returns
+ *
+ * @return zero on success, an error code otherwise
+ */
 static inline int vde_connection_write(vde_connection *conn, vde_pkt *pkt)
 {
   vde_assert(conn != NULL);
 
+  if (pkt->meta.flags & VDE_PKT_META_OFFLOAD & ~conn->offloads) {
+    return vde_connection_write_offload(conn, pkt);
+  }
   return conn->be_write(conn, pkt);
 }
 
+/**
+ * @brief Function used by connection user to send a batch of packets. If the
+ * backend has no batch implementation packets are written one at a time, until
+ * the first failure.
+ *
+ * @param conn The connection to send the packets into
+ * @param batch The packets to send, the caller still owns their references
+ * after the call returns
+ *
+ * @return The number of packets accepted, always the first ones of the batch.
+ * If less than batch->count errno is set appropriately.
+ */
+static inline unsigned int vde_connection_write_batch(vde_connection *conn,
+                                                      vde_pkt_batch *batch)
+{
+  unsigned int i;
+
+  vde_assert(conn != NULL);
+  vde_assert(batch != NULL);
+
+  // packets needing offloads done in software are written one at a time
+  if (conn->offloads != VDE_PKT_META_OFFLOAD) {
+    for (i = 0; i < batch->count; i++) {
+      if (batch->pkts[i]->meta.flags & VDE_PKT_META_OFFLOAD) {
+        break;
+      }
+    }
+    if (i < batch->count) {
+      for (i = 0; i < batch->count; i++) {
+        if (vde_connection_write(conn, batch->pkts[i])) {
+          break;
+        }
+      }
+      return i;
+    }
+  }
+
+  if (conn->be_write_batch != NULL) {
+    return conn->be_write_batch(conn, batch);
+  }
+  for (i = 0; i < batch->count; i++) {
+    if (i + 1 < batch->count) {
+      vde_pkt_prefetch(batch->pkts[i + 1]);
+    }
+    if (conn->be_write(conn, batch->pkts[i])) {
+      break;
+    }
+  }
+  return i;
+}
+
 /**
  * @brief Function called by connection backend to tell the connection user a
  * new packet is available.
  *
  * @param conn The connection whom backend has a new packet available
- * @param pkt The new packet. Connection users will duplicate the pkt if they
- * need it after this callback will return, so it can be free()d afterwards
+ * @param pkt The new packet. Connection users will share the pkt if they
+ * need it after this callback will return, so it can be released afterwards
  *
  * @return zero on success, -1 on error (and errno is set appropriately)
  */
@@ -224,13 +341,58 @@ static inline int vde_connection_call_read(vde_connection *conn, vde_pkt *pkt)
   return conn->read_cb(conn, pkt, conn->cb_priv);
 }
 
+/**
+ * @brief Function called by connection backend to tell the connection user a
+ * batch of packets is available. If the user has not set a batch callback
+ * read_cb is called for each packet, stopping early if it asks to close the
+ * connection.
+ *
+ * @param conn The connection whom backend has new packets available
+ * @param batch The new packets. Connection users will share the packets they
+ * need after this callback will return, so they can be released afterwards
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately, to the
+ * value set by the last failed callback)
+ */
+static inline int vde_connection_call_read_batch(vde_connection *conn,
+                                                 vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int rv = 0, cb_errno = 0;
+
+  vde_assert(conn != NULL);
+  vde_assert(batch != NULL);
+
+  if (conn->read_batch_cb != NULL) {
+    return conn->read_batch_cb(conn, batch, conn->cb_priv);
+  }
+
+  vde_assert(conn->read_cb != NULL);
+  for (i = 0; i < batch->count; i++) {
+    if (i + 1 < batch->count) {
+      vde_pkt_prefetch(batch->pkts[i + 1]);
+    }
+    if (conn->read_cb(conn, batch->pkts[i], conn->cb_priv)) {
+      rv = -1;
+      cb_errno = errno;
+      if (cb_errno == EPIPE) {
+        break;
+      }
+    }
+  }
+  if (rv) {
+    errno = cb_errno;
+  }
+  return rv;
+}
+
 /**
  * @brief Function called by connection backend to tell the connection user a
  * packet has been successfully sent.
  *
  * @param conn The connection whom backend has a sent the packet
- * @param pkt The sent packet. Connection users will duplicate the pkt if they
- * need it after this callback will return, so it can be free()d afterwards
+ * @param pkt The sent packet. Connection users will share the pkt if they
+ * need it after this callback will return, so it can be released afterwards
  *
  * @return zero on success, -1 on error (and errno is set appropriately)
  */
@@ -244,6 +406,64 @@ static inline int vde_connection_call_write(vde_connection *conn, vde_pkt *pkt)
   return 0;
 }
 
+/**
+ * @brief Function called by connection backend to tell the connection user a
+ * batch of packets has been successfully sent. If the user has not set a
+ * batch callback write_cb is called for each packet, stopping early if it
+ * asks to close the connection.
+ *
+ * @param conn The connection whom backend has sent the packets
+ * @param batch The sent packets. Connection users will share the packets they
+ * need after this callback will return, so they can be released afterwards
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately, to the
+ * value set by the last failed callback)
+ */
+static inline int vde_connection_call_write_batch(vde_connection *conn,
+                                                  vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int rv = 0, cb_errno = 0;
+
+  vde_assert(conn != NULL);
+  vde_assert(batch != NULL);
+
+  if (conn->write_batch_cb != NULL) {
+    return conn->write_batch_cb(conn, batch, conn->cb_priv);
+  }
+  if (conn->write_cb == NULL) {
+    return 0;
+  }
+
+  for (i = 0; i < batch->count; i++) {
+    if (conn->write_cb(conn, batch->pkts[i], conn->cb_priv)) {
+      rv = -1;
+      cb_errno = errno;
+      if (cb_errno == EPIPE) {
+        break;
+      }
+    }
+  }
+  if (rv) {
+    errno = cb_errno;
+  }
+  return rv;
+}
+
+/**
+ * @brief Check if the connection user wants to be told about sent packets
+ *
+ * @param conn The connection
+ *
+ * @return Nonzero if a write or write batch callback is set
+ */
+static inline int vde_connection_has_write_cb(vde_connection *conn)
+{
+  vde_assert(conn != NULL);
+
+  return conn->write_cb != NULL || conn->write_batch_cb != NULL;
+}
+
 /**
  * @brief Function called by connection backend to tell the connection user an
  * error occurred.
@@ -278,6 +498,40 @@ void vde_connection_set_callbacks(vde_connection *conn,
                                   conn_error_cb error_cb,
                                   void *cb_priv);
 
+/**
+ * @brief Set user's batch read callback in a connection, to be called after
+ * vde_connection_set_callbacks(). read_cb is still used by backends which
+ * deliver one packet at a time.
+ *
+ * @param conn The connection to set the callback to
+ * @param read_batch_cb Function called when a batch of packets is available,
+ * NULL to receive them one at a time with read_cb
+ */
+void vde_connection_set_read_batch_cb(vde_connection *conn,
+                                      conn_read_batch_cb read_batch_cb);
+
+/**
+ * @brief Set user's batch write callback in a connection, to be called after
+ * vde_connection_set_callbacks(). write_cb is still used by backends which
+ * notify one packet at a time.
+ *
+ * @param conn The connection to set the callback to
+ * @param write_batch_cb Function called when a batch of packets has been sent,
+ * NULL to be notified one packet at a time with write_cb
+ */
+void vde_connection_set_write_batch_cb(vde_connection *conn,
+                                       conn_write_batch_cb write_batch_cb);
+
+/**
+ * @brief Set the backend batch write implementation, to be called after
+ * vde_connection_init() by backends which can send many packets at once.
+ *
+ * @param conn The connection
+ * @param be_write_batch The backend implementation for writing a batch
+ */
+void vde_connection_set_be_write_batch(vde_connection *conn,
+                                       conn_be_write_batch be_write_batch);
+
 /**
  * @brief Get connection context
  *
@@ -301,6 +555,28 @@ static inline vde_context *vde_connection_get_context(vde_connection *conn)
  */
 unsigned int vde_connection_max_payload(vde_connection *conn);
 
+/**
+ * @brief Lower the maximum payload size of a connection, for transports
+ * which agree on it with the peer. It must be called before the connection is
+ * given to an engine, offloads declared with vde_connection_set_offloads() are
+ * left untouched.
+ *
+ * @param conn The connection
+ * @param payload_size The new maximum payload size
+ */
+void vde_connection_set_max_payload(vde_connection *conn,
+                                    unsigned int payload_size);
+
+/**
+ * @brief Declare the offloads the backend of a connection supports, frames
+ * with other offloads have them done in software when they are written. None
+ * are supported by default.
+ *
+ * @param conn The connection
+ * @param offloads VDE_PKT_META_CSUM and/or VDE_PKT_META_GSO
+ */
+void vde_connection_set_offloads(vde_connection *conn, unsigned int offloads);
+
 /**
  * @brief Get connection backend private data
  *
@@ -315,6 +591,21 @@ static inline void *vde_connection_get_priv(vde_connection *conn)
   return conn->be_priv;
 }
 
+/**
+ * @brief Get the id of a connection, unique in its context. Transports store
+ * it in the metadata of the packets they receive (see vde_pkt_meta).
+ *
+ * @param conn The connection
+ *
+ * @return The id
+ */
+static inline unsigned int vde_connection_get_id(vde_connection *conn)
+{
+  vde_assert(conn != NULL);
+
+  return conn->id;
+}
+
 /**
  * @brief Called by the component using the connection to set some properties
  * about the packet it will receive.
@@ -401,6 +692,72 @@ struct timeval *vde_connection_get_send_maxtimeout(vde_connection *conn)
   return &(conn->send_maxtimeout);
 }
 
+/**
+ * @brief Called by the component using the connection to limit the packets a
+ * connection backend keeps queued for sending. Packets above the limits are
+ * dropped, the context can drop packets earlier when all the queues of the
+ * context are holding too much memory (see vde_pool_params).
+ *
+ * @param conn The connection to set the limits to
+ * @param max_bytes The maximum number of queued bytes, 0 for unlimited
+ * @param max_len The maximum number of queued packets, backends with a fixed
+ * size queue allocate it with (at least) this size
+ */
+void vde_connection_set_queue_properties(vde_connection *conn,
+                                         unsigned long max_bytes,
+                                         unsigned int max_len);
+
+/**
+ * @brief Get the maximum number of packets a backend keeps queued
+ *
+ * @param conn The connection
+ *
+ * @return The maximum number of packets
+ */
+static inline
+unsigned int vde_connection_get_queue_maxlen(vde_connection *conn)
+{
+  vde_assert(conn != NULL);
+
+  return conn->queue_maxlen;
+}
+
+/**
+ * @brief Get the bytes a connection backend keeps queued for sending
+ *
+ * @param conn The connection
+ *
+ * @return The number of bytes
+ */
+static inline
+unsigned long vde_connection_get_queue_bytes(vde_connection *conn)
+{
+  vde_assert(conn != NULL);
+
+  return conn->queue_bytes;
+}
+
+/**
+ * @brief Called by a connection backend before it queues a packet for
+ * sending.
+ *
+ * @param conn The connection
+ * @param len The length of the packet
+ *
+ * @return zero on success, -1 if the packet must be dropped (and errno is set
+ * to ENOBUFS)
+ */
+int vde_connection_queue_reserve(vde_connection *conn, unsigned int len);
+
+/**
+ * @brief Called by a connection backend when a queued packet has been sent or
+ * dropped.
+ *
+ * @param conn The connection
+ * @param len The length of the packet
+ */
+void vde_connection_queue_release(vde_connection *conn, unsigned int len);
+
 /**
  * @brief Set connection attributes, data will be duplicated
  *
@@ -422,20 +779,37 @@ vde_attributes *vde_connection_get_attributes(vde_connection *conn);
 /*
  * Memory management:
  * - a connection calls read_cb iff a packet is ready
- * - when write() is called the connection must be responsible for copying the
- * packet because because it will be free()ed right after write() returns
- * - a local connection duplicate the packet passed with write(), calls its
- * peer's read_cb and then free()s the duplicated packet
- *
- * DGRAM/STACK flow:
- * - connection: read on stack space
+ * - every packet passed to a function (write(), read_cb, write_cb, error_cb) is
+ * lent to the callee: the caller keeps its reference and releases it after
+ * the function returns
+ * - a callee which needs the packet after returning calls vde_pkt_share(): a
+ * reference counted packet gets a new reference (no copy), a borrowed packet
+ * (e.g. on the caller's stack) is copied. Each share is released with
+ * vde_pkt_put()
+ * - shared packets are read-only, a holder which needs to change the packet
+ * or its head/tail space calls vde_pkt_cow() which copies only if the packet
+ * has other holders or not enough room
+ * - a local connection calls its peer's read_cb with the packet passed to
+ * write(), without copying it
+ * - batches (write_batch(), read_batch_cb) are lent as a whole, the rules
+ * above apply to each packet they contain
+ * - write_batch() returns how many packets left the caller's hands: those
+ * packets may already be shared by the other end, so the caller only retries
+ * the ones after them. A local connection whose peer fails its read_batch_cb
+ * still reports the whole batch as written
+ *
+ * DGRAM/POOL flow:
+ * - connection: read into a packet of the context pool
  * - connection: call read_cb()
  * - engine/cm: does stuff considering that when read_cb() returns the packet
- * will be free()d. e.g.:
+ * will be released. e.g.:
+ * shared = vde_pkt_share(pkt)
  * for each c in connections:
  * if c != incoming_connection:
- * c.write(pkt)
- * - connection: memcpy(pkt) -> add(packetq)
+ * c.write(shared)
+ * vde_pkt_put(shared)
+ * - connection: vde_pkt_share(shared) -> add(packetq)
+ * - connection: vde_pkt_put(pkt)
  *
  * STREAM/BUFFER, incoming flow:
  * n = 0;
@@ -22,6 +22,7 @@
 #define __VDE3_CONTEXT_H__
 
 #include <vde3/module.h>
+#include <vde3/pool.h>
 #include <vde3/vde_ordhash.h>
 
 /**
@@ -34,6 +35,10 @@ struct vde_context {
   vde_ordhash *components;
   // list of vde_module*
   vde_list *modules;
+  // packets used by components running in the context
+  vde_pool *pool;
+  // last id given to a connection
+  unsigned int conn_ids;
   // configuration path
   // list of startup commands (from configuration)
 };
@@ -48,6 +53,21 @@ struct vde_context {
  */
 int vde_context_register_module(vde_context *ctx, vde_module *module);
 
+/**
+ * @brief Get the packet pool of a context
+ *
+ * @param ctx The context
+ *
+ * @return The packet pool
+ */
+static inline vde_pool *vde_context_get_pool(vde_context *ctx)
+{
+  vde_assert(ctx != NULL);
+  vde_assert(ctx->initialized == 1);
+
+  return ctx->pool;
+}
+
 static inline void *vde_context_event_add(vde_context *ctx, int fd,
                                           short events,
                                           const struct timeval *timeout,
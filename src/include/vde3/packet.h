@@ -23,58 +23,230 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include <vde3/common.h>
 
 // A packet exchanged by vde engines
 // (it should be used more or less like Linux socket buffers).
 //
-// - allocated/freed by the same connection (probably using cached memory)
-// - copied mostly by connections, but also by engines if they need to cache it
-//   or to mangle it in particular ways
+// - allocated by connections or engines, freed when its last reference is
+//   dropped
+// - shared by reference among connections and engines, copied only when a
+//   holder needs to change it (see vde_pkt_cow())
+// - optionally made of a chain of segments, so that headers and trailers can
+//   be added without copying the payload (see vde_pkt_chain_prepend())
+
+/**
+ * @brief Size of a cache line, packet metadata fits in one of them
+ */
+#define VDE_CACHE_LINE 64
+
+/**
+ * @brief Alignment of packet payload, i.e. of the ethernet header of frames
+ */
+#define VDE_PKT_PAYLOAD_ALIGN 16
 
 /**
  * @brief A vde packet header.
  */
-// XXX(shammash): check alignment
+// naturally aligned, it is always at the beginning of packet data
 typedef struct {
   uint8_t version; //!< Header version
   uint8_t type; //!< Type of payload
   uint16_t pkt_len; //!< Payload length
 } vde_hdr;
 
+/**
+ * @brief Version of vde_hdr
+ */
+#define VDE_HDR_VERSION 3
 
 /**
- * @brief A vde packet.
+ * @brief Types of payload
+ */
+enum vde_pkt_type {
+  VDE_PKT_TYPE_UNKNOWN, //!< Not set
+  VDE_PKT_TYPE_ETH, //!< Ethernet frame
+};
+
+/*
+ * Bits of vde_pkt_meta flags, each one marks some fields as valid
+ */
+#define VDE_PKT_META_RX 0x01 //!< conn_id and rx_time
+#define VDE_PKT_META_VLAN 0x02 //!< vlan_tci
+#define VDE_PKT_META_L3 0x04 //!< l3_proto and l3_off
+#define VDE_PKT_META_L4 0x08 //!< l4_proto and l4_off
+#define VDE_PKT_META_HASH 0x10 //!< flow_hash
+#define VDE_PKT_META_CSUM 0x20 //!< csum_start and csum_off
+#define VDE_PKT_META_GSO 0x40 //!< gso_type and gso_size
+
+#define VDE_PKT_META_PARSED (VDE_PKT_META_VLAN | VDE_PKT_META_L3 | \
+                             VDE_PKT_META_L4 | VDE_PKT_META_HASH)
+
+/*
+ * Offloads carried by a frame, work left to the egress connection: either its
+ * backend does it (e.g. the kernel for a tap device) or it is done in software
+ * when the frame is written, see vde_connection_set_offloads().
+ *
+ * With VDE_PKT_META_CSUM the L4 checksum field holds the checksum of the
+ * pseudo header only, the checksum from csum_start to the end of the frame
+ * must be folded into it. With VDE_PKT_META_GSO the frame is a TCP burst to
+ * be split in segments of gso_size bytes of payload each, with their own IP
+ * and TCP headers, the L4 header starts at csum_start.
+ */
+#define VDE_PKT_META_OFFLOAD (VDE_PKT_META_CSUM | VDE_PKT_META_GSO)
+
+/**
+ * @brief Types of segmentation of a frame with VDE_PKT_META_GSO
+ */
+enum vde_pkt_gso_type {
+  VDE_PKT_GSO_TCPV4 = 1, //!< TCP over IPv4
+  VDE_PKT_GSO_TCPV6, //!< TCP over IPv6
+};
+
+/**
+ * @brief ORed to the GSO type when the burst has CWR set, only the first
+ * segment keeps it
+ */
+#define VDE_PKT_GSO_ECN 0x80
+
+/**
+ * @brief Informations about a frame computed once when it is received, so
+ * that the engines it goes through don't need to parse it again.
+ *
+ * Offsets are relative to the payload of the head segment of the packet,
+ * where the ethernet header starts.
  */
 typedef struct {
+  uint64_t rx_time; //!< Receive time in ns, see vde_clock_ns()
+  uint32_t conn_id; //!< Id of the ingress connection
+  uint32_t flow_hash; //!< Hash of addresses and ports, same in both directions
+  uint16_t flags; //!< VDE_PKT_META_* bits, fields not flagged are undefined
+  uint16_t vlan_tci; //!< 802.1Q tag control information of the outer tag
+  uint16_t l3_proto; //!< Ethertype of the L3 header, in host byte order
+  uint16_t l3_off; //!< Offset of the L3 header
+  uint16_t l4_off; //!< Offset of the L4 header
+  uint8_t l4_proto; //!< IP protocol of the L4 header
+  uint8_t gso_type; //!< vde_pkt_gso_type, possibly with VDE_PKT_GSO_ECN
+  uint16_t gso_size; //!< Payload length of each segment
+  uint16_t csum_start; //!< Offset where the partial checksum starts
+  uint16_t csum_off; //!< Offset of the checksum field from csum_start
+} vde_pkt_meta;
+
+
+/**
+ * @brief A vde packet.
+ *
+ * A packet is either reference counted (refcount > 0, allocated with
+ * vde_pkt_new()) or borrowed (refcount == 0, its memory is owned by someone
+ * else, e.g. it lives on the stack of the caller). Borrowed packets can't be
+ * referenced, vde_pkt_share() returns a copy of them instead.
+ *
+ * The memory of a shared packet (refcount > 1) must be considered read-only,
+ * a holder who needs to change it must obtain a private copy with
+ * vde_pkt_cow().
+ *
+ * A packet can be the head of a chain of segments linked through next, each
+ * segment is a packet whose hdr->pkt_len is the length of its own payload.
+ * The frame is the concatenation of the segment payloads, its version and
+ * type are the ones of the head. Every segment holds a reference to the next
+ * one and the segments of a shared chain are read-only as well. Code which
+ * doesn't handle chains must call vde_pkt_linearize() first.
+ *
+ * The fields used on the data path fit in a single cache line, the frame
+ * metadata takes the following one and data starts after it. The payload
+ * starts at a multiple of VDE_PKT_PAYLOAD_ALIGN whatever the head size, the
+ * padding needed is taken between the header and the head space.
+ */
+typedef struct vde_pkt {
   vde_hdr *hdr; //!< Pointer to vde_header inside data
   char *head; //!< Pointer to an empty head space inside data
   char *payload; //!< Pointer to payload inside data
   char *tail; //!< Pointer to an empty tail space inside data
   unsigned int data_size; //!< The total size of memory allocated in data
-  char data[0]; //!< Allocated memory
+  unsigned int refcount; //!< Number of references, 0 if borrowed
+  struct vde_pool_cache *cache; //!< Pool size class, NULL if not pooled
+  struct vde_pkt *next; //!< Next segment of the frame, NULL if last
+  vde_pkt_meta meta __attribute__((aligned(VDE_CACHE_LINE))); //!< Metadata
+  char data[0] __attribute__((aligned(VDE_CACHE_LINE))); //!< Allocated memory
 } vde_pkt;
 
 /**
- * @brief Initialize vde packet fields.
+ * @brief The size of the data of a packet able to hold the given payload, head
+ * and tail space wherever the data is placed in memory.
+ */
+#define VDE_PKT_DATA_SZ(payload_sz, head, tail) \
+  (sizeof(vde_hdr) + (head) + (payload_sz) + (tail) + VDE_PKT_PAYLOAD_ALIGN - 1)
+
+/*
+ * Implemented by the packet pool (see vde3/pool.h), declared here because
+ * pooled packets are released and duplicated by the functions below.
+ */
+void vde_pool_pkt_release(vde_pkt *pkt);
+vde_pkt *vde_pool_cache_pkt_new(struct vde_pool_cache *cache,
+                                unsigned int payload_sz, unsigned int head,
+                                unsigned int tail);
+
+/**
+ * @brief Initialize vde packet fields. The packet is initialized as borrowed.
  *
  * @param pkt The packet to initialize
- * @param data The size of preallocated memory
+ * @param data The size of preallocated memory, see VDE_PKT_DATA_SZ()
  * @param head The size of the space before payload
  * @param tail The size of the space after payload
  */
 static inline void vde_pkt_init(vde_pkt *pkt, unsigned int data,
                                 unsigned int head, unsigned int tail) {
+  uintptr_t payload = (uintptr_t)(pkt->data + sizeof(vde_hdr) + head);
+
+  payload = (payload + VDE_PKT_PAYLOAD_ALIGN - 1) &
+            ~(uintptr_t)(VDE_PKT_PAYLOAD_ALIGN - 1);
   pkt->hdr = (vde_hdr *)pkt->data;
-  pkt->head = pkt->data + sizeof(vde_hdr);
-  pkt->payload = pkt->head + head;
+  pkt->payload = (char *)payload;
+  pkt->head = pkt->payload - head;
   pkt->tail = pkt->data + data - tail;
   pkt->data_size = data;
+  pkt->refcount = 0;
+  pkt->cache = NULL;
+  pkt->next = NULL;
+  pkt->meta.flags = 0;
 }
 
 /**
- * @brief Allocate and initialize a new vde_pkt
+ * @brief Size of the data of a packet initialized with vde_pkt_init_extern()
+ */
+#define VDE_PKT_EXTERN_DATA_SZ VDE_PKT_DATA_SZ(0, 0, 0)
+
+/**
+ * @brief Initialize a borrowed packet whose payload is memory owned by someone
+ * else, e.g. a frame in a ring mapped from the kernel, so that it can be lent
+ * to engines without copying it. Its data only holds the header, there is no
+ * head nor tail space; vde_pkt_share() copies it as any borrowed packet.
+ *
+ * @param pkt The packet to initialize, with VDE_PKT_EXTERN_DATA_SZ bytes of
+ * data
+ * @param payload The frame
+ * @param len The length of the frame
+ */
+static inline void vde_pkt_init_extern(vde_pkt *pkt, char *payload,
+                                       unsigned int len) {
+  pkt->hdr = (vde_hdr *)pkt->data;
+  pkt->hdr->pkt_len = len;
+  pkt->payload = payload;
+  pkt->head = payload;
+  pkt->data_size = VDE_PKT_EXTERN_DATA_SZ;
+  pkt->tail = pkt->data + pkt->data_size;
+  pkt->refcount = 0;
+  pkt->cache = NULL;
+  pkt->next = NULL;
+  pkt->meta.flags = 0;
+}
+
+/**
+ * @brief Allocate and initialize a new vde_pkt, the caller owns the only
+ * reference to it. Packets allocated in the data path should come from the
+ * context packet pool instead, see vde_pool_pkt_new().
  *
  * @param payload_sz The size of the payload
  * @param head The size of the space before payload
@@ -86,47 +258,488 @@ static inline void vde_pkt_init(vde_pkt *pkt, unsigned int data,
 static inline vde_pkt *vde_pkt_new(unsigned int payload_sz, unsigned int head,
                                    unsigned int tail)
 {
-  unsigned int data_sz = sizeof(vde_hdr) + head + payload_sz + tail;
+  unsigned int data_sz = VDE_PKT_DATA_SZ(payload_sz, head, tail);
   unsigned int pkt_sz = sizeof(vde_pkt) + data_sz;
-  // XXX consider using cached allocator
-  vde_pkt *pkt = (vde_pkt *)vde_calloc(pkt_sz);
+  vde_pkt *pkt = (vde_pkt *)vde_calloc_aligned(VDE_CACHE_LINE, pkt_sz);
 
   if (pkt == NULL) {
     errno = ENOMEM;
     return NULL;
   }
   vde_pkt_init(pkt, data_sz, head, tail);
+  pkt->refcount = 1;
+  return pkt;
+}
+
+/**
+ * @brief Get the size of the free space before payload
+ *
+ * @param pkt The packet
+ *
+ * @return The head space size
+ */
+static inline unsigned int vde_pkt_get_headsize(vde_pkt *pkt)
+{
+  return pkt->payload - pkt->head;
+}
+
+/**
+ * @brief Get the size of the free space after payload
+ *
+ * @param pkt The packet
+ *
+ * @return The tail space size
+ */
+static inline unsigned int vde_pkt_get_tailsize(vde_pkt *pkt)
+{
+  return pkt->data + pkt->data_size - pkt->tail;
+}
+
+/**
+ * @brief Take a new reference to a reference counted packet
+ *
+ * @param pkt The packet, it must not be borrowed
+ *
+ * @return The packet itself
+ */
+static inline vde_pkt *vde_pkt_get(vde_pkt *pkt)
+{
+  vde_assert(pkt != NULL);
+  vde_assert(pkt->refcount > 0);
+
+  pkt->refcount++;
   return pkt;
 }
 
 /**
- * @brief Copy the content of a packet into another pre-allocated packet
+ * @brief Drop a reference to a packet, the packet is freed when its last
+ * reference is dropped.
+ *
+ * @param pkt The packet, it must not be borrowed
+ */
+static inline void vde_pkt_put(vde_pkt *pkt)
+{
+  vde_pkt *next;
+
+  vde_assert(pkt != NULL);
+
+  // the reference held by a released segment to the next one is dropped too
+  while (pkt != NULL) {
+    vde_assert(pkt->refcount > 0);
+
+    if (--pkt->refcount != 0) {
+      return;
+    }
+    next = pkt->next;
+    if (pkt->cache != NULL) {
+      vde_pool_pkt_release(pkt);
+    } else {
+      vde_free_aligned(pkt);
+    }
+    pkt = next;
+  }
+}
+
+/**
+ * @brief Check if a packet has other holders besides the caller
+ *
+ * @param pkt The packet
+ *
+ * @return Nonzero if the packet memory must be considered read-only
+ */
+static inline int vde_pkt_is_shared(vde_pkt *pkt)
+{
+  return pkt->refcount != 1;
+}
+
+/**
+ * @brief Hint the cpu that a packet is going to be used soon, e.g. the next
+ * one of a batch. The metadata and the first line of data are fetched, the
+ * latter holds the header and (unless head space is large) the ethernet
+ * header. No packet field is read, so this never stalls.
+ *
+ * @param pkt The packet
+ */
+static inline void vde_pkt_prefetch(vde_pkt *pkt)
+{
+  __builtin_prefetch(pkt);
+  __builtin_prefetch(&pkt->meta);
+  __builtin_prefetch(pkt->data);
+}
+
+/**
+ * @brief Check if a packet is made of a single segment
+ *
+ * @param pkt The packet
+ *
+ * @return Nonzero if the whole frame is in pkt->payload
+ */
+static inline int vde_pkt_is_linear(vde_pkt *pkt)
+{
+  return pkt->next == NULL;
+}
+
+/**
+ * @brief Get the length of the frame carried by a packet, summing the length
+ * of all its segments
+ *
+ * @param pkt The packet
+ *
+ * @return The frame length
+ */
+static inline unsigned int vde_pkt_len(vde_pkt *pkt)
+{
+  unsigned int len = 0;
+
+  for (; pkt != NULL; pkt = pkt->next) {
+    len += pkt->hdr->pkt_len;
+  }
+  return len;
+}
+
+/**
+ * @brief Copy the frame carried by a packet into a buffer
+ *
+ * @param pkt The packet
+ * @param buf The destination, it must be at least vde_pkt_len() bytes long
+ */
+static inline void vde_pkt_gather(vde_pkt *pkt, char *buf)
+{
+  for (; pkt != NULL; pkt = pkt->next) {
+    memcpy(buf, pkt->payload, pkt->hdr->pkt_len);
+    buf += pkt->hdr->pkt_len;
+  }
+}
+
+/**
+ * @brief Allocate a private copy of a packet with the given head and tail
+ * space. Only header, metadata and payload are copied, the copy comes from the
+ * same pool of the original packet (if any) and is always linear.
+ *
+ * @param pkt The packet to copy
+ * @param head The size of the space before payload in the copy
+ * @param tail The size of the space after payload in the copy
+ *
+ * @return The new packet with a single reference on success, NULL on error
+ * (and errno is set appropriately)
+ */
+static inline vde_pkt *vde_pkt_dup(vde_pkt *pkt, unsigned int head,
+                                   unsigned int tail)
+{
+  vde_pkt *new_pkt;
+  unsigned int len = vde_pkt_len(pkt);
+
+  if (pkt->cache != NULL) {
+    new_pkt = vde_pool_cache_pkt_new(pkt->cache, len, head, tail);
+  } else {
+    new_pkt = vde_pkt_new(len, head, tail);
+  }
+  if (new_pkt == NULL) {
+    return NULL;
+  }
+  memcpy(new_pkt->hdr, pkt->hdr, sizeof(vde_hdr));
+  new_pkt->hdr->pkt_len = len;
+  new_pkt->meta = pkt->meta;
+  vde_pkt_gather(pkt, new_pkt->payload);
+  return new_pkt;
+}
+
+/**
+ * @brief Get a reference to a packet which can be kept after the function
+ * which received the packet returns.
+ *
+ * If the packet is reference counted a new reference is taken, otherwise the
+ * packet is borrowed and a copy with the same head and tail space is
+ * returned. In both cases the result must be released with vde_pkt_put().
+ *
+ * @param pkt The packet to share
+ *
+ * @return The shared packet on success, NULL on error (and errno is set
+ * appropriately)
+ */
+static inline vde_pkt *vde_pkt_share(vde_pkt *pkt)
+{
+  vde_assert(pkt != NULL);
+
+  if (pkt->refcount > 0) {
+    return vde_pkt_get(pkt);
+  }
+  return vde_pkt_dup(pkt, vde_pkt_get_headsize(pkt),
+                     vde_pkt_get_tailsize(pkt));
+}
+
+/**
+ * @brief Copy-on-write: get a packet the caller can modify, with at least
+ * head bytes before and tail bytes after the payload.
+ *
+ * If the caller holds the only reference, the packet is linear and it already
+ * has enough head and tail space the packet itself is returned, otherwise a
+ * private linear copy is made and the caller's reference to the original
+ * packet is dropped.
+ *
+ * @param pkt A packet reference owned by the caller (or a borrowed packet)
+ * @param head The minimum size of the space before payload
+ * @param tail The minimum size of the space after payload
+ *
+ * @return The writable packet on success, NULL on error (and errno is set
+ * appropriately), in the latter case the reference to pkt is still owned by
+ * the caller.
+ */
+static inline vde_pkt *vde_pkt_cow(vde_pkt *pkt, unsigned int head,
+                                   unsigned int tail)
+{
+  vde_pkt *new_pkt;
+  unsigned int cur_head = vde_pkt_get_headsize(pkt);
+  unsigned int cur_tail = vde_pkt_get_tailsize(pkt);
+
+  if (pkt->refcount == 1 && vde_pkt_is_linear(pkt) && cur_head >= head &&
+      cur_tail >= tail) {
+    return pkt;
+  }
+  new_pkt = vde_pkt_dup(pkt, cur_head > head ? cur_head : head,
+                        cur_tail > tail ? cur_tail : tail);
+  if (new_pkt == NULL) {
+    return NULL;
+  }
+  if (pkt->refcount > 0) {
+    vde_pkt_put(pkt);
+  }
+  return new_pkt;
+}
+
+/**
+ * @brief Get a linear packet with the same frame, for code which needs the
+ * whole frame in pkt->payload. Unlike vde_pkt_cow() a linear packet is never
+ * copied, even if shared.
+ *
+ * @param pkt A packet reference owned by the caller
+ *
+ * @return The linear packet on success, NULL on error (and errno is set
+ * appropriately), in the latter case the reference to pkt is still owned by
+ * the caller.
+ */
+static inline vde_pkt *vde_pkt_linearize(vde_pkt *pkt)
+{
+  vde_pkt *new_pkt;
+
+  if (vde_pkt_is_linear(pkt)) {
+    return pkt;
+  }
+  new_pkt = vde_pkt_dup(pkt, vde_pkt_get_headsize(pkt), 0);
+  if (new_pkt == NULL) {
+    return NULL;
+  }
+  vde_pkt_put(pkt);
+  return new_pkt;
+}
+
+/**
+ * @brief Put a segment in front of a packet, e.g. to add an encapsulation
+ * header without touching the payload. The version and type of the frame and
+ * its receive metadata are copied into the new head, parsed metadata refers to
+ * the old frame and is dropped. Offloads of the old frame must be done before
+ * it is encapsulated.
+ *
+ * @param seg A linear, private segment; its payload is the data to prepend
+ * @param pkt A packet reference owned by the caller, it is taken over by the
+ * chain and can be shared
+ *
+ * @return The head of the chain (seg)
+ */
+static inline vde_pkt *vde_pkt_chain_prepend(vde_pkt *seg, vde_pkt *pkt)
+{
+  vde_assert(seg->refcount == 1 && vde_pkt_is_linear(seg));
+  vde_assert(pkt->refcount > 0);
+
+  seg->hdr->version = pkt->hdr->version;
+  seg->hdr->type = pkt->hdr->type;
+  seg->meta = pkt->meta;
+  seg->meta.flags &= ~VDE_PKT_META_PARSED;
+  seg->next = pkt;
+  return seg;
+}
+
+/**
+ * @brief Put a segment at the end of a packet, e.g. to add a trailer. The
+ * links of a chain live in its segments, so the part of the chain shared with
+ * other holders is replaced with a linear copy of it before linking.
+ *
+ * @param pkt A private packet reference owned by the caller
+ * @param seg A segment reference owned by the caller, it is taken over by the
+ * chain
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately), in
+ * the latter case the caller still owns seg and pkt is unchanged.
+ */
+static inline int vde_pkt_chain_append(vde_pkt *pkt, vde_pkt *seg)
+{
+  vde_pkt **link, *new_pkt;
+
+  vde_assert(pkt->refcount == 1);
+  vde_assert(seg->refcount > 0);
+
+  link = &pkt->next;
+  while (*link != NULL && (*link)->refcount == 1) {
+    link = &(*link)->next;
+  }
+  if (*link != NULL) {
+    new_pkt = vde_pkt_dup(*link, vde_pkt_get_headsize(*link), 0);
+    if (new_pkt == NULL) {
+      return -1;
+    }
+    vde_pkt_put(*link);
+    *link = new_pkt;
+    link = &new_pkt->next;
+  }
+  *link = seg;
+  return 0;
+}
+
+/**
+ * @brief Describe the frame carried by a packet with an iovec array, e.g. to
+ * send it with sendmsg() or writev()
+ *
+ * @param pkt The packet
+ * @param iov The array to fill
+ * @param iovcnt The number of elements of iov
+ *
+ * @return The number of elements used on success, -1 on error (and errno is
+ * set appropriately)
+ */
+static inline int vde_pkt_to_iovec(vde_pkt *pkt, struct iovec *iov,
+                                   int iovcnt)
+{
+  int i;
+
+  for (i = 0; pkt != NULL; pkt = pkt->next, i++) {
+    if (i == iovcnt) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    iov[i].iov_base = pkt->payload;
+    iov[i].iov_len = pkt->hdr->pkt_len;
+  }
+  return i;
+}
+
+/**
+ * @brief Copy the content of a packet into another pre-allocated packet, the
+ * reference count and the pool of the destination are preserved.
  *
  * @param dst The destination of the copy, the user of this function must check
  * in advance that the destination data_size can contain the copy.
- * @param src The source of the copy
+ * @param src The source of the copy, it must be linear and its payload must be
+ * in its data (see vde_pkt_init_extern())
  */
 static inline void vde_pkt_cpy(vde_pkt *dst, vde_pkt *src) {
-  vde_pkt_init(dst, src->data_size,
-               src->payload - src->head,
-               src->data + src->data_size - src->tail);
-  memcpy(&dst->data, &src->data, src->data_size);
+  unsigned int refcount = dst->refcount;
+  struct vde_pool_cache *cache = dst->cache;
+
+  vde_assert(vde_pkt_is_linear(src));
+  // the payload offset depends on where data is, copy the parts one by one
+  vde_pkt_init(dst, src->data_size, vde_pkt_get_headsize(src),
+               vde_pkt_get_tailsize(src));
+  dst->refcount = refcount;
+  dst->cache = cache;
+  memcpy(dst->hdr, src->hdr, sizeof(vde_hdr));
+  dst->meta = src->meta;
+  memcpy(dst->head, src->head, src->tail - src->head);
 }
 
 /**
  * @brief Copy the content of a packet into another pre-allocated packet. Does
- * not keep head/tail space
+ * not keep head/tail space, the reference count and the pool of the
+ * destination are preserved.
  *
  * @param dst The destination of the copy, the user of this function must check
  * in advance that the destination data_size can contain the copy.
- * @param src The source of the copy
+ * @param src The source of the copy, it must be linear
  */
 static inline void vde_pkt_compact_cpy(vde_pkt *dst, vde_pkt *src) {
+  unsigned int refcount = dst->refcount;
+  struct vde_pool_cache *cache = dst->cache;
+
+  vde_assert(vde_pkt_is_linear(src));
   vde_pkt_init(dst, src->data_size, 0, 0);
+  dst->refcount = refcount;
+  dst->cache = cache;
   memcpy(dst->hdr, src->hdr, sizeof(vde_hdr));
+  dst->meta = src->meta;
   memcpy(dst->payload, src->payload, src->hdr->pkt_len);
 }
 
+/**
+ * @brief Maximum number of packets in a batch
+ */
+#define VDE_PKT_BATCH_MAX 32
+
+/**
+ * @brief A batch of packets handed over with a single call.
+ *
+ * The ownership of the packets in a batch follows the same rules of a single
+ * packet: a batch passed to a callback or to a backend is lent for the
+ * duration of the call, each packet must be shared to be kept.
+ */
+typedef struct {
+  unsigned int count; //!< Number of packets in pkts
+  vde_pkt *pkts[VDE_PKT_BATCH_MAX]; //!< The packets
+} vde_pkt_batch;
+
+/**
+ * @brief Empty a batch, the packets it contains are not released.
+ *
+ * @param batch The batch to initialize
+ */
+static inline void vde_pkt_batch_init(vde_pkt_batch *batch)
+{
+  batch->count = 0;
+}
+
+/**
+ * @brief Append a packet to a batch
+ *
+ * @param batch The batch
+ * @param pkt The packet to append
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static inline int vde_pkt_batch_add(vde_pkt_batch *batch, vde_pkt *pkt)
+{
+  if (batch->count >= VDE_PKT_BATCH_MAX) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  batch->pkts[batch->count++] = pkt;
+  return 0;
+}
+
+/**
+ * @brief Check if a batch can't take more packets
+ *
+ * @param batch The batch
+ *
+ * @return Nonzero if the batch is full
+ */
+static inline int vde_pkt_batch_is_full(vde_pkt_batch *batch)
+{
+  return batch->count >= VDE_PKT_BATCH_MAX;
+}
+
+/**
+ * @brief Drop a reference to every packet of a batch and empty it
+ *
+ * @param batch The batch, its packets must not be borrowed
+ */
+static inline void vde_pkt_batch_put(vde_pkt_batch *batch)
+{
+  unsigned int i;
+
+  for (i = 0; i < batch->count; i++) {
+    vde_pkt_put(batch->pkts[i]);
+  }
+  batch->count = 0;
+}
+
 // When a packet is read from the network by a connection the payload always
 // follows the header, so head size and tail size are zero.
 // If a connection implementation does not handle generic vde data but specific
@@ -139,27 +752,85 @@ static inline void vde_pkt_compact_cpy(vde_pkt *dst, vde_pkt *src) {
 //                                       unsigned int head_sz,
 //                                       unsigned int tail_sz);
 
-// For further speedup certain implementations might want to define their own
-// data structure to be used when specific properties are set by the engine.
-// struct vde2_transport_pkt {
-//   vde_pkt pkt;
-//   char data[1540]; // sizeof(vde_hdr) +
-//                    // 4 (head reserved for vlan tags) +
-//                    // 1504 (frame eth+trailing)
-// };
+// Connections read into packets of the context pool (see vde3/pool.h) sized
+// with the connection properties, so the payload is received directly after
+// the requested head space and no copy is needed when an engine grows it:
 //
-// Inside a connection handling read event:
-// struct vde2_transport_pkt stack_pkt;
-// vde_pkt *pkt;
-// ...
-// if(conn->head_sz == 4 && conn->tail_sz == 0) {
-//   ... set fields as explained above ...
-//   read(stack_pkt.pkt.payload, MAX_ETH_FRAME_SIZE);
-//   *pkt = stack_pkt;
-// } else {
-//   ... alloc a new vde_pkt with the necessary data and read ...
-// }
-// ... set packet fields and pass it to the engine ...
+// pkt = vde_pool_pkt_new(pool, MAX_FRAME_SIZE,
+//                        vde_connection_get_pkt_headsize(conn),
+//                        vde_connection_get_pkt_tailsize(conn));
+// len = read(fd, pkt->payload, MAX_FRAME_SIZE);
+// ... set packet fields, pass it to the engine and drop the reference ...
 
 
+/**
+ * @brief Parse the headers of the ethernet frame carried by a packet and fill
+ * its metadata: VLAN tag, L3 and L4 offsets and the flow hash. Only the head
+ * segment is parsed, headers beyond it are left unflagged.
+ *
+ * @param pkt The packet, its payload must be an ethernet frame
+ */
+void vde_pkt_meta_parse(vde_pkt *pkt);
+
+/**
+ * @brief Complete the partial checksum of a frame with VDE_PKT_META_CSUM
+ *
+ * @param pkt A linear, private packet
+ *
+ * @return zero on success, -1 if the checksum offsets are out of the frame
+ * (and errno is set appropriately)
+ */
+int vde_pkt_csum_complete(vde_pkt *pkt);
+
+/**
+ * @brief Get the number of segments of a frame with VDE_PKT_META_GSO
+ *
+ * @param pkt A linear packet, its L3 metadata must be valid
+ *
+ * @return The number of segments, 0 if the frame can't be segmented
+ */
+unsigned int vde_pkt_gso_count(vde_pkt *pkt);
+
+/**
+ * @brief Get the length of the largest segment of a frame with
+ * VDE_PKT_META_GSO, the headers must be in the head segment of a chain
+ *
+ * @param pkt The packet, its L3 metadata must be valid
+ *
+ * @return The length of the segment, 0 if the frame can't be segmented
+ */
+unsigned int vde_pkt_gso_seg_len(vde_pkt *pkt);
+
+/**
+ * @brief Build a segment of a frame with VDE_PKT_META_GSO, with its IP and
+ * TCP headers fixed and checksums computed. The segment comes from the same
+ * pool of the frame (if any) and has its metadata without offloads.
+ *
+ * @param pkt A linear packet, see vde_pkt_gso_count()
+ * @param index The index of the segment, less than vde_pkt_gso_count()
+ *
+ * @return The segment with a single reference on success, NULL on error (and
+ * errno is set appropriately)
+ */
+vde_pkt *vde_pkt_gso_segment(vde_pkt *pkt, unsigned int index);
+
+/**
+ * @brief Called by transports when a packet has been received, set the
+ * receive metadata, the header type and parse the frame.
+ *
+ * @param pkt The received packet
+ * @param conn_id The id of the connection the packet has been received from
+ * @param rx_time The receive time, see vde_clock_ns()
+ */
+static inline void vde_pkt_meta_rx(vde_pkt *pkt, uint32_t conn_id,
+                                   uint64_t rx_time)
+{
+  pkt->hdr->version = VDE_HDR_VERSION;
+  pkt->hdr->type = VDE_PKT_TYPE_ETH;
+  pkt->meta.conn_id = conn_id;
+  pkt->meta.rx_time = rx_time;
+  pkt->meta.flags = VDE_PKT_META_RX;
+  vde_pkt_meta_parse(pkt);
+}
+
 #endif /* __VDE3_PACKET_H__ */
@@ -0,0 +1,215 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_POOL_H__
+#define __VDE3_POOL_H__
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/packet.h>
+
+/*
+ * The packet pool keeps a free list of packets for each size class. When a
+ * free list is empty a new slab of packets is allocated with a single
+ * allocation, slabs are given back to the system only when the pool is
+ * deleted. Packets larger than the largest class are allocated with
+ * vde_pkt_new().
+ *
+ * Sizes are the amount of memory available in vde_pkt data (vde_hdr, head
+ * space, payload and tail space).
+ *
+ * In arena mode slabs are VDE_POOL_ARENA_SLAB_SZ mappings backed by huge pages
+ * (MAP_HUGETLB) when the system has some reserved, otherwise by transparent
+ * huge pages (madvise(MADV_HUGEPAGE)) or normal pages. This reduces TLB misses
+ * when many packets are queued.
+ *
+ * The pool also accounts the bytes held by the egress queues of all the
+ * connections of the context. Above queue_limit packets are dropped, above
+ * queue_watermark a queue gets only its fair share of the watermark (the
+ * watermark divided by the number of non-empty queues) so that slow consumers
+ * are dropped first.
+ */
+#define VDE_POOL_CTRL_DATA_SZ 512
+#define VDE_POOL_ETH_DATA_SZ 2048
+#define VDE_POOL_JUMBO_DATA_SZ (64 * 1024 + 1024)
+#define VDE_POOL_ARENA_SLAB_SZ (2 * 1024 * 1024)
+
+/**
+ * @brief A packet pool
+ */
+typedef struct vde_pool vde_pool;
+
+/**
+ * @brief Statistics of a packet pool size class
+ */
+typedef struct {
+  unsigned int data_size; //!< Size of the data of each packet
+  unsigned int total; //!< Packets allocated
+  unsigned int free; //!< Packets in the free list
+  unsigned long hits; //!< Allocations served by the free list
+  unsigned long misses; //!< Allocations which needed new memory
+  unsigned long exhausted; //!< Allocations failed because of class limit
+  unsigned long mem; //!< Bytes of memory allocated for packets
+  unsigned long mem_hugetlb; //!< Part of mem backed by MAP_HUGETLB
+  unsigned long mem_thp; //!< Part of mem advised for transparent huge pages
+} vde_pool_stats;
+
+/**
+ * @brief Occupancy of the connection queues of a pool
+ */
+typedef struct {
+  unsigned long bytes; //!< Bytes queued
+  unsigned long limit; //!< Max bytes queued, 0 for unlimited
+  unsigned long watermark; //!< Early drop threshold, 0 for none
+  unsigned int queues; //!< Non-empty queues
+  int over_watermark; //!< Early drops are active
+  unsigned long drops; //!< Packets dropped because of limit
+  unsigned long early_drops; //!< Packets dropped because of watermark
+} vde_pool_queue_stats;
+
+/**
+ * @brief Called when the queued bytes cross the watermark
+ *
+ * @param over Nonzero if early drops started, zero if they stopped
+ * @param bytes The bytes queued
+ * @param arg The argument given to vde_pool_set_watermark_cb()
+ */
+typedef void (*vde_pool_watermark_cb)(int over, unsigned long bytes,
+                                      void *arg);
+
+/**
+ * @brief Alloc a new packet pool
+ *
+ * @param params The pool parameters, if NULL use defaults
+ *
+ * @return a pool on success, NULL on error (and errno is set appropriately)
+ */
+vde_pool *vde_pool_new(vde_pool_params *params);
+
+/**
+ * @brief Deallocate a packet pool. If some of its packets are still in use
+ * the memory is freed when the last one is released.
+ *
+ * @param pool The pool to delete
+ */
+void vde_pool_delete(vde_pool *pool);
+
+/**
+ * @brief Allocate a new packet from the pool, the caller owns the only
+ * reference to it. The payload space of the packet can be larger than
+ * payload_sz.
+ *
+ * @param pool The pool to allocate from
+ * @param payload_sz The size of the payload
+ * @param head The size of the space before payload
+ * @param tail The size of the space after payload
+ *
+ * @return The new packet on success, NULL on error (and errno is set
+ * appropriately, ENOBUFS if the size class limit has been reached)
+ */
+vde_pkt *vde_pool_pkt_new(vde_pool *pool, unsigned int payload_sz,
+                          unsigned int head, unsigned int tail);
+
+/**
+ * @brief Like vde_pkt_share(), but a borrowed packet is copied into a packet
+ * of the pool. The copy has no head and tail space, this is meant to be used
+ * by connections which keep the packet only to send its payload.
+ *
+ * @param pool The pool to allocate the copy from
+ * @param pkt The packet to share
+ *
+ * @return The shared packet on success, NULL on error (and errno is set
+ * appropriately)
+ */
+vde_pkt *vde_pool_pkt_share(vde_pool *pool, vde_pkt *pkt);
+
+/**
+ * @brief Check if the pool maps packet memory in arena mode
+ *
+ * @param pool The pool
+ *
+ * @return Nonzero in arena mode
+ */
+int vde_pool_is_arena(vde_pool *pool);
+
+/**
+ * @brief Get statistics of a size class
+ *
+ * @param pool The pool
+ * @param cls The size class
+ * @param stats The structure to fill
+ */
+void vde_pool_get_stats(vde_pool *pool, vde_pool_class cls,
+                        vde_pool_stats *stats);
+
+/**
+ * @brief Account bytes added to a connection queue.
+ *
+ * @param pool The pool
+ * @param len The bytes to add
+ * @param held The bytes the queue holds before adding len
+ *
+ * @return zero on success, -1 if the packet must be dropped (and errno is set
+ * to ENOBUFS)
+ */
+int vde_pool_queue_charge(vde_pool *pool, unsigned int len,
+                          unsigned long held);
+
+/**
+ * @brief Account bytes removed from a connection queue.
+ *
+ * @param pool The pool
+ * @param len The bytes to remove
+ * @param held The bytes the queue holds after removing len
+ */
+void vde_pool_queue_uncharge(vde_pool *pool, unsigned int len,
+                             unsigned long held);
+
+/**
+ * @brief Check if the queued bytes are above the watermark
+ *
+ * @param pool The pool
+ *
+ * @return Nonzero if early drops are active
+ */
+int vde_pool_queue_over_watermark(vde_pool *pool);
+
+/**
+ * @brief Set the function called when the queued bytes cross the watermark,
+ * from the vde_pool_queue_charge() or vde_pool_queue_uncharge() call which
+ * crossed it
+ *
+ * @param pool The pool
+ * @param cb The function, NULL for none
+ * @param arg The argument of cb
+ */
+void vde_pool_set_watermark_cb(vde_pool *pool, vde_pool_watermark_cb cb,
+                               void *arg);
+
+/**
+ * @brief Get the occupancy of connection queues
+ *
+ * @param pool The pool
+ * @param stats The structure to fill
+ */
+void vde_pool_get_queue_stats(vde_pool *pool, vde_pool_queue_stats *stats);
+
+#endif /* __VDE3_POOL_H__ */
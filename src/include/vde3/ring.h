@@ -0,0 +1,240 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_RING_H__
+#define __VDE3_RING_H__
+
+#include <vde3/common.h>
+
+/*
+ * A fixed capacity double ended queue of pointers, stored in a power of two
+ * array allocated once. Unlike vde_queue pushing an element doesn't allocate
+ * memory, so it can be used on the data path.
+ *
+ * head and tail are free running counters, the elements are the ones from
+ * tail (included) to head (excluded) and their number is head - tail.
+ */
+
+/**
+ * @brief A ring of pointers
+ */
+typedef struct {
+  void **slots; //!< The array of elements
+  unsigned int mask; //!< Capacity - 1
+  unsigned int head; //!< Index of the next element pushed to the head
+  unsigned int tail; //!< Index of the element at the tail
+  unsigned int hwm; //!< Max number of elements ever held
+} vde_ring;
+
+/**
+ * @brief Allocate the elements of a ring
+ *
+ * @param ring The ring to initialize
+ * @param capacity The minimum number of elements, rounded up to a power of two
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static inline int vde_ring_init(vde_ring *ring, unsigned int capacity)
+{
+  unsigned int size = 1;
+
+  vde_assert(ring != NULL);
+
+  if (capacity == 0 || capacity > 1U << 31) {
+    errno = EINVAL;
+    return -1;
+  }
+  while (size < capacity) {
+    size <<= 1;
+  }
+  ring->slots = (void **)vde_alloc(size * sizeof(void *));
+  if (ring->slots == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  ring->mask = size - 1;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->hwm = 0;
+  return 0;
+}
+
+/**
+ * @brief Free the elements array of a ring, the elements are not released.
+ *
+ * @param ring The ring
+ */
+static inline void vde_ring_fini(vde_ring *ring)
+{
+  vde_assert(ring != NULL);
+
+  vde_free(ring->slots);
+  ring->slots = NULL;
+}
+
+/**
+ * @brief Check if the elements of a ring have been allocated
+ *
+ * @param ring The ring
+ *
+ * @return Nonzero if vde_ring_init() has been called
+ */
+static inline int vde_ring_is_init(vde_ring *ring)
+{
+  return ring->slots != NULL;
+}
+
+/**
+ * @brief Get the max number of elements of a ring
+ *
+ * @param ring The ring
+ *
+ * @return The capacity
+ */
+static inline unsigned int vde_ring_capacity(vde_ring *ring)
+{
+  return ring->mask + 1;
+}
+
+/**
+ * @brief Get the number of elements in a ring
+ *
+ * @param ring The ring
+ *
+ * @return The number of elements
+ */
+static inline unsigned int vde_ring_get_length(vde_ring *ring)
+{
+  return ring->head - ring->tail;
+}
+
+/**
+ * @brief Check if a ring is empty
+ *
+ * @param ring The ring
+ *
+ * @return Nonzero if the ring has no elements
+ */
+static inline int vde_ring_is_empty(vde_ring *ring)
+{
+  return ring->head == ring->tail;
+}
+
+/**
+ * @brief Check if a ring is full
+ *
+ * @param ring The ring
+ *
+ * @return Nonzero if no element can be pushed
+ */
+static inline int vde_ring_is_full(vde_ring *ring)
+{
+  return vde_ring_get_length(ring) > ring->mask;
+}
+
+/**
+ * @brief Get the max number of elements the ring has held
+ *
+ * @param ring The ring
+ *
+ * @return The high-water mark
+ */
+static inline unsigned int vde_ring_get_hwm(vde_ring *ring)
+{
+  return ring->hwm;
+}
+
+// internal, called after each push
+static inline void vde_ring_update_hwm(vde_ring *ring)
+{
+  if (vde_ring_get_length(ring) > ring->hwm) {
+    ring->hwm = vde_ring_get_length(ring);
+  }
+}
+
+/**
+ * @brief Add an element at the head of a ring
+ *
+ * @param ring The ring
+ * @param data The element
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static inline int vde_ring_push_head(vde_ring *ring, void *data)
+{
+  if (vde_ring_is_full(ring)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  ring->slots[ring->head++ & ring->mask] = data;
+  vde_ring_update_hwm(ring);
+  return 0;
+}
+
+/**
+ * @brief Add an element at the tail of a ring
+ *
+ * @param ring The ring
+ * @param data The element
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static inline int vde_ring_push_tail(vde_ring *ring, void *data)
+{
+  if (vde_ring_is_full(ring)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  ring->slots[--ring->tail & ring->mask] = data;
+  vde_ring_update_hwm(ring);
+  return 0;
+}
+
+/**
+ * @brief Remove the element at the head of a ring
+ *
+ * @param ring The ring
+ *
+ * @return The element, NULL if the ring is empty
+ */
+static inline void *vde_ring_pop_head(vde_ring *ring)
+{
+  if (vde_ring_is_empty(ring)) {
+    return NULL;
+  }
+  return ring->slots[--ring->head & ring->mask];
+}
+
+/**
+ * @brief Remove the element at the tail of a ring
+ *
+ * @param ring The ring
+ *
+ * @return The element, NULL if the ring is empty
+ */
+static inline void *vde_ring_pop_tail(vde_ring *ring)
+{
+  if (vde_ring_is_empty(ring)) {
+    return NULL;
+  }
+  return ring->slots[ring->tail++ & ring->mask];
+}
+
+#endif /* __VDE3_RING_H__ */
@@ -0,0 +1,227 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+/**
+ * @file
+ */
+
+#ifndef __VDE3_TRANSPORT_COMMON_H__
+#define __VDE3_TRANSPORT_COMMON_H__
+
+#include <sys/socket.h>
+
+#include <vde3.h>
+
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/ring.h>
+
+/*
+ * Helpers shared by the transport modules.
+ */
+
+/**
+ * @brief Send packets to the peer of a connection.
+ *
+ * @param priv The private data of the send queue
+ * @param pkts The packets, they are not released
+ * @param count The number of packets, at most VDE_PKT_BATCH_MAX
+ *
+ * @return The number of packets sent, or dropped by the backend. If less than
+ * count errno tells what happened to the first packet not sent: EAGAIN if the
+ * peer cannot take it now, EINPROGRESS if part of it has been sent and it must
+ * not be dropped, EMSGSIZE if it must be linearized, any other value if it can
+ * never be sent.
+ */
+typedef unsigned int (*vde_sendq_send_cb)(void *priv, vde_pkt **pkts,
+                                          unsigned int count);
+
+/**
+ * @brief Arrange for vde_sendq_flush() to be called when the peer can take
+ * more packets.
+ *
+ * @param priv The private data of the send queue
+ */
+typedef void (*vde_sendq_wait_cb)(void *priv);
+
+/**
+ * @brief The packets a connection could not send right away.
+ */
+typedef struct {
+  vde_ring pkts; //!< References to the packets, the oldest at the tail
+  unsigned int numtries; //!< Send attempts of the packet at the tail
+  int count_tries; //!< Nonzero to drop the tail after too many attempts
+  vde_connection *conn; //!< The connection sending the packets
+  vde_sendq_send_cb send; //!< Backend send function
+  vde_sendq_wait_cb wait; //!< Backend wait function
+  void *priv; //!< Private data of send and wait
+} vde_sendq;
+
+/**
+ * @brief Initialize a send queue, the queue itself is allocated with the
+ * first packet queued.
+ *
+ * @param q The send queue
+ * @param conn The connection, its queue properties bound the queue
+ * @param send The function sending packets
+ * @param wait The function waiting for the peer
+ * @param priv Private data of send and wait
+ * @param count_tries Nonzero if the packet at the tail is dropped with
+ * CONN_WRITE_DELAY after the send maxtries of the connection, to be used when
+ * wait is bound to the send maxtimeout of the connection
+ */
+void vde_sendq_init(vde_sendq *q, vde_connection *conn, vde_sendq_send_cb send,
+                    vde_sendq_wait_cb wait, void *priv, int count_tries);
+
+/**
+ * @brief Release the packets still in a send queue and the queue itself
+ *
+ * @param q The send queue
+ */
+void vde_sendq_fini(vde_sendq *q);
+
+/**
+ * @brief Check if a send queue holds no packets
+ *
+ * @param q The send queue
+ *
+ * @return Nonzero if the queue is empty
+ */
+static inline int vde_sendq_is_empty(vde_sendq *q)
+{
+  return vde_ring_is_empty(&q->pkts);
+}
+
+/**
+ * @brief Put a reference to a packet at the head of a send queue, its length
+ * is accounted in the queue of the connection.
+ *
+ * @param q The send queue
+ * @param pkt The packet, it is not released
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_sendq_push(vde_sendq *q, vde_pkt *pkt);
+
+/**
+ * @brief Send a packet, or queue it if it cannot be sent right away. A backend
+ * write implementation.
+ *
+ * @param q The send queue
+ * @param pkt The packet, it is not released
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+int vde_sendq_write(vde_sendq *q, vde_pkt *pkt);
+
+/**
+ * @brief Send a batch of packets, queueing those which cannot be sent right
+ * away. A backend write_batch implementation.
+ *
+ * @param q The send queue
+ * @param batch The packets, they are not released
+ *
+ * @return The number of packets sent or queued (and errno is set
+ * appropriately if less than batch->count)
+ */
+unsigned int vde_sendq_write_batch(vde_sendq *q, vde_pkt_batch *batch);
+
+/**
+ * @brief Send the packets of a send queue until the peer cannot take more,
+ * the connection user is notified of the packets sent and of those dropped.
+ * The wait function is not called.
+ *
+ * @param q The send queue
+ *
+ * @return zero if the connection is still usable, -1 if it must be closed
+ */
+int vde_sendq_flush(vde_sendq *q);
+
+/**
+ * @brief Close a connection of a transport being finalized. The connection
+ * user is told the peer is gone, if it doesn't close the connection the
+ * backend is closed anyway and the connection refuses packets until the user
+ * finalizes it.
+ *
+ * @param conn The connection
+ */
+void vde_transport_conn_gone(vde_connection *conn);
+
+/**
+ * @brief Create a listening socket. A unix socket left in the filesystem by a
+ * process which is gone is replaced.
+ *
+ * @param sa The address to bind
+ * @param sa_len The length of the address
+ * @param type The socket type
+ * @param backlog The backlog of the socket
+ *
+ * @return The nonblocking socket, -1 on error (and errno is set appropriately)
+ */
+int vde_sock_listen(struct sockaddr *sa, socklen_t sa_len, int type,
+                    int backlog);
+
+/**
+ * @brief Connect a nonblocking socket. A unix socket is refused while the
+ * backlog of the listener is full, the attempt is then repeated from a
+ * timeout for a while.
+ *
+ * @param ctx The context
+ * @param fd The socket
+ * @param sa The address to connect to
+ * @param sa_len The length of the address
+ * @param tries Attempts refused so far, zero before the first one
+ * @param retry_to Set to the timeout of the next attempt
+ * @param retry_cb Called by the timeout, it deletes the timeout and calls
+ * vde_sock_connect() again
+ * @param arg The argument of retry_cb
+ *
+ * @return 1 if the socket is connected or connecting, 0 if the attempt is
+ * repeated later, -1 on error (and errno is set appropriately)
+ */
+int vde_sock_connect(vde_context *ctx, int fd, struct sockaddr *sa,
+                     socklen_t sa_len, unsigned int *tries, void **retry_to,
+                     event_cb retry_cb, void *arg);
+
+/**
+ * @brief Get an integer parameter
+ *
+ * @param params The parameters hash
+ * @param name The name of the parameter
+ * @param min The minimum value
+ * @param max The maximum value
+ * @param value Set to the value if the parameter is present
+ *
+ * @return zero if the parameter is absent or valid, -1 if it is invalid (and
+ * errno is set to EINVAL)
+ */
+int vde_params_get_int(vde_sobj *params, const char *name, int min, int max,
+                       int *value);
+
+/**
+ * @brief Get a boolean parameter
+ *
+ * @param params The parameters hash
+ * @param name The name of the parameter
+ * @param value Set to the value if the parameter is present
+ *
+ * @return zero if the parameter is absent or valid, -1 if it is invalid (and
+ * errno is set to EINVAL)
+ */
+int vde_params_get_bool(vde_sobj *params, const char *name, int *value);
+
+#endif /* __VDE3_TRANSPORT_COMMON_H__ */
@@ -32,7 +32,7 @@
  *
  * event_init();
  * ...
- * vde_context_init(ctx, &libevent_eh);
+ * vde_context_init(ctx, &libevent_eh, NULL, NULL);
  * ...
  * event_dispatch();
  *
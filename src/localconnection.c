@@ -36,11 +36,12 @@ int vde_lc_write(vde_connection *conn, vde_pkt *pkt)
   int tmp_errno;
   vde_lc *lc = (vde_lc *)vde_connection_get_priv(conn);
   vde_lc *peer = lc->peer;
-  vde_connection *peer_conn = peer->conn;
+  vde_connection *peer_conn;
 
   if (peer == NULL) {
     return -1;
   }
+  peer_conn = peer->conn;
   if (vde_connection_call_read(peer_conn, pkt)) {
     tmp_errno = errno;
     if (errno == EPIPE) {
@@ -53,13 +54,38 @@ int vde_lc_write(vde_connection *conn, vde_pkt *pkt)
   return 0;
 }
 
+unsigned int vde_lc_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  int tmp_errno;
+  vde_lc *lc = (vde_lc *)vde_connection_get_priv(conn);
+  vde_lc *peer = lc->peer;
+  vde_connection *peer_conn;
+
+  if (peer == NULL) {
+    return 0;
+  }
+  peer_conn = peer->conn;
+  // the peer has been handed the whole batch and may have kept some packets
+  // before failing, so it is reported as consumed to avoid resending them
+  if (vde_connection_call_read_batch(peer_conn, batch)) {
+    tmp_errno = errno;
+    if (errno == EPIPE) {
+      vde_connection_fini(peer_conn);
+      vde_connection_delete(peer_conn);
+    }
+    errno = tmp_errno;
+  }
+  return batch->count;
+}
+
 void vde_lc_close(vde_connection *conn)
 {
   vde_lc *lc = (vde_lc *)vde_connection_get_priv(conn);
   vde_lc *peer = lc->peer;
-  vde_connection *peer_conn = peer->conn;
+  vde_connection *peer_conn;
 
   if (peer != NULL) {
+    peer_conn = peer->conn;
     peer->peer = NULL; // detach from peer to avoid circular close calls
     if (vde_connection_call_error(peer_conn, NULL, CONN_READ_CLOSED) &&
         (errno == EPIPE)) {
@@ -113,6 +139,11 @@ int vde_connect_engines_unqueued(vde_context *ctx, vde_component *engine1,
 
   vde_connection_init(c1, ctx, 0, &vde_lc_write, &vde_lc_close, (void *)lc1);
   vde_connection_init(c2, ctx, 0, &vde_lc_write, &vde_lc_close, (void *)lc2);
+  vde_connection_set_be_write_batch(c1, &vde_lc_write_batch);
+  vde_connection_set_be_write_batch(c2, &vde_lc_write_batch);
+  // packets are handed to the peer engine as they are, offloads included
+  vde_connection_set_offloads(c1, VDE_PKT_META_OFFLOAD);
+  vde_connection_set_offloads(c2, VDE_PKT_META_OFFLOAD);
 
   if (vde_engine_new_connection(engine1, c1, req1) != 0) {
     vde_error("%s: cannot connect to first engine");
@@ -0,0 +1,368 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdint.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/packet.h>
+
+#define ETHTYPE_IP 0x0800
+#define ETHTYPE_IPV6 0x86dd
+#define ETHTYPE_VLAN 0x8100
+#define ETHTYPE_QINQ 0x88a8
+
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+#define IP_PROTO_SCTP 132
+
+// at most an outer and an inner tag are skipped
+#define VLAN_MAX_TAGS 2
+
+#define GET16(p) ((uint16_t)((p)[0] << 8 | (p)[1]))
+
+// final mix of murmur3
+static inline uint32_t hash_mix(uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+/**
+ * @brief Hash one endpoint of a flow
+ *
+ * @param addr The address
+ * @param len The length of the address
+ * @param port The L4 port, 0 if none
+ *
+ * @return The hash
+ */
+static uint32_t hash_endpoint(const unsigned char *addr, unsigned int len,
+                              uint16_t port)
+{
+  uint32_t h = port;
+  unsigned int i;
+
+  for (i = 0; i < len; i++) {
+    h = h * 31 + addr[i];
+  }
+  return hash_mix(h);
+}
+
+/**
+ * @brief Combine the hashes of the two endpoints of a flow, the result does
+ * not depend on the direction of the frame.
+ */
+static inline uint32_t hash_flow(uint32_t a, uint32_t b, uint32_t proto)
+{
+  return hash_mix(a + b + proto);
+}
+
+static inline int l4_has_ports(uint8_t proto)
+{
+  return proto == IP_PROTO_TCP || proto == IP_PROTO_UDP ||
+         proto == IP_PROTO_SCTP;
+}
+
+void vde_pkt_meta_parse(vde_pkt *pkt)
+{
+  vde_pkt_meta *meta = &pkt->meta;
+  const unsigned char *frame = (const unsigned char *)pkt->payload;
+  const unsigned char *src_addr, *dst_addr;
+  unsigned int len = pkt->hdr->pkt_len;
+  unsigned int off, addr_len, tags;
+  uint16_t proto, src_port = 0, dst_port = 0;
+
+  meta->flags &= ~VDE_PKT_META_PARSED;
+
+  if (len < sizeof(struct eth_hdr)) {
+    return;
+  }
+  off = sizeof(struct eth_hdr);
+  proto = GET16(frame + off - 2);
+
+  for (tags = 0; tags < VLAN_MAX_TAGS &&
+       (proto == ETHTYPE_VLAN || proto == ETHTYPE_QINQ); tags++) {
+    if (len < off + 4) {
+      return;
+    }
+    if (tags == 0) {
+      meta->vlan_tci = GET16(frame + off);
+      meta->flags |= VDE_PKT_META_VLAN;
+    }
+    proto = GET16(frame + off + 2);
+    off += 4;
+  }
+  meta->l3_proto = proto;
+  meta->l3_off = off;
+  meta->flags |= VDE_PKT_META_L3;
+
+  if (proto == ETHTYPE_IP && len >= off + 20 && (frame[off] >> 4) == 4 &&
+      (frame[off] & 0x0f) >= 5) {
+    src_addr = frame + off + 12;
+    dst_addr = frame + off + 16;
+    addr_len = 4;
+    meta->l4_proto = frame[off + 9];
+    // only the first fragment has the L4 header
+    if ((GET16(frame + off + 6) & 0x1fff) == 0) {
+      meta->l4_off = off + (frame[off] & 0x0f) * 4;
+      meta->flags |= VDE_PKT_META_L4;
+    }
+  } else if (proto == ETHTYPE_IPV6 && len >= off + 40 &&
+             (frame[off] >> 4) == 6) {
+    src_addr = frame + off + 8;
+    dst_addr = frame + off + 24;
+    addr_len = 16;
+    // XXX extension headers are not followed
+    meta->l4_proto = frame[off + 6];
+    meta->l4_off = off + 40;
+    meta->flags |= VDE_PKT_META_L4;
+  } else {
+    // not IP, the flow is identified by the mac addresses
+    meta->flow_hash = hash_flow(hash_endpoint(frame + ETH_ALEN, ETH_ALEN, 0),
+                                hash_endpoint(frame, ETH_ALEN, 0), proto);
+    meta->flags |= VDE_PKT_META_HASH;
+    return;
+  }
+
+  if ((meta->flags & VDE_PKT_META_L4) && meta->l4_off > len) {
+    // truncated IP header options
+    meta->flags &= ~VDE_PKT_META_L4;
+  }
+  if ((meta->flags & VDE_PKT_META_L4) && l4_has_ports(meta->l4_proto) &&
+      len >= meta->l4_off + 4) {
+    src_port = GET16(frame + meta->l4_off);
+    dst_port = GET16(frame + meta->l4_off + 2);
+  }
+  meta->flow_hash = hash_flow(hash_endpoint(src_addr, addr_len, src_port),
+                              hash_endpoint(dst_addr, addr_len, dst_port),
+                              meta->l4_proto);
+  meta->flags |= VDE_PKT_META_HASH;
+}
+
+#define PUT16(p, v) ((p)[0] = (v) >> 8, (p)[1] = (v) & 0xff)
+#define GET32(p) ((uint32_t)GET16(p) << 16 | GET16((p) + 2))
+#define PUT32(p, v) (PUT16((p), (v) >> 16), PUT16((p) + 2, (v) & 0xffff))
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
+/**
+ * @brief Add data to a ones' complement sum of 16 bit words in network order
+ *
+ * @param data The data
+ * @param len The length of the data, an odd length is padded with a zero
+ * @param sum The sum so far
+ *
+ * @return The new sum, not folded
+ */
+static uint32_t csum_add(const unsigned char *data, unsigned int len,
+                         uint32_t sum)
+{
+  unsigned int i;
+
+  for (i = 0; i + 1 < len; i += 2) {
+    sum += GET16(data + i);
+    // fold early so that large frames can't overflow
+    if (sum & 0x80000000) {
+      sum = (sum & 0xffff) + (sum >> 16);
+    }
+  }
+  if (len & 1) {
+    sum += data[len - 1] << 8;
+  }
+  return sum;
+}
+
+static inline uint16_t csum_fold(uint32_t sum)
+{
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum & 0xffff;
+}
+
+int vde_pkt_csum_complete(vde_pkt *pkt)
+{
+  unsigned char *frame = (unsigned char *)pkt->payload;
+  unsigned int len = pkt->hdr->pkt_len;
+  unsigned int start = pkt->meta.csum_start;
+  unsigned int off = pkt->meta.csum_off;
+  uint16_t csum;
+
+  vde_assert(vde_pkt_is_linear(pkt));
+
+  if (start > len || off + 2 > len - start) {
+    errno = EINVAL;
+    return -1;
+  }
+  // the field holds the pseudo header checksum, it is summed along
+  csum = csum_fold(csum_add(frame + start, len - start, 0));
+  // zero means no checksum for UDP
+  if (csum == 0 && off == 6) {
+    csum = 0xffff;
+  }
+  PUT16(frame + start + off, csum);
+  pkt->meta.flags &= ~VDE_PKT_META_CSUM;
+  return 0;
+}
+
+/**
+ * @brief Get the length of the headers of a frame with VDE_PKT_META_GSO
+ *
+ * @param pkt The packet
+ *
+ * @return The length of the headers, 0 if the frame can't be segmented
+ */
+static unsigned int gso_hdr_len(vde_pkt *pkt)
+{
+  const unsigned char *frame = (const unsigned char *)pkt->payload;
+  vde_pkt_meta *meta = &pkt->meta;
+  unsigned int len = pkt->hdr->pkt_len;
+  unsigned int l4 = meta->csum_start, l3_len, tcp_len;
+
+  if (!(meta->flags & VDE_PKT_META_GSO) || !(meta->flags & VDE_PKT_META_L3) ||
+      meta->gso_size == 0) {
+    return 0;
+  }
+  switch (meta->gso_type & ~VDE_PKT_GSO_ECN) {
+    case VDE_PKT_GSO_TCPV4:
+      if (meta->l3_proto != ETHTYPE_IP || len < meta->l3_off + 20) {
+        return 0;
+      }
+      l3_len = (frame[meta->l3_off] & 0x0f) * 4;
+      break;
+    case VDE_PKT_GSO_TCPV6:
+      if (meta->l3_proto != ETHTYPE_IPV6) {
+        return 0;
+      }
+      l3_len = 40;
+      break;
+    default:
+      return 0;
+  }
+  if (l4 < meta->l3_off + l3_len || len < l4 + 20) {
+    return 0;
+  }
+  tcp_len = (frame[l4 + 12] >> 4) * 4;
+  if (tcp_len < 20 || len < l4 + tcp_len) {
+    return 0;
+  }
+  return l4 + tcp_len;
+}
+
+unsigned int vde_pkt_gso_count(vde_pkt *pkt)
+{
+  unsigned int hdr_len;
+
+  vde_assert(vde_pkt_is_linear(pkt));
+
+  hdr_len = gso_hdr_len(pkt);
+  if (hdr_len == 0) {
+    return 0;
+  }
+  if (pkt->hdr->pkt_len == hdr_len) {
+    return 1;
+  }
+  return (pkt->hdr->pkt_len - hdr_len + pkt->meta.gso_size - 1) /
+         pkt->meta.gso_size;
+}
+
+unsigned int vde_pkt_gso_seg_len(vde_pkt *pkt)
+{
+  unsigned int hdr_len = gso_hdr_len(pkt);
+
+  if (hdr_len == 0) {
+    return 0;
+  }
+  if (vde_pkt_len(pkt) < hdr_len + pkt->meta.gso_size) {
+    return vde_pkt_len(pkt);
+  }
+  return hdr_len + pkt->meta.gso_size;
+}
+
+vde_pkt *vde_pkt_gso_segment(vde_pkt *pkt, unsigned int index)
+{
+  vde_pkt *seg;
+  vde_pkt_meta *meta = &pkt->meta;
+  unsigned char *frame;
+  unsigned int hdr_len, data_len, off, seg_len, l3, l4, tcp_len;
+  uint32_t sum;
+
+  vde_assert(vde_pkt_is_linear(pkt));
+
+  hdr_len = gso_hdr_len(pkt);
+  data_len = pkt->hdr->pkt_len - hdr_len;
+  off = index * meta->gso_size;
+  if (hdr_len == 0 || (off >= data_len && index > 0)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  seg_len = data_len - off < meta->gso_size ? data_len - off : meta->gso_size;
+
+  if (pkt->cache != NULL) {
+    seg = vde_pool_cache_pkt_new(pkt->cache, hdr_len + seg_len,
+                                 vde_pkt_get_headsize(pkt), 0);
+  } else {
+    seg = vde_pkt_new(hdr_len + seg_len, vde_pkt_get_headsize(pkt), 0);
+  }
+  if (seg == NULL) {
+    return NULL;
+  }
+  memcpy(seg->hdr, pkt->hdr, sizeof(vde_hdr));
+  seg->hdr->pkt_len = hdr_len + seg_len;
+  seg->meta = *meta;
+  seg->meta.flags &= ~VDE_PKT_META_OFFLOAD;
+  memcpy(seg->payload, pkt->payload, hdr_len);
+  memcpy(seg->payload + hdr_len, pkt->payload + hdr_len + off, seg_len);
+
+  frame = (unsigned char *)seg->payload;
+  l3 = meta->l3_off;
+  l4 = meta->csum_start;
+  tcp_len = seg->hdr->pkt_len - l4;
+  if ((meta->gso_type & ~VDE_PKT_GSO_ECN) == VDE_PKT_GSO_TCPV4) {
+    PUT16(frame + l3 + 2, seg->hdr->pkt_len - l3);
+    PUT16(frame + l3 + 4, (uint16_t)(GET16(frame + l3 + 4) + index));
+    PUT16(frame + l3 + 10, 0);
+    PUT16(frame + l3 + 10,
+          csum_fold(csum_add(frame + l3, (frame[l3] & 0x0f) * 4, 0)));
+    // pseudo header: addresses, protocol and TCP length
+    sum = csum_add(frame + l3 + 12, 8, IP_PROTO_TCP + tcp_len);
+  } else {
+    PUT16(frame + l3 + 4, seg->hdr->pkt_len - l3 - 40);
+    sum = csum_add(frame + l3 + 8, 32, IP_PROTO_TCP + tcp_len);
+  }
+
+  PUT32(frame + l4 + 4, GET32(frame + l4 + 4) + off);
+  if (off + seg_len < data_len) {
+    frame[l4 + 13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+  }
+  if (index > 0) {
+    frame[l4 + 13] &= ~TCP_FLAG_CWR;
+  }
+  PUT16(frame + l4 + 16, 0);
+  PUT16(frame + l4 + 16, csum_fold(csum_add(frame + l4, tcp_len, sum)));
+
+  // the flow is the same, its hash and offsets still hold
+  return seg;
+}
@@ -0,0 +1,507 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+// size of the memory allocated at once when a size class grows
+#define SLAB_SZ (128 * 1024)
+
+// early drops stop when queued bytes fall this fraction below the watermark
+#define QUEUE_HYSTERESIS(wm) ((wm) / 8)
+
+// a released packet keeps the pointer to the next free packet in its data
+#define FREE_NEXT(pkt) (*(vde_pkt **)((pkt)->data))
+
+static const unsigned int class_data_sz[VDE_POOL_CLASSES] = {
+  VDE_POOL_CTRL_DATA_SZ,
+  VDE_POOL_ETH_DATA_SZ,
+  VDE_POOL_JUMBO_DATA_SZ,
+};
+
+static vde_pool_params default_params = {
+  .prewarm = 0,
+  .arena = 0,
+  .prewarm_pkts = { 16, 256, 0 },
+  .limit = { 0, 0, 0 },
+  .queue_limit = 0,
+  .queue_watermark = 0,
+};
+
+struct vde_pool_cache {
+  vde_pool *pool;
+  unsigned int data_sz; // size of vde_pkt data
+  unsigned int obj_sz; // size of vde_pkt and its data
+  unsigned int slab_objs; // packets allocated each time the class grows
+  unsigned int slab_sz; // size of a slab mapping in arena mode
+  unsigned int limit;
+  vde_pkt *free_list;
+  unsigned int free_count;
+  unsigned int total;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long exhausted;
+  unsigned long mem;
+  unsigned long mem_hugetlb;
+  unsigned long mem_thp;
+  vde_list *slabs;
+};
+
+struct vde_pool {
+  struct vde_pool_cache caches[VDE_POOL_CLASSES];
+  int arena;
+  int hugetlb_failed; // don't retry MAP_HUGETLB once it has failed
+  int deleted; // freed when the last packet in use is released
+  // bytes held by connection queues
+  unsigned long queue_bytes;
+  unsigned long queue_limit;
+  unsigned long queue_watermark;
+  unsigned int queues; // non-empty queues
+  int queue_over_wm;
+  vde_pool_watermark_cb watermark_cb;
+  void *watermark_arg;
+  unsigned long queue_drops;
+  unsigned long queue_early_drops;
+};
+
+/**
+ * @brief Map a slab in arena mode, trying huge pages first
+ *
+ * @param cache The size class the slab is for
+ *
+ * @return The slab on success, NULL on error
+ */
+static char *vde_pool_arena_map(struct vde_pool_cache *cache)
+{
+  char *raw, *slab;
+  size_t sz = cache->slab_sz;
+
+#ifdef MAP_HUGETLB
+  if (!cache->pool->hugetlb_failed) {
+    slab = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (slab != MAP_FAILED) {
+      cache->mem_hugetlb += sz;
+      return slab;
+    }
+    vde_info("%s: no huge pages available, using normal pages",
+             __PRETTY_FUNCTION__);
+    cache->pool->hugetlb_failed = 1;
+  }
+#endif
+
+  // map twice the size to get a region aligned to the huge page size, which
+  // the kernel can back with a transparent huge page
+  raw = mmap(NULL, 2 * sz, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return NULL;
+  }
+  slab = (char *)(((uintptr_t)raw + sz - 1) & ~(uintptr_t)(sz - 1));
+  if (slab > raw) {
+    munmap(raw, slab - raw);
+  }
+  munmap(slab + sz, raw + sz - slab);
+
+#ifdef MADV_HUGEPAGE
+  if (!madvise(slab, sz, MADV_HUGEPAGE)) {
+    cache->mem_thp += sz;
+  }
+#endif
+  return slab;
+}
+
+/**
+ * @brief Allocate a new slab of packets and put them in the free list
+ *
+ * @param cache The size class to grow
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde_pool_cache_grow(struct vde_pool_cache *cache)
+{
+  unsigned int i, count = cache->slab_objs;
+  char *slab;
+  vde_pkt *pkt;
+
+  if (cache->limit) {
+    if (cache->total >= cache->limit) {
+      errno = ENOBUFS;
+      return -1;
+    }
+    if (cache->total + count > cache->limit) {
+      count = cache->limit - cache->total;
+    }
+  }
+
+  if (cache->pool->arena) {
+    slab = vde_pool_arena_map(cache);
+  } else {
+    slab = (char *)vde_calloc_aligned(VDE_CACHE_LINE, count * cache->obj_sz);
+  }
+  if (slab == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  cache->slabs = vde_list_prepend(cache->slabs, slab);
+  cache->mem += cache->pool->arena ? cache->slab_sz : count * cache->obj_sz;
+
+  for (i = 0; i < count; i++) {
+    pkt = (vde_pkt *)(slab + i * cache->obj_sz);
+    FREE_NEXT(pkt) = cache->free_list;
+    cache->free_list = pkt;
+  }
+  cache->free_count += count;
+  cache->total += count;
+
+  return 0;
+}
+
+static vde_pkt *vde_pool_cache_alloc(struct vde_pool_cache *cache,
+                                     unsigned int head, unsigned int tail)
+{
+  vde_pkt *pkt;
+
+  if (cache->free_list != NULL) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+    if (vde_pool_cache_grow(cache)) {
+      if (errno == ENOBUFS) {
+        cache->exhausted++;
+      }
+      return NULL;
+    }
+  }
+
+  pkt = cache->free_list;
+  cache->free_list = FREE_NEXT(pkt);
+  cache->free_count--;
+
+  vde_pkt_init(pkt, cache->data_sz, head, tail);
+  pkt->refcount = 1;
+  pkt->cache = cache;
+
+  return pkt;
+}
+
+vde_pool *vde_pool_new(vde_pool_params *params)
+{
+  int cls;
+  unsigned int prewarm;
+  vde_pool *pool;
+  struct vde_pool_cache *cache;
+
+  if (params == NULL) {
+    params = &default_params;
+  }
+
+  pool = (vde_pool *)vde_calloc(sizeof(vde_pool));
+  if (pool == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  pool->arena = params->arena;
+  pool->queue_limit = params->queue_limit;
+  pool->queue_watermark = params->queue_watermark;
+  if (pool->queue_limit && pool->queue_watermark > pool->queue_limit) {
+    vde_warning("%s: queue watermark %lu above limit %lu, lowering",
+                __PRETTY_FUNCTION__, pool->queue_watermark, pool->queue_limit);
+    pool->queue_watermark = pool->queue_limit;
+  }
+
+  for (cls = 0; cls < VDE_POOL_CLASSES; cls++) {
+    cache = &pool->caches[cls];
+    cache->pool = pool;
+    cache->data_sz = class_data_sz[cls];
+    // keep every packet of the slab on a cache line boundary
+    cache->obj_sz = (sizeof(vde_pkt) + cache->data_sz + VDE_CACHE_LINE - 1) &
+                    ~(VDE_CACHE_LINE - 1);
+    if (pool->arena) {
+      cache->slab_sz = VDE_POOL_ARENA_SLAB_SZ;
+      cache->slab_objs = cache->slab_sz / cache->obj_sz;
+    } else {
+      cache->slab_objs = SLAB_SZ / cache->obj_sz;
+      if (cache->slab_objs == 0) {
+        cache->slab_objs = 1;
+      }
+    }
+    cache->limit = params->limit[cls];
+    prewarm = params->prewarm_pkts[cls];
+    if (cache->limit && prewarm > cache->limit) {
+      vde_warning("%s: prewarm_pkts %u above limit %u for class %d, lowering",
+                  __PRETTY_FUNCTION__, prewarm, cache->limit, cls);
+      prewarm = cache->limit;
+    }
+
+    if (!params->prewarm) {
+      continue;
+    }
+    while (cache->total < prewarm) {
+      if (vde_pool_cache_grow(cache)) {
+        vde_error("%s: cannot prewarm class %d", __PRETTY_FUNCTION__, cls);
+        vde_pool_delete(pool);
+        errno = ENOMEM;
+        return NULL;
+      }
+    }
+  }
+
+  return pool;
+}
+
+/**
+ * @brief Count the packets of a pool not in its free lists
+ */
+static unsigned int vde_pool_in_use(vde_pool *pool)
+{
+  int cls;
+  unsigned int in_use = 0;
+
+  for (cls = 0; cls < VDE_POOL_CLASSES; cls++) {
+    in_use += pool->caches[cls].total - pool->caches[cls].free_count;
+  }
+  return in_use;
+}
+
+static void vde_pool_free(vde_pool *pool)
+{
+  int cls;
+  vde_list *iter;
+  struct vde_pool_cache *cache;
+
+  for (cls = 0; cls < VDE_POOL_CLASSES; cls++) {
+    cache = &pool->caches[cls];
+    iter = vde_list_first(cache->slabs);
+    while (iter != NULL) {
+      if (pool->arena) {
+        munmap(vde_list_get_data(iter), cache->slab_sz);
+      } else {
+        vde_free_aligned(vde_list_get_data(iter));
+      }
+      iter = vde_list_next(iter);
+    }
+    vde_list_delete(cache->slabs);
+  }
+
+  vde_free(pool);
+}
+
+void vde_pool_delete(vde_pool *pool)
+{
+  unsigned int in_use;
+
+  vde_assert(pool != NULL);
+  vde_assert(!pool->deleted);
+
+  if (pool->queue_bytes) {
+    vde_warning("%s: %lu bytes still queued", __PRETTY_FUNCTION__,
+                pool->queue_bytes);
+  }
+  in_use = vde_pool_in_use(pool);
+  if (in_use > 0) {
+    // the slabs are still referenced, vde_pool_pkt_release() frees them
+    vde_warning("%s: %u packets still in use, pool freed on their release",
+                __PRETTY_FUNCTION__, in_use);
+    pool->deleted = 1;
+    return;
+  }
+  vde_pool_free(pool);
+}
+
+vde_pkt *vde_pool_pkt_new(vde_pool *pool, unsigned int payload_sz,
+                          unsigned int head, unsigned int tail)
+{
+  int cls;
+  unsigned int data_sz = VDE_PKT_DATA_SZ(payload_sz, head, tail);
+
+  vde_assert(pool != NULL);
+
+  for (cls = 0; cls < VDE_POOL_CLASSES; cls++) {
+    if (data_sz <= pool->caches[cls].data_sz) {
+      return vde_pool_cache_alloc(&pool->caches[cls], head, tail);
+    }
+  }
+
+  // larger than the largest class
+  pool->caches[VDE_POOL_CLASSES - 1].misses++;
+  return vde_pkt_new(payload_sz, head, tail);
+}
+
+vde_pkt *vde_pool_cache_pkt_new(struct vde_pool_cache *cache,
+                                unsigned int payload_sz, unsigned int head,
+                                unsigned int tail)
+{
+  vde_assert(cache != NULL);
+
+  return vde_pool_pkt_new(cache->pool, payload_sz, head, tail);
+}
+
+vde_pkt *vde_pool_pkt_share(vde_pool *pool, vde_pkt *pkt)
+{
+  vde_pkt *new_pkt;
+
+  vde_assert(pkt != NULL);
+
+  if (pkt->refcount > 0) {
+    return vde_pkt_get(pkt);
+  }
+  new_pkt = vde_pool_pkt_new(pool, vde_pkt_len(pkt), 0, 0);
+  if (new_pkt == NULL) {
+    return NULL;
+  }
+  memcpy(new_pkt->hdr, pkt->hdr, sizeof(vde_hdr));
+  new_pkt->hdr->pkt_len = vde_pkt_len(pkt);
+  new_pkt->meta = pkt->meta;
+  vde_pkt_gather(pkt, new_pkt->payload);
+  return new_pkt;
+}
+
+void vde_pool_pkt_release(vde_pkt *pkt)
+{
+  struct vde_pool_cache *cache = pkt->cache;
+
+  vde_assert(cache != NULL);
+  vde_assert(pkt->refcount == 0);
+
+  FREE_NEXT(pkt) = cache->free_list;
+  cache->free_list = pkt;
+  cache->free_count++;
+
+  if (cache->pool->deleted && vde_pool_in_use(cache->pool) == 0) {
+    vde_pool_free(cache->pool);
+  }
+}
+
+int vde_pool_is_arena(vde_pool *pool)
+{
+  vde_assert(pool != NULL);
+
+  return pool->arena;
+}
+
+void vde_pool_get_stats(vde_pool *pool, vde_pool_class cls,
+                        vde_pool_stats *stats)
+{
+  struct vde_pool_cache *cache;
+
+  vde_assert(pool != NULL);
+  vde_assert(cls < VDE_POOL_CLASSES);
+  vde_assert(stats != NULL);
+
+  cache = &pool->caches[cls];
+  stats->data_size = cache->data_sz;
+  stats->total = cache->total;
+  stats->free = cache->free_count;
+  stats->hits = cache->hits;
+  stats->misses = cache->misses;
+  stats->exhausted = cache->exhausted;
+  stats->mem = cache->mem;
+  stats->mem_hugetlb = cache->mem_hugetlb;
+  stats->mem_thp = cache->mem_thp;
+}
+
+int vde_pool_queue_charge(vde_pool *pool, unsigned int len,
+                          unsigned long held)
+{
+  unsigned int queues;
+
+  vde_assert(pool != NULL);
+
+  if (pool->queue_limit && pool->queue_bytes + len > pool->queue_limit) {
+    pool->queue_drops++;
+    errno = ENOBUFS;
+    return -1;
+  }
+  if (pool->queue_over_wm) {
+    queues = pool->queues + (held == 0);
+    if (held + len > pool->queue_watermark / queues) {
+      pool->queue_early_drops++;
+      errno = ENOBUFS;
+      return -1;
+    }
+  }
+
+  if (held == 0) {
+    pool->queues++;
+  }
+  pool->queue_bytes += len;
+  if (!pool->queue_over_wm && pool->queue_watermark &&
+      pool->queue_bytes > pool->queue_watermark) {
+    pool->queue_over_wm = 1;
+    if (pool->watermark_cb != NULL) {
+      pool->watermark_cb(1, pool->queue_bytes, pool->watermark_arg);
+    }
+  }
+  return 0;
+}
+
+void vde_pool_queue_uncharge(vde_pool *pool, unsigned int len,
+                             unsigned long held)
+{
+  vde_assert(pool != NULL);
+  vde_assert(pool->queue_bytes >= len);
+
+  if (held == 0) {
+    vde_assert(pool->queues > 0);
+    pool->queues--;
+  }
+  pool->queue_bytes -= len;
+  if (pool->queue_over_wm && pool->queue_bytes <= pool->queue_watermark -
+                             QUEUE_HYSTERESIS(pool->queue_watermark)) {
+    pool->queue_over_wm = 0;
+    if (pool->watermark_cb != NULL) {
+      pool->watermark_cb(0, pool->queue_bytes, pool->watermark_arg);
+    }
+  }
+}
+
+int vde_pool_queue_over_watermark(vde_pool *pool)
+{
+  vde_assert(pool != NULL);
+
+  return pool->queue_over_wm;
+}
+
+void vde_pool_set_watermark_cb(vde_pool *pool, vde_pool_watermark_cb cb,
+                               void *arg)
+{
+  vde_assert(pool != NULL);
+
+  pool->watermark_cb = cb;
+  pool->watermark_arg = arg;
+}
+
+void vde_pool_get_queue_stats(vde_pool *pool, vde_pool_queue_stats *stats)
+{
+  vde_assert(pool != NULL);
+  vde_assert(stats != NULL);
+
+  stats->bytes = pool->queue_bytes;
+  stats->limit = pool->queue_limit;
+  stats->watermark = pool->queue_watermark;
+  stats->queues = pool->queues;
+  stats->over_watermark = pool->queue_over_wm;
+  stats->drops = pool->queue_drops;
+  stats->early_drops = pool->queue_early_drops;
+}
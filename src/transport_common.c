@@ -0,0 +1,463 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <vde3/transport_common.h>
+
+#include <vde3/common.h>
+#include <vde3/pool.h>
+
+// retries of a connect() refused because the listener backlog is full
+#define CONNECT_RETRY_USEC 10000
+#define CONNECT_MAXTRIES 100
+
+/*
+ * Send queue
+ */
+
+void vde_sendq_init(vde_sendq *q, vde_connection *conn, vde_sendq_send_cb send,
+                    vde_sendq_wait_cb wait, void *priv, int count_tries)
+{
+  vde_assert(q != NULL);
+  vde_assert(send != NULL && wait != NULL);
+
+  memset(q, 0, sizeof(vde_sendq));
+  q->conn = conn;
+  q->send = send;
+  q->wait = wait;
+  q->priv = priv;
+  q->count_tries = count_tries;
+}
+
+void vde_sendq_fini(vde_sendq *q)
+{
+  vde_pkt *pkt;
+
+  if (!vde_ring_is_init(&q->pkts)) {
+    return;
+  }
+  pkt = vde_ring_pop_tail(&q->pkts);
+  while (pkt != NULL) {
+    vde_connection_queue_release(q->conn, vde_pkt_len(pkt));
+    vde_pkt_put(pkt);
+    pkt = vde_ring_pop_tail(&q->pkts);
+  }
+  vde_ring_fini(&q->pkts);
+}
+
+int vde_sendq_push(vde_sendq *q, vde_pkt *pkt)
+{
+  vde_pkt *q_pkt;
+  vde_connection *conn = q->conn;
+
+  if (vde_pkt_len(pkt) > vde_connection_max_payload(conn)) {
+    vde_warning("%s: packet larger than mtu for connection %u, discarding",
+                __PRETTY_FUNCTION__, vde_connection_get_id(conn));
+    errno = EMSGSIZE;
+    return -1;
+  }
+  if (!vde_ring_is_init(&q->pkts) &&
+      vde_ring_init(&q->pkts, vde_connection_get_queue_maxlen(conn))) {
+    vde_warning("%s: cannot allocate packet queue for connection %u, "
+                "discarding", __PRETTY_FUNCTION__,
+                vde_connection_get_id(conn));
+    return -1;
+  }
+  if (vde_ring_is_full(&q->pkts) ||
+      vde_connection_queue_reserve(conn, vde_pkt_len(pkt))) {
+    vde_warning("%s: packet queue for connection %u is full, discarding",
+                __PRETTY_FUNCTION__, vde_connection_get_id(conn));
+    errno = EAGAIN;
+    return -1;
+  }
+  q_pkt = vde_pool_pkt_share(
+            vde_context_get_pool(vde_connection_get_context(conn)), pkt);
+  if (q_pkt == NULL) {
+    vde_warning("%s: cannot share pkt, discarding", __PRETTY_FUNCTION__);
+    vde_connection_queue_release(conn, vde_pkt_len(pkt));
+    return -1;
+  }
+
+  vde_ring_push_head(&q->pkts, q_pkt);
+  return 0;
+}
+
+/**
+ * @brief Send packets right away if nothing is waiting in the queue and the
+ * connection user doesn't want to be notified of sent packets.
+ *
+ * @param q The send queue
+ * @param pkts The packets to send, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of packets sent, the following ones must be queued
+ */
+static unsigned int vde_sendq_send_now(vde_sendq *q, vde_pkt **pkts,
+                                       unsigned int count)
+{
+  unsigned int i;
+  unsigned int max_payload = vde_connection_max_payload(q->conn);
+
+  if (!vde_sendq_is_empty(q) || vde_connection_has_write_cb(q->conn)) {
+    return 0;
+  }
+  if (count > VDE_PKT_BATCH_MAX) {
+    count = VDE_PKT_BATCH_MAX;
+  }
+  // oversized packets are rejected by the queue
+  for (i = 0; i < count; i++) {
+    if (vde_pkt_len(pkts[i]) > max_payload) {
+      break;
+    }
+  }
+  if (i == 0) {
+    return 0;
+  }
+  // errors are handled by the flush when the packets get queued
+  return q->send(q->priv, pkts, i);
+}
+
+int vde_sendq_write(vde_sendq *q, vde_pkt *pkt)
+{
+  if (vde_sendq_send_now(q, &pkt, 1) == 1) {
+    return 0;
+  }
+  if (vde_sendq_push(q, pkt)) {
+    return -1;
+  }
+  q->wait(q->priv);
+  return 0;
+}
+
+unsigned int vde_sendq_write_batch(vde_sendq *q, vde_pkt_batch *batch)
+{
+  unsigned int i, sent;
+  int tmp_errno;
+
+  sent = vde_sendq_send_now(q, batch->pkts, batch->count);
+  if (sent == batch->count) {
+    return sent;
+  }
+
+  for (i = sent; i < batch->count; i++) {
+    if (vde_sendq_push(q, batch->pkts[i])) {
+      break;
+    }
+  }
+  if (i > sent) {
+    tmp_errno = errno;
+    q->wait(q->priv);
+    errno = tmp_errno;
+  }
+  return i;
+}
+
+/**
+ * @brief Handle the packet at the tail of a send queue which could not be
+ * sent, it is dropped if the error is fatal or the send has been tried too
+ * many times.
+ *
+ * @param q The send queue
+ * @param send_errno The error of the send
+ *
+ * @return zero if the connection is still usable, -1 if it must be closed
+ */
+static int vde_sendq_send_failed(vde_sendq *q, int send_errno)
+{
+  int cb_errno = 0;
+  vde_pkt *pkt;
+  vde_conn_error err;
+  vde_connection *conn = q->conn;
+
+  if (send_errno == EINPROGRESS) {
+    // the rest of the packet follows what has been sent already
+    return 0;
+  }
+  if (send_errno == EAGAIN) {
+    if (!q->count_tries ||
+        ++q->numtries <= vde_connection_get_send_maxtries(conn)) {
+      return 0;
+    }
+    err = CONN_WRITE_DELAY;
+  } else {
+    err = CONN_WRITE_CLOSED;
+  }
+
+  q->numtries = 0;
+  pkt = vde_ring_pop_tail(&q->pkts);
+  vde_connection_queue_release(conn, vde_pkt_len(pkt));
+  if (vde_connection_call_error(conn, pkt, err)) {
+    cb_errno = errno;
+  }
+  vde_pkt_put(pkt);
+  if (cb_errno == EPIPE) {
+    return -1;
+  }
+  if (err == CONN_WRITE_CLOSED) {
+    vde_warning("%s: fatal error on connection %u but connection not closed",
+                __PRETTY_FUNCTION__, vde_connection_get_id(conn));
+  }
+  return 0;
+}
+
+int vde_sendq_flush(vde_sendq *q)
+{
+  unsigned int i, count, sent;
+  int send_errno;
+  vde_pkt *linear;
+  vde_pkt_batch batch;
+  vde_connection *conn = q->conn;
+
+  while (!vde_sendq_is_empty(q)) {
+    // the oldest packets are at the tail of the queue
+    vde_pkt_batch_init(&batch);
+    while (!vde_pkt_batch_is_full(&batch) && !vde_sendq_is_empty(q)) {
+      vde_pkt_batch_add(&batch, vde_ring_pop_tail(&q->pkts));
+    }
+    count = batch.count;
+
+    sent = q->send(q->priv, batch.pkts, count);
+    send_errno = errno;
+    if (sent < count && send_errno == EMSGSIZE) {
+      // too many segments, send a linear copy
+      linear = vde_pkt_linearize(batch.pkts[sent]);
+      if (linear == NULL) {
+        // not enough memory, the packet is retried later
+        send_errno = EAGAIN;
+      } else {
+        batch.pkts[sent] = linear;
+        sent += q->send(q->priv, batch.pkts + sent, count - sent);
+        send_errno = errno;
+      }
+    }
+
+    // give back the packets not sent, the oldest ends up at the tail again
+    for (i = count; i > sent; i--) {
+      if (vde_ring_push_tail(&q->pkts, batch.pkts[i - 1])) {
+        vde_warning("%s: packet queue for connection %u is full, discarding",
+                    __PRETTY_FUNCTION__, vde_connection_get_id(conn));
+        vde_connection_queue_release(conn, vde_pkt_len(batch.pkts[i - 1]));
+        vde_pkt_put(batch.pkts[i - 1]);
+      }
+    }
+    batch.count = sent;
+
+    if (sent > 0) {
+      q->numtries = 0;
+      for (i = 0; i < sent; i++) {
+        vde_connection_queue_release(conn, vde_pkt_len(batch.pkts[i]));
+      }
+      if (vde_connection_call_write_batch(conn, &batch) && errno == EPIPE) {
+        vde_pkt_batch_put(&batch);
+        return -1;
+      }
+      vde_pkt_batch_put(&batch);
+    }
+
+    if (sent < count) {
+      return vde_sendq_send_failed(q, send_errno);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Connections
+ */
+
+static int vde_conn_gone_write(vde_connection *conn, vde_pkt *pkt)
+{
+  errno = EPIPE;
+  return -1;
+}
+
+static void vde_conn_gone_close(vde_connection *conn)
+{
+}
+
+void vde_transport_conn_gone(vde_connection *conn)
+{
+  if (vde_connection_call_error(conn, NULL, CONN_READ_CLOSED) &&
+      errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  vde_warning("%s: called fatal error but engine did not close",
+              __PRETTY_FUNCTION__);
+  // the backend goes away with the transport, the user still holds conn
+  vde_connection_fini(conn);
+  conn->be_write = &vde_conn_gone_write;
+  conn->be_close = &vde_conn_gone_close;
+  vde_connection_set_be_write_batch(conn, NULL);
+}
+
+/*
+ * Sockets
+ */
+
+/**
+ * @brief Remove a unix socket left in the filesystem if nobody listens to it
+ *
+ * @param sa_unix The address of the socket
+ * @param type The socket type
+ *
+ * @return zero if the socket has been removed, nonzero otherwise
+ */
+static int vde_sock_remove_if_unused(struct sockaddr_un *sa_unix, int type)
+{
+  int test_fd, ret = 1;
+
+  if ((test_fd = socket(PF_UNIX, type, 0)) < 0) {
+    vde_error("%s: socket %s", __PRETTY_FUNCTION__, strerror(errno));
+    return 1;
+  }
+  if (connect(test_fd, (struct sockaddr *) sa_unix, sizeof(*sa_unix)) < 0) {
+    if (errno == ECONNREFUSED) {
+      if (unlink(sa_unix->sun_path) < 0) {
+        vde_error("%s: failed to removed unused socket '%s': %s",
+            __PRETTY_FUNCTION__, sa_unix->sun_path, strerror(errno));
+      }
+      ret = 0;
+    } else {
+      vde_error("%s: connect %s", __PRETTY_FUNCTION__, strerror(errno));
+    }
+  }
+  close(test_fd);
+  return ret;
+}
+
+int vde_sock_listen(struct sockaddr *sa, socklen_t sa_len, int type,
+                    int backlog)
+{
+  int fd, tmp_errno, on = 1;
+  struct sockaddr_un *sa_unix = (struct sockaddr_un *)sa;
+  // sockets in the abstract namespace vanish with their process
+  int is_file = sa->sa_family == AF_UNIX && sa_unix->sun_path[0] != '\0';
+
+  fd = socket(sa->sa_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (sa->sa_family != AF_UNIX) {
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  }
+  if (bind(fd, sa, sa_len) < 0) {
+    if (errno != EADDRINUSE || !is_file ||
+        vde_sock_remove_if_unused(sa_unix, type) ||
+        bind(fd, sa, sa_len) < 0) {
+      tmp_errno = errno;
+      vde_error("%s: Could not bind socket: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      goto error_close;
+    }
+  }
+  if (listen(fd, backlog) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not listen: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error_unlink;
+  }
+  return fd;
+
+error_unlink:
+  if (is_file) {
+    unlink(sa_unix->sun_path);
+  }
+error_close:
+  close(fd);
+error:
+  errno = tmp_errno;
+  return -1;
+}
+
+int vde_sock_connect(vde_context *ctx, int fd, struct sockaddr *sa,
+                     socklen_t sa_len, unsigned int *tries, void **retry_to,
+                     event_cb retry_cb, void *arg)
+{
+  int tmp_errno;
+  struct timeval retry = { 0, CONNECT_RETRY_USEC };
+
+  if (connect(fd, sa, sa_len) == 0 || errno == EINPROGRESS) {
+    return 1;
+  }
+  if (errno == EAGAIN && (*tries)++ < CONNECT_MAXTRIES) {
+    // XXX: check timeout NULL
+    *retry_to = vde_context_timeout_add(ctx, VDE_EV_TIMEOUT, &retry,
+                                        retry_cb, arg);
+    return 0;
+  }
+  tmp_errno = errno;
+  vde_error("%s: cannot connect: %s", __PRETTY_FUNCTION__, strerror(errno));
+  errno = tmp_errno;
+  return -1;
+}
+
+/*
+ * Parameters
+ */
+
+int vde_params_get_int(vde_sobj *params, const char *name, int min, int max,
+                       int *value)
+{
+  vde_sobj *sobj = vde_sobj_hash_lookup(params, name);
+
+  if (!sobj) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(sobj, vde_sobj_type_int) ||
+      vde_sobj_get_int(sobj) < min || vde_sobj_get_int(sobj) > max) {
+    if (max != INT_MAX) {
+      vde_error("%s: %s must be between %d and %d", __PRETTY_FUNCTION__,
+                name, min, max);
+    } else if (min <= 1) {
+      vde_error("%s: %s must be a positive integer", __PRETTY_FUNCTION__,
+                name);
+    } else {
+      vde_error("%s: %s must be an integer not less than %d",
+                __PRETTY_FUNCTION__, name, min);
+    }
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_int(sobj);
+  return 0;
+}
+
+int vde_params_get_bool(vde_sobj *params, const char *name, int *value)
+{
+  vde_sobj *sobj = vde_sobj_hash_lookup(params, name);
+
+  if (!sobj) {
+    return 0;
+  }
+  if (!vde_sobj_is_type(sobj, vde_sobj_type_bool)) {
+    vde_error("%s: %s must be a boolean", __PRETTY_FUNCTION__, name);
+    errno = EINVAL;
+    return -1;
+  }
+  *value = vde_sobj_get_bool(sobj);
+  return 0;
+}
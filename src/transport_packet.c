@@ -0,0 +1,838 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Linux network interfaces through AF_PACKET sockets: a connect plugs the
+ * interface ifname (e.g. a veth or an uplink) as a port, the frames it
+ * receives are read and the frames written to the port are sent through
+ * rings mapped from the kernel.
+ *
+ * The receive ring is a TPACKET_V3 one: the kernel fills blocks of
+ * block_size bytes with frames of any length and hands a block over when it
+ * is full or when it has been open for retire_timeout ms, so a busy interface
+ * wakes us up once for many frames. The frames of a block are lent to the
+ * engine as borrowed packets pointing into the ring, the block is given back
+ * once all of them have been read.
+ *
+ * The transmit ring is made of tx_frames fixed size slots: frames are copied
+ * into free slots and the kernel is kicked once for each batch.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/transport_common.h>
+
+// from linux/if_ether.h, which conflicts with our ethernet definitions
+#define ETH_P_ALL 0x0003
+#define ETH_P_8021Q 0x8100
+#define VLAN_HLEN 4
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23
+#endif
+
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+
+// offset of the frame in a transmit slot, see tpacket_parse_header()
+#define TX_DATA_OFF TPACKET_ALIGN(sizeof(struct tpacket3_hdr))
+
+// frame size given to the kernel for the receive ring, only used to check it
+#define RX_FRAME_SIZE 2048
+
+// transmit slots in a block, rounded up to fill whole pages
+#define TX_BLOCK_SLOTS 16
+
+// defaults
+#define RX_BLOCK_SIZE (1 << 18)
+#define RX_BLOCKS 16
+#define RX_RETIRE_TIMEOUT 1 // ms
+#define TX_FRAMES 256
+#define RX_BUDGET 64
+
+// size of a borrowed packet describing a frame of the receive ring
+#define RX_DESC_SIZE ((sizeof(vde_pkt) + VDE_PKT_EXTERN_DATA_SZ + \
+                       VDE_CACHE_LINE - 1) & ~(VDE_CACHE_LINE - 1))
+
+typedef struct {
+  int fd;
+  void *ev_rd;
+  void *ev_wr;
+  void *ready_to; // timeout passing the connection to the connection manager
+  char *ring; // receive ring followed by transmit ring
+  size_t ring_size;
+  unsigned int rx_block; // next block to read
+  char *tx; // transmit ring
+  unsigned int tx_slot_size; // size of a transmit slot
+  unsigned int tx_block_size;
+  unsigned int tx_slots_per_block;
+  unsigned int tx_slots;
+  unsigned int tx_head; // next slot to fill
+  unsigned int tx_pending; // slots filled since the last kick
+  char *rx_descs; // VDE_PKT_BATCH_MAX borrowed packets of RX_DESC_SIZE
+  vde_sendq sendq; // packets waiting for free transmit slots
+  vde_connection *conn;
+  vde_component *transport;
+} pr_conn;
+
+typedef struct {
+  char ifname[IFNAMSIZ];
+  unsigned int block_size; // size of a receive block
+  unsigned int blocks; // number of receive blocks
+  unsigned int retire_timeout; // ms before a partially filled block is read
+  unsigned int tx_frames; // number of transmit slots
+  int promisc; // nonzero to put the interface in promiscuous mode
+  unsigned int frame_len; // largest frame
+  unsigned long queue_size; // max bytes queued by a connection
+  unsigned int queue_len; // max packets queued by a connection
+  unsigned int rx_budget; // max frames received at each read event
+  vde_list *conns;
+} pr_tr;
+
+static inline struct tpacket_block_desc *pr_rx_block(pr_conn *pc,
+                                                     unsigned int index)
+{
+  pr_tr *tr = (pr_tr *)vde_component_get_priv(pc->transport);
+
+  return (struct tpacket_block_desc *)(pc->ring + index * tr->block_size);
+}
+
+static inline struct tpacket3_hdr *pr_tx_slot(pr_conn *pc, unsigned int index)
+{
+  return (struct tpacket3_hdr *)(pc->tx +
+           (index / pc->tx_slots_per_block) * pc->tx_block_size +
+           (index % pc->tx_slots_per_block) * pc->tx_slot_size);
+}
+
+/**
+ * @brief Report to the connection user that the interface is gone
+ *
+ * @param pc The connection
+ * @param err The error
+ *
+ * @return Nonzero if the connection has been closed
+ */
+static int pr_conn_closed(pr_conn *pc, vde_conn_error err)
+{
+  vde_connection *conn = pc->conn;
+
+  if (vde_connection_call_error(conn, NULL, err) && errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return 1;
+  }
+  vde_warning("%s: interface %s is gone but connection not closed",
+              __PRETTY_FUNCTION__,
+              ((pr_tr *)vde_component_get_priv(pc->transport))->ifname);
+  // the socket would stay readable, stop listening to it
+  vde_context_event_del(vde_connection_get_context(conn), pc->ev_rd);
+  pc->ev_rd = NULL;
+  return 0;
+}
+
+/**
+ * @brief Get a packet for a received frame
+ *
+ * @param pc The connection
+ * @param hdr The frame header in the receive ring
+ * @param desc The borrowed packet to use for frames lent from the ring
+ *
+ * @return The packet, NULL if the frame must be dropped
+ */
+static vde_pkt *pr_rx_pkt(pr_conn *pc, struct tpacket3_hdr *hdr,
+                          vde_pkt *desc)
+{
+  vde_pkt *pkt;
+  char *frame = (char *)hdr + hdr->tp_mac;
+  uint16_t tpid = ETH_P_8021Q;
+  pr_tr *tr = (pr_tr *)vde_component_get_priv(pc->transport);
+  vde_connection *conn = pc->conn;
+
+  if (hdr->tp_snaplen < hdr->tp_len ||
+      hdr->tp_snaplen < sizeof(struct eth_hdr)) {
+    vde_warning("%s: truncated frame, dropping", __PRETTY_FUNCTION__);
+    return NULL;
+  }
+  // GRO on the interface can merge frames beyond the mtu
+  if (hdr->tp_snaplen > tr->frame_len) {
+    vde_warning("%s: frame larger than mtu, dropping", __PRETTY_FUNCTION__);
+    return NULL;
+  }
+
+  if (!(hdr->tp_status & TP_STATUS_VLAN_VALID)) {
+    vde_pkt_init_extern(desc, frame, hdr->tp_snaplen);
+    return desc;
+  }
+
+  // the tag has been stripped by the device, put it back in a copy
+  if (hdr->tp_snaplen + VLAN_HLEN > tr->frame_len) {
+    vde_warning("%s: tagged frame larger than mtu, dropping",
+                __PRETTY_FUNCTION__);
+    return NULL;
+  }
+  pkt = vde_pool_pkt_new(vde_context_get_pool(
+                           vde_connection_get_context(conn)),
+                         hdr->tp_snaplen + VLAN_HLEN,
+                         vde_connection_get_pkt_headsize(conn),
+                         vde_connection_get_pkt_tailsize(conn));
+  if (pkt == NULL) {
+    vde_warning("%s: cannot allocate packet, dropping: %s",
+                __PRETTY_FUNCTION__, strerror(errno));
+    return NULL;
+  }
+  if (hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) {
+    tpid = hdr->hv1.tp_vlan_tpid;
+  }
+  memcpy(pkt->payload, frame, 2 * ETH_ALEN);
+  pkt->payload[12] = tpid >> 8;
+  pkt->payload[13] = tpid & 0xff;
+  pkt->payload[14] = hdr->hv1.tp_vlan_tci >> 8;
+  pkt->payload[15] = hdr->hv1.tp_vlan_tci & 0xff;
+  memcpy(pkt->payload + 2 * ETH_ALEN + VLAN_HLEN, frame + 2 * ETH_ALEN,
+         hdr->tp_snaplen - 2 * ETH_ALEN);
+  pkt->hdr->pkt_len = hdr->tp_snaplen + VLAN_HLEN;
+  return pkt;
+}
+
+/**
+ * @brief Lend a batch of received frames to the connection user, packets
+ * copied out of the ring are released.
+ *
+ * @param pc The connection
+ * @param batch The batch
+ *
+ * @return Nonzero if the connection has been closed
+ */
+static int pr_rx_deliver(pr_conn *pc, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int closed = 0;
+  vde_connection *conn = pc->conn;
+
+  if (batch->count == 0) {
+    return 0;
+  }
+  if (vde_connection_call_read_batch(conn, batch) && errno == EPIPE) {
+    closed = 1;
+  }
+  for (i = 0; i < batch->count; i++) {
+    if (batch->pkts[i]->refcount > 0) {
+      vde_pkt_put(batch->pkts[i]);
+    }
+  }
+  vde_pkt_batch_init(batch);
+  if (closed) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
+  return closed;
+}
+
+/**
+ * @brief Clear the pending error of the socket, which makes it readable
+ *
+ * @param pc The connection
+ *
+ * @return Nonzero if the connection has been closed
+ */
+static int pr_check_error(pr_conn *pc)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+  pr_tr *tr = (pr_tr *)vde_component_get_priv(pc->transport);
+
+  if (getsockopt(pc->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err == 0) {
+    return 0;
+  }
+  // ENETDOWN both when the interface goes down and when it is removed
+  if (err == ENETDOWN && if_nametoindex(tr->ifname) == 0) {
+    return pr_conn_closed(pc, CONN_READ_CLOSED);
+  }
+  vde_warning("%s: error on %s: %s", __PRETTY_FUNCTION__, tr->ifname,
+              strerror(err));
+  return 0;
+}
+
+void pr_read_event(int fd, short event_type, void *arg)
+{
+  struct tpacket_block_desc *block;
+  struct tpacket3_hdr *hdr;
+  struct sockaddr_ll *sll;
+  vde_pkt *pkt;
+  vde_pkt_batch batch;
+  unsigned int i, num, total = 0;
+  uint64_t now;
+  pr_conn *pc = (pr_conn *)arg;
+  pr_tr *tr = (pr_tr *)vde_component_get_priv(pc->transport);
+  vde_connection *conn = pc->conn;
+
+  block = pr_rx_block(pc, pc->rx_block);
+  if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+        TP_STATUS_USER) && pr_check_error(pc)) {
+    return;
+  }
+
+  vde_pkt_batch_init(&batch);
+  // whole blocks are read, the budget is checked between them
+  while (total < tr->rx_budget) {
+    block = pr_rx_block(pc, pc->rx_block);
+    if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+          TP_STATUS_USER)) {
+      break;
+    }
+
+    now = vde_clock_ns();
+    num = block->hdr.bh1.num_pkts;
+    hdr = (struct tpacket3_hdr *)((char *)block +
+                                  block->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < num; i++, total++) {
+      sll = (struct sockaddr_ll *)((char *)hdr +
+                                   TPACKET_ALIGN(sizeof(*hdr)));
+      // without PACKET_IGNORE_OUTGOING we see the frames we send
+      if (sll->sll_pkttype != PACKET_OUTGOING) {
+        pkt = pr_rx_pkt(pc, hdr,
+                        (vde_pkt *)(pc->rx_descs + batch.count * RX_DESC_SIZE));
+      } else {
+        pkt = NULL;
+      }
+      if (pkt != NULL) {
+        vde_pkt_meta_rx(pkt, vde_connection_get_id(conn), now);
+        // a partial checksum from a local sender, e.g. through a veth
+        if ((hdr->tp_status & TP_STATUS_CSUMNOTREADY) &&
+            (pkt->meta.flags & VDE_PKT_META_L4) &&
+            (pkt->meta.l4_proto == IP_PROTO_TCP ||
+             pkt->meta.l4_proto == IP_PROTO_UDP)) {
+          pkt->meta.csum_start = pkt->meta.l4_off;
+          pkt->meta.csum_off = pkt->meta.l4_proto == IP_PROTO_TCP ? 16 : 6;
+          pkt->meta.flags |= VDE_PKT_META_CSUM;
+        }
+        vde_pkt_batch_add(&batch, pkt);
+      }
+      if (vde_pkt_batch_is_full(&batch) && pr_rx_deliver(pc, &batch)) {
+        return;
+      }
+      hdr = (struct tpacket3_hdr *)((char *)hdr + hdr->tp_next_offset);
+    }
+    if (pr_rx_deliver(pc, &batch)) {
+      return;
+    }
+
+    // the frames have been shared by whoever kept them
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    pc->rx_block = (pc->rx_block + 1) % tr->blocks;
+  }
+}
+
+/**
+ * @brief Ask the kernel to send the filled transmit slots
+ *
+ * @param pc The connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int pr_tx_kick(pr_conn *pc)
+{
+  if (pc->tx_pending == 0) {
+    return 0;
+  }
+  if (send(pc->fd, NULL, 0, MSG_DONTWAIT) < 0) {
+    // ENOBUFS and EAGAIN leave the slots to the next kick
+    if (errno != ENOBUFS && errno != EAGAIN) {
+      vde_warning("%s: cannot send on %s: %s", __PRETTY_FUNCTION__,
+                  ((pr_tr *)vde_component_get_priv(pc->transport))->ifname,
+                  strerror(errno));
+    }
+    return -1;
+  }
+  pc->tx_pending = 0;
+  return 0;
+}
+
+void pr_write_event(int fd, short event_type, void *arg);
+
+/**
+ * @brief Wait for free transmit slots. The event times out as well, since
+ * slots left to a later kick don't make the socket writable. A
+ * vde_sendq_wait_cb.
+ *
+ * @param arg The connection
+ */
+static void pr_write_event_start(void *arg)
+{
+  pr_conn *pc = (pr_conn *)arg;
+  vde_connection *conn = pc->conn;
+
+  if (pc->ev_wr != NULL) {
+    return;
+  }
+  pc->ev_wr = vde_context_event_add(vde_connection_get_context(conn), pc->fd,
+                                    VDE_EV_WRITE | VDE_EV_PERSIST,
+                                    vde_connection_get_send_maxtimeout(conn),
+                                    &pr_write_event, (void *)pc);
+}
+
+/**
+ * @brief Copy packets into the transmit ring and kick the kernel. A
+ * vde_sendq_send_cb.
+ *
+ * @param priv The connection
+ * @param pkts The packets to send, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of packets sent or dropped
+ */
+static unsigned int pr_conn_send_batch(void *priv, vde_pkt **pkts,
+                                       unsigned int count)
+{
+  unsigned int i, len;
+  int tmp_errno;
+  struct tpacket3_hdr *hdr;
+  pr_conn *pc = (pr_conn *)priv;
+
+  for (i = 0; i < count; i++) {
+    hdr = pr_tx_slot(pc, pc->tx_head);
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+        TP_STATUS_AVAILABLE) {
+      break;
+    }
+    len = vde_pkt_len(pkts[i]);
+    if (len > pc->tx_slot_size - TX_DATA_OFF) {
+      vde_warning("%s: packet larger than mtu, discarding",
+                  __PRETTY_FUNCTION__);
+      continue;
+    }
+    vde_pkt_gather(pkts[i], (char *)hdr + TX_DATA_OFF);
+    hdr->tp_len = len;
+    hdr->tp_snaplen = len;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+                     __ATOMIC_RELEASE);
+    pc->tx_head = (pc->tx_head + 1) % pc->tx_slots;
+    pc->tx_pending++;
+  }
+
+  tmp_errno = errno;
+  pr_tx_kick(pc);
+  // slots the kernel didn't take are kicked again from the write event
+  if (pc->tx_pending > 0) {
+    pr_write_event_start(pc);
+  }
+  // the transmit ring is full
+  errno = i < count ? EAGAIN : tmp_errno;
+  return i;
+}
+
+void pr_write_event(int fd, short event_type, void *arg)
+{
+  pr_conn *pc = (pr_conn *)arg;
+  vde_connection *conn = pc->conn;
+
+  pr_tx_kick(pc);
+
+  if (vde_sendq_flush(&pc->sendq)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  if (vde_sendq_is_empty(&pc->sendq) && pc->tx_pending == 0) {
+    vde_context_event_del(vde_connection_get_context(conn), pc->ev_wr);
+    pc->ev_wr = NULL;
+  }
+}
+
+int pr_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  pr_conn *pc = vde_connection_get_priv(conn);
+
+  return vde_sendq_write(&pc->sendq, pkt);
+}
+
+unsigned int pr_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  pr_conn *pc = vde_connection_get_priv(conn);
+
+  return vde_sendq_write_batch(&pc->sendq, batch);
+}
+
+void pr_conn_close(vde_connection *conn)
+{
+  pr_conn *pc = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
+  pr_tr *tr = (pr_tr *)vde_component_get_priv(pc->transport);
+
+  if (pc->ev_rd != NULL) {
+    vde_context_event_del(ctx, pc->ev_rd);
+  }
+  if (pc->ev_wr != NULL) {
+    vde_context_event_del(ctx, pc->ev_wr);
+  }
+  if (pc->ready_to != NULL) {
+    vde_context_timeout_del(ctx, pc->ready_to);
+  }
+  vde_sendq_fini(&pc->sendq);
+  munmap(pc->ring, pc->ring_size);
+  close(pc->fd);
+  vde_free_aligned(pc->rx_descs);
+  tr->conns = vde_list_remove(tr->conns, pc);
+
+  vde_free(pc);
+}
+
+/**
+ * @brief Open a packet socket bound to the interface and map its rings
+ *
+ * @param pc The connection
+ * @param tr The transport
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int pr_open(pr_conn *pc, pr_tr *tr)
+{
+  int fd, tmp_errno, ver = TPACKET_V3, one = 1;
+  unsigned int tx_blocks, page = getpagesize();
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  struct packet_mreq mreq;
+  char *ring;
+
+  // no protocol until the socket is bound, frames would be queued
+  fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create packet socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    errno = tmp_errno;
+    return -1;
+  }
+
+  memset(&sll, 0, sizeof(sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons(ETH_P_ALL);
+  sll.sll_ifindex = if_nametoindex(tr->ifname);
+  if (sll.sll_ifindex == 0) {
+    tmp_errno = errno;
+    vde_error("%s: no interface %s", __PRETTY_FUNCTION__, tr->ifname);
+    goto error;
+  }
+
+  if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver))) {
+    tmp_errno = errno;
+    vde_error("%s: TPACKET_V3 not supported: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  // malformed frames are skipped instead of stopping the transmit ring
+  setsockopt(fd, SOL_PACKET, PACKET_LOSS, &one, sizeof(one));
+  if (setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one))) {
+    vde_warning("%s: cannot ignore outgoing frames, they will be filtered",
+                __PRETTY_FUNCTION__);
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = tr->block_size;
+  req.tp_block_nr = tr->blocks;
+  req.tp_frame_size = RX_FRAME_SIZE;
+  req.tp_frame_nr = tr->block_size / RX_FRAME_SIZE * tr->blocks;
+  req.tp_retire_blk_tov = tr->retire_timeout;
+  if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+    tmp_errno = errno;
+    vde_error("%s: cannot set up receive ring: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+
+  // transmit slots are fixed size, packed into page multiple blocks
+  pc->tx_slot_size = TPACKET_ALIGN(TX_DATA_OFF + tr->frame_len);
+  pc->tx_block_size = (TX_BLOCK_SLOTS * pc->tx_slot_size + page - 1) /
+                      page * page;
+  pc->tx_slots_per_block = pc->tx_block_size / pc->tx_slot_size;
+  tx_blocks = (tr->tx_frames + pc->tx_slots_per_block - 1) /
+              pc->tx_slots_per_block;
+  pc->tx_slots = tx_blocks * pc->tx_slots_per_block;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = pc->tx_block_size;
+  req.tp_block_nr = tx_blocks;
+  req.tp_frame_size = pc->tx_slot_size;
+  req.tp_frame_nr = pc->tx_slots;
+  if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req))) {
+    tmp_errno = errno;
+    vde_error("%s: cannot set up transmit ring: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+
+  pc->ring_size = (size_t)tr->block_size * tr->blocks +
+                  (size_t)pc->tx_block_size * tx_blocks;
+  ring = mmap(NULL, pc->ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, 0);
+  if (ring == MAP_FAILED) {
+    tmp_errno = errno;
+    vde_error("%s: cannot map rings: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+
+  if (bind(fd, (struct sockaddr *)&sll, sizeof(sll))) {
+    tmp_errno = errno;
+    vde_error("%s: cannot bind to %s: %s", __PRETTY_FUNCTION__, tr->ifname,
+              strerror(errno));
+    goto error_unmap;
+  }
+  // dropped when the socket is closed
+  if (tr->promisc) {
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = sll.sll_ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+                   sizeof(mreq))) {
+      tmp_errno = errno;
+      vde_error("%s: cannot set %s promiscuous: %s", __PRETTY_FUNCTION__,
+                tr->ifname, strerror(errno));
+      goto error_unmap;
+    }
+  }
+
+  pc->fd = fd;
+  pc->ring = ring;
+  pc->tx = ring + (size_t)tr->block_size * tr->blocks;
+  return 0;
+
+error_unmap:
+  munmap(ring, pc->ring_size);
+error:
+  close(fd);
+  errno = tmp_errno;
+  return -1;
+}
+
+void pr_conn_ready(int fd, short event_type, void *arg)
+{
+  pr_conn *pc = (pr_conn *)arg;
+  vde_context *ctx = vde_component_get_context(pc->transport);
+
+  vde_context_timeout_del(ctx, pc->ready_to);
+  pc->ready_to = NULL;
+
+  // frames are read once the connection manager set the callbacks
+  // XXX: check event NULL
+  pc->ev_rd = vde_context_event_add(ctx, pc->fd, VDE_EV_READ | VDE_EV_PERSIST,
+                                    NULL, &pr_read_event, (void *)pc);
+  vde_transport_call_cm_connect_cb(pc->transport, pc->conn);
+}
+
+/*
+ * The interface is opened right away, the connection manager is called from
+ * the event loop as with other transports.
+ */
+int pr_connect(vde_component *component, vde_connection *conn)
+{
+  int tmp_errno;
+  struct timeval now = { 0, 0 };
+  pr_conn *pc;
+  vde_context *ctx = vde_component_get_context(component);
+  pr_tr *tr = (pr_tr *)vde_component_get_priv(component);
+
+  pc = (pr_conn *)vde_calloc(sizeof(pr_conn));
+  if (!pc) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  pc->rx_descs = vde_calloc_aligned(VDE_CACHE_LINE,
+                                    RX_DESC_SIZE * VDE_PKT_BATCH_MAX);
+  if (!pc->rx_descs) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    vde_free(pc);
+    errno = ENOMEM;
+    return -1;
+  }
+  pc->conn = conn;
+  pc->transport = component;
+
+  if (pr_open(pc, tr)) {
+    tmp_errno = errno;
+    vde_free_aligned(pc->rx_descs);
+    vde_free(pc);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  vde_connection_init(conn, ctx, tr->frame_len, &pr_conn_write,
+                      &pr_conn_close, (void *)pc);
+  vde_connection_set_be_write_batch(conn, &pr_conn_write_batch);
+  vde_connection_set_queue_properties(conn, tr->queue_size, tr->queue_len);
+  vde_sendq_init(&pc->sendq, conn, &pr_conn_send_batch, &pr_write_event_start,
+                 (void *)pc, 1);
+
+  // XXX: check timeout NULL
+  pc->ready_to = vde_context_timeout_add(ctx, VDE_EV_TIMEOUT, &now,
+                                         &pr_conn_ready, (void *)pc);
+  // XXX: check error on list
+  tr->conns = vde_list_prepend(tr->conns, pc);
+  return 0;
+}
+
+int pr_listen(vde_component *component)
+{
+  vde_error("%s: interfaces are plugged with a connect", __PRETTY_FUNCTION__);
+  errno = EOPNOTSUPP;
+  return -1;
+}
+
+static int transport_packet_init(vde_component *component, vde_sobj *params)
+{
+  pr_tr *tr;
+  vde_sobj *ifname_sobj;
+  const char *ifname;
+  int block_size = RX_BLOCK_SIZE;
+  int blocks = RX_BLOCKS;
+  int retire_timeout = RX_RETIRE_TIMEOUT;
+  int tx_frames = TX_FRAMES;
+  int promisc = 1;
+  int mtu = ETH_DATA_LEN;
+  int queue_size = VDE_CONNECTION_QUEUE_MAXBYTES;
+  int queue_len = VDE_CONNECTION_QUEUE_MAXLEN;
+  int rx_budget = RX_BUDGET;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  ifname_sobj = vde_sobj_hash_lookup(params, "ifname");
+  if (!ifname_sobj || !vde_sobj_is_type(ifname_sobj, vde_sobj_type_string)) {
+    vde_error("%s: no interface name received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  ifname = vde_sobj_get_string(ifname_sobj);
+  if (strlen(ifname) == 0 || strlen(ifname) >= IFNAMSIZ) {
+    vde_error("%s: invalid interface name", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (vde_params_get_int(params, "mtu", ETH_MIN_MTU, ETH_MAX_MTU, &mtu) ||
+      vde_params_get_int(params, "block_size", 1, INT_MAX, &block_size) ||
+      vde_params_get_int(params, "blocks", 1, INT_MAX, &blocks) ||
+      vde_params_get_int(params, "retire_timeout", 0, INT_MAX,
+                         &retire_timeout) ||
+      vde_params_get_int(params, "tx_frames", 1, INT_MAX, &tx_frames) ||
+      vde_params_get_bool(params, "promisc", &promisc) ||
+      vde_params_get_int(params, "queue_size", 0, INT_MAX, &queue_size) ||
+      vde_params_get_int(params, "queue_len", 1, INT_MAX, &queue_len) ||
+      vde_params_get_int(params, "rx_budget", 1, INT_MAX, &rx_budget)) {
+    return -1;
+  }
+
+  if (block_size % getpagesize() != 0) {
+    vde_error("%s: block_size must be a multiple of the page size",
+              __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  // a block must hold the largest frame along with its headers
+  if (block_size < ETH_FRAME_LEN(mtu) + 2 * TPACKET3_HDRLEN) {
+    vde_error("%s: block_size too small for mtu %d", __PRETTY_FUNCTION__,
+              mtu);
+    errno = EINVAL;
+    return -1;
+  }
+
+  tr = (pr_tr *)vde_calloc(sizeof(pr_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  strcpy(tr->ifname, ifname);
+  tr->block_size = block_size;
+  tr->blocks = blocks;
+  tr->retire_timeout = retire_timeout;
+  tr->tx_frames = tx_frames;
+  tr->promisc = promisc;
+  tr->frame_len = ETH_FRAME_LEN(mtu);
+  tr->queue_size = queue_size;
+  tr->queue_len = queue_len;
+  tr->rx_budget = rx_budget;
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_packet_fini(vde_component *component)
+{
+  pr_tr *tr;
+  pr_conn *pc;
+  vde_connection *conn;
+
+  vde_assert(component != NULL);
+
+  tr = (pr_tr *)vde_component_get_priv(component);
+  // closing a connection removes it from the list
+  while (tr->conns != NULL) {
+    pc = vde_list_get_data(vde_list_first(tr->conns));
+    conn = pc->conn;
+    if (pc->ready_to != NULL) {
+      // not passed to the connection manager yet, which deletes it
+      vde_connection_fini(conn);
+      vde_transport_call_cm_error_cb(component, conn, ECONNABORTED);
+    } else {
+      vde_transport_conn_gone(conn);
+    }
+  }
+  vde_free(tr);
+}
+
+component_ops transport_packet_component_ops = {
+  .init = transport_packet_init,
+  .fini = transport_packet_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "packet",
+  .cops = &transport_packet_component_ops,
+  .tr_listen = &pr_listen,
+  .tr_connect = &pr_connect,
+};
@@ -0,0 +1,966 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Native vde3 transport: each port is a single SOCK_SEQPACKET unix
+ * connection carrying vde packets, header included, one per message. The
+ * listening socket lives in the filesystem or, if path starts with '@', in
+ * the abstract namespace. The handshake is one round trip: the connecting
+ * side sends a hello with the largest frame it handles, the listening side
+ * replies with the frame size both will use.
+ */
+
+#include <unistd.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/types.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/transport_common.h>
+
+// default backlog of the listening socket
+#define LISTEN_QUEUE 128
+
+// max connections accepted at each event of the listening socket
+#define ACCEPT_BUDGET 64
+
+// default time given to peers to complete the handshake, in milliseconds
+#define HANDSHAKE_TIMEOUT 5000
+
+// size of sockaddr_un.sun_path
+#define UNIX_PATH_MAX 108
+
+// max number of segments of a chained packet sent without linearizing it
+#define SEND_IOV_MAX 16
+
+// default max number of messages received at each read event
+#define RX_BUDGET 64
+
+#define HELLO_MAGIC 0x76646533 // "vde3"
+#define HELLO_VERSION 1
+#define HELLO_LEN 256
+
+// first message of each side of a connection
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t status; // in the reply, zero or the errno of the refusal
+  uint32_t frame_len; // largest frame the sender handles or agreed on
+  char description[]; // in the hello, NUL terminated
+} __attribute__((packed)) sp_hello;
+
+typedef struct {
+  int fd;
+  void *ev_rd; // handshake event until the connection is established
+  void *ev_wr;
+  uint64_t deadline; // when the handshake times out, see vde_clock_ns()
+  void *connect_to; // timeout of the next connect() attempt
+  unsigned int connect_tries; // connect() attempts refused with EAGAIN
+  vde_sendq sendq; // packets waiting to be sent
+  unsigned int rx_hint; // packets to allocate for the next receive
+  int outgoing; // nonzero if the connection manager owns the connection
+  vde_connection *conn;
+  vde_component *transport;
+} sp_conn;
+
+typedef struct {
+  struct sockaddr_un sa; // address of the listening socket
+  socklen_t sa_len;
+  int abstract; // nonzero if sa is in the abstract namespace
+  unsigned int frame_len; // largest frame sent or received by connections
+  unsigned long queue_size; // max bytes queued by a connection
+  unsigned int queue_len; // max packets queued by a connection
+  unsigned int rx_budget; // max messages received at each read event
+  int backlog; // backlog of the listening socket
+  unsigned int handshake_timeout; // milliseconds to complete a handshake
+  int listen_fd;
+  void *listen_event;
+  vde_list *pending_conns;
+  vde_list *conns; // connections which completed the handshake
+} sp_tr;
+
+/**
+ * @brief Start the handshake timer of a connection
+ *
+ * @param sp The connection
+ */
+static void sp_conn_handshake_start(sp_conn *sp)
+{
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(sp->transport);
+
+  sp->deadline = vde_clock_ns() + (uint64_t)tr->handshake_timeout * 1000000;
+}
+
+/**
+ * @brief Get the time left to a connection to complete its handshake, to be
+ * used as the timeout of the handshake events.
+ *
+ * @param sp The connection
+ * @param tv The time left, zero if the deadline has passed
+ *
+ * @return tv
+ */
+static struct timeval *sp_conn_handshake_left(sp_conn *sp, struct timeval *tv)
+{
+  uint64_t now = vde_clock_ns();
+  uint64_t left = sp->deadline > now ? sp->deadline - now : 0;
+
+  tv->tv_sec = left / 1000000000;
+  tv->tv_usec = (left % 1000000000) / 1000;
+  return tv;
+}
+
+/**
+ * @brief Check that a message received from the peer carries a vde packet
+ *
+ * @param pkt The packet the message has been received into
+ * @param len The length of the message
+ * @param flags The flags of the message
+ *
+ * @return Nonzero if the packet is valid
+ */
+static int sp_pkt_is_valid(vde_pkt *pkt, unsigned int len, int flags)
+{
+  return !(flags & MSG_TRUNC) && len >= sizeof(vde_hdr) &&
+         pkt->hdr->version == VDE_HDR_VERSION &&
+         pkt->hdr->pkt_len == len - sizeof(vde_hdr) &&
+         pkt->hdr->pkt_len >= sizeof(struct eth_hdr);
+}
+
+/**
+ * @brief Receive up to batch->count messages into the packets of a batch,
+ * header included
+ *
+ * @param sp The connection to receive from
+ * @param batch The packets to fill
+ * @param msgs The messages, their length and flags are set on return
+ *
+ * @return The number of messages received, -1 on error (and errno is set
+ * appropriately)
+ */
+static int sp_conn_recv_batch(sp_conn *sp, vde_pkt_batch *batch,
+                              struct mmsghdr *msgs)
+{
+  unsigned int i;
+  struct iovec iov[VDE_PKT_BATCH_MAX][2];
+  unsigned int max_payload = vde_connection_max_payload(sp->conn);
+
+  memset(msgs, 0, batch->count * sizeof(struct mmsghdr));
+  for (i = 0; i < batch->count; i++) {
+    // the header and the payload are not contiguous in the packet
+    iov[i][0].iov_base = batch->pkts[i]->hdr;
+    iov[i][0].iov_len = sizeof(vde_hdr);
+    iov[i][1].iov_base = batch->pkts[i]->payload;
+    iov[i][1].iov_len = max_payload;
+    msgs[i].msg_hdr.msg_iov = iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 2;
+  }
+  return recvmmsg(sp->fd, msgs, batch->count, MSG_DONTWAIT, NULL);
+}
+
+/**
+ * @brief Report to the connection user that the peer is gone
+ *
+ * @param sp The connection
+ * @param err The error
+ *
+ * @return Nonzero if the connection has been closed
+ */
+static int sp_conn_closed(sp_conn *sp, vde_conn_error err)
+{
+  vde_connection *conn = sp->conn;
+  vde_context *ctx = vde_connection_get_context(conn);
+
+  if (vde_connection_call_error(conn, NULL, err) && errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return 1;
+  }
+  vde_warning("%s: peer of fd %d is gone but connection not closed",
+              __PRETTY_FUNCTION__, sp->fd);
+  // the socket would stay readable, stop listening to it
+  if (sp->ev_rd != NULL) {
+    vde_context_event_del(ctx, sp->ev_rd);
+    sp->ev_rd = NULL;
+  }
+  return 0;
+}
+
+void sp_conn_read_event(int fd, short event_type, void *arg)
+{
+  vde_pkt *pkt;
+  vde_pkt_batch batch, frames;
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  unsigned int i, chunk, total = 0;
+  int rcvd, eof = 0;
+  int cb_errno = 0;
+  uint64_t now;
+  sp_conn *sp = (sp_conn *)arg;
+  vde_connection *conn = sp->conn;
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(sp->transport);
+  vde_pool *pool = vde_context_get_pool(vde_connection_get_context(conn));
+
+  while (total < tr->rx_budget) {
+    chunk = sp->rx_hint;
+    if (chunk > tr->rx_budget - total) {
+      chunk = tr->rx_budget - total;
+    }
+
+    vde_pkt_batch_init(&batch);
+    for (i = 0; i < chunk; i++) {
+      pkt = vde_pool_pkt_new(pool, vde_connection_max_payload(conn),
+                             vde_connection_get_pkt_headsize(conn),
+                             vde_connection_get_pkt_tailsize(conn));
+      if (pkt == NULL) {
+        break;
+      }
+      vde_pkt_batch_add(&batch, pkt);
+    }
+    if (batch.count == 0) {
+      vde_warning("%s: cannot allocate packet, dropping: %s",
+                  __PRETTY_FUNCTION__, strerror(errno));
+      // discard a message, or the event will trigger again
+      recv(sp->fd, NULL, 0, MSG_DONTWAIT);
+      return;
+    }
+    // the batch is emptied before the end of the loop
+    chunk = batch.count;
+
+    rcvd = sp_conn_recv_batch(sp, &batch, msgs);
+    if (rcvd < 0) {
+      if (errno != EAGAIN) {
+        vde_warning("%s: error reading from fd %d: %s", __PRETTY_FUNCTION__,
+                    sp->fd, strerror(errno));
+        eof = 1;
+      }
+      vde_pkt_batch_put(&batch);
+      break;
+    }
+    total += rcvd;
+
+    if (rcvd == chunk) {
+      sp->rx_hint = rcvd * 2 < VDE_PKT_BATCH_MAX ? rcvd * 2 :
+                                                   VDE_PKT_BATCH_MAX;
+    } else {
+      sp->rx_hint = rcvd > 0 ? rcvd : 1;
+    }
+
+    now = vde_clock_ns();
+    vde_pkt_batch_init(&frames);
+    for (i = 0; i < rcvd; i++) {
+      pkt = batch.pkts[i];
+      // messages are never empty, an empty one is the end of the stream
+      if (msgs[i].msg_len == 0) {
+        eof = 1;
+        break;
+      }
+      if (!sp_pkt_is_valid(pkt, msgs[i].msg_len,
+                           msgs[i].msg_hdr.msg_flags)) {
+        vde_warning("%s: invalid packet from fd %d, dropping",
+                    __PRETTY_FUNCTION__, sp->fd);
+        continue;
+      }
+      vde_pkt_meta_rx(pkt, vde_connection_get_id(conn), now);
+      vde_pkt_batch_add(&frames, pkt);
+    }
+    if (frames.count > 0 && vde_connection_call_read_batch(conn, &frames)) {
+      cb_errno = errno;
+    }
+
+    vde_pkt_batch_put(&batch);
+
+    if (cb_errno == EPIPE) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+      return;
+    }
+    if (eof || rcvd == 0 || rcvd < chunk) {
+      break;
+    }
+  }
+
+  if (eof || (total == 0 && rcvd == 0)) {
+    sp_conn_closed(sp, CONN_READ_CLOSED);
+  }
+}
+
+/**
+ * @brief Describe a packet, header included, with a message for sendmmsg(),
+ * chained packets are sent without copying them.
+ *
+ * @param pkt The packet
+ * @param hdr The header to send, it covers the whole chain
+ * @param msg The message to fill
+ * @param iov An array of SEND_IOV_MAX + 1 elements to describe the packet
+ *
+ * @return zero on success, -1 if the packet has too many segments
+ */
+static int sp_msg_fill(vde_pkt *pkt, vde_hdr *hdr, struct mmsghdr *msg,
+                       struct iovec *iov)
+{
+  int iovcnt;
+
+  iovcnt = vde_pkt_to_iovec(pkt, iov + 1, SEND_IOV_MAX);
+  if (iovcnt < 0) {
+    return -1;
+  }
+  hdr->version = VDE_HDR_VERSION;
+  hdr->type = pkt->hdr->type;
+  hdr->pkt_len = vde_pkt_len(pkt);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(vde_hdr);
+
+  memset(msg, 0, sizeof(struct mmsghdr));
+  msg->msg_hdr.msg_iov = iov;
+  msg->msg_hdr.msg_iovlen = iovcnt + 1;
+  return 0;
+}
+
+/**
+ * @brief Send packets with a single sendmmsg(), chained packets are sent
+ * without copying them. A vde_sendq_send_cb.
+ *
+ * @param priv The connection
+ * @param pkts The packets to send, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of packets sent
+ */
+static unsigned int sp_conn_send(void *priv, vde_pkt **pkts,
+                                 unsigned int count)
+{
+  unsigned int i;
+  int sent;
+  vde_hdr hdrs[VDE_PKT_BATCH_MAX];
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iov[VDE_PKT_BATCH_MAX][SEND_IOV_MAX + 1];
+  sp_conn *sp = (sp_conn *)priv;
+
+  for (i = 0; i < count; i++) {
+    if (sp_msg_fill(pkts[i], &hdrs[i], &msgs[i], iov[i])) {
+      break;
+    }
+  }
+  if (i == 0) {
+    // too many segments, the queue sends a linear copy
+    errno = EMSGSIZE;
+    return 0;
+  }
+
+  sent = sendmmsg(sp->fd, msgs, i, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent < 0) {
+    return 0;
+  }
+  if (sent < i) {
+    errno = EAGAIN;
+  } else if (i < count) {
+    errno = EMSGSIZE;
+  }
+  return sent;
+}
+
+void sp_conn_write_event(int fd, short event_type, void *arg)
+{
+  sp_conn *sp = (sp_conn *)arg;
+  vde_connection *conn = sp->conn;
+
+  if (vde_sendq_flush(&sp->sendq)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  if (vde_sendq_is_empty(&sp->sendq)) {
+    vde_context_event_del(vde_connection_get_context(conn), sp->ev_wr);
+    sp->ev_wr = NULL;
+  }
+}
+
+static void sp_conn_write_event_start(void *arg)
+{
+  sp_conn *sp = (sp_conn *)arg;
+  vde_connection *conn = sp->conn;
+
+  if (sp->ev_wr == NULL) {
+    sp->ev_wr = vde_context_event_add(vde_connection_get_context(conn),
+                                      sp->fd, VDE_EV_WRITE|VDE_EV_PERSIST,
+                                      vde_connection_get_send_maxtimeout(conn),
+                                      &sp_conn_write_event, (void *)sp);
+  }
+}
+
+int sp_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  sp_conn *sp = vde_connection_get_priv(conn);
+
+  return vde_sendq_write(&sp->sendq, pkt);
+}
+
+unsigned int sp_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  sp_conn *sp = vde_connection_get_priv(conn);
+
+  return vde_sendq_write_batch(&sp->sendq, batch);
+}
+
+void sp_conn_close(vde_connection *conn)
+{
+  sp_conn *sp = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(sp->transport);
+
+  if (sp->ev_rd != NULL) {
+    vde_context_event_del(ctx, sp->ev_rd);
+  }
+  if (sp->ev_wr != NULL) {
+    vde_context_event_del(ctx, sp->ev_wr);
+  }
+  if (sp->connect_to != NULL) {
+    vde_context_timeout_del(ctx, sp->connect_to);
+  }
+  if (sp->fd >= 0) {
+    close(sp->fd);
+  }
+  vde_sendq_fini(&sp->sendq);
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sp);
+  tr->conns = vde_list_remove(tr->conns, sp);
+
+  vde_free(sp);
+}
+
+/**
+ * @brief Allocate the backend of a connection and initialize the connection
+ *
+ * @param component The transport
+ * @param conn The connection
+ * @param fd The socket of the connection, -1 if not created yet
+ *
+ * @return The backend, NULL on error (and errno is set appropriately)
+ */
+static sp_conn *sp_conn_new(vde_component *component, vde_connection *conn,
+                            int fd)
+{
+  sp_conn *sp;
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(component);
+
+  sp = (sp_conn *)vde_calloc(sizeof(sp_conn));
+  if (!sp) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  sp->fd = fd;
+  sp->rx_hint = 1;
+  sp->conn = conn;
+  sp->transport = component;
+  sp_conn_handshake_start(sp);
+
+  vde_connection_init(conn, vde_component_get_context(component),
+                      tr->frame_len, &sp_conn_write, &sp_conn_close,
+                      (void *)sp);
+  vde_connection_set_be_write_batch(conn, &sp_conn_write_batch);
+  vde_connection_set_queue_properties(conn, tr->queue_size, tr->queue_len);
+  vde_sendq_init(&sp->sendq, conn, &sp_conn_send, &sp_conn_write_event_start,
+                 (void *)sp, 1);
+
+  // XXX: check error on list
+  tr->pending_conns = vde_list_prepend(tr->pending_conns, sp);
+  return sp;
+}
+
+/**
+ * @brief Move a connection which completed the handshake to the data path
+ *
+ * @param sp The connection
+ * @param frame_len The frame size agreed with the peer
+ */
+static void sp_conn_established(sp_conn *sp, unsigned int frame_len)
+{
+  vde_context *ctx = vde_component_get_context(sp->transport);
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(sp->transport);
+
+  vde_connection_set_max_payload(sp->conn, frame_len);
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sp);
+  tr->conns = vde_list_prepend(tr->conns, sp);
+
+  // XXX: check event NULL
+  sp->ev_rd = vde_context_event_add(ctx, sp->fd, VDE_EV_READ|VDE_EV_PERSIST,
+                                    NULL, &sp_conn_read_event, (void *)sp);
+}
+
+/**
+ * @brief Send the reply to a hello
+ *
+ * @param sp The connection
+ * @param status Zero if the connection is accepted, an errno value otherwise
+ * @param frame_len The agreed frame size
+ *
+ * @return zero on success, -1 on error
+ */
+static int sp_srv_send_reply(sp_conn *sp, int status, unsigned int frame_len)
+{
+  sp_hello reply;
+
+  memset(&reply, 0, sizeof(reply));
+  reply.magic = HELLO_MAGIC;
+  reply.version = HELLO_VERSION;
+  reply.status = status;
+  reply.frame_len = frame_len;
+
+  // the socket is empty, the reply fits in its buffer
+  if (send(sp->fd, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) !=
+      sizeof(reply)) {
+    vde_error("%s: cannot reply to peer: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+void sp_srv_get_hello(int fd, short event_type, void *arg)
+{
+  int len;
+  unsigned int frame_len;
+  struct timeval left;
+  char buf[HELLO_LEN + 1];
+  sp_hello *hello = (sp_hello *)buf;
+  sp_conn *sp = (sp_conn *)arg;
+  vde_connection *conn = sp->conn;
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(sp->transport);
+  vde_context *ctx = vde_component_get_context(sp->transport);
+
+  vde_context_event_del(ctx, sp->ev_rd);
+  sp->ev_rd = NULL;
+
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_warning("%s: handshake timed out on fd %d", __PRETTY_FUNCTION__,
+                sp->fd);
+    goto error;
+  }
+
+  len = recv(sp->fd, buf, HELLO_LEN, MSG_DONTWAIT);
+  if (len < 0 && errno == EAGAIN) {
+    // spurious wakeup, wait for the hello again
+    sp->ev_rd = vde_context_event_add(ctx, sp->fd, VDE_EV_READ,
+                                      sp_conn_handshake_left(sp, &left),
+                                      &sp_srv_get_hello, (void *)sp);
+    return;
+  }
+  if (len < (int)sizeof(sp_hello) || hello->magic != HELLO_MAGIC ||
+      hello->version != HELLO_VERSION) {
+    vde_error("%s: received an invalid hello", __PRETTY_FUNCTION__);
+    goto error;
+  }
+  buf[len] = 0;
+  // XXX: add the description and the peer credentials to conn.attributes
+
+  frame_len = hello->frame_len < tr->frame_len ? hello->frame_len :
+                                                 tr->frame_len;
+  if (frame_len < ETH_FRAME_LEN(ETH_MIN_MTU)) {
+    vde_error("%s: peer frame size %u is too small", __PRETTY_FUNCTION__,
+              hello->frame_len);
+    sp_srv_send_reply(sp, EMSGSIZE, frame_len);
+    goto error;
+  }
+  if (sp_srv_send_reply(sp, 0, frame_len)) {
+    goto error;
+  }
+
+  sp_conn_established(sp, frame_len);
+  vde_transport_call_cm_accept_cb(sp->transport, conn);
+  return;
+
+error:
+  // XXX: call connection manager error callback here?
+  vde_connection_fini(conn);
+  vde_connection_delete(conn);
+}
+
+/*
+ * When many peers connect at once the backlog is drained at each event, up to
+ * ACCEPT_BUDGET connections so that established connections are served in the
+ * meantime.
+ */
+void sp_accept(int listen_fd, short event_type, void *arg)
+{
+  int new;
+  unsigned int burst = 0;
+  struct timeval left;
+  vde_connection *conn;
+  sp_conn *sp;
+  vde_component *component = (vde_component *)arg;
+  vde_context *ctx = vde_component_get_context(component);
+
+  while (burst < ACCEPT_BUDGET) {
+    new = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (new < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
+      }
+      break;
+    }
+    burst++;
+
+    if (vde_connection_new(&conn)) {
+      vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
+      close(new);
+      continue;
+    }
+    sp = sp_conn_new(component, conn, new);
+    if (sp == NULL) {
+      vde_connection_delete(conn);
+      close(new);
+      continue;
+    }
+
+    // XXX: check event NULL
+    sp->ev_rd = vde_context_event_add(ctx, sp->fd, VDE_EV_READ,
+                                      sp_conn_handshake_left(sp, &left),
+                                      &sp_srv_get_hello, (void *)sp);
+  }
+}
+
+int sp_listen(vde_component *component)
+{
+  vde_context *ctx = vde_component_get_context(component);
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(component);
+
+  tr->listen_fd = vde_sock_listen((struct sockaddr *)&tr->sa, tr->sa_len,
+                                  SOCK_SEQPACKET, tr->backlog);
+  if (tr->listen_fd < 0) {
+    return -1;
+  }
+
+  // XXX: check event not NULL
+  tr->listen_event = vde_context_event_add(ctx, tr->listen_fd,
+                                           VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                           &sp_accept, (void *)component);
+  return 0;
+}
+
+/**
+ * @brief Abort the handshake of an outgoing connection and report the error to
+ * the connection manager, which deletes the connection.
+ *
+ * @param sp The connection
+ * @param tr_errno The error
+ */
+static void sp_cli_error(sp_conn *sp, int tr_errno)
+{
+  vde_connection *conn = sp->conn;
+  vde_component *transport = sp->transport;
+
+  vde_connection_fini(conn);
+  vde_transport_call_cm_error_cb(transport, conn, tr_errno);
+}
+
+void sp_cli_get_reply(int fd, short event_type, void *arg)
+{
+  int len;
+  struct timeval left;
+  sp_hello reply;
+  sp_conn *sp = (sp_conn *)arg;
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(sp->transport);
+  vde_context *ctx = vde_component_get_context(sp->transport);
+
+  vde_context_event_del(ctx, sp->ev_rd);
+  sp->ev_rd = NULL;
+
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_error("%s: no reply from peer", __PRETTY_FUNCTION__);
+    sp_cli_error(sp, ETIMEDOUT);
+    return;
+  }
+
+  len = recv(sp->fd, &reply, sizeof(reply), MSG_DONTWAIT);
+  if (len < 0 && errno == EAGAIN) {
+    sp->ev_rd = vde_context_event_add(ctx, sp->fd, VDE_EV_READ,
+                                      sp_conn_handshake_left(sp, &left),
+                                      &sp_cli_get_reply, (void *)sp);
+    return;
+  }
+  if (len != sizeof(reply) || reply.magic != HELLO_MAGIC ||
+      reply.version != HELLO_VERSION) {
+    vde_error("%s: invalid reply from peer: %s", __PRETTY_FUNCTION__,
+              len < 0 ? strerror(errno) : "bad message");
+    sp_cli_error(sp, len < 0 ? errno : ECONNREFUSED);
+    return;
+  }
+  if (reply.status != 0) {
+    vde_error("%s: refused by peer: %s", __PRETTY_FUNCTION__,
+              strerror(reply.status));
+    sp_cli_error(sp, reply.status);
+    return;
+  }
+  if (reply.frame_len > tr->frame_len ||
+      reply.frame_len < ETH_FRAME_LEN(ETH_MIN_MTU)) {
+    vde_error("%s: invalid frame size %u from peer", __PRETTY_FUNCTION__,
+              reply.frame_len);
+    sp_cli_error(sp, EMSGSIZE);
+    return;
+  }
+
+  sp_conn_established(sp, reply.frame_len);
+  vde_transport_call_cm_connect_cb(sp->transport, sp->conn);
+}
+
+/**
+ * @brief Send the hello of an outgoing connection
+ *
+ * @param sp The connection, its socket connected
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int sp_cli_send_hello(sp_conn *sp)
+{
+  int len, tmp_errno;
+  struct timeval left;
+  char buf[HELLO_LEN];
+  sp_hello *hello = (sp_hello *)buf;
+  vde_context *ctx = vde_component_get_context(sp->transport);
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(sp->transport);
+
+  memset(buf, 0, sizeof(buf));
+  hello->magic = HELLO_MAGIC;
+  hello->version = HELLO_VERSION;
+  hello->frame_len = tr->frame_len;
+  snprintf(hello->description, HELLO_LEN - sizeof(sp_hello), "vde3 %s",
+           vde_component_get_name(sp->transport));
+  len = sizeof(sp_hello) + strlen(hello->description) + 1;
+
+  if (send(sp->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+    tmp_errno = errno;
+    vde_error("%s: cannot send hello: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    errno = tmp_errno;
+    return -1;
+  }
+
+  // XXX: check event NULL
+  sp->ev_rd = vde_context_event_add(ctx, sp->fd, VDE_EV_READ,
+                                    sp_conn_handshake_left(sp, &left),
+                                    &sp_cli_get_reply, (void *)sp);
+  return 0;
+}
+
+void sp_cli_connect_retry(int fd, short event_type, void *arg);
+
+/**
+ * @brief Connect the socket of an outgoing connection and send the hello.
+ * Unix sockets connect right away, unless the backlog of the listener is full.
+ *
+ * @param sp The connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int sp_cli_connect(sp_conn *sp)
+{
+  int ret;
+  vde_context *ctx = vde_component_get_context(sp->transport);
+  sp_tr *tr = (sp_tr *)vde_component_get_priv(sp->transport);
+
+  ret = vde_sock_connect(ctx, sp->fd, (struct sockaddr *)&tr->sa, tr->sa_len,
+                         &sp->connect_tries, &sp->connect_to,
+                         &sp_cli_connect_retry, (void *)sp);
+  if (ret <= 0) {
+    return ret;
+  }
+  return sp_cli_send_hello(sp);
+}
+
+void sp_cli_connect_retry(int fd, short event_type, void *arg)
+{
+  sp_conn *sp = (sp_conn *)arg;
+  vde_context *ctx = vde_component_get_context(sp->transport);
+
+  vde_context_timeout_del(ctx, sp->connect_to);
+  sp->connect_to = NULL;
+  if (sp_cli_connect(sp)) {
+    sp_cli_error(sp, errno);
+  }
+}
+
+int sp_connect(vde_component *component, vde_connection *conn)
+{
+  int tmp_errno;
+  sp_conn *sp;
+
+  sp = sp_conn_new(component, conn, -1);
+  if (sp == NULL) {
+    return -1;
+  }
+  sp->outgoing = 1;
+
+  sp->fd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+  if (sp->fd < 0) {
+    vde_error("%s: cannot create socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (sp_cli_connect(sp)) {
+    goto error;
+  }
+  return 0;
+
+error:
+  tmp_errno = errno;
+  // the connection manager owns the connection and deletes it
+  vde_connection_fini(conn);
+  errno = tmp_errno;
+  return -1;
+}
+
+static int transport_seqpacket_init(vde_component *component,
+                                    vde_sobj *params)
+{
+  sp_tr *tr;
+  vde_sobj *path_sobj;
+  const char *path;
+  int mtu = ETH_DATA_LEN;
+  int queue_size = VDE_CONNECTION_QUEUE_MAXBYTES;
+  int queue_len = VDE_CONNECTION_QUEUE_MAXLEN;
+  int rx_budget = RX_BUDGET;
+  int backlog = LISTEN_QUEUE;
+  int handshake_timeout = HANDSHAKE_TIMEOUT;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  path_sobj = vde_sobj_hash_lookup(params, "path");
+  if (!path_sobj || !vde_sobj_is_type(path_sobj, vde_sobj_type_string)) {
+    vde_error("%s: no socket path received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  path = vde_sobj_get_string(path_sobj);
+  if (strlen(path) < 2 || strlen(path) >= UNIX_PATH_MAX) {
+    vde_error("%s: invalid socket path", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (vde_params_get_int(params, "mtu", ETH_MIN_MTU, ETH_MAX_MTU, &mtu) ||
+      vde_params_get_int(params, "queue_size", 0, INT_MAX, &queue_size) ||
+      vde_params_get_int(params, "queue_len", 1, INT_MAX, &queue_len) ||
+      vde_params_get_int(params, "rx_budget", 1, INT_MAX, &rx_budget) ||
+      vde_params_get_int(params, "backlog", 1, INT_MAX, &backlog) ||
+      vde_params_get_int(params, "handshake_timeout", 1, INT_MAX,
+                         &handshake_timeout)) {
+    return -1;
+  }
+
+  tr = (sp_tr *)vde_calloc(sizeof(sp_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  tr->sa.sun_family = AF_UNIX;
+  if (path[0] == '@') {
+    // abstract namespace, the name is not NUL terminated
+    tr->abstract = 1;
+    memcpy(tr->sa.sun_path + 1, path + 1, strlen(path) - 1);
+    tr->sa_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+  } else {
+    // XXX: path needs to be normalized/checked somewhere
+    strcpy(tr->sa.sun_path, path);
+    tr->sa_len = sizeof(tr->sa);
+  }
+  tr->frame_len = ETH_FRAME_LEN(mtu);
+  tr->queue_size = queue_size;
+  tr->queue_len = queue_len;
+  tr->rx_budget = rx_budget;
+  tr->backlog = backlog;
+  tr->handshake_timeout = handshake_timeout;
+  tr->listen_fd = -1;
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_seqpacket_fini(vde_component *component)
+{
+  sp_tr *tr;
+  sp_conn *sp;
+  vde_connection *conn;
+
+  vde_assert(component != NULL);
+
+  tr = (sp_tr *)vde_component_get_priv(component);
+  if (tr->listen_fd >= 0) {
+    vde_context_event_del(vde_component_get_context(component),
+                          tr->listen_event);
+    close(tr->listen_fd);
+    if (!tr->abstract) {
+      unlink(tr->sa.sun_path);
+    }
+  }
+  // closing a connection removes it from its list
+  while (tr->pending_conns != NULL) {
+    sp = vde_list_get_data(vde_list_first(tr->pending_conns));
+    if (sp->outgoing) {
+      sp_cli_error(sp, ECONNABORTED);
+    } else {
+      conn = sp->conn; // closing the connection frees sp
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+    }
+  }
+  while (tr->conns != NULL) {
+    sp = vde_list_get_data(vde_list_first(tr->conns));
+    vde_transport_conn_gone(sp->conn);
+  }
+  vde_free(tr);
+}
+
+component_ops transport_seqpacket_component_ops = {
+  .init = transport_seqpacket_init,
+  .fini = transport_seqpacket_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "seqpacket",
+  .cops = &transport_seqpacket_component_ops,
+  .tr_listen = &sp_listen,
+  .tr_connect = &sp_connect,
+};
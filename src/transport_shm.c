@@ -0,0 +1,1296 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Shared memory transport for peers on the same host. The connecting side
+ * creates a memfd holding two rings of descriptors, one for each direction,
+ * and the buffers they refer to, plus an eventfd for each side. These are
+ * passed to the listening side over a SOCK_SEQPACKET unix socket with
+ * SCM_RIGHTS, afterwards the socket is only watched to notice when the peer
+ * goes away.
+ *
+ * Each ring has a single producer and a single consumer: the producer copies
+ * a frame into the buffer of a free slot and advances head, the consumer
+ * copies it into a packet and advances tail. A consumer which finds the ring
+ * empty sets consumer_waiting and sleeps on its eventfd, the producer kicks
+ * the eventfd only if the flag is set, so no system call is made as long as
+ * the consumer is polling the ring. The same way a producer which finds the
+ * ring full sets producer_waiting and the consumer kicks it when it frees
+ * slots.
+ */
+
+#include <unistd.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/transport_common.h>
+
+// default backlog of the listening socket
+#define LISTEN_QUEUE 128
+
+// max connections accepted at each event of the listening socket
+#define ACCEPT_BUDGET 64
+
+// default time given to peers to complete the handshake, in milliseconds
+#define HANDSHAKE_TIMEOUT 5000
+
+// size of sockaddr_un.sun_path
+#define UNIX_PATH_MAX 108
+
+// default max number of frames received at each wakeup
+#define RX_BUDGET 64
+
+// default and max number of slots of each ring, always a power of two
+#define RING_SIZE 256
+#define RING_SIZE_MAX 4096
+
+#define HELLO_MAGIC 0x76646533 // "vde3"
+#define HELLO_VERSION 1
+#define HELLO_LEN 256
+
+// descriptors passed along with the hello: the memfd, the eventfd of the
+// listening side and the eventfd of the connecting side
+#define HELLO_FDS 3
+
+// first message of each side of a connection
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t status; // in the reply, zero or the errno of the refusal
+  uint32_t ring_size; // slots of each ring
+  uint32_t frame_len; // size of the buffers in the hello, agreed frame size
+                      // in the reply
+  char description[]; // in the hello, NUL terminated
+} __attribute__((packed)) shm_hello;
+
+// descriptor of the frame in a slot
+typedef struct {
+  uint32_t len;
+  uint8_t type; // type of the vde header
+  uint8_t pad[3];
+} shm_desc;
+
+// header of a ring, followed by its descriptors
+typedef struct {
+  // written by the producer
+  uint32_t head; // slots filled so far, free running
+  uint32_t producer_waiting; // the producer waits for free slots
+  char pad0[VDE_CACHE_LINE - 2 * sizeof(uint32_t)];
+  // written by the consumer
+  uint32_t tail; // slots consumed so far, free running
+  uint32_t consumer_waiting; // the consumer sleeps on its eventfd
+  char pad1[VDE_CACHE_LINE - 2 * sizeof(uint32_t)];
+  shm_desc desc[];
+} shm_ring;
+
+// the peer reads and writes the rings concurrently
+#define shm_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define shm_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define shm_full_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define shm_align(s) (((s) + VDE_CACHE_LINE - 1) & ~(size_t)(VDE_CACHE_LINE - 1))
+
+typedef struct {
+  int fd; // control socket
+  void *ev_rd; // handshake event, then end of stream of the control socket
+  void *ev_kick;
+  int memfd; // until the region is mapped and sent to the peer
+  int kick_fd; // eventfd kicked by the peer
+  int peer_kick_fd; // eventfd of the peer
+  char *region;
+  size_t region_len;
+  shm_ring *rx;
+  shm_ring *tx;
+  char *rx_bufs;
+  char *tx_bufs;
+  unsigned int ring_size;
+  size_t slot_len; // distance between buffers
+  uint32_t rx_tail; // private copies of the indexes we write
+  uint32_t tx_head;
+  uint64_t deadline; // when the handshake times out, see vde_clock_ns()
+  void *connect_to; // timeout of the next connect() attempt
+  unsigned int connect_tries; // connect() attempts refused with EAGAIN
+  vde_sendq sendq; // packets waiting for free slots
+  int outgoing; // nonzero if the connection manager owns the connection
+  vde_connection *conn;
+  vde_component *transport;
+} shm_conn;
+
+typedef struct {
+  struct sockaddr_un sa; // address of the listening socket
+  socklen_t sa_len;
+  int abstract; // nonzero if sa is in the abstract namespace
+  unsigned int frame_len; // largest frame sent or received by connections
+  unsigned int ring_size; // slots of each ring of outgoing connections
+  unsigned long queue_size; // max bytes queued by a connection
+  unsigned int queue_len; // max packets queued by a connection
+  unsigned int rx_budget; // max frames received at each wakeup
+  int backlog; // backlog of the listening socket
+  unsigned int handshake_timeout; // milliseconds to complete a handshake
+  int listen_fd;
+  void *listen_event;
+  vde_list *pending_conns;
+  vde_list *conns; // connections which completed the handshake
+} shm_tr;
+
+/**
+ * @brief Get the size of the memory shared by the two sides of a connection
+ *
+ * @param ring_size The slots of each ring
+ * @param frame_len The size of each buffer
+ *
+ * @return The size in bytes
+ */
+static size_t shm_region_len(unsigned int ring_size, unsigned int frame_len)
+{
+  size_t ring_len = shm_align(sizeof(shm_ring) + ring_size * sizeof(shm_desc));
+
+  return 2 * ring_len + 2 * (size_t)ring_size * shm_align(frame_len);
+}
+
+/**
+ * @brief Map the memory shared with the peer and set up the rings, the first
+ * ring carries frames from the connecting side to the listening one.
+ *
+ * @param sc The connection
+ * @param ring_size The slots of each ring
+ * @param frame_len The size of each buffer
+ * @param outgoing Nonzero on the connecting side
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int shm_conn_map(shm_conn *sc, unsigned int ring_size,
+                        unsigned int frame_len, int outgoing)
+{
+  size_t ring_len = shm_align(sizeof(shm_ring) + ring_size * sizeof(shm_desc));
+  shm_ring *rings[2];
+  char *bufs[2];
+
+  sc->region_len = shm_region_len(ring_size, frame_len);
+  sc->region = mmap(NULL, sc->region_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    sc->memfd, 0);
+  if (sc->region == MAP_FAILED) {
+    sc->region = NULL;
+    return -1;
+  }
+  sc->ring_size = ring_size;
+  sc->slot_len = shm_align(frame_len);
+
+  rings[0] = (shm_ring *)sc->region;
+  rings[1] = (shm_ring *)(sc->region + ring_len);
+  bufs[0] = sc->region + 2 * ring_len;
+  bufs[1] = bufs[0] + ring_size * sc->slot_len;
+
+  sc->tx = rings[!outgoing];
+  sc->tx_bufs = bufs[!outgoing];
+  sc->rx = rings[!!outgoing];
+  sc->rx_bufs = bufs[!!outgoing];
+  return 0;
+}
+
+/**
+ * @brief Kick an eventfd
+ *
+ * @param fd The eventfd
+ */
+static void shm_kick(int fd)
+{
+  uint64_t one = 1;
+
+  // EAGAIN means the counter is about to overflow, the peer is awake anyway
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    vde_warning("%s: cannot kick eventfd %d: %s", __PRETTY_FUNCTION__, fd,
+                strerror(errno));
+  }
+}
+
+/**
+ * @brief Wake up the peer if it's waiting on a ring we just updated
+ *
+ * @param sc The connection
+ * @param waiting The flag the peer sets before sleeping
+ */
+static void shm_conn_notify(shm_conn *sc, uint32_t *waiting)
+{
+  // order the update of the ring before the check of the flag, the peer does
+  // the opposite before sleeping
+  shm_full_barrier();
+  if (__atomic_load_n(waiting, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED)) {
+    shm_kick(sc->peer_kick_fd);
+  }
+}
+
+/**
+ * @brief Ask the peer to kick us when it updates a ring index
+ *
+ * @param waiting The flag the peer checks after updating the index
+ * @param index The index
+ * @param seen The value of the index we are waiting to change
+ *
+ * @return zero if the peer will kick us, nonzero if the index has already
+ * changed and we must not sleep
+ */
+static int shm_conn_wait(uint32_t *waiting, uint32_t *index, uint32_t seen)
+{
+  __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+  shm_full_barrier();
+  if (shm_load_acquire(index) != seen) {
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Start the handshake timer of a connection
+ *
+ * @param sc The connection
+ */
+static void shm_conn_handshake_start(shm_conn *sc)
+{
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+
+  sc->deadline = vde_clock_ns() + (uint64_t)tr->handshake_timeout * 1000000;
+}
+
+/**
+ * @brief Get the time left to a connection to complete its handshake, to be
+ * used as the timeout of the handshake events.
+ *
+ * @param sc The connection
+ * @param tv The time left, zero if the deadline has passed
+ *
+ * @return tv
+ */
+static struct timeval *shm_conn_handshake_left(shm_conn *sc,
+                                               struct timeval *tv)
+{
+  uint64_t now = vde_clock_ns();
+  uint64_t left = sc->deadline > now ? sc->deadline - now : 0;
+
+  tv->tv_sec = left / 1000000000;
+  tv->tv_usec = (left % 1000000000) / 1000;
+  return tv;
+}
+
+/**
+ * @brief Report to the connection user that the peer is gone
+ *
+ * @param sc The connection
+ * @param err The error
+ *
+ * @return Nonzero if the connection has been closed
+ */
+static int shm_conn_closed(shm_conn *sc, vde_conn_error err)
+{
+  vde_connection *conn = sc->conn;
+  vde_context *ctx = vde_connection_get_context(conn);
+
+  if (vde_connection_call_error(conn, NULL, err) && errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return 1;
+  }
+  vde_warning("%s: peer of fd %d is gone but connection not closed",
+              __PRETTY_FUNCTION__, sc->fd);
+  // the socket would stay readable and the rings are not updated anymore
+  if (sc->ev_rd != NULL) {
+    vde_context_event_del(ctx, sc->ev_rd);
+    sc->ev_rd = NULL;
+  }
+  if (sc->ev_kick != NULL) {
+    vde_context_event_del(ctx, sc->ev_kick);
+    sc->ev_kick = NULL;
+  }
+  return 0;
+}
+
+void shm_conn_ctl_event(int fd, short event_type, void *arg)
+{
+  char c;
+  shm_conn *sc = (shm_conn *)arg;
+
+  if (recv(sc->fd, &c, sizeof(c), MSG_DONTWAIT) < 0 && errno == EAGAIN) {
+    return;
+  }
+  // nothing is sent after the handshake, the peer closed the socket
+  shm_conn_closed(sc, CONN_READ_CLOSED);
+}
+
+/**
+ * @brief Copy packets into free slots of the transmit ring and kick the peer
+ * if it sleeps. A vde_sendq_send_cb.
+ *
+ * @param priv The connection
+ * @param pkts The packets, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of packets copied
+ */
+static unsigned int shm_conn_tx(void *priv, vde_pkt **pkts,
+                                unsigned int count)
+{
+  unsigned int i, used, slot, n;
+  shm_desc *desc;
+  shm_conn *sc = (shm_conn *)priv;
+  unsigned int max_payload = vde_connection_max_payload(sc->conn);
+
+  used = sc->tx_head - shm_load_acquire(&sc->tx->tail);
+  n = 0;
+  if (used < sc->ring_size) {
+    n = count < sc->ring_size - used ? count : sc->ring_size - used;
+  }
+
+  for (i = 0; i < n; i++) {
+    // oversized packets are rejected by the queue
+    if (vde_pkt_len(pkts[i]) > max_payload) {
+      errno = EMSGSIZE;
+      break;
+    }
+    slot = (sc->tx_head + i) & (sc->ring_size - 1);
+    vde_pkt_gather(pkts[i], sc->tx_bufs + slot * sc->slot_len);
+    desc = &sc->tx->desc[slot];
+    desc->len = vde_pkt_len(pkts[i]);
+    desc->type = pkts[i]->hdr->type;
+  }
+  if (i > 0) {
+    sc->tx_head += i;
+    shm_store_release(&sc->tx->head, sc->tx_head);
+    shm_conn_notify(sc, &sc->tx->consumer_waiting);
+  }
+  if (i == n && n < count) {
+    // the ring is full
+    errno = EAGAIN;
+  }
+  return i;
+}
+
+/**
+ * @brief Wait for free slots in the transmit ring, if some have been freed in
+ * the meantime kick ourselves so that the queue is flushed from the event
+ * loop. A vde_sendq_wait_cb.
+ *
+ * @param arg The connection
+ */
+static void shm_conn_tx_wait(void *arg)
+{
+  shm_conn *sc = (shm_conn *)arg;
+
+  // the ring is full as long as tail is a ring behind head
+  if (shm_conn_wait(&sc->tx->producer_waiting, &sc->tx->tail,
+                    sc->tx_head - sc->ring_size)) {
+    shm_kick(sc->kick_fd);
+  }
+}
+
+/**
+ * @brief Copy the frames of the receive ring into packets and pass them to
+ * the connection user, up to rx_budget frames.
+ *
+ * @param sc The connection
+ *
+ * @return zero if the connection is still usable, -1 if it has been closed
+ */
+static int shm_conn_rx(shm_conn *sc)
+{
+  unsigned int i, avail, chunk, slot, len, total = 0;
+  uint32_t head;
+  uint64_t now;
+  vde_pkt *pkt;
+  vde_pkt_batch batch;
+  shm_desc *desc;
+  vde_connection *conn = sc->conn;
+  unsigned int max_payload = vde_connection_max_payload(conn);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+  vde_pool *pool = vde_context_get_pool(vde_connection_get_context(conn));
+
+  while (total < tr->rx_budget) {
+    head = shm_load_acquire(&sc->rx->head);
+    avail = head - sc->rx_tail;
+    if (avail == 0) {
+      if (shm_conn_wait(&sc->rx->consumer_waiting, &sc->rx->head,
+                        sc->rx_tail)) {
+        continue;
+      }
+      return 0;
+    }
+    if (avail > sc->ring_size) {
+      vde_warning("%s: corrupted ring from fd %d", __PRETTY_FUNCTION__,
+                  sc->fd);
+      return shm_conn_closed(sc, CONN_READ_CLOSED) ? -1 : 0;
+    }
+
+    chunk = avail;
+    if (chunk > VDE_PKT_BATCH_MAX) {
+      chunk = VDE_PKT_BATCH_MAX;
+    }
+    if (chunk > tr->rx_budget - total) {
+      chunk = tr->rx_budget - total;
+    }
+
+    now = vde_clock_ns();
+    vde_pkt_batch_init(&batch);
+    for (i = 0; i < chunk; i++) {
+      slot = (sc->rx_tail + i) & (sc->ring_size - 1);
+      desc = &sc->rx->desc[slot];
+      // read once, the peer could change it under our feet
+      len = __atomic_load_n(&desc->len, __ATOMIC_RELAXED);
+      if (len < sizeof(struct eth_hdr) || len > max_payload) {
+        vde_warning("%s: invalid frame from fd %d, dropping",
+                    __PRETTY_FUNCTION__, sc->fd);
+        continue;
+      }
+      pkt = vde_pool_pkt_new(pool, max_payload,
+                             vde_connection_get_pkt_headsize(conn),
+                             vde_connection_get_pkt_tailsize(conn));
+      if (pkt == NULL) {
+        vde_warning("%s: cannot allocate packet, dropping: %s",
+                    __PRETTY_FUNCTION__, strerror(errno));
+        continue;
+      }
+      memcpy(pkt->payload, sc->rx_bufs + slot * sc->slot_len, len);
+      pkt->hdr->version = VDE_HDR_VERSION;
+      pkt->hdr->type = desc->type;
+      pkt->hdr->pkt_len = len;
+      vde_pkt_meta_rx(pkt, vde_connection_get_id(conn), now);
+      vde_pkt_batch_add(&batch, pkt);
+    }
+    total += chunk;
+
+    // the frames have been copied, give the slots back to the peer
+    sc->rx_tail += chunk;
+    shm_store_release(&sc->rx->tail, sc->rx_tail);
+    shm_conn_notify(sc, &sc->rx->producer_waiting);
+
+    if (batch.count > 0 && vde_connection_call_read_batch(conn, &batch) &&
+        errno == EPIPE) {
+      vde_pkt_batch_put(&batch);
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+      return -1;
+    }
+    vde_pkt_batch_put(&batch);
+  }
+
+  // budget exhausted, keep polling the ring from the event loop
+  shm_kick(sc->kick_fd);
+  return 0;
+}
+
+void shm_conn_kick_event(int fd, short event_type, void *arg)
+{
+  uint64_t count;
+  shm_conn *sc = (shm_conn *)arg;
+  vde_connection *conn = sc->conn;
+
+  // reset the counter, kicks from now on trigger the event again
+  if (read(sc->kick_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    vde_warning("%s: error reading eventfd %d: %s", __PRETTY_FUNCTION__,
+                sc->kick_fd, strerror(errno));
+  }
+
+  if (vde_sendq_flush(&sc->sendq)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  if (!vde_sendq_is_empty(&sc->sendq)) {
+    shm_conn_tx_wait(sc);
+  }
+  shm_conn_rx(sc);
+}
+
+int shm_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  shm_conn *sc = vde_connection_get_priv(conn);
+
+  return vde_sendq_write(&sc->sendq, pkt);
+}
+
+unsigned int shm_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  shm_conn *sc = vde_connection_get_priv(conn);
+
+  return vde_sendq_write_batch(&sc->sendq, batch);
+}
+
+void shm_conn_close(vde_connection *conn)
+{
+  shm_conn *sc = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+
+  if (sc->ev_rd != NULL) {
+    vde_context_event_del(ctx, sc->ev_rd);
+  }
+  if (sc->ev_kick != NULL) {
+    vde_context_event_del(ctx, sc->ev_kick);
+  }
+  if (sc->connect_to != NULL) {
+    vde_context_timeout_del(ctx, sc->connect_to);
+  }
+  if (sc->fd >= 0) {
+    close(sc->fd);
+  }
+  if (sc->memfd >= 0) {
+    close(sc->memfd);
+  }
+  if (sc->kick_fd >= 0) {
+    close(sc->kick_fd);
+  }
+  if (sc->peer_kick_fd >= 0) {
+    close(sc->peer_kick_fd);
+  }
+  if (sc->region != NULL) {
+    munmap(sc->region, sc->region_len);
+  }
+  vde_sendq_fini(&sc->sendq);
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sc);
+  tr->conns = vde_list_remove(tr->conns, sc);
+
+  vde_free(sc);
+}
+
+/**
+ * @brief Allocate the backend of a connection and initialize the connection
+ *
+ * @param component The transport
+ * @param conn The connection
+ * @param fd The control socket of the connection, -1 if not created yet
+ *
+ * @return The backend, NULL on error (and errno is set appropriately)
+ */
+static shm_conn *shm_conn_new(vde_component *component, vde_connection *conn,
+                              int fd)
+{
+  shm_conn *sc;
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(component);
+
+  sc = (shm_conn *)vde_calloc(sizeof(shm_conn));
+  if (!sc) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  sc->fd = fd;
+  sc->memfd = -1;
+  sc->kick_fd = -1;
+  sc->peer_kick_fd = -1;
+  sc->conn = conn;
+  sc->transport = component;
+  shm_conn_handshake_start(sc);
+
+  vde_connection_init(conn, vde_component_get_context(component),
+                      tr->frame_len, &shm_conn_write, &shm_conn_close,
+                      (void *)sc);
+  vde_connection_set_be_write_batch(conn, &shm_conn_write_batch);
+  vde_connection_set_queue_properties(conn, tr->queue_size, tr->queue_len);
+  // the wait for free slots is not bound to a timeout, tries are not counted
+  vde_sendq_init(&sc->sendq, conn, &shm_conn_tx, &shm_conn_tx_wait,
+                 (void *)sc, 0);
+
+  // XXX: check error on list
+  tr->pending_conns = vde_list_prepend(tr->pending_conns, sc);
+  return sc;
+}
+
+/**
+ * @brief Move a connection which completed the handshake to the data path
+ *
+ * @param sc The connection
+ * @param frame_len The frame size agreed with the peer
+ */
+static void shm_conn_established(shm_conn *sc, unsigned int frame_len)
+{
+  vde_context *ctx = vde_component_get_context(sc->transport);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+
+  vde_connection_set_max_payload(sc->conn, frame_len);
+  tr->pending_conns = vde_list_remove(tr->pending_conns, sc);
+  tr->conns = vde_list_prepend(tr->conns, sc);
+
+  // XXX: check events NULL
+  sc->ev_rd = vde_context_event_add(ctx, sc->fd, VDE_EV_READ|VDE_EV_PERSIST,
+                                    NULL, &shm_conn_ctl_event, (void *)sc);
+  sc->ev_kick = vde_context_event_add(ctx, sc->kick_fd,
+                                      VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                      &shm_conn_kick_event, (void *)sc);
+}
+
+/**
+ * @brief Send the reply to a hello
+ *
+ * @param sc The connection
+ * @param status Zero if the connection is accepted, an errno value otherwise
+ * @param frame_len The agreed frame size
+ *
+ * @return zero on success, -1 on error
+ */
+static int shm_srv_send_reply(shm_conn *sc, int status, unsigned int frame_len)
+{
+  shm_hello reply;
+
+  memset(&reply, 0, sizeof(reply));
+  reply.magic = HELLO_MAGIC;
+  reply.version = HELLO_VERSION;
+  reply.status = status;
+  reply.ring_size = sc->ring_size;
+  reply.frame_len = frame_len;
+
+  // the socket is empty, the reply fits in its buffer
+  if (send(sc->fd, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) !=
+      sizeof(reply)) {
+    vde_error("%s: cannot reply to peer: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Take the descriptors passed along with the hello, descriptors in
+ * excess are closed.
+ *
+ * @param sc The connection
+ * @param msg The message of the hello
+ *
+ * @return The number of descriptors received
+ */
+static int shm_srv_get_fds(shm_conn *sc, struct msghdr *msg)
+{
+  int i, nfds, count = 0;
+  int fds[HELLO_FDS];
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (i = 0; i < nfds; i++) {
+      if (count < HELLO_FDS) {
+        memcpy(&fds[count++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      } else {
+        close(*(int *)(CMSG_DATA(cmsg) + i * sizeof(int)));
+        count++;
+      }
+    }
+  }
+  if (count != HELLO_FDS) {
+    for (i = 0; i < count && i < HELLO_FDS; i++) {
+      close(fds[i]);
+    }
+    return count;
+  }
+  sc->memfd = fds[0];
+  sc->kick_fd = fds[1];
+  sc->peer_kick_fd = fds[2];
+  return count;
+}
+
+/**
+ * @brief Check that the memory passed by the peer can be mapped safely: it
+ * must be large enough and sealed against shrinking, or the peer could make
+ * us fault while accessing it.
+ *
+ * @param memfd The memfd
+ * @param len The size of the memory to map
+ *
+ * @return Nonzero if the memory is valid
+ */
+static int shm_srv_memfd_is_valid(int memfd, size_t len)
+{
+  struct stat st;
+  int seals;
+
+  if (fstat(memfd, &st) < 0 || !S_ISREG(st.st_mode) ||
+      (size_t)st.st_size < len) {
+    return 0;
+  }
+  seals = fcntl(memfd, F_GET_SEALS);
+  return seals >= 0 && (seals & F_SEAL_SHRINK);
+}
+
+void shm_srv_get_hello(int fd, short event_type, void *arg)
+{
+  int len, nfds;
+  unsigned int frame_len;
+  struct timeval left;
+  char buf[HELLO_LEN + 1];
+  char cbuf[CMSG_SPACE(HELLO_FDS * sizeof(int))];
+  struct iovec iov;
+  struct msghdr msg;
+  shm_hello *hello = (shm_hello *)buf;
+  shm_conn *sc = (shm_conn *)arg;
+  vde_connection *conn = sc->conn;
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+  vde_context *ctx = vde_component_get_context(sc->transport);
+
+  vde_context_event_del(ctx, sc->ev_rd);
+  sc->ev_rd = NULL;
+
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_warning("%s: handshake timed out on fd %d", __PRETTY_FUNCTION__,
+                sc->fd);
+    goto error;
+  }
+
+  iov.iov_base = buf;
+  iov.iov_len = HELLO_LEN;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  len = recvmsg(sc->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (len < 0 && errno == EAGAIN) {
+    // spurious wakeup, wait for the hello again
+    sc->ev_rd = vde_context_event_add(ctx, sc->fd, VDE_EV_READ,
+                                      shm_conn_handshake_left(sc, &left),
+                                      &shm_srv_get_hello, (void *)sc);
+    return;
+  }
+  nfds = len < 0 ? 0 : shm_srv_get_fds(sc, &msg);
+  if (len < (int)sizeof(shm_hello) || hello->magic != HELLO_MAGIC ||
+      hello->version != HELLO_VERSION) {
+    vde_error("%s: received an invalid hello", __PRETTY_FUNCTION__);
+    goto error;
+  }
+  buf[len] = 0;
+  // XXX: add the description and the peer credentials to conn.attributes
+
+  if (nfds != HELLO_FDS || (msg.msg_flags & MSG_CTRUNC)) {
+    vde_error("%s: peer passed %d descriptors instead of %d",
+              __PRETTY_FUNCTION__, nfds, HELLO_FDS);
+    shm_srv_send_reply(sc, EINVAL, 0);
+    goto error;
+  }
+  if (hello->ring_size < 2 || hello->ring_size > RING_SIZE_MAX ||
+      (hello->ring_size & (hello->ring_size - 1)) ||
+      hello->frame_len > ETH_MAX_FRAME_LEN) {
+    vde_error("%s: invalid ring geometry from peer", __PRETTY_FUNCTION__);
+    shm_srv_send_reply(sc, EINVAL, 0);
+    goto error;
+  }
+  frame_len = hello->frame_len < tr->frame_len ? hello->frame_len :
+                                                 tr->frame_len;
+  if (frame_len < ETH_FRAME_LEN(ETH_MIN_MTU)) {
+    vde_error("%s: peer frame size %u is too small", __PRETTY_FUNCTION__,
+              hello->frame_len);
+    shm_srv_send_reply(sc, EMSGSIZE, frame_len);
+    goto error;
+  }
+  if (!shm_srv_memfd_is_valid(sc->memfd,
+                              shm_region_len(hello->ring_size,
+                                             hello->frame_len))) {
+    vde_error("%s: invalid shared memory from peer", __PRETTY_FUNCTION__);
+    shm_srv_send_reply(sc, EINVAL, 0);
+    goto error;
+  }
+  // the eventfds are read and written from the event loop
+  if (fcntl(sc->kick_fd, F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(sc->peer_kick_fd, F_SETFL, O_NONBLOCK) < 0 ||
+      shm_conn_map(sc, hello->ring_size, hello->frame_len, 0)) {
+    vde_error("%s: cannot map shared memory: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    shm_srv_send_reply(sc, ENOMEM, 0);
+    goto error;
+  }
+  close(sc->memfd);
+  sc->memfd = -1;
+
+  if (shm_srv_send_reply(sc, 0, frame_len)) {
+    goto error;
+  }
+
+  shm_conn_established(sc, frame_len);
+  vde_transport_call_cm_accept_cb(sc->transport, conn);
+  return;
+
+error:
+  // XXX: call connection manager error callback here?
+  vde_connection_fini(conn);
+  vde_connection_delete(conn);
+}
+
+/*
+ * When many peers connect at once the backlog is drained at each event, up to
+ * ACCEPT_BUDGET connections so that established connections are served in the
+ * meantime.
+ */
+void shm_accept(int listen_fd, short event_type, void *arg)
+{
+  int new;
+  unsigned int burst = 0;
+  struct timeval left;
+  vde_connection *conn;
+  shm_conn *sc;
+  vde_component *component = (vde_component *)arg;
+  vde_context *ctx = vde_component_get_context(component);
+
+  while (burst < ACCEPT_BUDGET) {
+    new = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
+      }
+      break;
+    }
+    burst++;
+
+    if (vde_connection_new(&conn)) {
+      vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
+      close(new);
+      continue;
+    }
+    sc = shm_conn_new(component, conn, new);
+    if (sc == NULL) {
+      vde_connection_delete(conn);
+      close(new);
+      continue;
+    }
+
+    // XXX: check event NULL
+    sc->ev_rd = vde_context_event_add(ctx, sc->fd, VDE_EV_READ,
+                                      shm_conn_handshake_left(sc, &left),
+                                      &shm_srv_get_hello, (void *)sc);
+  }
+}
+
+int shm_listen(vde_component *component)
+{
+  vde_context *ctx = vde_component_get_context(component);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(component);
+
+  tr->listen_fd = vde_sock_listen((struct sockaddr *)&tr->sa, tr->sa_len,
+                                  SOCK_SEQPACKET, tr->backlog);
+  if (tr->listen_fd < 0) {
+    return -1;
+  }
+
+  // XXX: check event not NULL
+  tr->listen_event = vde_context_event_add(ctx, tr->listen_fd,
+                                           VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                           &shm_accept, (void *)component);
+  return 0;
+}
+
+/**
+ * @brief Abort the handshake of an outgoing connection and report the error to
+ * the connection manager, which deletes the connection.
+ *
+ * @param sc The connection
+ * @param tr_errno The error
+ */
+static void shm_cli_error(shm_conn *sc, int tr_errno)
+{
+  vde_connection *conn = sc->conn;
+  vde_component *transport = sc->transport;
+
+  vde_connection_fini(conn);
+  vde_transport_call_cm_error_cb(transport, conn, tr_errno);
+}
+
+void shm_cli_get_reply(int fd, short event_type, void *arg)
+{
+  int len;
+  struct timeval left;
+  shm_hello reply;
+  shm_conn *sc = (shm_conn *)arg;
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+  vde_context *ctx = vde_component_get_context(sc->transport);
+
+  vde_context_event_del(ctx, sc->ev_rd);
+  sc->ev_rd = NULL;
+
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_error("%s: no reply from peer", __PRETTY_FUNCTION__);
+    shm_cli_error(sc, ETIMEDOUT);
+    return;
+  }
+
+  len = recv(sc->fd, &reply, sizeof(reply), MSG_DONTWAIT);
+  if (len < 0 && errno == EAGAIN) {
+    sc->ev_rd = vde_context_event_add(ctx, sc->fd, VDE_EV_READ,
+                                      shm_conn_handshake_left(sc, &left),
+                                      &shm_cli_get_reply, (void *)sc);
+    return;
+  }
+  if (len != sizeof(reply) || reply.magic != HELLO_MAGIC ||
+      reply.version != HELLO_VERSION) {
+    vde_error("%s: invalid reply from peer: %s", __PRETTY_FUNCTION__,
+              len < 0 ? strerror(errno) : "bad message");
+    shm_cli_error(sc, len < 0 ? errno : ECONNREFUSED);
+    return;
+  }
+  if (reply.status != 0) {
+    vde_error("%s: refused by peer: %s", __PRETTY_FUNCTION__,
+              strerror(reply.status));
+    shm_cli_error(sc, reply.status);
+    return;
+  }
+  if (reply.frame_len > tr->frame_len ||
+      reply.frame_len < ETH_FRAME_LEN(ETH_MIN_MTU)) {
+    vde_error("%s: invalid frame size %u from peer", __PRETTY_FUNCTION__,
+              reply.frame_len);
+    shm_cli_error(sc, EMSGSIZE);
+    return;
+  }
+
+  shm_conn_established(sc, reply.frame_len);
+  vde_transport_call_cm_connect_cb(sc->transport, sc->conn);
+}
+
+/**
+ * @brief Create the memory and the eventfds of an outgoing connection. The
+ * memory is sealed so that the peer can map it safely.
+ *
+ * @param sc The connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int shm_cli_setup(shm_conn *sc)
+{
+  int tmp_errno;
+  size_t len;
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+
+  len = shm_region_len(tr->ring_size, tr->frame_len);
+  sc->memfd = memfd_create("vde3-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (sc->memfd < 0 || ftruncate(sc->memfd, len) < 0 ||
+      fcntl(sc->memfd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create shared memory: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    errno = tmp_errno;
+    return -1;
+  }
+  sc->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  sc->peer_kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (sc->kick_fd < 0 || sc->peer_kick_fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create eventfd: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    errno = tmp_errno;
+    return -1;
+  }
+  if (shm_conn_map(sc, tr->ring_size, tr->frame_len, 1)) {
+    tmp_errno = errno;
+    vde_error("%s: cannot map shared memory: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    errno = tmp_errno;
+    return -1;
+  }
+
+  // both sides sleep until the first frame
+  sc->tx->consumer_waiting = 1;
+  sc->rx->consumer_waiting = 1;
+  return 0;
+}
+
+/**
+ * @brief Send the hello of an outgoing connection along with the memory and
+ * the eventfds.
+ *
+ * @param sc The connection, its socket connected
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int shm_cli_send_hello(shm_conn *sc)
+{
+  int len, tmp_errno;
+  int fds[HELLO_FDS];
+  struct timeval left;
+  char buf[HELLO_LEN];
+  char cbuf[CMSG_SPACE(HELLO_FDS * sizeof(int))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  shm_hello *hello = (shm_hello *)buf;
+  vde_context *ctx = vde_component_get_context(sc->transport);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+
+  memset(buf, 0, sizeof(buf));
+  hello->magic = HELLO_MAGIC;
+  hello->version = HELLO_VERSION;
+  hello->ring_size = tr->ring_size;
+  hello->frame_len = tr->frame_len;
+  snprintf(hello->description, HELLO_LEN - sizeof(shm_hello), "vde3 %s",
+           vde_component_get_name(sc->transport));
+  len = sizeof(shm_hello) + strlen(hello->description) + 1;
+
+  // the peer kicks the first eventfd and waits on the second one
+  fds[0] = sc->memfd;
+  fds[1] = sc->peer_kick_fd;
+  fds[2] = sc->kick_fd;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  memset(cbuf, 0, sizeof(cbuf));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(sc->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+    tmp_errno = errno;
+    vde_error("%s: cannot send hello: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    errno = tmp_errno;
+    return -1;
+  }
+  // the memory stays mapped
+  close(sc->memfd);
+  sc->memfd = -1;
+
+  // XXX: check event NULL
+  sc->ev_rd = vde_context_event_add(ctx, sc->fd, VDE_EV_READ,
+                                    shm_conn_handshake_left(sc, &left),
+                                    &shm_cli_get_reply, (void *)sc);
+  return 0;
+}
+
+void shm_cli_connect_retry(int fd, short event_type, void *arg);
+
+/**
+ * @brief Connect the socket of an outgoing connection and send the hello.
+ * Unix sockets connect right away, unless the backlog of the listener is full.
+ *
+ * @param sc The connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int shm_cli_connect(shm_conn *sc)
+{
+  int ret;
+  vde_context *ctx = vde_component_get_context(sc->transport);
+  shm_tr *tr = (shm_tr *)vde_component_get_priv(sc->transport);
+
+  ret = vde_sock_connect(ctx, sc->fd, (struct sockaddr *)&tr->sa, tr->sa_len,
+                         &sc->connect_tries, &sc->connect_to,
+                         &shm_cli_connect_retry, (void *)sc);
+  if (ret <= 0) {
+    return ret;
+  }
+  return shm_cli_send_hello(sc);
+}
+
+void shm_cli_connect_retry(int fd, short event_type, void *arg)
+{
+  shm_conn *sc = (shm_conn *)arg;
+  vde_context *ctx = vde_component_get_context(sc->transport);
+
+  vde_context_timeout_del(ctx, sc->connect_to);
+  sc->connect_to = NULL;
+  if (shm_cli_connect(sc)) {
+    shm_cli_error(sc, errno);
+  }
+}
+
+int shm_connect(vde_component *component, vde_connection *conn)
+{
+  int tmp_errno;
+  shm_conn *sc;
+
+  sc = shm_conn_new(component, conn, -1);
+  if (sc == NULL) {
+    return -1;
+  }
+  sc->outgoing = 1;
+
+  sc->fd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sc->fd < 0) {
+    vde_error("%s: cannot create socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (shm_cli_setup(sc) || shm_cli_connect(sc)) {
+    goto error;
+  }
+  return 0;
+
+error:
+  tmp_errno = errno;
+  // the connection manager owns the connection and deletes it
+  vde_connection_fini(conn);
+  errno = tmp_errno;
+  return -1;
+}
+
+static int transport_shm_init(vde_component *component, vde_sobj *params)
+{
+  shm_tr *tr;
+  vde_sobj *path_sobj;
+  const char *path;
+  int mtu = ETH_DATA_LEN;
+  int ring_size = RING_SIZE;
+  int queue_size = VDE_CONNECTION_QUEUE_MAXBYTES;
+  int queue_len = VDE_CONNECTION_QUEUE_MAXLEN;
+  int rx_budget = RX_BUDGET;
+  int backlog = LISTEN_QUEUE;
+  int handshake_timeout = HANDSHAKE_TIMEOUT;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  path_sobj = vde_sobj_hash_lookup(params, "path");
+  if (!path_sobj || !vde_sobj_is_type(path_sobj, vde_sobj_type_string)) {
+    vde_error("%s: no socket path received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  path = vde_sobj_get_string(path_sobj);
+  if (strlen(path) < 2 || strlen(path) >= UNIX_PATH_MAX) {
+    vde_error("%s: invalid socket path", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (vde_params_get_int(params, "mtu", ETH_MIN_MTU, ETH_MAX_MTU, &mtu) ||
+      vde_params_get_int(params, "ring_size", 2, RING_SIZE_MAX, &ring_size) ||
+      vde_params_get_int(params, "queue_size", 0, INT_MAX, &queue_size) ||
+      vde_params_get_int(params, "queue_len", 1, INT_MAX, &queue_len) ||
+      vde_params_get_int(params, "rx_budget", 1, INT_MAX, &rx_budget) ||
+      vde_params_get_int(params, "backlog", 1, INT_MAX, &backlog) ||
+      vde_params_get_int(params, "handshake_timeout", 1, INT_MAX,
+                         &handshake_timeout)) {
+    return -1;
+  }
+  if (ring_size & (ring_size - 1)) {
+    vde_error("%s: ring_size must be a power of two", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  tr = (shm_tr *)vde_calloc(sizeof(shm_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  tr->sa.sun_family = AF_UNIX;
+  if (path[0] == '@') {
+    // abstract namespace, the name is not NUL terminated
+    tr->abstract = 1;
+    memcpy(tr->sa.sun_path + 1, path + 1, strlen(path) - 1);
+    tr->sa_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+  } else {
+    // XXX: path needs to be normalized/checked somewhere
+    strcpy(tr->sa.sun_path, path);
+    tr->sa_len = sizeof(tr->sa);
+  }
+  tr->frame_len = ETH_FRAME_LEN(mtu);
+  tr->ring_size = ring_size;
+  tr->queue_size = queue_size;
+  tr->queue_len = queue_len;
+  tr->rx_budget = rx_budget;
+  tr->backlog = backlog;
+  tr->handshake_timeout = handshake_timeout;
+  tr->listen_fd = -1;
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_shm_fini(vde_component *component)
+{
+  shm_tr *tr;
+  shm_conn *sc;
+  vde_connection *conn;
+
+  vde_assert(component != NULL);
+
+  tr = (shm_tr *)vde_component_get_priv(component);
+  if (tr->listen_fd >= 0) {
+    vde_context_event_del(vde_component_get_context(component),
+                          tr->listen_event);
+    close(tr->listen_fd);
+    if (!tr->abstract) {
+      unlink(tr->sa.sun_path);
+    }
+  }
+  // closing a connection removes it from its list
+  while (tr->pending_conns != NULL) {
+    sc = vde_list_get_data(vde_list_first(tr->pending_conns));
+    if (sc->outgoing) {
+      shm_cli_error(sc, ECONNABORTED);
+    } else {
+      conn = sc->conn; // closing the connection frees sc
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+    }
+  }
+  while (tr->conns != NULL) {
+    sc = vde_list_get_data(vde_list_first(tr->conns));
+    vde_transport_conn_gone(sc->conn);
+  }
+  vde_free(tr);
+}
+
+component_ops transport_shm_component_ops = {
+  .init = transport_shm_init,
+  .fini = transport_shm_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "shm",
+  .cops = &transport_shm_component_ops,
+  .tr_listen = &shm_listen,
+  .tr_connect = &shm_connect,
+};
@@ -0,0 +1,972 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Stream transport: each port is a TCP or unix stream connection carrying
+ * frames prefixed by their length as a 32 bit big endian integer, the framing
+ * of QEMU socket and stream netdevs. There is no handshake, both sides must
+ * agree on the mtu.
+ *
+ * The socket is read in large chunks which are split in frames, and the
+ * queued frames are written with a single gather write. Frames can be held
+ * for a while (cork_usec) so that the batches of several events leave
+ * together.
+ */
+
+#include <unistd.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/transport_common.h>
+
+// default backlog of the listening socket
+#define LISTEN_QUEUE 128
+
+// max connections accepted at each event of the listening socket
+#define ACCEPT_BUDGET 64
+
+// default time given to a connect() to complete, in milliseconds
+#define CONNECT_TIMEOUT 5000
+
+// size of sockaddr_un.sun_path
+#define UNIX_PATH_MAX 108
+
+// length of the prefix of each frame
+#define PREFIX_LEN 4
+
+// max number of segments of a chained packet sent without linearizing it
+#define SEND_IOV_MAX 16
+
+// bytes read at once, besides room for a frame left over from the last read
+#define RX_CHUNK 65536
+
+// default max number of frames received at each read event
+#define RX_BUDGET 256
+
+// default bytes queued which end a cork
+#define CORK_BYTES 65536
+
+typedef struct {
+  int fd;
+  void *ev_rd;
+  void *ev_wr; // connect event until the connection is established
+  void *cork_to; // timeout ending the cork
+  void *connect_to; // timeout of the next connect() attempt
+  unsigned int connect_tries; // connect() attempts refused with EAGAIN
+  int established; // nonzero once passed to the connection manager
+  vde_sendq sendq; // packets waiting to be sent
+  unsigned int tx_off; // bytes already sent of the frame at the queue tail
+  char *rx_buf;
+  unsigned int rx_len; // bytes in rx_buf not split in frames yet
+  vde_connection *conn;
+  vde_component *transport;
+} st_conn;
+
+typedef struct {
+  struct sockaddr_storage sa; // address to listen on or to connect to
+  socklen_t sa_len;
+  int abstract; // nonzero if sa is a unix socket in the abstract namespace
+  int nodelay; // nonzero to set TCP_NODELAY
+  unsigned int frame_len; // largest frame sent or received by connections
+  unsigned long queue_size; // max bytes queued by a connection
+  unsigned int queue_len; // max packets queued by a connection
+  unsigned int rx_budget; // max frames received at each read event
+  unsigned int cork_usec; // max time frames are held before writing them
+  unsigned int cork_bytes; // bytes queued which end a cork
+  int backlog; // backlog of the listening socket
+  unsigned int connect_timeout; // milliseconds to complete a connect()
+  int listen_fd;
+  void *listen_event;
+  vde_list *conns;
+} st_tr;
+
+static unsigned int st_rx_size(st_tr *tr)
+{
+  return RX_CHUNK + PREFIX_LEN + tr->frame_len;
+}
+
+/**
+ * @brief Report to the connection user that the peer is gone
+ *
+ * @param sp The connection
+ * @param err The error
+ *
+ * @return Nonzero if the connection has been closed
+ */
+static int st_conn_closed(st_conn *sp, vde_conn_error err)
+{
+  vde_connection *conn = sp->conn;
+  vde_context *ctx = vde_connection_get_context(conn);
+
+  if (vde_connection_call_error(conn, NULL, err) && errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return 1;
+  }
+  vde_warning("%s: peer of fd %d is gone but connection not closed",
+              __PRETTY_FUNCTION__, sp->fd);
+  // the socket would stay ready, stop listening to it
+  if (sp->ev_rd != NULL) {
+    vde_context_event_del(ctx, sp->ev_rd);
+    sp->ev_rd = NULL;
+  }
+  if (sp->ev_wr != NULL) {
+    vde_context_event_del(ctx, sp->ev_wr);
+    sp->ev_wr = NULL;
+  }
+  return 0;
+}
+
+/**
+ * @brief Hand frames to the connection user
+ *
+ * @param sp The connection
+ * @param frames The frames, the batch is emptied
+ *
+ * @return Nonzero if the connection has been closed
+ */
+static int st_conn_deliver(st_conn *sp, vde_pkt_batch *frames)
+{
+  int cb_errno = 0;
+  vde_connection *conn = sp->conn;
+
+  if (frames->count > 0 && vde_connection_call_read_batch(conn, frames)) {
+    cb_errno = errno;
+  }
+  vde_pkt_batch_put(frames);
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Split the data read in frames and hand them over, a partial frame
+ * is moved at the start of the buffer.
+ *
+ * @param sp The connection
+ * @param total The number of frames received, updated
+ *
+ * @return zero on success, 1 if the connection has been closed, -1 if the
+ * stream is corrupted
+ */
+static int st_conn_split(st_conn *sp, unsigned int *total)
+{
+  vde_pkt *pkt;
+  vde_pkt_batch frames;
+  uint32_t prefix;
+  unsigned int len, off = 0;
+  uint64_t now = vde_clock_ns();
+  vde_connection *conn = sp->conn;
+  vde_pool *pool = vde_context_get_pool(vde_connection_get_context(conn));
+
+  vde_pkt_batch_init(&frames);
+  while (sp->rx_len - off >= PREFIX_LEN) {
+    memcpy(&prefix, sp->rx_buf + off, PREFIX_LEN);
+    len = ntohl(prefix);
+    // as QEMU does, the stream can't be resynchronized after a bogus length
+    if (len > vde_connection_max_payload(conn)) {
+      vde_warning("%s: frame of %u bytes from fd %d larger than mtu",
+                  __PRETTY_FUNCTION__, len, sp->fd);
+      return st_conn_deliver(sp, &frames) ? 1 : -1;
+    }
+    if (sp->rx_len - off - PREFIX_LEN < len) {
+      break;
+    }
+    off += PREFIX_LEN;
+
+    if (len < sizeof(struct eth_hdr)) {
+      vde_warning("%s: short frame from fd %d, dropping", __PRETTY_FUNCTION__,
+                  sp->fd);
+      off += len;
+      continue;
+    }
+    pkt = vde_pool_pkt_new(pool, len, vde_connection_get_pkt_headsize(conn),
+                           vde_connection_get_pkt_tailsize(conn));
+    if (pkt == NULL) {
+      vde_warning("%s: cannot allocate packet, dropping: %s",
+                  __PRETTY_FUNCTION__, strerror(errno));
+      off += len;
+      continue;
+    }
+    memcpy(pkt->payload, sp->rx_buf + off, len);
+    pkt->hdr->pkt_len = len;
+    off += len;
+    (*total)++;
+
+    vde_pkt_meta_rx(pkt, vde_connection_get_id(conn), now);
+    vde_pkt_batch_add(&frames, pkt);
+    if (vde_pkt_batch_is_full(&frames) && st_conn_deliver(sp, &frames)) {
+      return 1;
+    }
+  }
+
+  sp->rx_len -= off;
+  memmove(sp->rx_buf, sp->rx_buf + off, sp->rx_len);
+  return st_conn_deliver(sp, &frames);
+}
+
+void st_conn_read_event(int fd, short event_type, void *arg)
+{
+  int len, ret, eof = 0;
+  unsigned int room, total = 0;
+  st_conn *sp = (st_conn *)arg;
+  st_tr *tr = (st_tr *)vde_component_get_priv(sp->transport);
+  unsigned int size = st_rx_size(tr);
+
+  while (total < tr->rx_budget) {
+    room = size - sp->rx_len;
+    len = recv(sp->fd, sp->rx_buf + sp->rx_len, room, MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        vde_warning("%s: error reading from fd %d: %s", __PRETTY_FUNCTION__,
+                    sp->fd, strerror(errno));
+        eof = 1;
+      }
+      break;
+    }
+    if (len == 0) {
+      eof = 1;
+      break;
+    }
+    sp->rx_len += len;
+
+    ret = st_conn_split(sp, &total);
+    if (ret > 0) {
+      return;
+    }
+    if (ret < 0) {
+      eof = 1;
+      break;
+    }
+    if (len < room) {
+      break; // the socket is empty
+    }
+  }
+
+  if (eof) {
+    st_conn_closed(sp, CONN_READ_CLOSED);
+  }
+}
+
+/**
+ * @brief Write frames with a single sendmsg(), chained packets are written
+ * without copying them. A vde_sendq_send_cb.
+ *
+ * @param priv The connection
+ * @param pkts The packets to send, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of frames written entirely
+ */
+static unsigned int st_conn_send(void *priv, vde_pkt **pkts,
+                                 unsigned int count)
+{
+  unsigned int i, n, niov = 0, first = 0;
+  ssize_t written;
+  int iovcnt;
+  size_t skip, flen;
+  uint32_t prefixes[VDE_PKT_BATCH_MAX];
+  struct iovec iov[VDE_PKT_BATCH_MAX * (SEND_IOV_MAX + 1)];
+  struct msghdr msg;
+  st_conn *sp = (st_conn *)priv;
+
+  for (n = 0; n < count; n++) {
+    iovcnt = vde_pkt_to_iovec(pkts[n], &iov[niov + 1], SEND_IOV_MAX);
+    if (iovcnt < 0) {
+      break;
+    }
+    prefixes[n] = htonl(vde_pkt_len(pkts[n]));
+    iov[niov].iov_base = &prefixes[n];
+    iov[niov].iov_len = PREFIX_LEN;
+    niov += iovcnt + 1;
+  }
+  if (n == 0) {
+    // too many segments, the queue sends a linear copy
+    errno = EMSGSIZE;
+    return 0;
+  }
+
+  // skip what has been sent of the first frame
+  for (skip = sp->tx_off; skip > 0; first++) {
+    if (skip < iov[first].iov_len) {
+      iov[first].iov_base = (char *)iov[first].iov_base + skip;
+      iov[first].iov_len -= skip;
+      break;
+    }
+    skip -= iov[first].iov_len;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov[first];
+  msg.msg_iovlen = niov - first;
+  written = sendmsg(sp->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (written < 0) {
+    if (errno == EAGAIN && sp->tx_off > 0) {
+      errno = EINPROGRESS;
+    }
+    return 0;
+  }
+
+  // count the frames completed, from the start of the first one
+  written += sp->tx_off;
+  for (i = 0; i < n; i++) {
+    flen = PREFIX_LEN + vde_pkt_len(pkts[i]);
+    if (written < flen) {
+      break;
+    }
+    written -= flen;
+  }
+  sp->tx_off = written;
+
+  if (i < n) {
+    // a frame partly written is never dropped, the stream would be broken
+    errno = sp->tx_off > 0 ? EINPROGRESS : EAGAIN;
+  } else if (n < count) {
+    errno = EMSGSIZE;
+  }
+  return i;
+}
+
+void st_conn_write_event(int fd, short event_type, void *arg)
+{
+  st_conn *sp = (st_conn *)arg;
+  vde_connection *conn = sp->conn;
+
+  if (vde_sendq_flush(&sp->sendq)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  if (vde_sendq_is_empty(&sp->sendq)) {
+    vde_context_event_del(vde_connection_get_context(conn), sp->ev_wr);
+    sp->ev_wr = NULL;
+  }
+}
+
+static void st_conn_write_event_start(st_conn *sp)
+{
+  vde_connection *conn = sp->conn;
+
+  if (sp->ev_wr == NULL) {
+    sp->ev_wr = vde_context_event_add(vde_connection_get_context(conn),
+                                      sp->fd, VDE_EV_WRITE|VDE_EV_PERSIST,
+                                      vde_connection_get_send_maxtimeout(conn),
+                                      &st_conn_write_event, (void *)sp);
+  }
+}
+
+void st_conn_cork_timeout(int fd, short event_type, void *arg)
+{
+  st_conn *sp = (st_conn *)arg;
+
+  vde_context_timeout_del(vde_connection_get_context(sp->conn), sp->cork_to);
+  sp->cork_to = NULL;
+  // the write event counts send attempts only while the socket is full
+  st_conn_write_event_start(sp);
+}
+
+/**
+ * @brief Write the queue from the event loop, once the cork ends if the
+ * connection is corked. A vde_sendq_wait_cb.
+ *
+ * @param arg The connection
+ */
+static void st_conn_wait(void *arg)
+{
+  struct timeval cork;
+  st_conn *sp = (st_conn *)arg;
+  st_tr *tr = (st_tr *)vde_component_get_priv(sp->transport);
+  vde_connection *conn = sp->conn;
+
+  if (sp->ev_wr != NULL) {
+    return;
+  }
+  if (tr->cork_usec > 0 &&
+      vde_connection_get_queue_bytes(conn) < tr->cork_bytes) {
+    if (sp->cork_to == NULL) {
+      cork.tv_sec = tr->cork_usec / 1000000;
+      cork.tv_usec = tr->cork_usec % 1000000;
+      // XXX: check timeout NULL
+      sp->cork_to = vde_context_timeout_add(vde_connection_get_context(conn),
+                                            VDE_EV_TIMEOUT, &cork,
+                                            &st_conn_cork_timeout,
+                                            (void *)sp);
+    }
+    return;
+  }
+  if (sp->cork_to != NULL) {
+    vde_context_timeout_del(vde_connection_get_context(conn), sp->cork_to);
+    sp->cork_to = NULL;
+  }
+  st_conn_write_event_start(sp);
+}
+
+/**
+ * @brief Shut the socket down if a frame partly written right away could not
+ * be queued, the peer would take the following frames at the wrong offset.
+ * The read event then reports the connection closed.
+ *
+ * @param sp The connection
+ */
+static void st_conn_check_framing(st_conn *sp)
+{
+  if (sp->tx_off > 0 && vde_sendq_is_empty(&sp->sendq)) {
+    vde_warning("%s: frame partly written to fd %d dropped, shutting down",
+                __PRETTY_FUNCTION__, sp->fd);
+    sp->tx_off = 0;
+    shutdown(sp->fd, SHUT_RDWR);
+  }
+}
+
+int st_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  int ret;
+  st_conn *sp = vde_connection_get_priv(conn);
+  st_tr *tr = (st_tr *)vde_component_get_priv(sp->transport);
+
+  // a corked connection only writes from the event loop
+  if (tr->cork_usec > 0) {
+    if (vde_sendq_push(&sp->sendq, pkt)) {
+      return -1;
+    }
+    st_conn_wait(sp);
+    return 0;
+  }
+  ret = vde_sendq_write(&sp->sendq, pkt);
+  st_conn_check_framing(sp);
+  return ret;
+}
+
+unsigned int st_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int tmp_errno;
+  st_conn *sp = vde_connection_get_priv(conn);
+  st_tr *tr = (st_tr *)vde_component_get_priv(sp->transport);
+
+  if (tr->cork_usec > 0) {
+    for (i = 0; i < batch->count; i++) {
+      if (vde_sendq_push(&sp->sendq, batch->pkts[i])) {
+        break;
+      }
+    }
+    tmp_errno = errno;
+    st_conn_wait(sp);
+    errno = tmp_errno;
+    return i;
+  }
+  i = vde_sendq_write_batch(&sp->sendq, batch);
+  tmp_errno = errno;
+  st_conn_check_framing(sp);
+  errno = tmp_errno;
+  return i;
+}
+
+void st_conn_close(vde_connection *conn)
+{
+  st_conn *sp = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
+  st_tr *tr = (st_tr *)vde_component_get_priv(sp->transport);
+
+  if (sp->ev_rd != NULL) {
+    vde_context_event_del(ctx, sp->ev_rd);
+  }
+  if (sp->ev_wr != NULL) {
+    vde_context_event_del(ctx, sp->ev_wr);
+  }
+  if (sp->cork_to != NULL) {
+    vde_context_timeout_del(ctx, sp->cork_to);
+  }
+  if (sp->connect_to != NULL) {
+    vde_context_timeout_del(ctx, sp->connect_to);
+  }
+  if (sp->fd >= 0) {
+    close(sp->fd);
+  }
+  vde_sendq_fini(&sp->sendq);
+  vde_free(sp->rx_buf);
+  tr->conns = vde_list_remove(tr->conns, sp);
+
+  vde_free(sp);
+}
+
+/**
+ * @brief Allocate the backend of a connection and initialize the connection
+ *
+ * @param component The transport
+ * @param conn The connection
+ * @param fd The socket of the connection, -1 if not created yet
+ *
+ * @return The backend, NULL on error (and errno is set appropriately)
+ */
+static st_conn *st_conn_new(vde_component *component, vde_connection *conn,
+                            int fd)
+{
+  st_conn *sp;
+  st_tr *tr = (st_tr *)vde_component_get_priv(component);
+
+  sp = (st_conn *)vde_calloc(sizeof(st_conn));
+  if (!sp) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  sp->rx_buf = vde_alloc(st_rx_size(tr));
+  if (!sp->rx_buf) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    vde_free(sp);
+    errno = ENOMEM;
+    return NULL;
+  }
+  sp->fd = fd;
+  sp->conn = conn;
+  sp->transport = component;
+
+  vde_connection_init(conn, vde_component_get_context(component),
+                      tr->frame_len, &st_conn_write, &st_conn_close,
+                      (void *)sp);
+  vde_connection_set_be_write_batch(conn, &st_conn_write_batch);
+  vde_connection_set_queue_properties(conn, tr->queue_size, tr->queue_len);
+  vde_sendq_init(&sp->sendq, conn, &st_conn_send, &st_conn_wait, (void *)sp, 1);
+
+  // XXX: check error on list
+  tr->conns = vde_list_prepend(tr->conns, sp);
+  return sp;
+}
+
+/**
+ * @brief Start reading from a connected socket
+ *
+ * @param sp The connection
+ */
+static void st_conn_established(st_conn *sp)
+{
+  int on = 1;
+  vde_context *ctx = vde_component_get_context(sp->transport);
+  st_tr *tr = (st_tr *)vde_component_get_priv(sp->transport);
+
+  // frames are coalesced here, the kernel must not delay them further
+  if (tr->nodelay && tr->sa.ss_family != AF_UNIX &&
+      setsockopt(sp->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+    vde_warning("%s: cannot set TCP_NODELAY: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+  }
+
+  // XXX: check event NULL
+  sp->ev_rd = vde_context_event_add(ctx, sp->fd, VDE_EV_READ|VDE_EV_PERSIST,
+                                    NULL, &st_conn_read_event, (void *)sp);
+  sp->established = 1;
+}
+
+/*
+ * When many peers connect at once the backlog is drained at each event, up to
+ * ACCEPT_BUDGET connections so that established connections are served in the
+ * meantime.
+ */
+void st_accept(int listen_fd, short event_type, void *arg)
+{
+  int new;
+  unsigned int burst = 0;
+  vde_connection *conn;
+  st_conn *sp;
+  vde_component *component = (vde_component *)arg;
+
+  while (burst < ACCEPT_BUDGET) {
+    new = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
+      }
+      break;
+    }
+    burst++;
+
+    if (vde_connection_new(&conn)) {
+      vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
+      close(new);
+      continue;
+    }
+    sp = st_conn_new(component, conn, new);
+    if (sp == NULL) {
+      vde_connection_delete(conn);
+      close(new);
+      continue;
+    }
+
+    st_conn_established(sp);
+    vde_transport_call_cm_accept_cb(component, conn);
+  }
+}
+
+int st_listen(vde_component *component)
+{
+  vde_context *ctx = vde_component_get_context(component);
+  st_tr *tr = (st_tr *)vde_component_get_priv(component);
+
+  tr->listen_fd = vde_sock_listen((struct sockaddr *)&tr->sa, tr->sa_len,
+                                  SOCK_STREAM, tr->backlog);
+  if (tr->listen_fd < 0) {
+    return -1;
+  }
+
+  // XXX: check event not NULL
+  tr->listen_event = vde_context_event_add(ctx, tr->listen_fd,
+                                           VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                           &st_accept, (void *)component);
+  return 0;
+}
+
+/**
+ * @brief Abort an outgoing connection and report the error to the connection
+ * manager, which deletes the connection.
+ *
+ * @param sp The connection
+ * @param tr_errno The error
+ */
+static void st_cli_error(st_conn *sp, int tr_errno)
+{
+  vde_connection *conn = sp->conn;
+  vde_component *transport = sp->transport;
+
+  vde_connection_fini(conn);
+  vde_transport_call_cm_error_cb(transport, conn, tr_errno);
+}
+
+void st_cli_connected(int fd, short event_type, void *arg)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+  st_conn *sp = (st_conn *)arg;
+  vde_context *ctx = vde_component_get_context(sp->transport);
+
+  vde_context_event_del(ctx, sp->ev_wr);
+  sp->ev_wr = NULL;
+
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_error("%s: connection timed out", __PRETTY_FUNCTION__);
+    st_cli_error(sp, ETIMEDOUT);
+    return;
+  }
+  if (getsockopt(sp->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+    err = errno;
+  }
+  if (err != 0) {
+    vde_error("%s: cannot connect: %s", __PRETTY_FUNCTION__, strerror(err));
+    st_cli_error(sp, err);
+    return;
+  }
+
+  st_conn_established(sp);
+  vde_transport_call_cm_connect_cb(sp->transport, sp->conn);
+}
+
+void st_cli_connect_retry(int fd, short event_type, void *arg);
+
+/**
+ * @brief Start connecting the socket of an outgoing connection, the
+ * connection manager is called once the socket is writable.
+ *
+ * @param sp The connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int st_cli_connect(st_conn *sp)
+{
+  int ret;
+  struct timeval timeout;
+  vde_context *ctx = vde_component_get_context(sp->transport);
+  st_tr *tr = (st_tr *)vde_component_get_priv(sp->transport);
+
+  ret = vde_sock_connect(ctx, sp->fd, (struct sockaddr *)&tr->sa, tr->sa_len,
+                         &sp->connect_tries, &sp->connect_to,
+                         &st_cli_connect_retry, (void *)sp);
+  if (ret <= 0) {
+    return ret;
+  }
+
+  timeout.tv_sec = tr->connect_timeout / 1000;
+  timeout.tv_usec = (tr->connect_timeout % 1000) * 1000;
+  // XXX: check event NULL
+  sp->ev_wr = vde_context_event_add(ctx, sp->fd, VDE_EV_WRITE, &timeout,
+                                    &st_cli_connected, (void *)sp);
+  return 0;
+}
+
+void st_cli_connect_retry(int fd, short event_type, void *arg)
+{
+  st_conn *sp = (st_conn *)arg;
+  vde_context *ctx = vde_component_get_context(sp->transport);
+
+  vde_context_timeout_del(ctx, sp->connect_to);
+  sp->connect_to = NULL;
+  if (st_cli_connect(sp)) {
+    st_cli_error(sp, errno);
+  }
+}
+
+int st_connect(vde_component *component, vde_connection *conn)
+{
+  int tmp_errno;
+  st_conn *sp;
+  st_tr *tr = (st_tr *)vde_component_get_priv(component);
+
+  sp = st_conn_new(component, conn, -1);
+  if (sp == NULL) {
+    return -1;
+  }
+
+  sp->fd = socket(tr->sa.ss_family,
+                  SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sp->fd < 0) {
+    vde_error("%s: cannot create socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (st_cli_connect(sp)) {
+    goto error;
+  }
+  return 0;
+
+error:
+  tmp_errno = errno;
+  // the connection manager owns the connection and deletes it
+  vde_connection_fini(conn);
+  errno = tmp_errno;
+  return -1;
+}
+
+/**
+ * @brief Resolve the address of a TCP transport
+ *
+ * @param tr The transport
+ * @param host The host name or address
+ * @param port The port
+ *
+ * @return zero on success, -1 on error
+ */
+static int st_tr_resolve(st_tr *tr, const char *host, int port)
+{
+  int ret;
+  char service[8];
+  struct addrinfo hints, *res;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV;
+  snprintf(service, sizeof(service), "%d", port);
+
+  ret = getaddrinfo(host, service, &hints, &res);
+  if (ret != 0) {
+    vde_error("%s: cannot resolve %s: %s", __PRETTY_FUNCTION__, host,
+              gai_strerror(ret));
+    return -1;
+  }
+  memcpy(&tr->sa, res->ai_addr, res->ai_addrlen);
+  tr->sa_len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+}
+
+static int transport_stream_init(vde_component *component, vde_sobj *params)
+{
+  st_tr *tr;
+  vde_sobj *path_sobj, *host_sobj, *port_sobj;
+  const char *path = NULL;
+  const char *host = "127.0.0.1";
+  int port = 0;
+  int mtu = ETH_DATA_LEN;
+  int queue_size = VDE_CONNECTION_QUEUE_MAXBYTES;
+  int queue_len = VDE_CONNECTION_QUEUE_MAXLEN;
+  int rx_budget = RX_BUDGET;
+  int backlog = LISTEN_QUEUE;
+  int nodelay = 1;
+  int cork_usec = 0;
+  int cork_bytes = CORK_BYTES;
+  int connect_timeout = CONNECT_TIMEOUT;
+  struct sockaddr_un *sa_unix;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // a unix socket path, or a TCP host and port
+  path_sobj = vde_sobj_hash_lookup(params, "path");
+  if (path_sobj) {
+    if (!vde_sobj_is_type(path_sobj, vde_sobj_type_string)) {
+      vde_error("%s: path must be a string", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    path = vde_sobj_get_string(path_sobj);
+    if (strlen(path) < 2 || strlen(path) >= UNIX_PATH_MAX) {
+      vde_error("%s: invalid socket path", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+  } else {
+    port_sobj = vde_sobj_hash_lookup(params, "port");
+    if (!port_sobj || !vde_sobj_is_type(port_sobj, vde_sobj_type_int) ||
+        vde_sobj_get_int(port_sobj) < 1 ||
+        vde_sobj_get_int(port_sobj) > 65535) {
+      vde_error("%s: no socket path or TCP port received",
+                __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    port = vde_sobj_get_int(port_sobj);
+
+    host_sobj = vde_sobj_hash_lookup(params, "host");
+    if (host_sobj) {
+      if (!vde_sobj_is_type(host_sobj, vde_sobj_type_string)) {
+        vde_error("%s: host must be a string", __PRETTY_FUNCTION__);
+        errno = EINVAL;
+        return -1;
+      }
+      host = vde_sobj_get_string(host_sobj);
+    }
+  }
+
+  if (vde_params_get_int(params, "mtu", ETH_MIN_MTU, ETH_MAX_MTU, &mtu) ||
+      vde_params_get_int(params, "queue_size", 0, INT_MAX, &queue_size) ||
+      vde_params_get_int(params, "queue_len", 1, INT_MAX, &queue_len) ||
+      vde_params_get_int(params, "rx_budget", 1, INT_MAX, &rx_budget) ||
+      vde_params_get_int(params, "backlog", 1, INT_MAX, &backlog) ||
+      vde_params_get_bool(params, "nodelay", &nodelay) ||
+      vde_params_get_int(params, "cork_usec", 0, INT_MAX, &cork_usec) ||
+      vde_params_get_int(params, "cork_bytes", 1, INT_MAX, &cork_bytes) ||
+      vde_params_get_int(params, "connect_timeout", 1, INT_MAX,
+                         &connect_timeout)) {
+    return -1;
+  }
+
+  tr = (st_tr *)vde_calloc(sizeof(st_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if (path != NULL) {
+    sa_unix = (struct sockaddr_un *)&tr->sa;
+    sa_unix->sun_family = AF_UNIX;
+    if (path[0] == '@') {
+      // abstract namespace, the name is not NUL terminated
+      tr->abstract = 1;
+      memcpy(sa_unix->sun_path + 1, path + 1, strlen(path) - 1);
+      tr->sa_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    } else {
+      // XXX: path needs to be normalized/checked somewhere
+      strcpy(sa_unix->sun_path, path);
+      tr->sa_len = sizeof(struct sockaddr_un);
+    }
+  } else if (st_tr_resolve(tr, host, port)) {
+    vde_free(tr);
+    errno = EINVAL;
+    return -1;
+  }
+  tr->nodelay = nodelay;
+  tr->frame_len = ETH_FRAME_LEN(mtu);
+  tr->queue_size = queue_size;
+  tr->queue_len = queue_len;
+  tr->rx_budget = rx_budget;
+  tr->cork_usec = cork_usec;
+  tr->cork_bytes = cork_bytes;
+  tr->backlog = backlog;
+  tr->connect_timeout = connect_timeout;
+  tr->listen_fd = -1;
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_stream_fini(vde_component *component)
+{
+  st_tr *tr;
+  st_conn *sp;
+
+  vde_assert(component != NULL);
+
+  tr = (st_tr *)vde_component_get_priv(component);
+  if (tr->listen_fd >= 0) {
+    vde_context_event_del(vde_component_get_context(component),
+                          tr->listen_event);
+    close(tr->listen_fd);
+    if (tr->sa.ss_family == AF_UNIX && !tr->abstract) {
+      unlink(((struct sockaddr_un *)&tr->sa)->sun_path);
+    }
+  }
+  // closing a connection removes it from the list
+  while (tr->conns != NULL) {
+    sp = vde_list_get_data(vde_list_first(tr->conns));
+    if (sp->established) {
+      vde_transport_conn_gone(sp->conn);
+    } else {
+      st_cli_error(sp, ECONNABORTED);
+    }
+  }
+  vde_free(tr);
+}
+
+component_ops transport_stream_component_ops = {
+  .init = transport_stream_init,
+  .fini = transport_stream_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "stream",
+  .cops = &transport_stream_component_ops,
+  .tr_listen = &st_listen,
+  .tr_connect = &st_connect,
+};
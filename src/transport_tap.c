@@ -0,0 +1,812 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Linux tap devices: a connect plugs the tap device ifname as a port, its
+ * queues are opened with IFF_MULTI_QUEUE and frames sent to the device are
+ * spread among them by flow hash.
+ *
+ * With IFF_VNET_HDR each frame carries a virtio-net header, so partial
+ * checksums and TCP segmentation travel as packet metadata (see
+ * VDE_PKT_META_OFFLOAD) in both directions: the kernel hands us TSO bursts of
+ * up to 64k and completes the offloads of the frames we write, other
+ * connections do them in software only if their backend can't.
+ *
+ * XXX: the virtio-net header is in host byte order, only little endian hosts
+ * have been tested.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <net/if.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/transport_common.h>
+
+#define TUN_DEVICE "/dev/net/tun"
+
+/*
+ * From linux/if_tun.h and linux/virtio_net.h, which can't be included
+ * together with our ethernet definitions.
+ */
+#define TUNSETIFF _IOW('T', 202, int)
+#define TUNSETOFFLOAD _IOW('T', 208, unsigned int)
+#define TUNSETVNETHDRSZ _IOW('T', 216, int)
+#define IFF_TAP 0x0002
+#define IFF_NO_PI 0x1000
+#define IFF_VNET_HDR 0x4000
+#define IFF_MULTI_QUEUE 0x0100
+#define TUN_F_CSUM 0x01
+#define TUN_F_TSO4 0x02
+#define TUN_F_TSO6 0x04
+#define TUN_F_TSO_ECN 0x08
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_GSO_NONE 0
+#define VIRTIO_NET_HDR_GSO_TCPV4 1
+#define VIRTIO_NET_HDR_GSO_TCPV6 4
+#define VIRTIO_NET_HDR_GSO_ECN 0x80
+
+struct virtio_net_hdr {
+  uint8_t flags;
+  uint8_t gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
+
+// max number of queues of a device
+#define TAP_MAX_QUEUES 16
+
+// max number of segments of a chained packet sent without linearizing it
+#define SEND_IOV_MAX 16
+
+// default max number of frames received at each read event
+#define RX_BUDGET 64
+
+// offloads asked to the kernel for the frames we receive
+#define TAP_OFFLOADS (TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN)
+
+struct tap_conn;
+
+typedef struct {
+  int fd;
+  void *ev_rd;
+  // receives the part of a frame beyond the mtu, chained to the head packet
+  vde_pkt *spare;
+  struct tap_conn *tc;
+} tap_queue;
+
+typedef struct tap_conn {
+  tap_queue queues[TAP_MAX_QUEUES];
+  unsigned int nqueues;
+  void *ev_wr;
+  int wr_queue; // queue the write event is waiting for
+  int tx_queue; // queue which blocked the last write
+  void *ready_to; // timeout passing the connection to the connection manager
+  vde_sendq sendq; // packets waiting to be sent
+  vde_connection *conn;
+  vde_component *transport;
+} tap_conn;
+
+typedef struct {
+  char ifname[IFNAMSIZ];
+  unsigned int queues; // queues opened by each connection
+  int vnet_hdr; // nonzero to exchange frames with a virtio-net header
+  int offloads; // nonzero to receive frames with offloads from the kernel
+  unsigned int frame_len; // largest frame without offloads
+  unsigned long queue_size; // max bytes queued by a connection
+  unsigned int queue_len; // max packets queued by a connection
+  unsigned int rx_budget; // max frames received at each read event
+  vde_list *conns;
+} tap_tr;
+
+/**
+ * @brief Get the length of the virtio-net header in front of frames
+ *
+ * @param tc The connection
+ *
+ * @return The length, zero without IFF_VNET_HDR
+ */
+static inline unsigned int tap_hdr_len(tap_conn *tc)
+{
+  tap_tr *tr = (tap_tr *)vde_component_get_priv(tc->transport);
+
+  return tr->vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+}
+
+/**
+ * @brief Copy the offloads of a received frame from its virtio-net header to
+ * the packet metadata
+ *
+ * @param pkt The packet, with its receive metadata set
+ * @param vh The header
+ *
+ * @return zero on success, -1 if the offloads are not supported
+ */
+static int tap_hdr_to_meta(vde_pkt *pkt, struct virtio_net_hdr *vh)
+{
+  vde_pkt_meta *meta = &pkt->meta;
+
+  if (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+    meta->csum_start = vh->csum_start;
+    meta->csum_off = vh->csum_offset;
+    meta->flags |= VDE_PKT_META_CSUM;
+  }
+  switch (vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+      return 0;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+      meta->gso_type = VDE_PKT_GSO_TCPV4;
+      break;
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+      meta->gso_type = VDE_PKT_GSO_TCPV6;
+      break;
+    default:
+      return -1;
+  }
+  if (vh->gso_type & VIRTIO_NET_HDR_GSO_ECN) {
+    meta->gso_type |= VDE_PKT_GSO_ECN;
+  }
+  meta->gso_size = vh->gso_size;
+  meta->flags |= VDE_PKT_META_GSO;
+  return 0;
+}
+
+/**
+ * @brief Fill the virtio-net header of a frame to send from the packet
+ * metadata
+ *
+ * @param pkt The packet
+ * @param vh The header
+ */
+static void tap_meta_to_hdr(vde_pkt *pkt, struct virtio_net_hdr *vh)
+{
+  vde_pkt_meta *meta = &pkt->meta;
+  unsigned int tcp_off;
+
+  memset(vh, 0, sizeof(*vh));
+  if (meta->flags & VDE_PKT_META_CSUM) {
+    vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vh->csum_start = meta->csum_start;
+    vh->csum_offset = meta->csum_off;
+  }
+  if (!(meta->flags & VDE_PKT_META_GSO)) {
+    return;
+  }
+  vh->gso_type = (meta->gso_type & ~VDE_PKT_GSO_ECN) == VDE_PKT_GSO_TCPV4 ?
+                 VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+  if (meta->gso_type & VDE_PKT_GSO_ECN) {
+    vh->gso_type |= VIRTIO_NET_HDR_GSO_ECN;
+  }
+  vh->gso_size = meta->gso_size;
+  // a hint of the length of the headers, the TCP header is in the head
+  tcp_off = meta->csum_start + 12;
+  vh->hdr_len = meta->csum_start;
+  if (tcp_off < pkt->hdr->pkt_len) {
+    vh->hdr_len += ((unsigned char)pkt->payload[tcp_off] >> 4) * 4;
+  }
+}
+
+/**
+ * @brief Report to the connection user that the device is gone
+ *
+ * @param tc The connection
+ * @param err The error
+ *
+ * @return Nonzero if the connection has been closed
+ */
+static int tap_conn_closed(tap_conn *tc, vde_conn_error err)
+{
+  unsigned int i;
+  vde_connection *conn = tc->conn;
+  vde_context *ctx = vde_connection_get_context(conn);
+
+  if (vde_connection_call_error(conn, NULL, err) && errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return 1;
+  }
+  vde_warning("%s: device %s is gone but connection not closed",
+              __PRETTY_FUNCTION__,
+              ((tap_tr *)vde_component_get_priv(tc->transport))->ifname);
+  // the queues would stay readable, stop listening to them
+  for (i = 0; i < tc->nqueues; i++) {
+    if (tc->queues[i].ev_rd != NULL) {
+      vde_context_event_del(ctx, tc->queues[i].ev_rd);
+      tc->queues[i].ev_rd = NULL;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Read a frame from a queue
+ *
+ * @param q The queue
+ * @param pkt The packet to fill, the part of the frame beyond the mtu is
+ * chained to it from the spare packet of the queue
+ * @param vh The virtio-net header of the frame
+ *
+ * @return The length of the frame, 0 if the frame must be dropped, -1 on
+ * error (and errno is set appropriately)
+ */
+static int tap_queue_read(tap_queue *q, vde_pkt *pkt,
+                          struct virtio_net_hdr *vh)
+{
+  int len, iovcnt = 0;
+  struct iovec iov[3];
+  tap_conn *tc = q->tc;
+  tap_tr *tr = (tap_tr *)vde_component_get_priv(tc->transport);
+  unsigned int hdr_len = tap_hdr_len(tc);
+  unsigned int max_len = tr->frame_len;
+  vde_pool *pool = vde_context_get_pool(
+                     vde_connection_get_context(tc->conn));
+
+  if (hdr_len > 0) {
+    iov[iovcnt].iov_base = vh;
+    iov[iovcnt++].iov_len = hdr_len;
+  }
+  iov[iovcnt].iov_base = pkt->payload;
+  iov[iovcnt++].iov_len = tr->frame_len;
+  if (tr->offloads && q->spare == NULL) {
+    q->spare = vde_pool_pkt_new(pool, ETH_MAX_FRAME_LEN - tr->frame_len, 0, 0);
+  }
+  if (tr->offloads && q->spare != NULL) {
+    iov[iovcnt].iov_base = q->spare->payload;
+    iov[iovcnt++].iov_len = ETH_MAX_FRAME_LEN - tr->frame_len;
+    max_len = ETH_MAX_FRAME_LEN;
+  }
+
+  len = readv(q->fd, iov, iovcnt);
+  if (len < 0) {
+    return -1;
+  }
+  // the kernel returns the length of frames which don't fit
+  if (len < hdr_len + sizeof(struct eth_hdr) || len > hdr_len + max_len) {
+    vde_warning("%s: invalid frame from queue %d, dropping",
+                __PRETTY_FUNCTION__, q->fd);
+    return 0;
+  }
+  len -= hdr_len;
+
+  if (len <= tr->frame_len) {
+    pkt->hdr->pkt_len = len;
+  } else {
+    pkt->hdr->pkt_len = tr->frame_len;
+    q->spare->hdr->pkt_len = len - tr->frame_len;
+    // pkt is linear and private, appending can't fail
+    vde_pkt_chain_append(pkt, q->spare);
+    q->spare = NULL;
+  }
+  return len;
+}
+
+void tap_queue_read_event(int fd, short event_type, void *arg)
+{
+  vde_pkt *pkt;
+  vde_pkt_batch batch;
+  struct virtio_net_hdr vh;
+  unsigned int total = 0;
+  int len, done = 0, err = 0;
+  uint64_t now;
+  tap_queue *q = (tap_queue *)arg;
+  tap_conn *tc = q->tc;
+  vde_connection *conn = tc->conn;
+  tap_tr *tr = (tap_tr *)vde_component_get_priv(tc->transport);
+  vde_pool *pool = vde_context_get_pool(vde_connection_get_context(conn));
+
+  memset(&vh, 0, sizeof(vh));
+  while (!done && total < tr->rx_budget) {
+    now = vde_clock_ns();
+    vde_pkt_batch_init(&batch);
+    while (!vde_pkt_batch_is_full(&batch) && total < tr->rx_budget) {
+      pkt = vde_pool_pkt_new(pool, tr->frame_len,
+                             vde_connection_get_pkt_headsize(conn),
+                             vde_connection_get_pkt_tailsize(conn));
+      if (pkt == NULL) {
+        vde_warning("%s: cannot allocate packet, dropping: %s",
+                    __PRETTY_FUNCTION__, strerror(errno));
+        // discard a frame, or the event will trigger again
+        if (read(q->fd, &vh, sizeof(vh)) < 0) {
+          done = 1;
+        }
+        total++;
+        break;
+      }
+
+      len = tap_queue_read(q, pkt, &vh);
+      if (len <= 0) {
+        vde_pkt_put(pkt);
+        if (len < 0) {
+          if (errno != EAGAIN) {
+            vde_warning("%s: error reading from queue %d: %s",
+                        __PRETTY_FUNCTION__, q->fd, strerror(errno));
+            err = 1;
+          }
+          done = 1;
+          break;
+        }
+        continue;
+      }
+      total++;
+
+      vde_pkt_meta_rx(pkt, vde_connection_get_id(conn), now);
+      if (tap_hdr_len(tc) > 0 && tap_hdr_to_meta(pkt, &vh)) {
+        vde_warning("%s: unsupported offload from queue %d, dropping",
+                    __PRETTY_FUNCTION__, q->fd);
+        vde_pkt_put(pkt);
+        continue;
+      }
+      vde_pkt_batch_add(&batch, pkt);
+    }
+
+    if (batch.count > 0 && vde_connection_call_read_batch(conn, &batch) &&
+        errno == EPIPE) {
+      vde_pkt_batch_put(&batch);
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+      return;
+    }
+    vde_pkt_batch_put(&batch);
+  }
+
+  if (err) {
+    tap_conn_closed(tc, CONN_READ_CLOSED);
+  }
+}
+
+/**
+ * @brief Get the queue of the device a frame is written to
+ *
+ * @param tc The connection
+ * @param pkt The packet
+ *
+ * @return The index of the queue of the flow of the packet
+ */
+static int tap_conn_queue(tap_conn *tc, vde_pkt *pkt)
+{
+  if (tc->nqueues > 1 && (pkt->meta.flags & VDE_PKT_META_HASH)) {
+    return pkt->meta.flow_hash % tc->nqueues;
+  }
+  return 0;
+}
+
+/**
+ * @brief Write a frame to the device, on the queue of its flow
+ *
+ * @param tc The connection
+ * @param pkt The packet
+ * @param queue The index of the queue used
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int tap_conn_send(tap_conn *tc, vde_pkt *pkt, int *queue)
+{
+  int iovcnt, len = 0;
+  struct virtio_net_hdr vh;
+  struct iovec iov[SEND_IOV_MAX + 1];
+  unsigned int hdr_len = tap_hdr_len(tc);
+
+  *queue = tap_conn_queue(tc, pkt);
+
+  if (hdr_len > 0) {
+    tap_meta_to_hdr(pkt, &vh);
+    iov[0].iov_base = &vh;
+    iov[0].iov_len = hdr_len;
+    len = 1;
+  }
+  iovcnt = vde_pkt_to_iovec(pkt, iov + len, SEND_IOV_MAX);
+  if (iovcnt < 0) {
+    return -1;
+  }
+  return writev(tc->queues[*queue].fd, iov, iovcnt + len) < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Write packets to the device. A vde_sendq_send_cb.
+ *
+ * @param priv The connection
+ * @param pkts The packets to send, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of packets sent or dropped
+ */
+static unsigned int tap_conn_send_batch(void *priv, vde_pkt **pkts,
+                                        unsigned int count)
+{
+  unsigned int i;
+  int queue;
+  tap_conn *tc = (tap_conn *)priv;
+
+  for (i = 0; i < count; i++) {
+    if (tap_conn_send(tc, pkts[i], &queue) == 0) {
+      continue;
+    }
+    if (errno == EAGAIN) {
+      // full queue, the write event waits for it
+      tc->tx_queue = queue;
+      break;
+    }
+    if (errno == EMSGSIZE) {
+      // a long chain, linearized by the send queue
+      break;
+    }
+    // the device is down (EIO) or the frame is invalid: the frame is lost
+    if (errno != EIO) {
+      vde_warning("%s: cannot write to queue %d, dropping: %s",
+                  __PRETTY_FUNCTION__, tc->queues[queue].fd,
+                  strerror(errno));
+    }
+  }
+  return i;
+}
+
+void tap_conn_write_event(int fd, short event_type, void *arg);
+
+/**
+ * @brief Wait for the queue of the device which blocked to be writable. A
+ * vde_sendq_wait_cb.
+ *
+ * @param arg The connection
+ */
+static void tap_conn_write_event_start(void *arg)
+{
+  tap_conn *tc = (tap_conn *)arg;
+  vde_connection *conn = tc->conn;
+  vde_context *ctx = vde_connection_get_context(conn);
+
+  if (tc->ev_wr != NULL && tc->wr_queue == tc->tx_queue) {
+    return;
+  }
+  if (tc->ev_wr != NULL) {
+    vde_context_event_del(ctx, tc->ev_wr);
+  }
+  tc->wr_queue = tc->tx_queue;
+  tc->ev_wr = vde_context_event_add(ctx, tc->queues[tc->wr_queue].fd,
+                                    VDE_EV_WRITE | VDE_EV_PERSIST,
+                                    vde_connection_get_send_maxtimeout(conn),
+                                    &tap_conn_write_event, (void *)tc);
+}
+
+void tap_conn_write_event(int fd, short event_type, void *arg)
+{
+  tap_conn *tc = (tap_conn *)arg;
+  vde_connection *conn = tc->conn;
+
+  if (vde_sendq_flush(&tc->sendq)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  if (vde_sendq_is_empty(&tc->sendq)) {
+    vde_context_event_del(vde_connection_get_context(conn), tc->ev_wr);
+    tc->ev_wr = NULL;
+    return;
+  }
+  // another queue could have blocked in the meantime
+  tap_conn_write_event_start(tc);
+}
+
+int tap_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  tap_conn *tc = vde_connection_get_priv(conn);
+
+  return vde_sendq_write(&tc->sendq, pkt);
+}
+
+unsigned int tap_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  tap_conn *tc = vde_connection_get_priv(conn);
+
+  return vde_sendq_write_batch(&tc->sendq, batch);
+}
+
+void tap_conn_close(vde_connection *conn)
+{
+  unsigned int i;
+  tap_conn *tc = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
+  tap_tr *tr = (tap_tr *)vde_component_get_priv(tc->transport);
+
+  for (i = 0; i < tc->nqueues; i++) {
+    if (tc->queues[i].ev_rd != NULL) {
+      vde_context_event_del(ctx, tc->queues[i].ev_rd);
+    }
+    if (tc->queues[i].spare != NULL) {
+      vde_pkt_put(tc->queues[i].spare);
+    }
+    close(tc->queues[i].fd);
+  }
+  if (tc->ev_wr != NULL) {
+    vde_context_event_del(ctx, tc->ev_wr);
+  }
+  if (tc->ready_to != NULL) {
+    vde_context_timeout_del(ctx, tc->ready_to);
+  }
+  vde_sendq_fini(&tc->sendq);
+  tr->conns = vde_list_remove(tr->conns, tc);
+
+  vde_free(tc);
+}
+
+/**
+ * @brief Open a queue of the tap device
+ *
+ * @param tr The transport
+ *
+ * @return The descriptor of the queue, -1 on error (and errno is set
+ * appropriately)
+ */
+static int tap_open_queue(tap_tr *tr)
+{
+  int fd, tmp_errno;
+  int hdr_len = sizeof(struct virtio_net_hdr);
+  struct ifreq ifr;
+
+  fd = open(TUN_DEVICE, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot open %s: %s", __PRETTY_FUNCTION__, TUN_DEVICE,
+              strerror(errno));
+    errno = tmp_errno;
+    return -1;
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  strcpy(ifr.ifr_name, tr->ifname);
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  if (tr->vnet_hdr) {
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  }
+  if (tr->queues > 1) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+  if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot attach to %s: %s", __PRETTY_FUNCTION__, tr->ifname,
+              strerror(errno));
+    goto error;
+  }
+  if (tr->vnet_hdr && ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot set header size: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  // the kernel sends frames with offloads only if told we can take them
+  if (tr->offloads && ioctl(fd, TUNSETOFFLOAD, TAP_OFFLOADS) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot enable offloads: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  return fd;
+
+error:
+  close(fd);
+  errno = tmp_errno;
+  return -1;
+}
+
+void tap_conn_ready(int fd, short event_type, void *arg)
+{
+  unsigned int i;
+  tap_conn *tc = (tap_conn *)arg;
+  vde_context *ctx = vde_component_get_context(tc->transport);
+
+  vde_context_timeout_del(ctx, tc->ready_to);
+  tc->ready_to = NULL;
+
+  // frames are read once the connection manager set the callbacks
+  for (i = 0; i < tc->nqueues; i++) {
+    // XXX: check event NULL
+    tc->queues[i].ev_rd = vde_context_event_add(ctx, tc->queues[i].fd,
+                                                VDE_EV_READ | VDE_EV_PERSIST,
+                                                NULL, &tap_queue_read_event,
+                                                (void *)&tc->queues[i]);
+  }
+  vde_transport_call_cm_connect_cb(tc->transport, tc->conn);
+}
+
+/*
+ * The device is opened right away, the connection manager is called from the
+ * event loop as with other transports.
+ */
+int tap_connect(vde_component *component, vde_connection *conn)
+{
+  unsigned int i;
+  int tmp_errno;
+  struct timeval now = { 0, 0 };
+  tap_conn *tc;
+  vde_context *ctx = vde_component_get_context(component);
+  tap_tr *tr = (tap_tr *)vde_component_get_priv(component);
+
+  tc = (tap_conn *)vde_calloc(sizeof(tap_conn));
+  if (!tc) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  tc->conn = conn;
+  tc->transport = component;
+
+  for (i = 0; i < tr->queues; i++) {
+    tc->queues[i].fd = tap_open_queue(tr);
+    if (tc->queues[i].fd < 0) {
+      goto error;
+    }
+    tc->queues[i].tc = tc;
+    tc->nqueues++;
+  }
+
+  // TSO bursts are received only with offloads
+  vde_connection_init(conn, ctx,
+                      tr->offloads ? ETH_MAX_FRAME_LEN : tr->frame_len,
+                      &tap_conn_write, &tap_conn_close, (void *)tc);
+  vde_connection_set_be_write_batch(conn, &tap_conn_write_batch);
+  vde_connection_set_queue_properties(conn, tr->queue_size, tr->queue_len);
+  vde_sendq_init(&tc->sendq, conn, &tap_conn_send_batch,
+                 &tap_conn_write_event_start, (void *)tc, 1);
+  if (tr->offloads) {
+    vde_connection_set_offloads(conn, VDE_PKT_META_OFFLOAD);
+  }
+
+  // XXX: check timeout NULL
+  tc->ready_to = vde_context_timeout_add(ctx, VDE_EV_TIMEOUT, &now,
+                                         &tap_conn_ready, (void *)tc);
+  // XXX: check error on list
+  tr->conns = vde_list_prepend(tr->conns, tc);
+  return 0;
+
+error:
+  tmp_errno = errno;
+  for (i = 0; i < tc->nqueues; i++) {
+    close(tc->queues[i].fd);
+  }
+  vde_free(tc);
+  errno = tmp_errno;
+  return -1;
+}
+
+int tap_listen(vde_component *component)
+{
+  vde_error("%s: tap devices are plugged with a connect", __PRETTY_FUNCTION__);
+  errno = EOPNOTSUPP;
+  return -1;
+}
+
+static int transport_tap_init(vde_component *component, vde_sobj *params)
+{
+  tap_tr *tr;
+  vde_sobj *ifname_sobj;
+  const char *ifname;
+  int queues = 1;
+  int vnet_hdr = 1;
+  int offloads = 1;
+  int mtu = ETH_DATA_LEN;
+  int queue_size = VDE_CONNECTION_QUEUE_MAXBYTES;
+  int queue_len = VDE_CONNECTION_QUEUE_MAXLEN;
+  int rx_budget = RX_BUDGET;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  ifname_sobj = vde_sobj_hash_lookup(params, "ifname");
+  if (!ifname_sobj || !vde_sobj_is_type(ifname_sobj, vde_sobj_type_string)) {
+    vde_error("%s: no interface name received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  ifname = vde_sobj_get_string(ifname_sobj);
+  if (strlen(ifname) == 0 || strlen(ifname) >= IFNAMSIZ) {
+    vde_error("%s: invalid interface name", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (vde_params_get_int(params, "queues", 1, TAP_MAX_QUEUES, &queues) ||
+      vde_params_get_bool(params, "vnet_hdr", &vnet_hdr) ||
+      vde_params_get_bool(params, "offloads", &offloads) ||
+      vde_params_get_int(params, "mtu", ETH_MIN_MTU, ETH_MAX_MTU, &mtu) ||
+      vde_params_get_int(params, "queue_size", 0, INT_MAX, &queue_size) ||
+      vde_params_get_int(params, "queue_len", 1, INT_MAX, &queue_len) ||
+      vde_params_get_int(params, "rx_budget", 1, INT_MAX, &rx_budget)) {
+    return -1;
+  }
+  // offloads are described by the virtio-net header
+  offloads = offloads && vnet_hdr;
+
+  tr = (tap_tr *)vde_calloc(sizeof(tap_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  strcpy(tr->ifname, ifname);
+  tr->queues = queues;
+  tr->vnet_hdr = vnet_hdr;
+  tr->offloads = offloads;
+  tr->frame_len = ETH_FRAME_LEN(mtu);
+  tr->queue_size = queue_size;
+  tr->queue_len = queue_len;
+  tr->rx_budget = rx_budget;
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_tap_fini(vde_component *component)
+{
+  tap_tr *tr;
+  tap_conn *tc;
+  vde_connection *conn;
+
+  vde_assert(component != NULL);
+
+  tr = (tap_tr *)vde_component_get_priv(component);
+  // closing a connection removes it from the list
+  while (tr->conns != NULL) {
+    tc = vde_list_get_data(vde_list_first(tr->conns));
+    conn = tc->conn;
+    if (tc->ready_to != NULL) {
+      // not passed to the connection manager yet, which deletes it
+      vde_connection_fini(conn);
+      vde_transport_call_cm_error_cb(component, conn, ECONNABORTED);
+    } else {
+      vde_transport_conn_gone(conn);
+    }
+  }
+  vde_free(tr);
+}
+
+component_ops transport_tap_component_ops = {
+  .init = transport_tap_init,
+  .fini = transport_tap_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "tap",
+  .cops = &transport_tap_component_ops,
+  .tr_listen = &tap_listen,
+  .tr_connect = &tap_connect,
+};
@@ -16,9 +16,11 @@
  */
 
 #include <unistd.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
@@ -32,26 +34,43 @@
 #include <vde3/transport.h>
 #include <vde3/context.h>
 #include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/ring.h>
+#include <vde3/transport_common.h>
 
-#define LISTEN_QUEUE 15
-#define MAX_HEAD_SZ 4 /* size of prellocated space before payload */
-#define MAX_TAIL_SZ 0 /* size of prellocated space after payload */
-#define PKT_DATA_SZ (sizeof(vde_hdr) + MAX_HEAD_SZ + sizeof(struct eth_frame) \
-                     + MAX_TAIL_SZ)
-/*
- * pkt_data_sz = vde 3 header (sizeof(vde_hdr))
- *             + space reserved for vlan tags (4)
- *             + frame (1500)
- *             + trailing space (4)
- *             + further tail space (0)
- */
+#include <transport_vde2_commands.h>
+
+// default backlog of the listening socket
+#define LISTEN_QUEUE 128
+
+// max connections accepted at each event of the listening socket
+#define ACCEPT_BUDGET 64
+
+// default time given to peers to complete the handshake, in milliseconds
+#define HANDSHAKE_TIMEOUT 5000
 
 // size of sockaddr_un.sun_path
 #define UNIX_PATH_MAX 108
 
-// taken from vde2 packetq.c
-#define MAXQLEN 4192
-// end of vde2 packetq.c
+// max number of segments of a chained packet sent without linearizing it
+#define SEND_IOV_MAX 16
+
+// default max number of datagrams received at each read event
+#define RX_BUDGET 64
+
+// datagram sockets of outgoing connections, created in the socket directory
+// of the switch like libvdeplug does
+#define CLIENT_SOCK_FMT "%s/.%05d-%05d"
+
+// buffers of the datagram sockets are autotuned every AUTOTUNE_INTERVAL
+// seconds, and shrunk after AUTOTUNE_QUIET rounds without pressure
+#define AUTOTUNE_INTERVAL 1
+#define AUTOTUNE_QUIET 10
+#define SOCKBUF_MAX (4 * 1024 * 1024)
+
+// the max number of datagrams queued on a unix socket, the shared socket
+// queues the datagrams of all the ports
+#define UNIX_DGRAM_QLEN "/proc/sys/net/unix/max_dgram_qlen"
 
 // taken from vde2 datasock.c
 #define DATA_BUF_SIZE 131072
@@ -70,19 +89,32 @@ typedef struct {
 } __attribute__((packed)) vde2_request;
 // end of vde2 datasock.c
 
+// events which tell the buffers of a datagram socket are too small
 typedef struct {
-  unsigned int numtries;
-  vde_pkt pkt;
-  char data[PKT_DATA_SZ];
-} vde2_pkt;
+  unsigned long tx_stalls; // sends refused because the socket was full
+  unsigned long tx_drops; // packets dropped on the way out
+  unsigned long rx_full; // reads which left datagrams in the socket
+} vde2_conn_stats;
 
 typedef struct {
   int data_fd;
+  int shared; // data_fd is the shared socket of the transport
+  int outgoing; // nonzero if the connection manager owns the connection
   void *data_ev_rd;
   void *data_ev_wr;
   int ctl_fd;
   void *ctl_ev;
-  vde_queue *pkt_queue;
+  uint64_t deadline; // when the handshake times out, see vde_clock_ns()
+  void *connect_to; // timeout of the next connect() attempt
+  unsigned int connect_tries; // connect() attempts refused with EAGAIN
+  vde_ring pkt_queue; // references to the packets waiting to be sent
+  unsigned int numtries; // send attempts of the packet at the queue tail
+  unsigned int rx_hint; // packets to allocate for the next receive
+  vde2_conn_stats stats;
+  vde2_conn_stats tuned; // stats at the last autotuning round
+  unsigned int quiet_rounds; // autotuning rounds without pressure
+  int sndbuf; // buffer sizes asked for the datagram socket
+  int rcvbuf;
   struct sockaddr_un local_sa;
   struct sockaddr_un remote_sa;
   vde2_request *remote_request;
@@ -92,12 +124,312 @@ typedef struct {
 
 typedef struct {
   char *vdesock_dir;
+  unsigned int frame_len; // largest frame sent or received by connections
+  unsigned long queue_size; // max bytes queued by a connection
+  unsigned int queue_len; // max packets queued by a connection
+  unsigned int rx_budget; // max datagrams received at each read event
+  int sndbuf; // initial buffer sizes of datagram sockets, 0 for the default
+  int rcvbuf;
+  int sockbuf_max; // max buffer size set by autotuning
+  void *autotune_to; // autotuning timeout, NULL if disabled
   int listen_fd;
   void *listen_event;
+  int backlog; // backlog of the listening socket
+  unsigned int handshake_timeout; // milliseconds to complete a handshake
+  unsigned long accepted; // connections accepted
+  unsigned long accept_errors; // accept() failures
+  unsigned long handshake_errors; // handshakes failed, timeouts included
+  unsigned long handshake_timeouts; // handshakes not completed in time
+  unsigned int accept_burst_max; // max connections accepted at one event
   unsigned int connections;
   vde_list *pending_conns;
+  vde_list *conns; // connections which completed the handshake
+  int shared; // nonzero if ports share a datagram socket
+  int shared_fd; // the shared datagram socket, -1 if not listening
+  void *shared_ev;
+  struct sockaddr_un shared_sa;
+  vde_hash *peers; // ports of the shared socket by remote path
+  unsigned int shared_rx_hint; // packets to allocate for the next receive
+  // largest head/tail space asked for by the engines of the shared ports
+  unsigned int shared_headsize;
+  unsigned int shared_tailsize;
+  unsigned int shared_rx_max; // max datagrams received at one event
+  unsigned int shared_tx_max; // max datagrams sent with one sendmmsg()
+  unsigned long shared_unknown; // datagrams dropped from unknown peers
+  // sends to ports of the shared socket deferred while tx_cork is set
+  int tx_cork;
+  unsigned int tx_count;
+  vde2_conn *tx_conns[VDE_PKT_BATCH_MAX];
+  vde_pkt *tx_pkts[VDE_PKT_BATCH_MAX];
+  int tx_iovcnt[VDE_PKT_BATCH_MAX];
+  struct iovec tx_iov[VDE_PKT_BATCH_MAX][SEND_IOV_MAX];
 } vde2_tr;
 
+// START temporary signals declaration
+// XXX as for commands, signals should be auto-generated
+#include <vde3/signal.h>
+static vde_signal transport_vde2_signals [] = {
+  { "queue_watermark", NULL, NULL, NULL },
+  { NULL, NULL, NULL, NULL },
+};
+// END temporary signals declaration
+
+int transport_vde2_queues(vde_component *component, vde_sobj **out)
+{
+  vde_list *iter;
+  vde2_conn *v2_conn;
+  vde_ring *ring;
+  vde_sobj *queue;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  *out = vde_sobj_new_array();
+  // XXX check out not null
+
+  iter = vde_list_first(tr->conns);
+  while (iter != NULL) {
+    v2_conn = vde_list_get_data(iter);
+    ring = &v2_conn->pkt_queue;
+
+    queue = vde_sobj_new_hash();
+    vde_sobj_hash_insert(queue, "id",
+        vde_sobj_new_int(vde_connection_get_id(v2_conn->conn)));
+    vde_sobj_hash_insert(queue, "bytes",
+        vde_sobj_new_int(vde_connection_get_queue_bytes(v2_conn->conn)));
+    // the ring is allocated the first time something is queued
+    vde_sobj_hash_insert(queue, "packets", vde_sobj_new_int(
+        vde_ring_is_init(ring) ? vde_ring_get_length(ring) : 0));
+    vde_sobj_hash_insert(queue, "capacity", vde_sobj_new_int(
+        vde_ring_is_init(ring) ? vde_ring_capacity(ring) : 0));
+    vde_sobj_hash_insert(queue, "hwm", vde_sobj_new_int(
+        vde_ring_is_init(ring) ? vde_ring_get_hwm(ring) : 0));
+    vde_sobj_array_add(*out, queue);
+
+    iter = vde_list_next(iter);
+  }
+
+  return 0;
+}
+
+int transport_vde2_accepts(vde_component *component, vde_sobj **out)
+{
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  *out = vde_sobj_new_hash();
+  // XXX check out not null
+  vde_sobj_hash_insert(*out, "accepted", vde_sobj_new_int(tr->accepted));
+  vde_sobj_hash_insert(*out, "accept_errors",
+                       vde_sobj_new_int(tr->accept_errors));
+  vde_sobj_hash_insert(*out, "burst_max",
+                       vde_sobj_new_int(tr->accept_burst_max));
+  vde_sobj_hash_insert(*out, "pending",
+                       vde_sobj_new_int(vde_list_length(tr->pending_conns)));
+  vde_sobj_hash_insert(*out, "handshake_errors",
+                       vde_sobj_new_int(tr->handshake_errors));
+  vde_sobj_hash_insert(*out, "handshake_timeouts",
+                       vde_sobj_new_int(tr->handshake_timeouts));
+
+  return 0;
+}
+
+int transport_vde2_shared(vde_component *component, vde_sobj **out)
+{
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  *out = vde_sobj_new_hash();
+  // XXX check out not null
+  vde_sobj_hash_insert(*out, "enabled", vde_sobj_new_bool(tr->shared));
+  vde_sobj_hash_insert(*out, "ports", vde_sobj_new_int(
+      tr->peers != NULL ? vde_hash_size(tr->peers) : 0));
+  vde_sobj_hash_insert(*out, "rx_batch_max",
+                       vde_sobj_new_int(tr->shared_rx_max));
+  vde_sobj_hash_insert(*out, "tx_batch_max",
+                       vde_sobj_new_int(tr->shared_tx_max));
+  vde_sobj_hash_insert(*out, "unknown_peers",
+                       vde_sobj_new_int(tr->shared_unknown));
+
+  return 0;
+}
+
+int transport_vde2_buffers(vde_component *component, vde_sobj **out)
+{
+  int sndbuf, rcvbuf;
+  socklen_t optlen;
+  vde_list *iter;
+  vde2_conn *v2_conn;
+  vde_sobj *buffers;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  *out = vde_sobj_new_array();
+  // XXX check out not null
+
+  iter = vde_list_first(tr->conns);
+  while (iter != NULL) {
+    v2_conn = vde_list_get_data(iter);
+
+    // the sizes in use, the kernel may have changed the ones asked for
+    optlen = sizeof(sndbuf);
+    if (getsockopt(v2_conn->data_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                   &optlen) < 0) {
+      sndbuf = -1;
+    }
+    optlen = sizeof(rcvbuf);
+    if (getsockopt(v2_conn->data_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                   &optlen) < 0) {
+      rcvbuf = -1;
+    }
+
+    buffers = vde_sobj_new_hash();
+    vde_sobj_hash_insert(buffers, "id",
+        vde_sobj_new_int(vde_connection_get_id(v2_conn->conn)));
+    vde_sobj_hash_insert(buffers, "sndbuf", vde_sobj_new_int(sndbuf));
+    vde_sobj_hash_insert(buffers, "rcvbuf", vde_sobj_new_int(rcvbuf));
+    vde_sobj_hash_insert(buffers, "tx_stalls",
+                         vde_sobj_new_int(v2_conn->stats.tx_stalls));
+    vde_sobj_hash_insert(buffers, "tx_drops",
+                         vde_sobj_new_int(v2_conn->stats.tx_drops));
+    vde_sobj_hash_insert(buffers, "rx_full",
+                         vde_sobj_new_int(v2_conn->stats.rx_full));
+    vde_sobj_array_add(*out, buffers);
+
+    iter = vde_list_next(iter);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Start the handshake timer of a connection
+ *
+ * @param v2_conn The connection
+ */
+static void vde2_conn_handshake_start(vde2_conn *v2_conn)
+{
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+
+  v2_conn->deadline = vde_clock_ns() +
+                      (uint64_t)tr->handshake_timeout * 1000000;
+}
+
+/**
+ * @brief Get the time left to a connection to complete its handshake, to be
+ * used as the timeout of the handshake events.
+ *
+ * @param v2_conn The connection
+ * @param tv The time left, zero if the deadline has passed
+ *
+ * @return tv
+ */
+static struct timeval *vde2_conn_handshake_left(vde2_conn *v2_conn,
+                                                struct timeval *tv)
+{
+  uint64_t now = vde_clock_ns();
+  uint64_t left = v2_conn->deadline > now ? v2_conn->deadline - now : 0;
+
+  tv->tv_sec = left / 1000000000;
+  tv->tv_usec = (left % 1000000000) / 1000;
+  return tv;
+}
+
+/**
+ * @brief Set the buffer sizes of the datagram socket of a connection
+ *
+ * @param v2_conn The connection
+ * @param sndbuf The send buffer size, 0 to leave it unchanged
+ * @param rcvbuf The receive buffer size, 0 to leave it unchanged
+ */
+static void vde2_conn_set_sockbufs(vde2_conn *v2_conn, int sndbuf, int rcvbuf)
+{
+  if (sndbuf > 0) {
+    if (setsockopt(v2_conn->data_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                   sizeof(sndbuf)) < 0) {
+      vde_warning("%s: cannot set datagram send bufsize to %d on fd %d: %s",
+                  __PRETTY_FUNCTION__, sndbuf, v2_conn->data_fd,
+                  strerror(errno));
+    } else {
+      v2_conn->sndbuf = sndbuf;
+    }
+  }
+  if (rcvbuf > 0) {
+    if (setsockopt(v2_conn->data_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                   sizeof(rcvbuf)) < 0) {
+      vde_warning("%s: cannot set datagram recv bufsize to %d on fd %d: %s",
+                  __PRETTY_FUNCTION__, rcvbuf, v2_conn->data_fd,
+                  strerror(errno));
+    } else {
+      v2_conn->rcvbuf = rcvbuf;
+    }
+  }
+}
+
+/**
+ * @brief Grow or shrink a buffer size
+ *
+ * @param size The current size, 0 if it is not tuned
+ * @param pressure Nonzero if the buffer has been too small
+ * @param shrink Nonzero if the buffer can be shrunk
+ * @param min The initial size
+ * @param max The max size
+ *
+ * @return The new size, 0 if it doesn't change
+ */
+static int vde2_autotune_size(int size, int pressure, int shrink, int min,
+                              int max)
+{
+  if (size == 0) {
+    return 0;
+  }
+  if (pressure && size < max) {
+    return size > max / 2 ? max : size * 2;
+  }
+  if (shrink && size > min) {
+    return size / 2 < min ? min : size / 2;
+  }
+  return 0;
+}
+
+/**
+ * @brief Adapt the buffers of the datagram sockets to the traffic: a buffer
+ * is doubled when sends stalled or packets were dropped (send) or reads left
+ * datagrams behind (receive) since the last round, both are halved back
+ * towards the initial sizes after AUTOTUNE_QUIET quiet rounds.
+ */
+void vde2_tr_autotune(int fd, short event_type, void *arg)
+{
+  int tx_pressure, rx_pressure, shrink;
+  vde_list *iter;
+  vde2_conn *v2_conn;
+  vde_component *component = (vde_component *)arg;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  iter = vde_list_first(tr->conns);
+  while (iter != NULL) {
+    v2_conn = vde_list_get_data(iter);
+
+    tx_pressure = v2_conn->stats.tx_stalls != v2_conn->tuned.tx_stalls ||
+                  v2_conn->stats.tx_drops != v2_conn->tuned.tx_drops;
+    rx_pressure = v2_conn->stats.rx_full != v2_conn->tuned.rx_full;
+    v2_conn->tuned = v2_conn->stats;
+
+    if (tx_pressure || rx_pressure) {
+      v2_conn->quiet_rounds = 0;
+    } else if (v2_conn->quiet_rounds < AUTOTUNE_QUIET) {
+      v2_conn->quiet_rounds++;
+    }
+    shrink = v2_conn->quiet_rounds == AUTOTUNE_QUIET;
+    if (shrink) {
+      v2_conn->quiet_rounds = 0;
+    }
+
+    vde2_conn_set_sockbufs(v2_conn,
+        vde2_autotune_size(v2_conn->sndbuf, tx_pressure, shrink, tr->sndbuf,
+                           tr->sockbuf_max),
+        vde2_autotune_size(v2_conn->rcvbuf, rx_pressure, shrink, tr->rcvbuf,
+                           tr->sockbuf_max));
+
+    iter = vde_list_next(iter);
+  }
+}
+
 void vde2_conn_read_ctl_event(int ctl_fd, short event_type, void *arg)
 {
   int len;
@@ -140,119 +472,396 @@ err_close:
   vde_connection_delete(conn);
 }
 
+/**
+ * @brief Receive up to batch->count datagrams into the packets of a batch
+ *
+ * @param v2_conn The connection to receive from
+ * @param batch The packets to fill, their pkt_len is set to the length of the
+ * received datagram
+ *
+ * @return The number of datagrams received, -1 on error (and errno is set
+ * appropriately)
+ */
+static int vde2_conn_recv_batch(vde2_conn *v2_conn, vde_pkt_batch *batch)
+{
+  unsigned int i;
+  int rcvd;
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iov[VDE_PKT_BATCH_MAX];
+  unsigned int max_payload = vde_connection_max_payload(v2_conn->conn);
+
+  memset(msgs, 0, batch->count * sizeof(struct mmsghdr));
+  for (i = 0; i < batch->count; i++) {
+    // XXX: check received sock with remote path??
+    iov[i].iov_base = batch->pkts[i]->payload;
+    iov[i].iov_len = max_payload;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  rcvd = recvmmsg(v2_conn->data_fd, msgs, batch->count, MSG_DONTWAIT, NULL);
+  if (rcvd < 0) {
+    return -1;
+  }
+  for (i = 0; i < rcvd; i++) {
+    batch->pkts[i]->hdr->pkt_len = msgs[i].msg_len;
+  }
+  return rcvd;
+}
+
 void vde2_conn_read_data_event(int data_fd, short event_type, void *arg)
 {
-  vde2_pkt stack_pkt;
   vde_pkt *pkt;
-  struct sockaddr sock;
-  int len;
+  vde_pkt_batch batch, frames;
+  unsigned int i, chunk, total = 0;
+  int rcvd;
   int cb_errno = 0;
-  socklen_t socklen = sizeof(sock);
+  uint64_t now;
   vde2_conn *v2_conn = (vde2_conn *)arg;
   vde_connection *conn = v2_conn->conn;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+  vde_pool *pool = vde_context_get_pool(vde_connection_get_context(conn));
+
+  // drain the socket up to the budget, the event triggers again if some
+  // datagrams are left
+  while (total < tr->rx_budget) {
+    chunk = v2_conn->rx_hint;
+    if (chunk > tr->rx_budget - total) {
+      chunk = tr->rx_budget - total;
+    }
 
-  if ( (vde_connection_get_pkt_headsize(conn) <= MAX_HEAD_SZ)
-        && (vde_connection_get_pkt_tailsize(conn) <= MAX_TAIL_SZ) ) {
-    pkt = &stack_pkt.pkt;
-    vde_pkt_init(pkt, PKT_DATA_SZ, vde_connection_get_pkt_headsize(conn),
-                 vde_connection_get_pkt_tailsize(conn));
-  } else {
-    // XXX: perform dynamic allocation
-    vde_warning("%s: requested head + tail size too large, skipping",
-                __PRETTY_FUNCTION__);
-    return;
-  }
+    // receive directly into the payload, leaving the space the engine asked
+    // for around it
+    vde_pkt_batch_init(&batch);
+    for (i = 0; i < chunk; i++) {
+      pkt = vde_pool_pkt_new(pool, vde_connection_max_payload(conn),
+                             vde_connection_get_pkt_headsize(conn),
+                             vde_connection_get_pkt_tailsize(conn));
+      if (pkt == NULL) {
+        break;
+      }
+      vde_pkt_batch_add(&batch, pkt);
+    }
+    if (batch.count == 0) {
+      vde_warning("%s: cannot allocate packet, dropping: %s",
+                  __PRETTY_FUNCTION__, strerror(errno));
+      // discard a datagram, or the event will trigger again
+      recv(v2_conn->data_fd, NULL, 0, MSG_DONTWAIT);
+      return;
+    }
+    // the pool may have given us less than asked for, and the batch is
+    // emptied before the end of the loop
+    chunk = batch.count;
+
+    rcvd = vde2_conn_recv_batch(v2_conn, &batch);
+    if (rcvd <= 0) {
+      if (rcvd < 0 && errno != EAGAIN) {
+        // XXX: handle this error situation, call error_cb?
+        vde_warning("%s: error reading from data_fd %d: %s",
+                    __PRETTY_FUNCTION__, v2_conn->data_fd, strerror(errno));
+      } else if (total == 0) {
+        vde_warning("%s: got EAGAIN on data_fd %d", __PRETTY_FUNCTION__,
+                    v2_conn->data_fd);
+      }
+      vde_pkt_batch_put(&batch);
+      break;
+    }
+    total += rcvd;
+
+    // grow the next chunk while the socket keeps filling it, so that idle
+    // connections don't take many packets from the pool at each wakeup
+    if (rcvd == chunk) {
+      v2_conn->rx_hint = rcvd * 2 < VDE_PKT_BATCH_MAX ? rcvd * 2 :
+                                                        VDE_PKT_BATCH_MAX;
+    } else {
+      v2_conn->rx_hint = rcvd;
+    }
 
-  len = recvfrom(v2_conn->data_fd, pkt->payload, sizeof(struct eth_frame), 0,
-                 &sock, &socklen);
-  // XXX: check received sock with remote path??
-  if (len >= sizeof(struct eth_hdr)) {
-    // XXX: set hdr version and type
-    pkt->hdr->pkt_len = len;
-    if (vde_connection_call_read(conn, pkt)) {
+    now = vde_clock_ns();
+    vde_pkt_batch_init(&frames);
+    for (i = 0; i < rcvd; i++) {
+      pkt = batch.pkts[i];
+      if (pkt->hdr->pkt_len < sizeof(struct eth_hdr)) {
+        vde_warning("%s: short frame from data_fd %d, dropping",
+                    __PRETTY_FUNCTION__, v2_conn->data_fd);
+        continue;
+      }
+      vde_pkt_meta_rx(pkt, vde_connection_get_id(conn), now);
+      vde_pkt_batch_add(&frames, pkt);
+    }
+    if (frames.count > 0 && vde_connection_call_read_batch(conn, &frames)) {
       cb_errno = errno;
     }
-  } else if (len < 0) {
-    if (errno == EAGAIN) {
-      vde_warning("%s: got EAGAIN on data_fd %d", __PRETTY_FUNCTION__,
-                  v2_conn->data_fd);
-    } else {
-    // XXX: handle this error situation, call error_cb?
-    vde_warning("%s: error reading from data_fd %d: %s", __PRETTY_FUNCTION__,
-                v2_conn->data_fd, strerror(errno));
+
+    // drop our references, whoever needs the packets has taken its own
+    vde_pkt_batch_put(&batch);
+
+    if (cb_errno == EPIPE) {
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+      return;
+    }
+    if (rcvd < chunk) {
+      break; // the socket is empty
     }
-  } else if (len == 0) {
-    vde_warning("%s: EOF from data_fd %d: %s", __PRETTY_FUNCTION__,
-                v2_conn->data_fd, strerror(errno));
   }
+  if (total >= tr->rx_budget) {
+    v2_conn->stats.rx_full++;
+  }
+}
 
-  // XXX: free packet if previously allocated with dynamic allocation
+// address a message for sendmmsg() to the peer
+static inline void vde2_conn_msg_fill(vde2_conn *v2_conn, struct mmsghdr *msg,
+                                      struct iovec *iov, int iovcnt)
+{
+  memset(msg, 0, sizeof(struct mmsghdr));
+  msg->msg_hdr.msg_name = &v2_conn->remote_sa;
+  msg->msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+  msg->msg_hdr.msg_iov = iov;
+  msg->msg_hdr.msg_iovlen = iovcnt;
+}
 
-  if (cb_errno == EPIPE) {
-    vde_connection_fini(conn);
-    vde_connection_delete(conn);
+/**
+ * @brief Describe the frame carried by a packet with a message for
+ * sendmmsg(), chained packets are sent without copying them.
+ *
+ * @param v2_conn The connection the packet is sent to
+ * @param pkt The packet, if it has more than SEND_IOV_MAX segments it is
+ * replaced with a linear copy and the reference to the original is dropped
+ * @param msg The message to fill
+ * @param iov An array of SEND_IOV_MAX elements to describe the frame
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde2_conn_msg_init(vde2_conn *v2_conn, vde_pkt **pkt,
+                              struct mmsghdr *msg, struct iovec *iov)
+{
+  int iovcnt;
+  vde_pkt *linear;
+
+  iovcnt = vde_pkt_to_iovec(*pkt, iov, SEND_IOV_MAX);
+  if (iovcnt < 0) {
+    // too many segments, send a linear copy
+    linear = vde_pkt_dup(*pkt, 0, 0);
+    if (linear == NULL) {
+      return -1;
+    }
+    vde_pkt_put(*pkt);
+    *pkt = linear;
+    iovcnt = vde_pkt_to_iovec(linear, iov, SEND_IOV_MAX);
+  }
+
+  vde2_conn_msg_fill(v2_conn, msg, iov, iovcnt);
+  return 0;
+}
+
+static unsigned int vde2_tr_tx_defer(vde2_conn *v2_conn, vde_pkt **pkts,
+                                     unsigned int count);
+
+/**
+ * @brief Send packets right away if nothing is waiting in the queue, saving
+ * the queueing and the write event for the common case of a peer keeping up.
+ *
+ * Packets are not sent this way if the connection user wants to be notified
+ * of sent packets: the callbacks could write again on the connection, they are
+ * only called from the write event. Packets to ports of the shared socket
+ * written while it is being read are deferred and sent with one sendmmsg().
+ *
+ * @param v2_conn The connection
+ * @param pkts The packets to send, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of packets sent, the following ones must be queued
+ */
+static unsigned int vde2_conn_send_now(vde2_conn *v2_conn, vde_pkt **pkts,
+                                       unsigned int count)
+{
+  unsigned int i;
+  int iovcnt, sent;
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iov[VDE_PKT_BATCH_MAX][SEND_IOV_MAX];
+  vde_connection *conn = v2_conn->conn;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+
+  if ((vde_ring_is_init(&v2_conn->pkt_queue) &&
+       !vde_ring_is_empty(&v2_conn->pkt_queue)) ||
+      vde_connection_has_write_cb(conn)) {
+    return 0;
+  }
+  if (v2_conn->shared && tr->tx_cork) {
+    return vde2_tr_tx_defer(v2_conn, pkts, count);
+  }
+
+  if (count > VDE_PKT_BATCH_MAX) {
+    count = VDE_PKT_BATCH_MAX;
+  }
+  for (i = 0; i < count; i++) {
+    // oversized frames and long chains are handled by the queue
+    if (vde_pkt_len(pkts[i]) > vde_connection_max_payload(conn)) {
+      break;
+    }
+    iovcnt = vde_pkt_to_iovec(pkts[i], iov[i], SEND_IOV_MAX);
+    if (iovcnt < 0) {
+      break;
+    }
+    vde2_conn_msg_fill(v2_conn, &msgs[i], iov[i], iovcnt);
+  }
+  if (i == 0) {
+    return 0;
+  }
+
+  // errors are not reported here, the packets get queued and the write event
+  // will deal with them
+  sent = sendmmsg(v2_conn->data_fd, msgs, i, MSG_DONTWAIT);
+  if (sent < (int)i && (sent >= 0 || errno == EAGAIN)) {
+    v2_conn->stats.tx_stalls++;
+  }
+  return sent < 0 ? 0 : sent;
+}
+
+/**
+ * @brief Put back at the tail of the queue a packet which could not be sent,
+ * if the queue has been filled in the meantime the packet is dropped.
+ *
+ * @param v2_conn The connection
+ * @param pkt The packet, popped from the queue
+ */
+static void vde2_conn_requeue(vde2_conn *v2_conn, vde_pkt *pkt)
+{
+  if (vde_ring_push_tail(&v2_conn->pkt_queue, pkt)) {
+    vde_warning("%s: packet queue for %d is full, discarding",
+                __PRETTY_FUNCTION__, v2_conn->data_fd);
+    v2_conn->stats.tx_drops++;
+    vde_connection_queue_release(v2_conn->conn, vde_pkt_len(pkt));
+    vde_pkt_put(pkt);
+  }
+}
+
+/**
+ * @brief Handle the packet at the tail of the queue which could not be sent
+ *
+ * @param v2_conn The connection
+ * @param pkt The packet, popped from the queue
+ * @param send_errno The error of the send
+ *
+ * @return zero if the connection is still usable, -1 if it must be closed
+ */
+static int vde2_conn_send_failed(vde2_conn *v2_conn, vde_pkt *pkt,
+                                 int send_errno)
+{
+  int cb_errno = 0;
+  vde_connection *conn = v2_conn->conn;
+
+  if (send_errno != EAGAIN) {
+    v2_conn->numtries = 0;
+    vde_connection_queue_release(conn, vde_pkt_len(pkt));
+    if (vde_connection_call_error(conn, pkt, CONN_WRITE_CLOSED)) {
+      cb_errno = errno;
+    }
+    vde_pkt_put(pkt);
+    if (cb_errno == EPIPE) {
+      return -1;
+    }
+    vde_warning("%s: fatal error on data_fd %d but connection not closed",
+                __PRETTY_FUNCTION__, v2_conn->data_fd);
+    return 0;
+  }
+
+  v2_conn->stats.tx_stalls++;
+  v2_conn->numtries++;
+  if (v2_conn->numtries > vde_connection_get_send_maxtries(conn)) {
+    v2_conn->numtries = 0;
+    v2_conn->stats.tx_drops++;
+    vde_connection_queue_release(conn, vde_pkt_len(pkt));
+    if (vde_connection_call_error(conn, pkt, CONN_WRITE_DELAY)) {
+      cb_errno = errno;
+    }
+    vde_pkt_put(pkt);
+    if (cb_errno == EPIPE) {
+      return -1;
+    }
+  } else {
+    vde2_conn_requeue(v2_conn, pkt);
   }
+  return 0;
 }
 
 void vde2_conn_write_data_event(int data_fd, short event_type, void *arg)
 {
-  int len;
-  vde2_pkt *v2_pkt;
-  vde_pkt *pkt;
+  unsigned int i, count;
+  int sent, send_errno;
   int cb_errno = 0;
+  vde_pkt_batch batch;
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iov[VDE_PKT_BATCH_MAX][SEND_IOV_MAX];
   vde2_conn *v2_conn = (vde2_conn *)arg;
   vde_connection *conn = v2_conn->conn;
 
-  v2_pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
-  while (v2_pkt != NULL) {
-    pkt = &v2_pkt->pkt;
-    len = sendto(v2_conn->data_fd, pkt->payload, pkt->hdr->pkt_len, 0,
-                 (const struct sockaddr *)&v2_conn->remote_sa,
-                 sizeof(struct sockaddr_un));
-    if (len == pkt->hdr->pkt_len) {
-      if (vde_connection_call_write(conn, pkt)) {
-        cb_errno = errno;
+  while (!vde_ring_is_empty(&v2_conn->pkt_queue)) {
+    // the oldest packets are at the tail of the queue
+    vde_pkt_batch_init(&batch);
+    while (!vde_pkt_batch_is_full(&batch) &&
+           !vde_ring_is_empty(&v2_conn->pkt_queue)) {
+      vde_pkt_batch_add(&batch, vde_ring_pop_tail(&v2_conn->pkt_queue));
+      if (vde2_conn_msg_init(v2_conn, &batch.pkts[batch.count - 1],
+                             &msgs[batch.count - 1], iov[batch.count - 1])) {
+        // not enough memory to linearize, retry on next event
+        batch.count--;
+        vde2_conn_requeue(v2_conn, batch.pkts[batch.count]);
+        break;
       }
-      vde_cached_free_type(vde2_pkt, v2_pkt);
-      if (cb_errno == EPIPE) {
-        goto err_close;
+    }
+    if (batch.count == 0) {
+      break;
+    }
+    count = batch.count;
+
+    sent = sendmmsg(v2_conn->data_fd, msgs, count, MSG_DONTWAIT);
+    // messages after the first one which could not be sent are not tried
+    send_errno = sent < 0 ? errno : EAGAIN;
+    if (sent < 0) {
+      sent = 0;
+    }
+
+    // give back the packets not sent, keeping the order
+    for (i = count; i > sent + 1; i--) {
+      vde2_conn_requeue(v2_conn, batch.pkts[i - 1]);
+    }
+    batch.count = sent;
+
+    if (sent > 0) {
+      v2_conn->numtries = 0;
+      for (i = 0; i < sent; i++) {
+        vde_connection_queue_release(conn, vde_pkt_len(batch.pkts[i]));
       }
-    } else if ((len < 0) && (errno != EAGAIN)) {
-      if (vde_connection_call_error(conn, pkt, CONN_WRITE_CLOSED)) {
+      // a single notification for the whole batch
+      if (vde_connection_call_write_batch(conn, &batch)) {
         cb_errno = errno;
       }
-      vde_cached_free_type(vde2_pkt, v2_pkt);
+      vde_pkt_batch_put(&batch);
+    }
+
+    if (sent < count) {
       if (cb_errno == EPIPE) {
-        goto err_close;
-      } else {
-        vde_warning("%s: fatal error on data_fd %d but connection not closed",
-                    __PRETTY_FUNCTION__, v2_conn->data_fd);
-        break;
-      }
-    } else { /* (0 < len < pkt_len) || (len < 0 && errno == EAGAIN) */
-      v2_pkt->numtries++;
-      if (v2_pkt->numtries > vde_connection_get_send_maxtries(conn)) {
-        if (vde_connection_call_error(conn, pkt, CONN_WRITE_DELAY)) {
-          cb_errno = errno;
-        }
-        vde_cached_free_type(vde2_pkt, v2_pkt);
-        if (cb_errno == EPIPE) {
-          goto err_close;
-        }
-      } else {
-        vde_queue_push_tail(v2_conn->pkt_queue, v2_pkt);
+        // released along with the queue
+        vde2_conn_requeue(v2_conn, batch.pkts[sent]);
+      } else if (vde2_conn_send_failed(v2_conn, batch.pkts[sent],
+                                       send_errno)) {
+        cb_errno = EPIPE;
       }
+    }
+    if (cb_errno == EPIPE) {
+      goto err_close;
+    }
+    if (sent < count) {
       break; // give up sending
     }
-    v2_pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
   }
 
-  if (v2_pkt == NULL) {
+  if (vde_ring_is_empty(&v2_conn->pkt_queue)) {
     vde_context_event_del(vde_connection_get_context(conn),
                           v2_conn->data_ev_wr);
     v2_conn->data_ev_wr = NULL;
   }
-
   return;
 
 err_close:
@@ -260,37 +869,50 @@ err_close:
   vde_connection_delete(conn);
 }
 
-int vde2_conn_write(vde_connection *conn, vde_pkt *pkt)
+static int vde2_conn_enqueue(vde2_conn *v2_conn, vde_pkt *pkt)
 {
-  vde2_pkt *v2_pkt;
-  vde2_conn *v2_conn = vde_connection_get_priv(conn);
+  vde_pkt *q_pkt;
+  vde_connection *conn = v2_conn->conn;
 
-  if (vde_queue_get_length(v2_conn->pkt_queue) >= MAXQLEN) {
+  if (vde_pkt_len(pkt) > vde_connection_max_payload(conn)) {
+    vde_warning("%s: packet larger than mtu for %d, discarding",
+                __PRETTY_FUNCTION__, v2_conn->data_fd);
+    errno = EMSGSIZE;
+    return -1;
+  }
+  // the queue is allocated on first use, connections which never need to
+  // queue don't take memory for it
+  if (!vde_ring_is_init(&v2_conn->pkt_queue) &&
+      vde_ring_init(&v2_conn->pkt_queue,
+                    vde_connection_get_queue_maxlen(conn))) {
+    vde_warning("%s: cannot allocate packet queue for %d, discarding",
+                __PRETTY_FUNCTION__, v2_conn->data_fd);
+    return -1;
+  }
+  if (vde_ring_is_full(&v2_conn->pkt_queue) ||
+      vde_connection_queue_reserve(conn, vde_pkt_len(pkt))) {
     vde_warning("%s: packet queue for %d is full, discarding",
                 __PRETTY_FUNCTION__, v2_conn->data_fd);
+    v2_conn->stats.tx_drops++;
     errno = EAGAIN;
     return -1; // discard pkt
   }
-  if (pkt->data_size > PKT_DATA_SZ) {
-    // XXX: should alloc a struct greater than sizeof(vde2_pkt)
-    vde_warning("%s: packet size larger than vde2_pkt, discarding",
-                __PRETTY_FUNCTION__);
-    errno = EBADMSG;
-    return -1;
-  }
-  v2_pkt = vde_cached_alloc(sizeof(vde2_pkt));
-  if (v2_pkt == NULL) {
-    vde_warning("%s: cannot alloc new pkt, discarding", __PRETTY_FUNCTION__);
-    errno = ENOMEM;
+  // only payload is sent, a reference is enough unless pkt is borrowed
+  q_pkt = vde_pool_pkt_share(
+            vde_context_get_pool(vde_connection_get_context(conn)), pkt);
+  if (q_pkt == NULL) {
+    vde_warning("%s: cannot share pkt, discarding", __PRETTY_FUNCTION__);
+    vde_connection_queue_release(conn, vde_pkt_len(pkt));
     return -1;
   }
 
-  v2_pkt->numtries = 0;
-
-  vde_pkt_compact_cpy(&v2_pkt->pkt, pkt);
+  vde_ring_push_head(&v2_conn->pkt_queue, q_pkt);
+  return 0;
+}
 
-  // XXX: check push ok
-  vde_queue_push_head(v2_conn->pkt_queue, v2_pkt);
+static void vde2_conn_write_event_start(vde2_conn *v2_conn)
+{
+  vde_connection *conn = v2_conn->conn;
 
   if (v2_conn->data_ev_wr == NULL) {
     v2_conn->data_ev_wr = vde_context_event_add(
@@ -301,149 +923,548 @@ int vde2_conn_write(vde_connection *conn, vde_pkt *pkt)
                             &vde2_conn_write_data_event,
                             (void *)v2_conn);
   }
-  return 0;
 }
 
-void vde2_conn_close(vde_connection *conn)
+int vde2_conn_write(vde_connection *conn, vde_pkt *pkt)
 {
-  vde2_pkt *pkt;
   vde2_conn *v2_conn = vde_connection_get_priv(conn);
-  vde_context *ctx = vde_connection_get_context(conn);
 
-  if (v2_conn->data_fd >= 0){
-    close(v2_conn->data_fd);
+  if (vde2_conn_send_now(v2_conn, &pkt, 1) == 1) {
+    return 0;
   }
-  if (v2_conn->data_ev_rd != NULL) {
-    vde_context_event_del(ctx, v2_conn->data_ev_rd);
-  }
-  if (v2_conn->data_ev_wr != NULL) {
-    vde_context_event_del(ctx, v2_conn->data_ev_wr);
-  }
-  if (v2_conn->local_sa.sun_path != NULL) {
-    unlink(v2_conn->local_sa.sun_path);
+  if (vde2_conn_enqueue(v2_conn, pkt)) {
+    return -1;
   }
-  if (v2_conn->ctl_fd >= 0){
-    close(v2_conn->ctl_fd);
+  vde2_conn_write_event_start(v2_conn);
+  return 0;
+}
+
+unsigned int vde2_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  unsigned int i, sent;
+  int tmp_errno;
+  vde2_conn *v2_conn = vde_connection_get_priv(conn);
+
+  sent = vde2_conn_send_now(v2_conn, batch->pkts, batch->count);
+  if (sent == batch->count) {
+    return sent;
   }
-  if (v2_conn->ctl_ev != NULL) {
-    vde_context_event_del(ctx, v2_conn->ctl_ev);
+
+  for (i = sent; i < batch->count; i++) {
+    if (i + 1 < batch->count) {
+      vde_pkt_prefetch(batch->pkts[i + 1]);
+    }
+    if (vde2_conn_enqueue(v2_conn, batch->pkts[i])) {
+      break;
+    }
   }
-  if (v2_conn->remote_request) {
-    vde_free(v2_conn->remote_request);
+  if (i > sent) {
+    tmp_errno = errno;
+    vde2_conn_write_event_start(v2_conn);
+    errno = tmp_errno;
   }
-  pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
-  while (pkt != NULL) {
-    // XXX: handle dynamic allocation case
-    vde_cached_free_type(vde2_pkt, pkt);
-    pkt = vde_queue_pop_tail(v2_conn->pkt_queue);
+  return i;
+}
+
+/*
+ * In shared socket mode all the ports receive from and send to one datagram
+ * socket: ingress datagrams are demultiplexed by the path of the sender and
+ * the packets written to the ports while it is being read are sent to all
+ * the peers at once by vde2_tr_tx_flush().
+ */
+
+/**
+ * @brief Send the packets deferred by vde2_tr_tx_defer() with sendmmsg(), the
+ * packets of a peer which can't receive are moved to the queue of its port.
+ *
+ * @param component The transport
+ */
+static void vde2_tr_tx_flush(vde_component *component)
+{
+  unsigned int i, j, next = 0, count;
+  int sent;
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  vde2_conn *v2_conn;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  count = tr->tx_count;
+  if (count == 0) {
+    return;
+  }
+  tr->tx_count = 0;
+  if (count > tr->shared_tx_max) {
+    tr->shared_tx_max = count;
   }
-  vde_queue_delete(v2_conn->pkt_queue);
 
-  vde_free(v2_conn);
+  for (i = 0; i < count; i++) {
+    vde2_conn_msg_fill(tr->tx_conns[i], &msgs[i], tr->tx_iov[i],
+                       tr->tx_iovcnt[i]);
+  }
+
+  while (next < count) {
+    sent = sendmmsg(tr->shared_fd, &msgs[next], count - next, MSG_DONTWAIT);
+    if (sent > 0) {
+      for (i = next; i < next + sent; i++) {
+        vde_pkt_put(tr->tx_pkts[i]);
+      }
+      next += sent;
+      continue;
+    }
+
+    v2_conn = tr->tx_conns[next];
+    if (errno != EAGAIN) {
+      // XXX: the peer is gone, its control connection will tell
+      vde_warning("%s: cannot send to %s: %s", __PRETTY_FUNCTION__,
+                  v2_conn->remote_sa.sun_path, strerror(errno));
+      v2_conn->stats.tx_drops++;
+      vde_pkt_put(tr->tx_pkts[next]);
+      next++;
+      continue;
+    }
+
+    // the peer is full: queue its packets and go on with the other peers
+    v2_conn->stats.tx_stalls++;
+    for (i = next, j = next; i < count; i++) {
+      if (tr->tx_conns[i] == v2_conn) {
+        if (vde2_conn_enqueue(v2_conn, tr->tx_pkts[i]) == 0) {
+          vde2_conn_write_event_start(v2_conn);
+        }
+        vde_pkt_put(tr->tx_pkts[i]);
+        continue;
+      }
+      msgs[j] = msgs[i];
+      tr->tx_conns[j] = tr->tx_conns[i];
+      tr->tx_pkts[j] = tr->tx_pkts[i];
+      j++;
+    }
+    count = j;
+  }
+}
+
+/**
+ * @brief Defer sending packets to a port of the shared socket
+ *
+ * @param v2_conn The port
+ * @param pkts The packets to send, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of packets deferred, the following ones must be queued
+ */
+static unsigned int vde2_tr_tx_defer(vde2_conn *v2_conn, vde_pkt **pkts,
+                                     unsigned int count)
+{
+  unsigned int i;
+  int iovcnt;
+  vde_pkt *pkt;
+  vde_connection *conn = v2_conn->conn;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+  vde_pool *pool = vde_context_get_pool(vde_connection_get_context(conn));
+
+  for (i = 0; i < count; i++) {
+    if (vde_pkt_len(pkts[i]) > vde_connection_max_payload(conn)) {
+      break;
+    }
+    if (tr->tx_count == VDE_PKT_BATCH_MAX) {
+      vde2_tr_tx_flush(v2_conn->transport);
+      // the flush may have queued packets of this port, keep the order
+      if (vde_ring_is_init(&v2_conn->pkt_queue) &&
+          !vde_ring_is_empty(&v2_conn->pkt_queue)) {
+        break;
+      }
+    }
+
+    pkt = vde_pool_pkt_share(pool, pkts[i]);
+    if (pkt == NULL) {
+      break;
+    }
+    iovcnt = vde_pkt_to_iovec(pkt, tr->tx_iov[tr->tx_count], SEND_IOV_MAX);
+    if (iovcnt < 0) {
+      // long chains are linearized by the queue
+      vde_pkt_put(pkt);
+      break;
+    }
+    tr->tx_conns[tr->tx_count] = v2_conn;
+    tr->tx_pkts[tr->tx_count] = pkt;
+    tr->tx_iovcnt[tr->tx_count] = iovcnt;
+    tr->tx_count++;
+  }
+  return i;
+}
+
+/**
+ * @brief Drop the deferred packets of a port which is being closed
+ *
+ * @param tr The transport
+ * @param v2_conn The port
+ */
+static void vde2_tr_tx_purge(vde2_tr *tr, vde2_conn *v2_conn)
+{
+  unsigned int i, j;
+
+  for (i = 0, j = 0; i < tr->tx_count; i++) {
+    if (tr->tx_conns[i] == v2_conn) {
+      vde_pkt_put(tr->tx_pkts[i]);
+      continue;
+    }
+    if (j != i) {
+      tr->tx_conns[j] = tr->tx_conns[i];
+      tr->tx_pkts[j] = tr->tx_pkts[i];
+      tr->tx_iovcnt[j] = tr->tx_iovcnt[i];
+      memcpy(tr->tx_iov[j], tr->tx_iov[i], sizeof(tr->tx_iov[i]));
+    }
+    j++;
+  }
+  tr->tx_count = j;
+}
+
+/**
+ * @brief Hand a run of frames received on the shared socket to their port
+ *
+ * @param v2_conn The port
+ * @param frames The frames, the batch is emptied
+ */
+static void vde2_conn_deliver(vde2_conn *v2_conn, vde_pkt_batch *frames)
+{
+  int cb_errno = 0;
+  vde_connection *conn = v2_conn->conn;
+
+  if (frames->count > 0 && vde_connection_call_read_batch(conn, frames)) {
+    cb_errno = errno;
+  }
+  vde_pkt_batch_init(frames);
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
 }
 
-static int vde2_remove_sock_if_unused(struct sockaddr_un *sa_unix)
+/**
+ * @brief Grow the head/tail space of the packets received from the shared
+ * socket to the one asked for by the engine of a port
+ *
+ * @param tr The transport
+ * @param v2_conn The port
+ */
+static inline void vde2_tr_shared_pkt_properties(vde2_tr *tr,
+                                                 vde2_conn *v2_conn)
 {
-  int test_fd, ret = 1;
+  unsigned int head = vde_connection_get_pkt_headsize(v2_conn->conn);
+  unsigned int tail = vde_connection_get_pkt_tailsize(v2_conn->conn);
 
-  if ((test_fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
-    vde_error("%s: socket %s", __PRETTY_FUNCTION__, strerror(errno));
-    return 1;
+  if (head > tr->shared_headsize) {
+    tr->shared_headsize = head;
+  }
+  if (tail > tr->shared_tailsize) {
+    tr->shared_tailsize = tail;
   }
-  if (connect(test_fd, (struct sockaddr *) sa_unix, sizeof(*sa_unix)) < 0) {
-    if (errno == ECONNREFUSED) {
-      if (unlink(sa_unix->sun_path) < 0) {
-        vde_error("%s: failed to removed unused socket '%s': %s",
-            __PRETTY_FUNCTION__, sa_unix->sun_path, strerror(errno));
+}
+
+void vde2_tr_read_shared_event(int shared_fd, short event_type, void *arg)
+{
+  vde_pkt *pkt;
+  vde_pkt_batch batch, frames;
+  struct mmsghdr msgs[VDE_PKT_BATCH_MAX];
+  struct iovec iov[VDE_PKT_BATCH_MAX];
+  struct sockaddr_un names[VDE_PKT_BATCH_MAX];
+  unsigned int i, chunk, total = 0;
+  int rcvd, path_len;
+  uint64_t now;
+  vde2_conn *v2_conn;
+  vde_component *component = (vde_component *)arg;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+  vde_pool *pool = vde_context_get_pool(vde_component_get_context(component));
+
+  // the ports written while the frames are handed out are sent together
+  tr->tx_cork++;
+
+  while (total < tr->rx_budget) {
+    chunk = tr->shared_rx_hint;
+    if (chunk > tr->rx_budget - total) {
+      chunk = tr->rx_budget - total;
+    }
+
+    // the port is not known yet, packets get the largest head/tail space
+    // asked for by the engines of the ports seen so far
+    vde_pkt_batch_init(&batch);
+    for (i = 0; i < chunk; i++) {
+      pkt = vde_pool_pkt_new(pool, tr->frame_len, tr->shared_headsize,
+                             tr->shared_tailsize);
+      if (pkt == NULL) {
+        break;
+      }
+      vde_pkt_batch_add(&batch, pkt);
+    }
+    if (batch.count == 0) {
+      vde_warning("%s: cannot allocate packet, dropping: %s",
+                  __PRETTY_FUNCTION__, strerror(errno));
+      recv(shared_fd, NULL, 0, MSG_DONTWAIT);
+      break;
+    }
+    chunk = batch.count;
+
+    memset(msgs, 0, batch.count * sizeof(struct mmsghdr));
+    for (i = 0; i < batch.count; i++) {
+      iov[i].iov_base = batch.pkts[i]->payload;
+      iov[i].iov_len = tr->frame_len;
+      msgs[i].msg_hdr.msg_name = &names[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    rcvd = recvmmsg(shared_fd, msgs, batch.count, MSG_DONTWAIT, NULL);
+    if (rcvd <= 0) {
+      if (rcvd < 0 && errno != EAGAIN) {
+        vde_warning("%s: error reading from shared socket %d: %s",
+                    __PRETTY_FUNCTION__, shared_fd, strerror(errno));
       }
-      ret = 0;
+      vde_pkt_batch_put(&batch);
+      break;
+    }
+    total += rcvd;
+
+    if (rcvd == chunk) {
+      tr->shared_rx_hint = rcvd * 2 < VDE_PKT_BATCH_MAX ? rcvd * 2 :
+                                                          VDE_PKT_BATCH_MAX;
     } else {
-      vde_error("%s: connect %s", __PRETTY_FUNCTION__, strerror(errno));
+      tr->shared_rx_hint = rcvd;
+    }
+
+    // consecutive frames of a port are handed to it as a batch, the port is
+    // looked up again after each run because the engine may close ports
+    now = vde_clock_ns();
+    v2_conn = NULL;
+    vde_pkt_batch_init(&frames);
+    for (i = 0; i < rcvd; i++) {
+      pkt = batch.pkts[i];
+      pkt->hdr->pkt_len = msgs[i].msg_len;
+
+      path_len = (int)msgs[i].msg_hdr.msg_namelen -
+                 (int)offsetof(struct sockaddr_un, sun_path);
+      if (path_len <= 0 || path_len >= sizeof(names[i].sun_path)) {
+        tr->shared_unknown++;
+        continue;
+      }
+      names[i].sun_path[path_len] = 0;
+
+      if (v2_conn == NULL ||
+          strcmp(names[i].sun_path, v2_conn->remote_sa.sun_path) != 0) {
+        if (v2_conn != NULL) {
+          vde2_conn_deliver(v2_conn, &frames);
+        }
+        v2_conn = vde_hash_lookup(tr->peers, names[i].sun_path);
+        if (v2_conn == NULL) {
+          tr->shared_unknown++;
+          continue;
+        }
+        vde2_tr_shared_pkt_properties(tr, v2_conn);
+      }
+
+      if (pkt->hdr->pkt_len < sizeof(struct eth_hdr)) {
+        vde_warning("%s: short frame from %s, dropping", __PRETTY_FUNCTION__,
+                    names[i].sun_path);
+        continue;
+      }
+      vde_pkt_meta_rx(pkt, vde_connection_get_id(v2_conn->conn), now);
+      vde_pkt_batch_add(&frames, pkt);
+    }
+    if (v2_conn != NULL) {
+      vde2_conn_deliver(v2_conn, &frames);
+    }
+
+    // drop our references, whoever needs the packets has taken its own
+    vde_pkt_batch_put(&batch);
+
+    if (rcvd < chunk) {
+      break; // the socket is empty
     }
   }
-  close(test_fd);
-  return ret;
+  if (total > tr->shared_rx_max) {
+    tr->shared_rx_max = total;
+  }
+
+  tr->tx_cork--;
+  vde2_tr_tx_flush(component);
 }
 
-// XXX: check VDE_DARWIN defines here!!!
-void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
+void vde2_conn_close(vde_connection *conn)
 {
-  int len;
-#ifdef VDE_DARWIN
-  int sockbufsize = DATA_BUF_SIZE;
-  int optsize = sizeof(sockbufsize);
-#endif
-  vde2_conn *v2_conn = (vde2_conn *)arg;
-  vde_connection *conn = v2_conn->conn;
+  vde_pkt *pkt;
+  vde2_conn *v2_conn = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
   vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
-  vde_context *ctx = vde_component_get_context(v2_conn->transport);
 
-  vde_context_event_del(ctx, v2_conn->ctl_ev);
-  v2_conn->ctl_ev = NULL;
+  if (v2_conn->shared) {
+    // the socket belongs to the transport
+    if (vde_hash_lookup(tr->peers, v2_conn->remote_sa.sun_path) == v2_conn) {
+      vde_hash_remove(tr->peers, v2_conn->remote_sa.sun_path);
+    }
+    vde2_tr_tx_purge(tr, v2_conn);
+  } else if (v2_conn->data_fd >= 0){
+    close(v2_conn->data_fd);
+  }
+  if (v2_conn->data_ev_rd != NULL) {
+    vde_context_event_del(ctx, v2_conn->data_ev_rd);
+  }
+  if (v2_conn->data_ev_wr != NULL) {
+    vde_context_event_del(ctx, v2_conn->data_ev_wr);
+  }
+  if (v2_conn->local_sa.sun_path[0] != 0) {
+    unlink(v2_conn->local_sa.sun_path);
+  }
+  if (v2_conn->ctl_fd >= 0){
+    close(v2_conn->ctl_fd);
+  }
+  if (v2_conn->ctl_ev != NULL) {
+    vde_context_event_del(ctx, v2_conn->ctl_ev);
+  }
+  if (v2_conn->connect_to != NULL) {
+    vde_context_timeout_del(ctx, v2_conn->connect_to);
+  }
+  if (v2_conn->remote_request) {
+    vde_free(v2_conn->remote_request);
+  }
+  if (vde_ring_is_init(&v2_conn->pkt_queue)) {
+    pkt = vde_ring_pop_tail(&v2_conn->pkt_queue);
+    while (pkt != NULL) {
+      vde_connection_queue_release(conn, vde_pkt_len(pkt));
+      vde_pkt_put(pkt);
+      pkt = vde_ring_pop_tail(&v2_conn->pkt_queue);
+    }
+    vde_ring_fini(&v2_conn->pkt_queue);
+  }
+  tr->conns = vde_list_remove(tr->conns, v2_conn);
+
+  vde_free(v2_conn);
+}
 
-  // XXX: define a behaviour when called if event timeout expired
+/**
+ * @brief Create and bind the datagram socket of an accepted connection
+ *
+ * @param v2_conn The connection
+ *
+ * @return zero on success, -1 on error
+ */
+static int vde2_srv_data_socket(vde2_conn *v2_conn)
+{
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
 
   if ((v2_conn->data_fd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0) {
     vde_error("%s: cannot create datagram socket: %s", __PRETTY_FUNCTION__,
               strerror(errno));
-    goto error;
+    return -1;
   }
   if (fcntl(v2_conn->data_fd, F_SETFL, O_NONBLOCK) < 0) {
     vde_error("%s: cannot set O_NONBLOCK for datagram socket: %s",
               __PRETTY_FUNCTION__, strerror(errno));
-    goto error;
-  }
-#ifdef VDE_DARWIN
-  if (setsockopt(v2_conn->data_fd, SOL_SOCKET, SO_SNDBUF, &sockbufsize,
-      optsize) < 0) {
-      vde_warning("%s: cannot set datagram send bufsize to %d on fd %d: %s",
-                  __PRETTY_FUNCTION__, sockbufsize, v2_conn->data_fd,
-                  strerror(errno));
-  }
-  if (setsockopt(v2_conn->data_fd, SOL_SOCKET, SO_RCVBUF, &sockbufsize,
-      optsize) < 0) {
-      vde_warning("%s: cannot set datagram send bufsize to %d on fd %d: %s",
-                  __PRETTY_FUNCTION__, sockbufsize, v2_conn->data_fd,
-                  strerror(errno));
+    return -1;
   }
-#endif
+  vde2_conn_set_sockbufs(v2_conn, tr->sndbuf, tr->rcvbuf);
 
   v2_conn->local_sa.sun_family = AF_UNIX;
 
   snprintf(v2_conn->local_sa.sun_path, sizeof(v2_conn->local_sa.sun_path),
-           "%s/%04d", tr->vdesock_dir, tr->connections);
+           "%s/%04u", tr->vdesock_dir, tr->connections);
 
   if (unlink(v2_conn->local_sa.sun_path) < 0 && errno != ENOENT) {
     vde_error("%s: cannot remove old datagram socket %s: %s",
               __PRETTY_FUNCTION__, v2_conn->local_sa.sun_path,
               strerror(errno));
-    goto error;
+    return -1;
   }
   if (bind(v2_conn->data_fd, (struct sockaddr *) &v2_conn->local_sa,
            sizeof(struct sockaddr_un)) < 0) {
     vde_error("%s: cannot bind datagram socket %s: %s", __PRETTY_FUNCTION__,
               v2_conn->local_sa.sun_path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Make an accepted connection a port of the shared datagram socket,
+ * its datagrams are told apart from the other ports' ones by the path of the
+ * peer socket.
+ *
+ * @param v2_conn The connection
+ *
+ * @return zero on success, -1 on error
+ */
+static int vde2_srv_shared_port(vde2_conn *v2_conn)
+{
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+  char *path = v2_conn->remote_sa.sun_path;
+
+  if (memchr(path, 0, sizeof(v2_conn->remote_sa.sun_path)) == NULL) {
+    vde_error("%s: peer socket path is too long", __PRETTY_FUNCTION__);
+    return -1;
+  }
+  if (vde_hash_lookup(tr->peers, path) != NULL) {
+    vde_error("%s: peer socket %s already connected", __PRETTY_FUNCTION__,
+              path);
+    return -1;
+  }
+
+  v2_conn->data_fd = tr->shared_fd;
+  v2_conn->shared = 1;
+  vde_hash_insert(tr->peers, path, v2_conn);
+  return 0;
+}
+
+void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
+{
+  int len;
+  struct sockaddr_un *reply_sa;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_connection *conn = v2_conn->conn;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+  vde_context *ctx = vde_component_get_context(v2_conn->transport);
+
+  vde_context_event_del(ctx, v2_conn->ctl_ev);
+  v2_conn->ctl_ev = NULL;
+
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_warning("%s: handshake timed out on ctl_fd %d", __PRETTY_FUNCTION__,
+                v2_conn->ctl_fd);
+    tr->handshake_timeouts++;
     goto error;
   }
 
-  len = write(v2_conn->ctl_fd, &v2_conn->local_sa, sizeof(v2_conn->local_sa));
-  if (len != sizeof(v2_conn->local_sa)) {
+  if (tr->shared_fd >= 0) {
+    if (vde2_srv_shared_port(v2_conn)) {
+      goto error;
+    }
+    reply_sa = &tr->shared_sa;
+  } else {
+    if (vde2_srv_data_socket(v2_conn)) {
+      goto error;
+    }
+    reply_sa = &v2_conn->local_sa;
+  }
+
+  len = write(v2_conn->ctl_fd, reply_sa, sizeof(*reply_sa));
+  if (len != sizeof(*reply_sa)) {
     vde_error("%s: cannot reply to peer", __PRETTY_FUNCTION__);
     goto error;
   }
 
   tr->connections++;
   tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+  tr->conns = vde_list_prepend(tr->conns, v2_conn);
 
   // XXX: check events not NULL
   v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
                                           VDE_EV_READ|VDE_EV_PERSIST, NULL,
                                           &vde2_conn_read_ctl_event,
                                           (void *)v2_conn);
-  v2_conn->data_ev_rd = vde_context_event_add(ctx, v2_conn->data_fd,
-                                              VDE_EV_READ|VDE_EV_PERSIST,
-                                              NULL, &vde2_conn_read_data_event,
-                                              (void *)v2_conn);
+  if (!v2_conn->shared) {
+    v2_conn->data_ev_rd = vde_context_event_add(ctx, v2_conn->data_fd,
+                                                VDE_EV_READ|VDE_EV_PERSIST,
+                                                NULL,
+                                                &vde2_conn_read_data_event,
+                                                (void *)v2_conn);
+  }
 
   vde_transport_call_cm_accept_cb(v2_conn->transport, conn);
 
@@ -451,6 +1472,7 @@ void vde2_srv_send_request(int ctl_fd, short event_type, void *arg)
 
 error:
   // XXX: call connection manager error callback here?
+  tr->handshake_errors++;
   tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
   vde_connection_fini(conn);
   vde_connection_delete(conn);
@@ -459,6 +1481,7 @@ error:
 void vde2_srv_get_request(int ctl_fd, short event_type, void *arg)
 {
   int len;
+  struct timeval left;
   char reqbuf[REQBUFLEN+1];
   vde2_request *req=(vde2_request *)reqbuf;
   vde2_conn *v2_conn = (vde2_conn *)arg;
@@ -469,12 +1492,25 @@ void vde2_srv_get_request(int ctl_fd, short event_type, void *arg)
   vde_context_event_del(ctx, v2_conn->ctl_ev);
   v2_conn->ctl_ev = NULL;
 
-  // XXX: define a behaviour when called if event timeout expired
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_warning("%s: handshake timed out on ctl_fd %d", __PRETTY_FUNCTION__,
+                v2_conn->ctl_fd);
+    tr->handshake_timeouts++;
+    goto error;
+  }
+
   len = read(v2_conn->ctl_fd, reqbuf, REQBUFLEN);
   if (len < 0) {
     if (errno != EAGAIN) {
       goto error;
     }
+    // spurious wakeup, wait for the request again
+    v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
+                                            VDE_EV_READ,
+                                            vde2_conn_handshake_left(v2_conn,
+                                                                     &left),
+                                            &vde2_srv_get_request,
+                                            (void *)v2_conn);
   } else if (len == 0) {
     goto error;
   } else {
@@ -507,9 +1543,11 @@ void vde2_srv_get_request(int ctl_fd, short event_type, void *arg)
     // XXX: add peer credentials to conn.attributes
 
     memcpy(&v2_conn->remote_sa, &req->sock, sizeof(struct sockaddr_un));
-    // XXX: check event NULL and define a timeout
+    // XXX: check event NULL
     v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
-                                            VDE_EV_WRITE, NULL,
+                                            VDE_EV_WRITE,
+                                            vde2_conn_handshake_left(v2_conn,
+                                                                     &left),
                                             &vde2_srv_send_request,
                                             (void *)v2_conn);
   }
@@ -518,126 +1556,214 @@ void vde2_srv_get_request(int ctl_fd, short event_type, void *arg)
 
 error:
   // XXX: call connection manager error callback here?
+  tr->handshake_errors++;
   tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
   vde_connection_fini(conn);
   vde_connection_delete(conn);
 }
 
-void vde2_accept(int listen_fd, short event_type, void *arg)
+/**
+ * @brief Start the handshake of an accepted control connection
+ *
+ * @param component The transport
+ * @param ctl_fd The accepted socket, non-blocking
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde2_srv_new_conn(vde_component *component, int ctl_fd)
 {
-  struct sockaddr sa;
-  socklen_t sa_len = sizeof(struct sockaddr);
-  int new;
+  struct timeval left;
   vde_connection *conn;
   vde2_conn *v2_conn;
-  vde_component *component = (vde_component *)arg;
   vde_context *ctx = vde_component_get_context(component);
   vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
 
-  // XXX: consistency check: is listen_fd the right one?
-  new = accept(listen_fd, &sa, &sa_len);
-  if (new < 0) {
-    vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
-    return;
-  }
-  if (fcntl(new, F_SETFL, O_NONBLOCK) < 0) {
-    vde_warning("%s: cannot set O_NONBLOCK for new connection %s",
-                __PRETTY_FUNCTION__, strerror(errno));
-    goto error_close;
-  }
   if (vde_connection_new(&conn)) {
     vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
-    goto error_close;
+    return -1;
   }
   v2_conn = (vde2_conn *)vde_calloc(sizeof(vde2_conn));
   if (!v2_conn) {
     vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
-    goto error_conn_del;
+    // XXX: call connection manager error callback here?
+    vde_connection_delete(conn);
+    errno = ENOMEM;
+    return -1;
   }
 
-  v2_conn->ctl_fd = new;
+  v2_conn->ctl_fd = ctl_fd;
+  v2_conn->data_fd = -1;
+  v2_conn->rx_hint = 1;
   v2_conn->conn = conn;
   v2_conn->transport = component;
-  // XXX: check init result
-  v2_conn->pkt_queue = vde_queue_init();
+  vde2_conn_handshake_start(v2_conn);
 
   // XXX: check error on list
   tr->pending_conns = vde_list_prepend(tr->pending_conns, v2_conn);
 
-  vde_connection_init(conn, ctx, sizeof(struct eth_frame), &vde2_conn_write,
+  vde_connection_init(conn, ctx, tr->frame_len, &vde2_conn_write,
                       &vde2_conn_close, (void *)v2_conn);
+  vde_connection_set_be_write_batch(conn, &vde2_conn_write_batch);
+  vde_connection_set_queue_properties(conn, tr->queue_size, tr->queue_len);
 
-  // XXX: check event NULL and define a timeout
+  // XXX: check event NULL
   v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd, VDE_EV_READ,
-                                          NULL, &vde2_srv_get_request,
+                                          vde2_conn_handshake_left(v2_conn,
+                                                                   &left),
+                                          &vde2_srv_get_request,
                                           (void *)v2_conn);
+  return 0;
+}
 
-  return;
+/*
+ * When many peers connect at once the backlog is drained at each event, up to
+ * ACCEPT_BUDGET connections so that established connections are served in the
+ * meantime. Peers which don't complete the handshake in time are dropped.
+ */
+void vde2_accept(int listen_fd, short event_type, void *arg)
+{
+  int new;
+  unsigned int burst = 0;
+  vde_component *component = (vde_component *)arg;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
 
-error_conn_del:
-  // XXX: call connection manager error callback here?
-  vde_connection_delete(conn);
-error_close:
-  close(new);
+  // XXX: consistency check: is listen_fd the right one?
+  while (burst < ACCEPT_BUDGET) {
+    new = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (new < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        // e.g. out of file descriptors, the event triggers again
+        vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
+        tr->accept_errors++;
+      }
+      break;
+    }
+    burst++;
+    if (vde2_srv_new_conn(component, new)) {
+      tr->accept_errors++;
+      close(new);
+    }
+  }
+
+  tr->accepted += burst;
+  if (burst > tr->accept_burst_max) {
+    tr->accept_burst_max = burst;
+  }
 }
 
-int vde2_listen(vde_component *component)
+/**
+ * @brief Create the datagram socket shared by the ports of a listening
+ * transport. It carries the traffic of all the ports, its buffers get
+ * sockbuf_max bytes.
+ *
+ * @param component The transport
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde2_tr_shared_socket(vde_component *component)
 {
-  int tmp_errno; /* errno will be set back in last goto label */
-  struct sockaddr_un sa_unix;
-  int one = 1;
+  int tmp_errno;
+  unsigned int qlen;
+  FILE *qlen_file;
   vde_context *ctx = vde_component_get_context(component);
   vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
 
-  tr->listen_fd = socket(PF_UNIX, SOCK_STREAM, 0);
-  if (tr->listen_fd < 0) {
+  tr->shared_fd = socket(PF_UNIX, SOCK_DGRAM, 0);
+  if (tr->shared_fd < 0) {
     tmp_errno = errno;
-    vde_error("%s: Could not obtain a BSD socket: %s", __PRETTY_FUNCTION__,
-              strerror(errno));
+    vde_error("%s: cannot create shared datagram socket: %s",
+              __PRETTY_FUNCTION__, strerror(errno));
     goto error;
   }
-  if (setsockopt(tr->listen_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one,
-                 sizeof(one)) < 0) {
+  if (fcntl(tr->shared_fd, F_SETFL, O_NONBLOCK) < 0) {
     tmp_errno = errno;
-    vde_error("%s: Could not set socket options: %s", __PRETTY_FUNCTION__,
-              strerror(errno));
+    vde_error("%s: cannot set O_NONBLOCK for shared datagram socket: %s",
+              __PRETTY_FUNCTION__, strerror(errno));
+    goto error_close;
+  }
+  if (tr->sndbuf > 0 &&
+      setsockopt(tr->shared_fd, SOL_SOCKET, SO_SNDBUF, &tr->sockbuf_max,
+                 sizeof(tr->sockbuf_max)) < 0) {
+    vde_warning("%s: cannot set shared datagram send bufsize to %d: %s",
+                __PRETTY_FUNCTION__, tr->sockbuf_max, strerror(errno));
+  }
+  if (tr->rcvbuf > 0 &&
+      setsockopt(tr->shared_fd, SOL_SOCKET, SO_RCVBUF, &tr->sockbuf_max,
+                 sizeof(tr->sockbuf_max)) < 0) {
+    vde_warning("%s: cannot set shared datagram recv bufsize to %d: %s",
+                __PRETTY_FUNCTION__, tr->sockbuf_max, strerror(errno));
+  }
+
+  tr->shared_sa.sun_family = AF_UNIX;
+  snprintf(tr->shared_sa.sun_path, sizeof(tr->shared_sa.sun_path), "%s/data",
+           tr->vdesock_dir);
+  if (unlink(tr->shared_sa.sun_path) < 0 && errno != ENOENT) {
+    tmp_errno = errno;
+    vde_error("%s: cannot remove old datagram socket %s: %s",
+              __PRETTY_FUNCTION__, tr->shared_sa.sun_path, strerror(errno));
     goto error_close;
   }
-  if (fcntl(tr->listen_fd, F_SETFL, O_NONBLOCK) < 0) {
+  if (bind(tr->shared_fd, (struct sockaddr *)&tr->shared_sa,
+           sizeof(tr->shared_sa)) < 0) {
     tmp_errno = errno;
-    vde_error("%s: Could not set O_NONBLOCK: %s", __PRETTY_FUNCTION__,
-              strerror(errno));
+    vde_error("%s: cannot bind datagram socket %s: %s", __PRETTY_FUNCTION__,
+              tr->shared_sa.sun_path, strerror(errno));
     goto error_close;
   }
+
+  qlen_file = fopen(UNIX_DGRAM_QLEN, "r");
+  if (qlen_file != NULL) {
+    if (fscanf(qlen_file, "%u", &qlen) == 1 && qlen < tr->rx_budget) {
+      vde_warning("%s: %s is %u, peers will drop frames when sending many "
+                  "at once", __PRETTY_FUNCTION__, UNIX_DGRAM_QLEN, qlen);
+    }
+    fclose(qlen_file);
+  }
+
+  // XXX: check event not NULL
+  tr->shared_ev = vde_context_event_add(ctx, tr->shared_fd,
+                                        VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                        &vde2_tr_read_shared_event,
+                                        (void *)component);
+  return 0;
+
+error_close:
+  close(tr->shared_fd);
+  tr->shared_fd = -1;
+error:
+  errno = tmp_errno;
+  return -1;
+}
+
+int vde2_listen(vde_component *component)
+{
+  int tmp_errno; /* errno will be set back in last goto label */
+  struct sockaddr_un sa_unix;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
   if (((mkdir(tr->vdesock_dir, 0777) < 0) && (errno != EEXIST))) {
     tmp_errno = errno;
     vde_error("%s: Could not create vdesock directory %s: %s",
               __PRETTY_FUNCTION__, tr->vdesock_dir, strerror(errno));
-    goto error_close;
+    goto error;
   }
   sa_unix.sun_family = AF_UNIX;
   snprintf(sa_unix.sun_path, sizeof(sa_unix.sun_path), "%s/ctl",
            tr->vdesock_dir);
-  if (bind(tr->listen_fd, (struct sockaddr *)&sa_unix, sizeof(sa_unix)) < 0) {
-    if ((errno == EADDRINUSE) && vde2_remove_sock_if_unused(&sa_unix)) {
-      tmp_errno = errno;
-      vde_error("%s: Could not bind to %s/ctl: socket in use",
-                __PRETTY_FUNCTION__, tr->vdesock_dir);
-      goto error_close;
-    } else {
-      if (bind(tr->listen_fd, (struct sockaddr *)&sa_unix,
-               sizeof(sa_unix)) < 0) {
-        tmp_errno = errno;
-        vde_error("%s: Could not bind to %s/ctl: %s", __PRETTY_FUNCTION__,
-                  tr->vdesock_dir, strerror(errno));
-        goto error_close;
-      }
-    }
+  tr->listen_fd = vde_sock_listen((struct sockaddr *)&sa_unix,
+                                  sizeof(sa_unix), SOCK_STREAM, tr->backlog);
+  if (tr->listen_fd < 0) {
+    tmp_errno = errno;
+    vde_error("%s: Could not listen on %s/ctl", __PRETTY_FUNCTION__,
+              tr->vdesock_dir);
+    goto error;
   }
-  if (listen(tr->listen_fd, LISTEN_QUEUE) < 0) {
+  if (tr->shared && vde2_tr_shared_socket(component)) {
     tmp_errno = errno;
-    vde_error("%s: Could not listen: %s", __PRETTY_FUNCTION__,
-              strerror(errno));
     goto error_unlink;
   }
 
@@ -651,7 +1777,6 @@ int vde2_listen(vde_component *component)
 error_unlink:
   unlink(sa_unix.sun_path);
   rmdir(tr->vdesock_dir);
-error_close:
   close(tr->listen_fd);
   tr->listen_fd = -1;
 error:
@@ -659,8 +1784,306 @@ error:
   return -1;
 }
 
+/**
+ * @brief Abort the handshake of an outgoing connection and report the error to
+ * the connection manager, which deletes the connection.
+ *
+ * @param v2_conn The connection
+ * @param tr_errno The error
+ */
+static void vde2_cli_error(vde2_conn *v2_conn, int tr_errno)
+{
+  vde_connection *conn = v2_conn->conn;
+  vde_component *transport = v2_conn->transport;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(transport);
+
+  tr->handshake_errors++;
+  if (tr_errno == ETIMEDOUT) {
+    tr->handshake_timeouts++;
+  }
+  tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+  vde_connection_fini(conn);
+  vde_transport_call_cm_error_cb(transport, conn, tr_errno);
+}
+
+void vde2_cli_get_reply(int ctl_fd, short event_type, void *arg)
+{
+  int len;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_connection *conn = v2_conn->conn;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+  vde_context *ctx = vde_component_get_context(v2_conn->transport);
+
+  vde_context_event_del(ctx, v2_conn->ctl_ev);
+  v2_conn->ctl_ev = NULL;
+
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_error("%s: no reply from switch", __PRETTY_FUNCTION__);
+    vde2_cli_error(v2_conn, ETIMEDOUT);
+    return;
+  }
+
+  // the switch replies with the address of its datagram socket
+  len = read(v2_conn->ctl_fd, &v2_conn->remote_sa,
+             sizeof(v2_conn->remote_sa));
+  if (len != sizeof(v2_conn->remote_sa)) {
+    vde_error("%s: invalid reply from switch: %s", __PRETTY_FUNCTION__,
+              len < 0 ? strerror(errno) : "short read");
+    vde2_cli_error(v2_conn, len < 0 ? errno : ECONNREFUSED);
+    return;
+  }
+  if (v2_conn->remote_sa.sun_family != AF_UNIX ||
+      v2_conn->remote_sa.sun_path[0] == 0) {
+    vde_error("%s: received an invalid socket path", __PRETTY_FUNCTION__);
+    vde2_cli_error(v2_conn, ECONNREFUSED);
+    return;
+  }
+
+  tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+  tr->conns = vde_list_prepend(tr->conns, v2_conn);
+
+  // XXX: check events not NULL
+  v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd,
+                                          VDE_EV_READ|VDE_EV_PERSIST, NULL,
+                                          &vde2_conn_read_ctl_event,
+                                          (void *)v2_conn);
+  v2_conn->data_ev_rd = vde_context_event_add(ctx, v2_conn->data_fd,
+                                              VDE_EV_READ|VDE_EV_PERSIST,
+                                              NULL, &vde2_conn_read_data_event,
+                                              (void *)v2_conn);
+
+  vde_transport_call_cm_connect_cb(v2_conn->transport, conn);
+}
+
+void vde2_cli_send_request(int ctl_fd, short event_type, void *arg)
+{
+  int len, reqlen, sock_errno;
+  socklen_t optlen = sizeof(sock_errno);
+  struct timeval left;
+  char reqbuf[REQBUFLEN];
+  vde2_request *req = (vde2_request *)reqbuf;
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_context *ctx = vde_component_get_context(v2_conn->transport);
+
+  vde_context_event_del(ctx, v2_conn->ctl_ev);
+  v2_conn->ctl_ev = NULL;
+
+  if (event_type & VDE_EV_TIMEOUT) {
+    vde_error("%s: cannot connect to switch: timed out", __PRETTY_FUNCTION__);
+    vde2_cli_error(v2_conn, ETIMEDOUT);
+    return;
+  }
+
+  // outcome of the non-blocking connect()
+  if (getsockopt(v2_conn->ctl_fd, SOL_SOCKET, SO_ERROR, &sock_errno,
+                 &optlen) < 0) {
+    sock_errno = errno;
+  }
+  if (sock_errno != 0) {
+    vde_error("%s: cannot connect to switch: %s", __PRETTY_FUNCTION__,
+              strerror(sock_errno));
+    vde2_cli_error(v2_conn, sock_errno);
+    return;
+  }
+
+  memset(reqbuf, 0, sizeof(reqbuf));
+  req->magic = SWITCH_MAGIC;
+  req->version = 3;
+  req->type = REQ_NEW_CONTROL; // any port
+  memcpy(&req->sock, &v2_conn->local_sa, sizeof(struct sockaddr_un));
+  snprintf(req->description, REQBUFLEN - sizeof(vde2_request), "vde3 %s",
+           vde_component_get_name(v2_conn->transport));
+  reqlen = sizeof(vde2_request) + strlen(req->description) + 1;
+
+  len = write(v2_conn->ctl_fd, reqbuf, reqlen);
+  if (len != reqlen) {
+    vde_error("%s: cannot send request to switch", __PRETTY_FUNCTION__);
+    vde2_cli_error(v2_conn, len < 0 ? errno : EIO);
+    return;
+  }
+
+  // XXX: check event NULL
+  v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd, VDE_EV_READ,
+                                          vde2_conn_handshake_left(v2_conn,
+                                                                   &left),
+                                          &vde2_cli_get_reply,
+                                          (void *)v2_conn);
+}
+
+/**
+ * @brief Create the datagram socket of an outgoing connection
+ *
+ * @param v2_conn The connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde2_cli_data_socket(vde2_conn *v2_conn)
+{
+  int tmp_errno;
+  // shared by all the transports of the process, the names must not clash
+  static unsigned int client_socks = 0;
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+
+  if ((v2_conn->data_fd = socket(PF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot create datagram socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    errno = tmp_errno;
+    return -1;
+  }
+  if (fcntl(v2_conn->data_fd, F_SETFL, O_NONBLOCK) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot set O_NONBLOCK for datagram socket: %s",
+              __PRETTY_FUNCTION__, strerror(errno));
+    errno = tmp_errno;
+    return -1;
+  }
+  vde2_conn_set_sockbufs(v2_conn, tr->sndbuf, tr->rcvbuf);
+
+  v2_conn->local_sa.sun_family = AF_UNIX;
+  if (snprintf(v2_conn->local_sa.sun_path, sizeof(v2_conn->local_sa.sun_path),
+               CLIENT_SOCK_FMT, tr->vdesock_dir, getpid(), client_socks++) >=
+      sizeof(v2_conn->local_sa.sun_path)) {
+    vde_error("%s: socket directory %s is too long", __PRETTY_FUNCTION__,
+              tr->vdesock_dir);
+    v2_conn->local_sa.sun_path[0] = 0;
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (unlink(v2_conn->local_sa.sun_path) < 0 && errno != ENOENT) {
+    tmp_errno = errno;
+    vde_error("%s: cannot remove old datagram socket %s: %s",
+              __PRETTY_FUNCTION__, v2_conn->local_sa.sun_path,
+              strerror(errno));
+    v2_conn->local_sa.sun_path[0] = 0; // not ours, don't unlink it
+    errno = tmp_errno;
+    return -1;
+  }
+  if (bind(v2_conn->data_fd, (struct sockaddr *) &v2_conn->local_sa,
+           sizeof(struct sockaddr_un)) < 0) {
+    tmp_errno = errno;
+    vde_error("%s: cannot bind datagram socket %s: %s", __PRETTY_FUNCTION__,
+              v2_conn->local_sa.sun_path, strerror(errno));
+    v2_conn->local_sa.sun_path[0] = 0; // not ours, don't unlink it
+    errno = tmp_errno;
+    return -1;
+  }
+  // the switch checks it can access the socket
+  chmod(v2_conn->local_sa.sun_path, 0600);
+  return 0;
+}
+
+void vde2_cli_connect_retry(int fd, short event_type, void *arg);
+
+/**
+ * @brief Connect the control socket of an outgoing connection to the switch,
+ * the request is sent when the connection completes.
+ *
+ * @param v2_conn The connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vde2_cli_connect(vde2_conn *v2_conn)
+{
+  int ret;
+  struct sockaddr_un sa_unix;
+  struct timeval left;
+  vde_context *ctx = vde_component_get_context(v2_conn->transport);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(v2_conn->transport);
+
+  sa_unix.sun_family = AF_UNIX;
+  snprintf(sa_unix.sun_path, sizeof(sa_unix.sun_path), "%s/ctl",
+           tr->vdesock_dir);
+  ret = vde_sock_connect(ctx, v2_conn->ctl_fd, (struct sockaddr *)&sa_unix,
+                         sizeof(sa_unix), &v2_conn->connect_tries,
+                         &v2_conn->connect_to, &vde2_cli_connect_retry,
+                         (void *)v2_conn);
+  if (ret <= 0) {
+    return ret;
+  }
+
+  // XXX: check event NULL
+  v2_conn->ctl_ev = vde_context_event_add(ctx, v2_conn->ctl_fd, VDE_EV_WRITE,
+                                          vde2_conn_handshake_left(v2_conn,
+                                                                   &left),
+                                          &vde2_cli_send_request,
+                                          (void *)v2_conn);
+  return 0;
+}
+
+void vde2_cli_connect_retry(int fd, short event_type, void *arg)
+{
+  vde2_conn *v2_conn = (vde2_conn *)arg;
+  vde_context *ctx = vde_component_get_context(v2_conn->transport);
+
+  vde_context_timeout_del(ctx, v2_conn->connect_to);
+  v2_conn->connect_to = NULL;
+  if (vde2_cli_connect(v2_conn)) {
+    vde2_cli_error(v2_conn, errno);
+  }
+}
+
+/*
+ * Outgoing connections go through the vde2 handshake without blocking: the
+ * control socket connect()s to the switch, the request carrying the address
+ * of the datagram socket is sent when the control socket becomes writable and
+ * the connection manager is called back when the switch replies with the
+ * address of its datagram socket. Each handshake has its own events, so any
+ * number of them can be in progress at the same time.
+ */
 int vde2_connect(vde_component *component, vde_connection *conn)
 {
+  int tmp_errno;
+  vde2_conn *v2_conn;
+  vde_context *ctx = vde_component_get_context(component);
+  vde2_tr *tr = (vde2_tr *)vde_component_get_priv(component);
+
+  v2_conn = (vde2_conn *)vde_calloc(sizeof(vde2_conn));
+  if (!v2_conn) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+  v2_conn->data_fd = -1;
+  v2_conn->ctl_fd = -1;
+  v2_conn->rx_hint = 1;
+  v2_conn->outgoing = 1;
+  v2_conn->conn = conn;
+  v2_conn->transport = component;
+  vde2_conn_handshake_start(v2_conn);
+
+  vde_connection_init(conn, ctx, tr->frame_len, &vde2_conn_write,
+                      &vde2_conn_close, (void *)v2_conn);
+  vde_connection_set_be_write_batch(conn, &vde2_conn_write_batch);
+  vde_connection_set_queue_properties(conn, tr->queue_size, tr->queue_len);
+
+  if (vde2_cli_data_socket(v2_conn)) {
+    goto error;
+  }
+
+  if ((v2_conn->ctl_fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) {
+    vde_error("%s: cannot create control socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (fcntl(v2_conn->ctl_fd, F_SETFL, O_NONBLOCK) < 0) {
+    vde_error("%s: cannot set O_NONBLOCK for control socket: %s",
+              __PRETTY_FUNCTION__, strerror(errno));
+    goto error;
+  }
+  if (vde2_cli_connect(v2_conn)) {
+    goto error;
+  }
+
+  // XXX: check error on list
+  tr->pending_conns = vde_list_prepend(tr->pending_conns, v2_conn);
+  return 0;
+
+error:
+  tmp_errno = errno;
+  // the connection manager owns the connection and deletes it
+  vde_connection_fini(conn);
+  errno = tmp_errno;
   return -1;
 }
 
@@ -670,6 +2093,18 @@ static int transport_vde2_init(vde_component *component, vde_sobj *params)
   vde2_tr *tr;
   vde_sobj *path_sobj;
   const char *path;
+  struct timeval autotune_interval = { AUTOTUNE_INTERVAL, 0 };
+  int mtu = ETH_DATA_LEN;
+  int queue_size = VDE_CONNECTION_QUEUE_MAXBYTES;
+  int queue_len = VDE_CONNECTION_QUEUE_MAXLEN;
+  int rx_budget = RX_BUDGET;
+  int sndbuf = DATA_BUF_SIZE, rcvbuf = DATA_BUF_SIZE;
+  int sockbuf_max = SOCKBUF_MAX;
+  int autotune = 0;
+  int backlog = LISTEN_QUEUE;
+  int handshake_timeout = HANDSHAKE_TIMEOUT;
+  int shared = 0;
+  int tmp_errno;
 
   vde_assert(component != NULL);
 
@@ -687,11 +2122,29 @@ static int transport_vde2_init(vde_component *component, vde_sobj *params)
   }
   path = vde_sobj_get_string(path_sobj);
 
-  if (strlen(path) > UNIX_PATH_MAX - 4) { // we will add '/ctl' later
+  if (strlen(path) > UNIX_PATH_MAX - 6) { // we will add '/data' later
     vde_error("%s: directory name is too long", __PRETTY_FUNCTION__);
     errno = EINVAL;
     return -1;
   }
+
+  if (vde_params_get_int(params, "mtu", ETH_MIN_MTU, ETH_MAX_MTU, &mtu) ||
+      vde_params_get_int(params, "queue_size", 0, INT_MAX, &queue_size) ||
+      vde_params_get_int(params, "queue_len", 1, INT_MAX, &queue_len) ||
+      vde_params_get_int(params, "rx_budget", 1, INT_MAX, &rx_budget) ||
+      vde_params_get_int(params, "sndbuf", 0, INT_MAX, &sndbuf) ||
+      vde_params_get_int(params, "rcvbuf", 0, INT_MAX, &rcvbuf) ||
+      vde_params_get_bool(params, "autotune", &autotune) ||
+      vde_params_get_int(params, "sockbuf_max",
+                         sndbuf > rcvbuf ? sndbuf : rcvbuf, INT_MAX,
+                         &sockbuf_max) ||
+      vde_params_get_int(params, "backlog", 1, INT_MAX, &backlog) ||
+      vde_params_get_int(params, "handshake_timeout", 1, INT_MAX,
+                         &handshake_timeout) ||
+      vde_params_get_bool(params, "shared_socket", &shared)) {
+    return -1;
+  }
+
   tr = (vde2_tr *)vde_calloc(sizeof(vde2_tr));
   if (tr == NULL) {
     vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
@@ -708,13 +2161,121 @@ static int transport_vde2_init(vde_component *component, vde_sobj *params)
     return -1;
   }
 
+  tr->frame_len = ETH_FRAME_LEN(mtu);
+  tr->queue_size = queue_size;
+  tr->queue_len = queue_len;
+  tr->rx_budget = rx_budget;
+  tr->backlog = backlog;
+  tr->handshake_timeout = handshake_timeout;
+  tr->sndbuf = sndbuf;
+  tr->rcvbuf = rcvbuf;
+  tr->sockbuf_max = sockbuf_max < sndbuf || sockbuf_max < rcvbuf ?
+                    (sndbuf > rcvbuf ? sndbuf : rcvbuf) : sockbuf_max;
+  tr->listen_fd = -1;
+  tr->shared = shared;
+  tr->shared_fd = -1;
+  tr->shared_rx_hint = 1;
+  if (shared) {
+    tr->peers = vde_hash_init_string();
+  }
+
+  if (vde_component_commands_register(component, transport_vde2_commands)) {
+    tmp_errno = errno;
+    vde_error("%s: could not register commands", __PRETTY_FUNCTION__);
+    if (tr->peers != NULL) {
+      vde_hash_delete(tr->peers);
+    }
+    free(tr->vdesock_dir);
+    vde_free(tr);
+    errno = tmp_errno;
+    return -1;
+  }
+
+  if (vde_component_signals_register(component, transport_vde2_signals)) {
+    tmp_errno = errno;
+    vde_error("%s: could not register signals", __PRETTY_FUNCTION__);
+    vde_component_commands_deregister(component, transport_vde2_commands);
+    if (tr->peers != NULL) {
+      vde_hash_delete(tr->peers);
+    }
+    free(tr->vdesock_dir);
+    vde_free(tr);
+    errno = tmp_errno;
+    return -1;
+  }
+
   vde_component_set_priv(component, (void *)tr);
+
+  if (autotune) {
+    // XXX check timeout not NULL
+    tr->autotune_to = vde_context_timeout_add(
+                        vde_component_get_context(component),
+                        VDE_EV_TIMEOUT|VDE_EV_PERSIST, &autotune_interval,
+                        &vde2_tr_autotune, (void *)component);
+  }
   return 0;
 }
 
-// XXX to be defined
-void transport_vde2_fini(vde_component *component) {
+void transport_vde2_fini(vde_component *component)
+{
+  vde2_tr *tr;
+  vde2_conn *v2_conn;
+  vde_connection *conn;
+  vde_context *ctx;
+  char ctl_path[UNIX_PATH_MAX];
+
   vde_assert(component != NULL);
+
+  tr = (vde2_tr *)vde_component_get_priv(component);
+  ctx = vde_component_get_context(component);
+  if (tr->autotune_to != NULL) {
+    vde_context_timeout_del(ctx, tr->autotune_to);
+  }
+  if (tr->listen_fd >= 0) {
+    vde_context_event_del(ctx, tr->listen_event);
+  }
+  if (tr->shared_fd >= 0) {
+    vde_context_event_del(ctx, tr->shared_ev);
+  }
+
+  // the ports of the shared socket look themselves up in peers when closed,
+  // so they go before the socket and the hash
+  while (tr->pending_conns != NULL) {
+    v2_conn = vde_list_get_data(vde_list_first(tr->pending_conns));
+    if (v2_conn->outgoing) {
+      vde2_cli_error(v2_conn, ECONNABORTED);
+    } else {
+      conn = v2_conn->conn; // closing the connection frees v2_conn
+      tr->pending_conns = vde_list_remove(tr->pending_conns, v2_conn);
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+    }
+  }
+  // closing a connection removes it from the list
+  while (tr->conns != NULL) {
+    v2_conn = vde_list_get_data(vde_list_first(tr->conns));
+    vde_transport_conn_gone(v2_conn->conn);
+  }
+
+  if (tr->shared_fd >= 0) {
+    close(tr->shared_fd);
+    unlink(tr->shared_sa.sun_path);
+  }
+  if (tr->peers != NULL) {
+    vde_hash_delete(tr->peers);
+  }
+  if (tr->listen_fd >= 0) {
+    close(tr->listen_fd);
+    snprintf(ctl_path, sizeof(ctl_path), "%s/ctl", tr->vdesock_dir);
+    unlink(ctl_path);
+    // fails while some vde2 client still has its socket in there
+    rmdir(tr->vdesock_dir);
+  }
+
+  vde_component_commands_deregister(component, transport_vde2_commands);
+  vde_component_signals_deregister(component, transport_vde2_signals);
+  free(tr->vdesock_dir);
+  vde_free(tr);
 }
 
 component_ops transport_vde2_component_ops = {
@@ -0,0 +1,1752 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * vhost-user backend for virtio-net frontends such as QEMU: each connection
+ * to the unix socket in path is a port. The frontend passes the guest memory
+ * with VHOST_USER_SET_MEM_TABLE and sets up a receive and a transmit
+ * virtqueue in it, frames are then copied between the virtqueue buffers and
+ * vde packets without any system call but the eventfd notifications: the
+ * frontend kicks us when it adds buffers, we call it when we use them.
+ * Notifications are suppressed with the virtqueue flags while the rings are
+ * being polled.
+ *
+ * The connection is passed to the connection manager the first time both
+ * virtqueues are started, there is no handshake timeout since a guest may
+ * take long to load its driver.
+ *
+ * XXX: only little endian hosts are supported, which covers both legacy and
+ * virtio 1.0 devices there.
+ */
+
+#include <unistd.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/transport_common.h>
+
+// default backlog of the listening socket
+#define LISTEN_QUEUE 128
+
+// max connections accepted at each event of the listening socket
+#define ACCEPT_BUDGET 64
+
+// size of sockaddr_un.sun_path
+#define UNIX_PATH_MAX 108
+
+// default max number of frames received at each kick
+#define RX_BUDGET 64
+
+// vhost-user protocol, see docs/interop/vhost-user.rst in QEMU
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_VERSION_MASK 0x3
+#define VHOST_USER_REPLY_MASK (1 << 2)
+#define VHOST_USER_NEED_REPLY_MASK (1 << 3)
+#define VHOST_USER_VRING_IDX_MASK 0xff
+#define VHOST_USER_VRING_NOFD_MASK (1 << 8)
+#define VHOST_MEMORY_MAX_NREGIONS 8
+
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+
+enum vu_request {
+  VHOST_USER_GET_FEATURES = 1,
+  VHOST_USER_SET_FEATURES = 2,
+  VHOST_USER_SET_OWNER = 3,
+  VHOST_USER_RESET_OWNER = 4,
+  VHOST_USER_SET_MEM_TABLE = 5,
+  VHOST_USER_SET_LOG_BASE = 6,
+  VHOST_USER_SET_LOG_FD = 7,
+  VHOST_USER_SET_VRING_NUM = 8,
+  VHOST_USER_SET_VRING_ADDR = 9,
+  VHOST_USER_SET_VRING_BASE = 10,
+  VHOST_USER_GET_VRING_BASE = 11,
+  VHOST_USER_SET_VRING_KICK = 12,
+  VHOST_USER_SET_VRING_CALL = 13,
+  VHOST_USER_SET_VRING_ERR = 14,
+  VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+  VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+  VHOST_USER_GET_QUEUE_NUM = 17,
+  VHOST_USER_SET_VRING_ENABLE = 18,
+};
+
+// virtio, see the virtio 1.0 specification
+#define VIRTIO_NET_F_MRG_RXBUF 15
+#define VIRTIO_F_VERSION_1 32
+#define VIRTQUEUE_MAX_SIZE 32768
+
+#define VRING_DESC_F_NEXT 1
+#define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
+#define VRING_USED_F_NO_NOTIFY 1
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+
+// features offered to the frontend, no offloads: guests send and receive
+// plain ethernet frames
+#define VU_FEATURES ((1ULL << VIRTIO_NET_F_MRG_RXBUF) | \
+                     (1ULL << VIRTIO_F_VERSION_1) | \
+                     (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))
+#define VU_PROTOCOL_FEATURES (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK)
+
+// virtqueues of a virtio-net device, named after the frontend point of view
+#define VU_VQ_RX 0
+#define VU_VQ_TX 1
+#define VU_VQ_NUM 2
+
+typedef struct {
+  uint32_t request;
+  uint32_t flags;
+  uint32_t size; // of the payload
+} __attribute__((packed)) vu_msg_hdr;
+
+typedef struct {
+  uint32_t index;
+  uint32_t num;
+} __attribute__((packed)) vu_vring_state;
+
+typedef struct {
+  uint32_t index;
+  uint32_t flags;
+  uint64_t desc_user_addr;
+  uint64_t used_user_addr;
+  uint64_t avail_user_addr;
+  uint64_t log_guest_addr;
+} __attribute__((packed)) vu_vring_addr;
+
+typedef struct {
+  uint64_t guest_phys_addr;
+  uint64_t memory_size;
+  uint64_t userspace_addr;
+  uint64_t mmap_offset;
+} __attribute__((packed)) vu_mem_region;
+
+typedef struct {
+  uint32_t nregions;
+  uint32_t padding;
+  vu_mem_region regions[VHOST_MEMORY_MAX_NREGIONS];
+} __attribute__((packed)) vu_mem_table;
+
+typedef struct {
+  vu_msg_hdr hdr;
+  union {
+    uint64_t u64;
+    vu_vring_state state;
+    vu_vring_addr addr;
+    vu_mem_table mem;
+  } payload;
+} __attribute__((packed)) vu_msg;
+
+typedef struct {
+  uint64_t addr; // guest physical address
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} vring_desc;
+
+typedef struct {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[];
+} vring_avail;
+
+typedef struct {
+  uint32_t id;
+  uint32_t len;
+} vring_used_elem;
+
+typedef struct {
+  uint16_t flags;
+  uint16_t idx;
+  vring_used_elem ring[];
+} vring_used;
+
+// the frontend reads and writes the rings concurrently
+#define vu_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define vu_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define vu_full_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// header in front of each frame, num_buffers is there with
+// VIRTIO_NET_F_MRG_RXBUF or VIRTIO_F_VERSION_1
+#define VU_NET_HDR_LEN 10
+#define VU_NET_HDR_MRG_LEN 12
+
+typedef struct {
+  uint64_t gpa; // guest physical address
+  uint64_t size;
+  uint64_t uaddr; // address in the frontend
+  char *va; // address here
+  void *mmap_addr;
+  size_t mmap_len;
+} vu_region;
+
+struct vu_conn;
+
+typedef struct {
+  unsigned int index;
+  unsigned int num; // descriptors, zero until set
+  uint64_t desc_uaddr; // addresses of the rings in the frontend
+  uint64_t avail_uaddr;
+  uint64_t used_uaddr;
+  vring_desc *desc; // the rings, NULL if not mapped
+  vring_avail *avail;
+  vring_used *used;
+  uint16_t last_avail; // next entry of the avail ring to use
+  uint16_t used_idx; // private copy of used->idx
+  uint16_t avail_wait; // avail->idx when we ran out of receive buffers
+  int kick_fd;
+  int call_fd;
+  void *ev_kick;
+  int enabled;
+  int started;
+  struct vu_conn *vu;
+} vu_vq;
+
+typedef struct vu_conn {
+  int fd;
+  void *ev_rd;
+  int outgoing; // nonzero if we connected to the frontend
+  int established; // nonzero once passed to the connection manager
+  void *connect_to; // timeout of the next connect() attempt
+  unsigned int connect_tries; // connect() attempts refused with EAGAIN
+  vu_msg msg; // message being received
+  size_t msg_len;
+  int msg_fds[VHOST_MEMORY_MAX_NREGIONS];
+  unsigned int msg_nfds;
+  uint64_t features;
+  uint64_t protocol_features;
+  unsigned int hdr_len; // virtio-net header in front of frames
+  vu_region regions[VHOST_MEMORY_MAX_NREGIONS];
+  unsigned int nregions;
+  vu_vq vqs[VU_VQ_NUM];
+  vde_sendq sendq; // packets waiting for receive buffers
+  vde_connection *conn;
+  vde_component *transport;
+} vu_conn;
+
+typedef struct {
+  struct sockaddr_un sa; // address of the listening socket
+  socklen_t sa_len;
+  int abstract; // nonzero if sa is in the abstract namespace
+  unsigned int frame_len; // largest frame sent or received by connections
+  unsigned long queue_size; // max bytes queued by a connection
+  unsigned int queue_len; // max packets queued by a connection
+  unsigned int rx_budget; // max frames received at each kick
+  int backlog; // backlog of the listening socket
+  int listen_fd;
+  void *listen_event;
+  vde_list *pending_conns;
+  vde_list *conns; // connections passed to the connection manager
+} vu_tr;
+
+/**
+ * @brief Kick an eventfd
+ *
+ * @param fd The eventfd
+ */
+static void vu_kick(int fd)
+{
+  uint64_t one = 1;
+
+  // EAGAIN means the counter is about to overflow, it is kicked anyway
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    vde_warning("%s: cannot kick eventfd %d: %s", __PRETTY_FUNCTION__, fd,
+                strerror(errno));
+  }
+}
+
+/**
+ * @brief Translate an address of the guest into an address here
+ *
+ * @param vu The connection
+ * @param gpa The guest physical address
+ * @param len The length of the memory which must be mapped
+ *
+ * @return The address, NULL if not mapped
+ */
+static char *vu_gpa_to_va(vu_conn *vu, uint64_t gpa, uint64_t len)
+{
+  unsigned int i;
+  vu_region *r;
+
+  for (i = 0; i < vu->nregions; i++) {
+    r = &vu->regions[i];
+    if (gpa >= r->gpa && gpa - r->gpa < r->size &&
+        len <= r->size - (gpa - r->gpa)) {
+      return r->va + (gpa - r->gpa);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Translate an address of the frontend into an address here
+ *
+ * @param vu The connection
+ * @param uaddr The frontend address
+ * @param len The length of the memory which must be mapped
+ *
+ * @return The address, NULL if not mapped
+ */
+static char *vu_uva_to_va(vu_conn *vu, uint64_t uaddr, uint64_t len)
+{
+  unsigned int i;
+  vu_region *r;
+
+  for (i = 0; i < vu->nregions; i++) {
+    r = &vu->regions[i];
+    if (uaddr >= r->uaddr && uaddr - r->uaddr < r->size &&
+        len <= r->size - (uaddr - r->uaddr)) {
+      return r->va + (uaddr - r->uaddr);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Map the rings of a virtqueue once their size and addresses are known
+ *
+ * @param vu The connection
+ * @param vq The virtqueue
+ */
+static void vu_vq_map(vu_conn *vu, vu_vq *vq)
+{
+  vq->desc = NULL;
+  vq->avail = NULL;
+  vq->used = NULL;
+  if (vq->num == 0 || vq->desc_uaddr == 0) {
+    return;
+  }
+
+  vq->desc = (vring_desc *)vu_uva_to_va(vu, vq->desc_uaddr,
+                                        vq->num * sizeof(vring_desc));
+  vq->avail = (vring_avail *)vu_uva_to_va(vu, vq->avail_uaddr,
+                                          sizeof(vring_avail) +
+                                          (vq->num + 1) * sizeof(uint16_t));
+  vq->used = (vring_used *)vu_uva_to_va(vu, vq->used_uaddr,
+                                        sizeof(vring_used) + sizeof(uint16_t) +
+                                        vq->num * sizeof(vring_used_elem));
+  if (vq->desc == NULL || vq->avail == NULL || vq->used == NULL ||
+      ((uintptr_t)vq->desc & 15) || ((uintptr_t)vq->avail & 1) ||
+      ((uintptr_t)vq->used & 3)) {
+    vde_warning("%s: rings of virtqueue %u are not in guest memory",
+                __PRETTY_FUNCTION__, vq->index);
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+    return;
+  }
+  if (!vq->started) {
+    vq->used_idx = vq->used->idx;
+  }
+}
+
+/**
+ * @brief Call the frontend after we used buffers of a virtqueue, unless it
+ * asked not to.
+ *
+ * @param vq The virtqueue
+ */
+static void vu_vq_notify(vu_vq *vq)
+{
+  // order the update of the used ring before the check of the flags, the
+  // frontend does the opposite
+  vu_full_barrier();
+  if (vq->call_fd >= 0 &&
+      !(__atomic_load_n(&vq->avail->flags, __ATOMIC_RELAXED) &
+        VRING_AVAIL_F_NO_INTERRUPT)) {
+    vu_kick(vq->call_fd);
+  }
+}
+
+/**
+ * @brief Ask the frontend to kick a virtqueue when it adds buffers
+ *
+ * @param vq The virtqueue
+ * @param seen The value of avail->idx we are waiting to change
+ *
+ * @return zero if the frontend will kick, nonzero if buffers have been added
+ * in the meantime
+ */
+static int vu_vq_wait(vu_vq *vq, uint16_t seen)
+{
+  __atomic_store_n(&vq->used->flags, 0, __ATOMIC_RELAXED);
+  vu_full_barrier();
+  if (vu_load_acquire(&vq->avail->idx) != seen) {
+    __atomic_store_n(&vq->used->flags, VRING_USED_F_NO_NOTIFY,
+                     __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Report to the connection user that the frontend is gone
+ *
+ * @param vu The connection
+ * @param err The error
+ *
+ * @return Nonzero if the connection has been closed
+ */
+static int vu_conn_closed(vu_conn *vu, vde_conn_error err)
+{
+  unsigned int i;
+  vde_connection *conn = vu->conn;
+  vde_context *ctx = vde_connection_get_context(conn);
+
+  if (vde_connection_call_error(conn, NULL, err) && errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return 1;
+  }
+  vde_warning("%s: frontend of fd %d is gone but connection not closed",
+              __PRETTY_FUNCTION__, vu->fd);
+  // the socket would stay readable
+  if (vu->ev_rd != NULL) {
+    vde_context_event_del(ctx, vu->ev_rd);
+    vu->ev_rd = NULL;
+  }
+  for (i = 0; i < VU_VQ_NUM; i++) {
+    if (vu->vqs[i].ev_kick != NULL) {
+      vde_context_event_del(ctx, vu->vqs[i].ev_kick);
+      vu->vqs[i].ev_kick = NULL;
+    }
+    vu->vqs[i].started = 0;
+  }
+  return 0;
+}
+
+/**
+ * @brief Copy a frame sent by the guest into a packet
+ *
+ * @param vu The connection
+ * @param vq The transmit virtqueue
+ * @param head The first descriptor of the frame
+ * @param pkt The packet
+ *
+ * @return The length of the frame, -1 if the descriptors are invalid or the
+ * frame is too large
+ */
+static int vu_tx_copy(vu_conn *vu, vu_vq *vq, unsigned int head, vde_pkt *pkt)
+{
+  unsigned int idx = head, count = 0, skip = vu->hdr_len, len = 0, chunk;
+  unsigned int max_payload = vde_connection_max_payload(vu->conn);
+  vring_desc desc;
+  char *src;
+
+  while (1) {
+    if (idx >= vq->num || ++count > vq->num) {
+      return -1;
+    }
+    // read once, the guest could change it under our feet
+    memcpy(&desc, &vq->desc[idx], sizeof(desc));
+    if (desc.flags & (VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT)) {
+      return -1;
+    }
+    src = vu_gpa_to_va(vu, desc.addr, desc.len);
+    if (src == NULL) {
+      return -1;
+    }
+    chunk = desc.len;
+    if (skip > 0) {
+      // the virtio-net header, nothing to do with it without offloads
+      if (skip > chunk) {
+        skip -= chunk;
+        chunk = 0;
+      } else {
+        src += skip;
+        chunk -= skip;
+        skip = 0;
+      }
+    }
+    if (chunk > max_payload - len) {
+      return -1;
+    }
+    memcpy(pkt->payload + len, src, chunk);
+    len += chunk;
+    if (!(desc.flags & VRING_DESC_F_NEXT)) {
+      break;
+    }
+    idx = desc.next;
+  }
+  return skip > 0 ? -1 : len;
+}
+
+/**
+ * @brief Pass the frames sent by the guest to the connection user, up to
+ * rx_budget frames.
+ *
+ * @param vu The connection
+ *
+ * @return zero if the connection is still usable, -1 if it has been closed
+ */
+static int vu_tx_drain(vu_conn *vu)
+{
+  unsigned int i, chunk, head, total = 0;
+  int len;
+  uint16_t avail_idx;
+  uint64_t now;
+  vde_pkt *pkt;
+  vde_pkt_batch batch;
+  vu_vq *vq = &vu->vqs[VU_VQ_TX];
+  vde_connection *conn = vu->conn;
+  vu_tr *tr = (vu_tr *)vde_component_get_priv(vu->transport);
+  vde_pool *pool = vde_context_get_pool(vde_connection_get_context(conn));
+
+  // no kicks while we are polling the ring
+  __atomic_store_n(&vq->used->flags, VRING_USED_F_NO_NOTIFY, __ATOMIC_RELAXED);
+
+  while (total < tr->rx_budget) {
+    avail_idx = vu_load_acquire(&vq->avail->idx);
+    if (avail_idx == vq->last_avail) {
+      if (vu_vq_wait(vq, avail_idx)) {
+        continue;
+      }
+      return 0;
+    }
+    if ((uint16_t)(avail_idx - vq->last_avail) > vq->num) {
+      vde_warning("%s: corrupted avail ring from fd %d", __PRETTY_FUNCTION__,
+                  vu->fd);
+      return vu_conn_closed(vu, CONN_READ_CLOSED) ? -1 : 0;
+    }
+
+    chunk = (uint16_t)(avail_idx - vq->last_avail);
+    if (chunk > VDE_PKT_BATCH_MAX) {
+      chunk = VDE_PKT_BATCH_MAX;
+    }
+    if (chunk > tr->rx_budget - total) {
+      chunk = tr->rx_budget - total;
+    }
+
+    now = vde_clock_ns();
+    vde_pkt_batch_init(&batch);
+    for (i = 0; i < chunk; i++) {
+      head = __atomic_load_n(&vq->avail->ring[vq->last_avail & (vq->num - 1)],
+                             __ATOMIC_RELAXED);
+      vq->last_avail++;
+
+      pkt = vde_pool_pkt_new(pool, vde_connection_max_payload(conn),
+                             vde_connection_get_pkt_headsize(conn),
+                             vde_connection_get_pkt_tailsize(conn));
+      if (pkt == NULL) {
+        vde_warning("%s: cannot allocate packet, dropping: %s",
+                    __PRETTY_FUNCTION__, strerror(errno));
+        len = -1;
+      } else {
+        len = vu_tx_copy(vu, vq, head, pkt);
+        if (len < (int)sizeof(struct eth_hdr)) {
+          vde_warning("%s: invalid frame from fd %d, dropping",
+                      __PRETTY_FUNCTION__, vu->fd);
+          vde_pkt_put(pkt);
+          len = -1;
+        }
+      }
+      if (len >= 0) {
+        pkt->hdr->version = VDE_HDR_VERSION;
+        pkt->hdr->type = 0;
+        pkt->hdr->pkt_len = len;
+        vde_pkt_meta_rx(pkt, vde_connection_get_id(conn), now);
+        vde_pkt_batch_add(&batch, pkt);
+      }
+
+      // the frame has been copied, give the buffer back to the guest
+      vq->used->ring[vq->used_idx & (vq->num - 1)].id = head;
+      vq->used->ring[vq->used_idx & (vq->num - 1)].len = 0;
+      vq->used_idx++;
+    }
+    total += chunk;
+
+    vu_store_release(&vq->used->idx, vq->used_idx);
+    vu_vq_notify(vq);
+
+    if (batch.count > 0 && vde_connection_call_read_batch(conn, &batch) &&
+        errno == EPIPE) {
+      vde_pkt_batch_put(&batch);
+      vde_connection_fini(conn);
+      vde_connection_delete(conn);
+      return -1;
+    }
+    vde_pkt_batch_put(&batch);
+  }
+
+  // budget exhausted, keep polling the ring from the event loop
+  vu_kick(vq->kick_fd);
+  return 0;
+}
+
+/**
+ * @brief Copy a packet into the receive buffers of the guest, the used ring is
+ * filled but not published.
+ *
+ * @param vu The connection
+ * @param pkt The packet
+ * @param avail_idx The last value read of avail->idx
+ *
+ * @return zero on success, -1 if the guest has not enough buffers, -2 if the
+ * buffers are invalid: they are given back to the guest unused and the packet
+ * must be dropped
+ */
+static int vu_rx_put(vu_conn *vu, vde_pkt *pkt, uint16_t avail_idx)
+{
+  unsigned int i, idx, head, count, written, chunk, nbufs = 0;
+  unsigned int hdr_left = vu->hdr_len, seg_off = 0;
+  uint16_t saved_avail;
+  uint16_t num_buffers;
+  vring_desc desc;
+  vring_used_elem *elem;
+  char *dst, *hdr = NULL;
+  vde_pkt *seg = pkt;
+  vu_vq *vq = &vu->vqs[VU_VQ_RX];
+  int mrg = !!(vu->features & (1ULL << VIRTIO_NET_F_MRG_RXBUF));
+
+  saved_avail = vq->last_avail;
+  while (hdr_left > 0 || seg != NULL) {
+    if (vq->last_avail == avail_idx) {
+      vq->last_avail = saved_avail;
+      return -1;
+    }
+    if (nbufs > 0 && !mrg) {
+      // the frame doesn't fit in a buffer
+      goto invalid;
+    }
+    head = __atomic_load_n(&vq->avail->ring[vq->last_avail & (vq->num - 1)],
+                           __ATOMIC_RELAXED);
+    vq->last_avail++;
+    elem = &vq->used->ring[(uint16_t)(vq->used_idx + nbufs) & (vq->num - 1)];
+    elem->id = head;
+    elem->len = 0;
+    nbufs++;
+
+    idx = head;
+    count = 0;
+    written = 0;
+    while (1) {
+      if (idx >= vq->num || ++count > vq->num) {
+        goto invalid;
+      }
+      memcpy(&desc, &vq->desc[idx], sizeof(desc));
+      dst = vu_gpa_to_va(vu, desc.addr, desc.len);
+      if (!(desc.flags & VRING_DESC_F_WRITE) ||
+          (desc.flags & VRING_DESC_F_INDIRECT) || dst == NULL ||
+          desc.len < hdr_left) {
+        goto invalid;
+      }
+      if (hdr_left > 0) {
+        // no offloads, the header is all zeros but num_buffers
+        hdr = dst;
+        memset(hdr, 0, hdr_left);
+        dst += hdr_left;
+        desc.len -= hdr_left;
+        written += hdr_left;
+        hdr_left = 0;
+      }
+      while (desc.len > 0 && seg != NULL) {
+        chunk = seg->hdr->pkt_len - seg_off;
+        if (chunk > desc.len) {
+          chunk = desc.len;
+        }
+        memcpy(dst, seg->payload + seg_off, chunk);
+        dst += chunk;
+        desc.len -= chunk;
+        written += chunk;
+        seg_off += chunk;
+        if (seg_off == seg->hdr->pkt_len) {
+          seg = seg->next;
+          seg_off = 0;
+        }
+      }
+      if (seg == NULL || !(desc.flags & VRING_DESC_F_NEXT)) {
+        break;
+      }
+      idx = desc.next;
+    }
+
+    elem->len = written;
+  }
+
+  if (vu->hdr_len == VU_NET_HDR_MRG_LEN) {
+    num_buffers = nbufs;
+    memcpy(hdr + VU_NET_HDR_LEN, &num_buffers, sizeof(num_buffers));
+  }
+  vq->used_idx += nbufs;
+  return 0;
+
+invalid:
+  // retrying the same buffers would fail again, consume them
+  for (i = 0; i < nbufs; i++) {
+    vq->used->ring[(uint16_t)(vq->used_idx + i) & (vq->num - 1)].len = 0;
+  }
+  vq->used_idx += nbufs;
+  return -2;
+}
+
+/**
+ * @brief Copy packets into the receive buffers of the guest and call it. A
+ * vde_sendq_send_cb.
+ *
+ * @param priv The connection
+ * @param pkts The packets, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of packets sent or dropped
+ */
+static unsigned int vu_rx_send(void *priv, vde_pkt **pkts,
+                               unsigned int count)
+{
+  unsigned int i;
+  int ret;
+  uint16_t avail_idx, used_idx;
+  vu_conn *vu = (vu_conn *)priv;
+  vu_vq *vq = &vu->vqs[VU_VQ_RX];
+  unsigned int max_payload = vde_connection_max_payload(vu->conn);
+
+  // the guest has no receive buffers for now
+  errno = EAGAIN;
+  if (!vq->started) {
+    return 0;
+  }
+  avail_idx = vu_load_acquire(&vq->avail->idx);
+  if ((uint16_t)(avail_idx - vq->last_avail) > vq->num) {
+    vde_warning("%s: corrupted avail ring from fd %d", __PRETTY_FUNCTION__,
+                vu->fd);
+    return 0;
+  }
+
+  used_idx = vq->used_idx;
+  for (i = 0; i < count; i++) {
+    // oversized packets are rejected by the queue
+    if (vde_pkt_len(pkts[i]) > max_payload) {
+      errno = EMSGSIZE;
+      break;
+    }
+    ret = vu_rx_put(vu, pkts[i], avail_idx);
+    if (ret == -1 && vu_load_acquire(&vq->avail->idx) != avail_idx) {
+      // the guest added buffers in the meantime
+      avail_idx = vu_load_acquire(&vq->avail->idx);
+      ret = vu_rx_put(vu, pkts[i], avail_idx);
+    }
+    if (ret == -1) {
+      vq->avail_wait = avail_idx;
+      break;
+    }
+    if (ret == -2) {
+      vde_warning("%s: invalid receive buffers from fd %d, dropping",
+                  __PRETTY_FUNCTION__, vu->fd);
+    }
+  }
+  if (vq->used_idx != used_idx) {
+    vu_store_release(&vq->used->idx, vq->used_idx);
+    vu_vq_notify(vq);
+  }
+  return i;
+}
+
+/**
+ * @brief Wait for the guest to add receive buffers, if it added some in the
+ * meantime or the connection user wants to be notified of sent packets kick
+ * ourselves so that the queue is flushed from the event loop. A
+ * vde_sendq_wait_cb.
+ *
+ * @param arg The connection
+ */
+static void vu_rx_wait(void *arg)
+{
+  vu_conn *vu = (vu_conn *)arg;
+  vu_vq *vq = &vu->vqs[VU_VQ_RX];
+
+  // the queue is flushed when the virtqueue is started
+  if (!vq->started) {
+    return;
+  }
+  if (vu_vq_wait(vq, vq->avail_wait) ||
+      vde_connection_has_write_cb(vu->conn)) {
+    vu_kick(vq->kick_fd);
+  }
+}
+
+void vu_vq_kick_event(int fd, short event_type, void *arg)
+{
+  uint64_t count;
+  vu_vq *vq = (vu_vq *)arg;
+  vu_conn *vu = vq->vu;
+  vde_connection *conn = vu->conn;
+
+  // reset the counter, kicks from now on trigger the event again
+  if (read(vq->kick_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    vde_warning("%s: error reading eventfd %d: %s", __PRETTY_FUNCTION__,
+                vq->kick_fd, strerror(errno));
+  }
+
+  if (vq->index == VU_VQ_TX) {
+    vu_tx_drain(vu);
+    return;
+  }
+
+  // new receive buffers, no kicks until we run out of them again
+  __atomic_store_n(&vq->used->flags, VRING_USED_F_NO_NOTIFY, __ATOMIC_RELAXED);
+  if (vde_sendq_flush(&vu->sendq)) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+    return;
+  }
+  if (!vde_sendq_is_empty(&vu->sendq)) {
+    vu_rx_wait(vu);
+  }
+}
+
+int vu_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  vu_conn *vu = vde_connection_get_priv(conn);
+
+  return vde_sendq_write(&vu->sendq, pkt);
+}
+
+unsigned int vu_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  vu_conn *vu = vde_connection_get_priv(conn);
+
+  return vde_sendq_write_batch(&vu->sendq, batch);
+}
+
+/**
+ * @brief Unmap the guest memory
+ *
+ * @param vu The connection
+ */
+static void vu_conn_unmap(vu_conn *vu)
+{
+  unsigned int i;
+
+  for (i = 0; i < vu->nregions; i++) {
+    munmap(vu->regions[i].mmap_addr, vu->regions[i].mmap_len);
+  }
+  vu->nregions = 0;
+}
+
+void vu_conn_close(vde_connection *conn)
+{
+  unsigned int i;
+  vu_vq *vq;
+  vu_conn *vu = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
+  vu_tr *tr = (vu_tr *)vde_component_get_priv(vu->transport);
+
+  if (vu->ev_rd != NULL) {
+    vde_context_event_del(ctx, vu->ev_rd);
+  }
+  if (vu->connect_to != NULL) {
+    vde_context_timeout_del(ctx, vu->connect_to);
+  }
+  if (vu->fd >= 0) {
+    close(vu->fd);
+  }
+  for (i = 0; i < vu->msg_nfds; i++) {
+    close(vu->msg_fds[i]);
+  }
+  for (i = 0; i < VU_VQ_NUM; i++) {
+    vq = &vu->vqs[i];
+    if (vq->ev_kick != NULL) {
+      vde_context_event_del(ctx, vq->ev_kick);
+    }
+    if (vq->kick_fd >= 0) {
+      close(vq->kick_fd);
+    }
+    if (vq->call_fd >= 0) {
+      close(vq->call_fd);
+    }
+  }
+  vu_conn_unmap(vu);
+  vde_sendq_fini(&vu->sendq);
+  tr->pending_conns = vde_list_remove(tr->pending_conns, vu);
+  tr->conns = vde_list_remove(tr->conns, vu);
+
+  vde_free(vu);
+}
+
+/**
+ * @brief Send the reply to a message of the frontend
+ *
+ * @param vu The connection
+ * @param size The size of the payload of the reply, set in vu->msg
+ *
+ * @return zero on success, -1 on error
+ */
+static int vu_conn_reply(vu_conn *vu, uint32_t size)
+{
+  int len = sizeof(vu_msg_hdr) + size;
+
+  vu->msg.hdr.flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+  vu->msg.hdr.size = size;
+  // the frontend waits for the reply, it fits in the socket buffer
+  if (send(vu->fd, &vu->msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+    vde_error("%s: cannot reply to frontend: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Take a descriptor passed along with the current message
+ *
+ * @param vu The connection
+ *
+ * @return The descriptor, -1 if none has been passed
+ */
+static int vu_conn_take_fd(vu_conn *vu)
+{
+  int fd;
+  unsigned int i;
+
+  if (vu->msg_nfds == 0) {
+    return -1;
+  }
+  fd = vu->msg_fds[0];
+  vu->msg_nfds--;
+  for (i = 0; i < vu->msg_nfds; i++) {
+    vu->msg_fds[i] = vu->msg_fds[i + 1];
+  }
+  return fd;
+}
+
+/**
+ * @brief Map the guest memory described by the frontend
+ *
+ * @param vu The connection
+ * @param mem The memory table
+ *
+ * @return zero on success, -1 on error
+ */
+static int vu_conn_set_mem_table(vu_conn *vu, vu_mem_table *mem)
+{
+  unsigned int i;
+  int fd;
+  void *addr;
+  vu_region *r;
+  vu_mem_region *mr;
+
+  if (mem->nregions > VHOST_MEMORY_MAX_NREGIONS ||
+      mem->nregions != vu->msg_nfds) {
+    vde_error("%s: %u memory regions and %u descriptors", __PRETTY_FUNCTION__,
+              mem->nregions, vu->msg_nfds);
+    return -1;
+  }
+
+  vu_conn_unmap(vu);
+  for (i = 0; i < mem->nregions; i++) {
+    mr = &mem->regions[i];
+    fd = vu_conn_take_fd(vu);
+    if (mr->memory_size == 0 ||
+        mr->memory_size + mr->mmap_offset < mr->memory_size ||
+        mr->guest_phys_addr + mr->memory_size < mr->guest_phys_addr ||
+        mr->userspace_addr + mr->memory_size < mr->userspace_addr) {
+      vde_error("%s: invalid memory region", __PRETTY_FUNCTION__);
+      close(fd);
+      goto error;
+    }
+    addr = mmap(NULL, mr->memory_size + mr->mmap_offset,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      vde_error("%s: cannot map guest memory: %s", __PRETTY_FUNCTION__,
+                strerror(errno));
+      goto error;
+    }
+    r = &vu->regions[vu->nregions++];
+    r->gpa = mr->guest_phys_addr;
+    r->size = mr->memory_size;
+    r->uaddr = mr->userspace_addr;
+    r->mmap_addr = addr;
+    r->mmap_len = mr->memory_size + mr->mmap_offset;
+    r->va = (char *)addr + mr->mmap_offset;
+  }
+
+  // the rings may have moved
+  for (i = 0; i < VU_VQ_NUM; i++) {
+    vu_vq_map(vu, &vu->vqs[i]);
+  }
+  return 0;
+
+error:
+  vu_conn_unmap(vu);
+  for (i = 0; i < VU_VQ_NUM; i++) {
+    vu_vq_map(vu, &vu->vqs[i]);
+  }
+  return -1;
+}
+
+/**
+ * @brief Get the virtqueue a message refers to
+ *
+ * @param vu The connection
+ * @param index The index in the message
+ *
+ * @return The virtqueue, NULL if it doesn't exist
+ */
+static vu_vq *vu_conn_get_vq(vu_conn *vu, uint32_t index)
+{
+  index &= VHOST_USER_VRING_IDX_MASK;
+  if (index >= VU_VQ_NUM) {
+    vde_error("%s: virtqueue %u not supported", __PRETTY_FUNCTION__, index);
+    return NULL;
+  }
+  return &vu->vqs[index];
+}
+
+/**
+ * @brief Set the kick or call eventfd of a virtqueue
+ *
+ * @param vu The connection
+ * @param u64 The payload of the message
+ * @param fd The eventfd to replace
+ *
+ * @return zero on success, -1 on error
+ */
+static int vu_conn_set_vring_fd(vu_conn *vu, uint64_t u64, int *fd)
+{
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+  if (u64 & VHOST_USER_VRING_NOFD_MASK) {
+    return 0;
+  }
+  *fd = vu_conn_take_fd(vu);
+  if (*fd < 0) {
+    vde_error("%s: no eventfd received", __PRETTY_FUNCTION__);
+    return -1;
+  }
+  // the eventfds are read and written from the event loop
+  return fcntl(*fd, F_SETFL, O_NONBLOCK);
+}
+
+/**
+ * @brief Check that a virtqueue can be used
+ *
+ * @param vu The connection
+ * @param vq The virtqueue
+ *
+ * @return Nonzero if the virtqueue is ready
+ */
+static int vu_vq_is_ready(vu_conn *vu, vu_vq *vq)
+{
+  // rings start disabled only with VHOST_USER_F_PROTOCOL_FEATURES
+  return vq->desc != NULL && vq->kick_fd >= 0 &&
+         (vq->enabled ||
+          !(vu->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)));
+}
+
+/**
+ * @brief Start processing a virtqueue
+ *
+ * @param vu The connection
+ * @param vq The virtqueue
+ */
+static void vu_vq_start(vu_conn *vu, vu_vq *vq)
+{
+  vde_context *ctx = vde_component_get_context(vu->transport);
+
+  // XXX: check event NULL
+  vq->ev_kick = vde_context_event_add(ctx, vq->kick_fd,
+                                      VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                      &vu_vq_kick_event, (void *)vq);
+  vq->started = 1;
+  vq->avail_wait = vq->last_avail;
+  // receive buffers are kicked only when we run out of them
+  __atomic_store_n(&vq->used->flags,
+                   vq->index == VU_VQ_RX ? VRING_USED_F_NO_NOTIFY : 0,
+                   __ATOMIC_RELAXED);
+  // pick up frames sent or packets queued in the meantime
+  vu_kick(vq->kick_fd);
+}
+
+/**
+ * @brief Stop processing a virtqueue
+ *
+ * @param vu The connection
+ * @param vq The virtqueue
+ */
+static void vu_vq_stop(vu_conn *vu, vu_vq *vq)
+{
+  vde_context *ctx = vde_component_get_context(vu->transport);
+
+  if (vq->ev_kick != NULL) {
+    vde_context_event_del(ctx, vq->ev_kick);
+    vq->ev_kick = NULL;
+  }
+  vq->started = 0;
+}
+
+/**
+ * @brief Start or stop the virtqueues after a message of the frontend, the
+ * connection is passed to the connection manager the first time both are
+ * ready.
+ *
+ * @param vu The connection
+ *
+ * @return Nonzero if the connection manager has been called, the connection
+ * may have been closed.
+ */
+static int vu_conn_update(vu_conn *vu)
+{
+  unsigned int i;
+  int ready[VU_VQ_NUM];
+  vu_tr *tr = (vu_tr *)vde_component_get_priv(vu->transport);
+
+  for (i = 0; i < VU_VQ_NUM; i++) {
+    ready[i] = vu_vq_is_ready(vu, &vu->vqs[i]);
+    if (!ready[i] && vu->vqs[i].started) {
+      vu_vq_stop(vu, &vu->vqs[i]);
+    }
+  }
+  if (!vu->established && !(ready[VU_VQ_RX] && ready[VU_VQ_TX])) {
+    return 0;
+  }
+  for (i = 0; i < VU_VQ_NUM; i++) {
+    if (ready[i] && !vu->vqs[i].started) {
+      vu_vq_start(vu, &vu->vqs[i]);
+    }
+  }
+  if (vu->established) {
+    return 0;
+  }
+
+  vu->established = 1;
+  tr->pending_conns = vde_list_remove(tr->pending_conns, vu);
+  tr->conns = vde_list_prepend(tr->conns, vu);
+  if (vu->outgoing) {
+    vde_transport_call_cm_connect_cb(vu->transport, vu->conn);
+  } else {
+    vde_transport_call_cm_accept_cb(vu->transport, vu->conn);
+  }
+  return 1;
+}
+
+/**
+ * @brief Handle a message of the frontend
+ *
+ * @param vu The connection
+ *
+ * @return zero on success, -1 on error
+ */
+static int vu_conn_handle(vu_conn *vu)
+{
+  int ret = 0, replied = 0;
+  vu_vq *vq;
+  vu_msg *msg = &vu->msg;
+  uint32_t size = msg->hdr.size;
+
+// the payload must be large enough for the request
+#define VU_PAYLOAD(field) \
+  if (size < sizeof(msg->payload.field)) { \
+    vde_error("%s: short payload for request %u", __PRETTY_FUNCTION__, \
+              msg->hdr.request); \
+    return -1; \
+  }
+
+  switch (msg->hdr.request) {
+    case VHOST_USER_GET_FEATURES:
+      msg->payload.u64 = VU_FEATURES;
+      ret = vu_conn_reply(vu, sizeof(msg->payload.u64));
+      replied = 1;
+      break;
+    case VHOST_USER_SET_FEATURES:
+      VU_PAYLOAD(u64);
+      vu->features = msg->payload.u64 & VU_FEATURES;
+      vu->hdr_len = vu->features & ((1ULL << VIRTIO_NET_F_MRG_RXBUF) |
+                                    (1ULL << VIRTIO_F_VERSION_1)) ?
+                    VU_NET_HDR_MRG_LEN : VU_NET_HDR_LEN;
+      break;
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+      msg->payload.u64 = VU_PROTOCOL_FEATURES;
+      ret = vu_conn_reply(vu, sizeof(msg->payload.u64));
+      replied = 1;
+      break;
+    case VHOST_USER_SET_PROTOCOL_FEATURES:
+      VU_PAYLOAD(u64);
+      vu->protocol_features = msg->payload.u64 & VU_PROTOCOL_FEATURES;
+      break;
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+      break;
+    case VHOST_USER_SET_MEM_TABLE:
+      if (size < offsetof(vu_mem_table, regions)) {
+        vde_error("%s: short memory table", __PRETTY_FUNCTION__);
+        return -1;
+      }
+      if (size < offsetof(vu_mem_table, regions) +
+                 msg->payload.mem.nregions * sizeof(vu_mem_region)) {
+        vde_error("%s: short memory table", __PRETTY_FUNCTION__);
+        return -1;
+      }
+      ret = vu_conn_set_mem_table(vu, &msg->payload.mem);
+      break;
+    case VHOST_USER_SET_VRING_NUM:
+      VU_PAYLOAD(state);
+      vq = vu_conn_get_vq(vu, msg->payload.state.index);
+      if (vq == NULL || vq->started || msg->payload.state.num == 0 ||
+          msg->payload.state.num > VIRTQUEUE_MAX_SIZE ||
+          (msg->payload.state.num & (msg->payload.state.num - 1))) {
+        ret = -1;
+        break;
+      }
+      vq->num = msg->payload.state.num;
+      vu_vq_map(vu, vq);
+      break;
+    case VHOST_USER_SET_VRING_ADDR:
+      VU_PAYLOAD(addr);
+      vq = vu_conn_get_vq(vu, msg->payload.addr.index);
+      if (vq == NULL || vq->started) {
+        ret = -1;
+        break;
+      }
+      vq->desc_uaddr = msg->payload.addr.desc_user_addr;
+      vq->avail_uaddr = msg->payload.addr.avail_user_addr;
+      vq->used_uaddr = msg->payload.addr.used_user_addr;
+      vu_vq_map(vu, vq);
+      break;
+    case VHOST_USER_SET_VRING_BASE:
+      VU_PAYLOAD(state);
+      vq = vu_conn_get_vq(vu, msg->payload.state.index);
+      if (vq == NULL || vq->started) {
+        ret = -1;
+        break;
+      }
+      vq->last_avail = msg->payload.state.num;
+      break;
+    case VHOST_USER_GET_VRING_BASE:
+      VU_PAYLOAD(state);
+      vq = vu_conn_get_vq(vu, msg->payload.state.index);
+      if (vq == NULL) {
+        return -1;
+      }
+      // the ring is stopped until it gets a new kick eventfd
+      if (vq->started) {
+        vu_vq_stop(vu, vq);
+      }
+      if (vq->kick_fd >= 0) {
+        close(vq->kick_fd);
+        vq->kick_fd = -1;
+      }
+      msg->payload.state.num = vq->last_avail;
+      ret = vu_conn_reply(vu, sizeof(msg->payload.state));
+      replied = 1;
+      break;
+    case VHOST_USER_SET_VRING_KICK:
+      VU_PAYLOAD(u64);
+      vq = vu_conn_get_vq(vu, msg->payload.u64);
+      if (vq == NULL) {
+        ret = -1;
+        break;
+      }
+      if (vq->started) {
+        vu_vq_stop(vu, vq);
+      }
+      if (msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK) {
+        vde_error("%s: polling mode not supported", __PRETTY_FUNCTION__);
+        ret = -1;
+        break;
+      }
+      ret = vu_conn_set_vring_fd(vu, msg->payload.u64, &vq->kick_fd);
+      break;
+    case VHOST_USER_SET_VRING_CALL:
+      VU_PAYLOAD(u64);
+      vq = vu_conn_get_vq(vu, msg->payload.u64);
+      if (vq == NULL) {
+        ret = -1;
+        break;
+      }
+      ret = vu_conn_set_vring_fd(vu, msg->payload.u64, &vq->call_fd);
+      break;
+    case VHOST_USER_SET_VRING_ERR:
+    case VHOST_USER_SET_LOG_FD:
+      // errors are not reported and dirty pages are not logged, the
+      // descriptor is closed along with the message
+      break;
+    case VHOST_USER_GET_QUEUE_NUM:
+      msg->payload.u64 = 1;
+      ret = vu_conn_reply(vu, sizeof(msg->payload.u64));
+      replied = 1;
+      break;
+    case VHOST_USER_SET_VRING_ENABLE:
+      VU_PAYLOAD(state);
+      vq = vu_conn_get_vq(vu, msg->payload.state.index);
+      if (vq == NULL) {
+        ret = -1;
+        break;
+      }
+      vq->enabled = msg->payload.state.num;
+      break;
+    default:
+      vde_warning("%s: request %u not supported", __PRETTY_FUNCTION__,
+                  msg->hdr.request);
+      ret = -1;
+      break;
+  }
+#undef VU_PAYLOAD
+
+  if (!replied && (msg->hdr.flags & VHOST_USER_NEED_REPLY_MASK) &&
+      (vu->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))) {
+    msg->payload.u64 = ret != 0;
+    if (vu_conn_reply(vu, sizeof(msg->payload.u64))) {
+      return -1;
+    }
+    // the frontend knows, keep going
+    return 0;
+  }
+  return ret;
+}
+
+/**
+ * @brief Drop a connection which failed before being passed to the connection
+ * manager, or report the failure to the connection user.
+ *
+ * @param vu The connection
+ * @param tr_errno The error
+ */
+static void vu_conn_fail(vu_conn *vu, int tr_errno)
+{
+  vde_connection *conn = vu->conn;
+  vde_component *transport = vu->transport;
+
+  if (vu->established) {
+    vu_conn_closed(vu, CONN_READ_CLOSED);
+  } else if (vu->outgoing) {
+    vde_connection_fini(conn);
+    vde_transport_call_cm_error_cb(transport, conn, tr_errno);
+  } else {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
+}
+
+/**
+ * @brief Collect the descriptors passed along with a message, descriptors in
+ * excess are closed.
+ *
+ * @param vu The connection
+ * @param msg The message header
+ */
+static void vu_conn_get_fds(vu_conn *vu, struct msghdr *msg)
+{
+  int i, nfds, fd;
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (i = 0; i < nfds; i++) {
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (vu->msg_nfds < VHOST_MEMORY_MAX_NREGIONS) {
+        vu->msg_fds[vu->msg_nfds++] = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+}
+
+/*
+ * Messages are received in vu->msg as the socket becomes readable, one
+ * message is handled at each event.
+ */
+void vu_conn_ctl_event(int fd, short event_type, void *arg)
+{
+  int len;
+  unsigned int i;
+  size_t want;
+  char cbuf[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+  struct iovec iov;
+  struct msghdr msg;
+  vu_conn *vu = (vu_conn *)arg;
+
+  while (1) {
+    if (vu->msg_len < sizeof(vu_msg_hdr)) {
+      want = sizeof(vu_msg_hdr) - vu->msg_len;
+    } else {
+      want = sizeof(vu_msg_hdr) + vu->msg.hdr.size - vu->msg_len;
+    }
+
+    if (want > 0) {
+      iov.iov_base = (char *)&vu->msg + vu->msg_len;
+      iov.iov_len = want;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = cbuf;
+      msg.msg_controllen = sizeof(cbuf);
+
+      len = recvmsg(vu->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+      if (len < 0 && errno == EAGAIN) {
+        return;
+      }
+      if (len <= 0) {
+        if (len < 0) {
+          vde_warning("%s: error reading from fd %d: %s", __PRETTY_FUNCTION__,
+                      vu->fd, strerror(errno));
+        }
+        vu_conn_fail(vu, len < 0 ? errno : ECONNRESET);
+        return;
+      }
+      vu_conn_get_fds(vu, &msg);
+      vu->msg_len += len;
+
+      if (vu->msg_len == sizeof(vu_msg_hdr) &&
+          ((vu->msg.hdr.flags & VHOST_USER_VERSION_MASK) !=
+           VHOST_USER_VERSION ||
+           vu->msg.hdr.size > sizeof(vu->msg.payload))) {
+        vde_error("%s: invalid message from frontend", __PRETTY_FUNCTION__);
+        vu_conn_fail(vu, EPROTO);
+        return;
+      }
+      if (vu->msg_len < sizeof(vu_msg_hdr) ||
+          vu->msg_len < sizeof(vu_msg_hdr) + vu->msg.hdr.size) {
+        continue;
+      }
+    }
+
+    if (vu_conn_handle(vu)) {
+      vu_conn_fail(vu, EPROTO);
+      return;
+    }
+    // descriptors not used by the request
+    for (i = 0; i < vu->msg_nfds; i++) {
+      close(vu->msg_fds[i]);
+    }
+    vu->msg_nfds = 0;
+    vu->msg_len = 0;
+    vu_conn_update(vu);
+    return;
+  }
+}
+
+/**
+ * @brief Allocate the backend of a connection and initialize the connection
+ *
+ * @param component The transport
+ * @param conn The connection
+ * @param fd The socket of the connection, -1 if not created yet
+ *
+ * @return The backend, NULL on error (and errno is set appropriately)
+ */
+static vu_conn *vu_conn_new(vde_component *component, vde_connection *conn,
+                            int fd)
+{
+  unsigned int i;
+  vu_conn *vu;
+  vu_tr *tr = (vu_tr *)vde_component_get_priv(component);
+
+  vu = (vu_conn *)vde_calloc(sizeof(vu_conn));
+  if (!vu) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  vu->fd = fd;
+  vu->hdr_len = VU_NET_HDR_LEN;
+  for (i = 0; i < VU_VQ_NUM; i++) {
+    vu->vqs[i].index = i;
+    vu->vqs[i].kick_fd = -1;
+    vu->vqs[i].call_fd = -1;
+    vu->vqs[i].vu = vu;
+  }
+  vu->conn = conn;
+  vu->transport = component;
+
+  vde_connection_init(conn, vde_component_get_context(component),
+                      tr->frame_len, &vu_conn_write, &vu_conn_close,
+                      (void *)vu);
+  vde_connection_set_be_write_batch(conn, &vu_conn_write_batch);
+  vde_connection_set_queue_properties(conn, tr->queue_size, tr->queue_len);
+  // the wait for receive buffers is not bound to a timeout, tries are not
+  // counted
+  vde_sendq_init(&vu->sendq, conn, &vu_rx_send, &vu_rx_wait, (void *)vu, 0);
+
+  // XXX: check error on list
+  tr->pending_conns = vde_list_prepend(tr->pending_conns, vu);
+  return vu;
+}
+
+/*
+ * When many frontends connect at once the backlog is drained at each event,
+ * up to ACCEPT_BUDGET connections so that established connections are served
+ * in the meantime.
+ */
+void vu_accept(int listen_fd, short event_type, void *arg)
+{
+  int new;
+  unsigned int burst = 0;
+  vde_connection *conn;
+  vu_conn *vu;
+  vde_component *component = (vde_component *)arg;
+  vde_context *ctx = vde_component_get_context(component);
+
+  while (burst < ACCEPT_BUDGET) {
+    new = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (new < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        vde_warning("%s: accept %s", __PRETTY_FUNCTION__, strerror(errno));
+      }
+      break;
+    }
+    burst++;
+
+    if (vde_connection_new(&conn)) {
+      vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
+      close(new);
+      continue;
+    }
+    vu = vu_conn_new(component, conn, new);
+    if (vu == NULL) {
+      vde_connection_delete(conn);
+      close(new);
+      continue;
+    }
+
+    // XXX: check event NULL
+    vu->ev_rd = vde_context_event_add(ctx, vu->fd,
+                                      VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                      &vu_conn_ctl_event, (void *)vu);
+  }
+}
+
+int vu_listen(vde_component *component)
+{
+  vde_context *ctx = vde_component_get_context(component);
+  vu_tr *tr = (vu_tr *)vde_component_get_priv(component);
+
+  tr->listen_fd = vde_sock_listen((struct sockaddr *)&tr->sa, tr->sa_len,
+                                  SOCK_STREAM, tr->backlog);
+  if (tr->listen_fd < 0) {
+    return -1;
+  }
+
+  // XXX: check event not NULL
+  tr->listen_event = vde_context_event_add(ctx, tr->listen_fd,
+                                           VDE_EV_READ | VDE_EV_PERSIST, NULL,
+                                           &vu_accept, (void *)component);
+  return 0;
+}
+
+void vu_cli_connect_retry(int fd, short event_type, void *arg);
+
+/**
+ * @brief Connect to a frontend waiting for its backend, e.g. QEMU with a
+ * server chardev. Unix sockets connect right away, unless the backlog of the
+ * listener is full.
+ *
+ * @param vu The connection
+ *
+ * @return zero on success, -1 on error (and errno is set appropriately)
+ */
+static int vu_cli_connect(vu_conn *vu)
+{
+  int ret;
+  vde_context *ctx = vde_component_get_context(vu->transport);
+  vu_tr *tr = (vu_tr *)vde_component_get_priv(vu->transport);
+
+  ret = vde_sock_connect(ctx, vu->fd, (struct sockaddr *)&tr->sa, tr->sa_len,
+                         &vu->connect_tries, &vu->connect_to,
+                         &vu_cli_connect_retry, (void *)vu);
+  if (ret <= 0) {
+    return ret;
+  }
+
+  // the frontend drives the protocol
+  // XXX: check event NULL
+  vu->ev_rd = vde_context_event_add(ctx, vu->fd, VDE_EV_READ | VDE_EV_PERSIST,
+                                    NULL, &vu_conn_ctl_event, (void *)vu);
+  return 0;
+}
+
+void vu_cli_connect_retry(int fd, short event_type, void *arg)
+{
+  vu_conn *vu = (vu_conn *)arg;
+  vde_context *ctx = vde_component_get_context(vu->transport);
+
+  vde_context_timeout_del(ctx, vu->connect_to);
+  vu->connect_to = NULL;
+  if (vu_cli_connect(vu)) {
+    vu_conn_fail(vu, errno);
+  }
+}
+
+int vu_connect(vde_component *component, vde_connection *conn)
+{
+  int tmp_errno;
+  vu_conn *vu;
+
+  vu = vu_conn_new(component, conn, -1);
+  if (vu == NULL) {
+    return -1;
+  }
+  vu->outgoing = 1;
+
+  vu->fd = socket(PF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (vu->fd < 0) {
+    vde_error("%s: cannot create socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    goto error;
+  }
+  if (vu_cli_connect(vu)) {
+    goto error;
+  }
+  return 0;
+
+error:
+  tmp_errno = errno;
+  // the connection manager owns the connection and deletes it
+  vde_connection_fini(conn);
+  errno = tmp_errno;
+  return -1;
+}
+
+static int transport_vhost_user_init(vde_component *component,
+                                     vde_sobj *params)
+{
+  vu_tr *tr;
+  vde_sobj *path_sobj;
+  const char *path;
+  int mtu = ETH_DATA_LEN;
+  int queue_size = VDE_CONNECTION_QUEUE_MAXBYTES;
+  int queue_len = VDE_CONNECTION_QUEUE_MAXLEN;
+  int rx_budget = RX_BUDGET;
+  int backlog = LISTEN_QUEUE;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  path_sobj = vde_sobj_hash_lookup(params, "path");
+  if (!path_sobj || !vde_sobj_is_type(path_sobj, vde_sobj_type_string)) {
+    vde_error("%s: no socket path received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  path = vde_sobj_get_string(path_sobj);
+  if (strlen(path) < 2 || strlen(path) >= UNIX_PATH_MAX) {
+    vde_error("%s: invalid socket path", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (vde_params_get_int(params, "mtu", ETH_MIN_MTU, ETH_MAX_MTU, &mtu) ||
+      vde_params_get_int(params, "queue_size", 0, INT_MAX, &queue_size) ||
+      vde_params_get_int(params, "queue_len", 1, INT_MAX, &queue_len) ||
+      vde_params_get_int(params, "rx_budget", 1, INT_MAX, &rx_budget) ||
+      vde_params_get_int(params, "backlog", 1, INT_MAX, &backlog)) {
+    return -1;
+  }
+
+  tr = (vu_tr *)vde_calloc(sizeof(vu_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  tr->sa.sun_family = AF_UNIX;
+  if (path[0] == '@') {
+    // abstract namespace, the name is not NUL terminated
+    tr->abstract = 1;
+    memcpy(tr->sa.sun_path + 1, path + 1, strlen(path) - 1);
+    tr->sa_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+  } else {
+    // XXX: path needs to be normalized/checked somewhere
+    strcpy(tr->sa.sun_path, path);
+    tr->sa_len = sizeof(tr->sa);
+  }
+  tr->frame_len = ETH_FRAME_LEN(mtu);
+  tr->queue_size = queue_size;
+  tr->queue_len = queue_len;
+  tr->rx_budget = rx_budget;
+  tr->backlog = backlog;
+  tr->listen_fd = -1;
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_vhost_user_fini(vde_component *component)
+{
+  vu_tr *tr;
+  vu_conn *vu;
+
+  vde_assert(component != NULL);
+
+  tr = (vu_tr *)vde_component_get_priv(component);
+  if (tr->listen_fd >= 0) {
+    vde_context_event_del(vde_component_get_context(component),
+                          tr->listen_event);
+    close(tr->listen_fd);
+    if (!tr->abstract) {
+      unlink(tr->sa.sun_path);
+    }
+  }
+  // closing a connection removes it from its list
+  while (tr->pending_conns != NULL) {
+    vu = vde_list_get_data(vde_list_first(tr->pending_conns));
+    vu_conn_fail(vu, ECONNABORTED);
+  }
+  while (tr->conns != NULL) {
+    vu = vde_list_get_data(vde_list_first(tr->conns));
+    vde_transport_conn_gone(vu->conn);
+  }
+  vde_free(tr);
+}
+
+component_ops transport_vhost_user_component_ops = {
+  .init = transport_vhost_user_init,
+  .fini = transport_vhost_user_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "vhost_user",
+  .cops = &transport_vhost_user_component_ops,
+  .tr_listen = &vu_listen,
+  .tr_connect = &vu_connect,
+};
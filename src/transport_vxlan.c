@@ -0,0 +1,1097 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * A UDP tunnel with VXLAN encapsulation (RFC 7348), interoperable with Linux
+ * vxlan devices. Each transport is a VNI: a connect plugs the tunnel to the
+ * VTEP remote as a port, a listen accepts a port for each VTEP which sends
+ * frames of the VNI.
+ *
+ * The transports of a context bound to the same local address share a UDP
+ * socket, which demultiplexes ingress frames by VNI and then by VTEP. Frames
+ * are received with UDP_GRO, many of them coalesced in a datagram, and sent
+ * with UDP_SEGMENT: the frames of equal length written to a port at once are
+ * sent as a single datagram which the kernel splits.
+ *
+ * Frames are encapsulated as they are: the port declares no offload, so the
+ * connection does checksums and segmentation in software first.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/module.h>
+#include <vde3/connection.h>
+#include <vde3/transport.h>
+#include <vde3/context.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+#include <vde3/transport_common.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define VXLAN_PORT 4789
+#define VXLAN_HDR_LEN 8
+#define VXLAN_FLAG_VNI 0x08
+#define VXLAN_VNI_MAX 0xffffff
+
+// max length of a UDP datagram, coalesced by GRO or to be split by GSO
+#define UDP_MAX_LEN 65507
+
+// max number of segments of a UDP_SEGMENT datagram (UDP_MAX_SEGMENTS)
+#define UDP_GSO_MAX 64
+
+// max number of segments of a chained packet sent without linearizing it
+#define SEND_IOV_MAX 8
+
+// frames deferred before being sent
+#define TX_MAX (2 * VDE_PKT_BATCH_MAX)
+
+// datagrams received at once, each buffer holds a coalesced datagram
+#define RX_SLOTS 8
+#define RX_SLOT_SIZE 65536
+
+// defaults
+#define VXLAN_MTU 1450
+#define RX_BUDGET 256
+#define MAX_PORTS 64
+
+struct vx_conn;
+
+// a UDP socket shared by the transports of a context with the same local
+// address
+typedef struct {
+  int fd;
+  void *ev;
+  vde_context *ctx;
+  struct sockaddr_storage local;
+  socklen_t local_len;
+  unsigned int refcount; // transports and connections using the socket
+  vde_hash *vnis; // transports by VNI
+  int gso; // nonzero if UDP_SEGMENT is used
+  int gro; // nonzero if UDP_GRO is enabled
+  unsigned int rx_budget; // max frames received at each read event
+  char *rx_buf; // RX_SLOTS buffers of RX_SLOT_SIZE
+  unsigned long unknown; // frames dropped for unknown VNI or VTEP
+  // frames deferred while tx_cork is set, sent by vx_sock_tx_flush()
+  int tx_cork;
+  unsigned int tx_count;
+  struct vx_conn *tx_conns[TX_MAX];
+  vde_pkt *tx_pkts[TX_MAX];
+} vx_sock;
+
+typedef struct vx_conn {
+  struct sockaddr_storage remote;
+  socklen_t remote_len;
+  void *ready_to; // timeout passing the connection to the connection manager
+  unsigned long tx_drops;
+  vde_connection *conn;
+  vde_component *transport;
+} vx_conn;
+
+typedef struct {
+  uint32_t vni;
+  unsigned char hdr[VXLAN_HDR_LEN]; // VXLAN header of the VNI
+  struct sockaddr_storage local;
+  socklen_t local_len;
+  struct sockaddr_storage remote; // VTEP to connect to
+  socklen_t remote_len; // zero if no remote
+  int listening; // nonzero to accept unknown VTEPs
+  struct sockaddr_storage *allowed; // VTEPs accepted, any if NULL
+  unsigned int allowed_len;
+  unsigned int max_ports; // max ports, beyond it unknown VTEPs are refused
+  unsigned int nports;
+  int gso;
+  int gro;
+  unsigned int frame_len; // largest frame
+  unsigned int rx_budget;
+  vx_sock *sock; // NULL until the first listen or connect
+  vde_list *conns;
+} vx_tr;
+
+// sockets of all contexts, they are few
+static vde_list *vx_socks = NULL;
+
+/**
+ * @brief Parse a numeric IPv4 or IPv6 address
+ *
+ * @param str The address
+ * @param port The port, in host byte order
+ * @param sa The socket address to fill
+ * @param len The length of the socket address
+ *
+ * @return zero on success, -1 if the address is invalid
+ */
+static int vx_parse_addr(const char *str, int port,
+                         struct sockaddr_storage *sa, socklen_t *len)
+{
+  struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+
+  memset(sa, 0, sizeof(*sa));
+  if (inet_pton(AF_INET, str, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    *len = sizeof(*sin);
+    return 0;
+  }
+  if (inet_pton(AF_INET6, str, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    *len = sizeof(*sin6);
+    return 0;
+  }
+  return -1;
+}
+
+/**
+ * @brief Check if two socket addresses have the same IP address, the ports
+ * are not compared since vxlan devices send from a port chosen by flow.
+ */
+static int vx_same_host(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+  if (a->ss_family != b->ss_family) {
+    return 0;
+  }
+  if (a->ss_family == AF_INET) {
+    return ((struct sockaddr_in *)a)->sin_addr.s_addr ==
+           ((struct sockaddr_in *)b)->sin_addr.s_addr;
+  }
+  return !memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+                 &((struct sockaddr_in6 *)b)->sin6_addr,
+                 sizeof(struct in6_addr));
+}
+
+static vx_conn *vx_tr_lookup_conn(vx_tr *tr, struct sockaddr_storage *sa)
+{
+  vx_conn *vc;
+  vde_list *iter;
+
+  for (iter = vde_list_first(tr->conns); iter != NULL;
+       iter = vde_list_next(iter)) {
+    vc = vde_list_get_data(iter);
+    if (vx_same_host(&vc->remote, sa)) {
+      return vc;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Sending: frames written to ports are deferred in the socket and sent by
+ * vx_sock_tx_flush(), right away or, while the socket is being read, when
+ * the read event ends so that the frames flooded by an engine go out with a
+ * single system call.
+ */
+
+/**
+ * @brief Fill the iovec describing the datagrams of a packet
+ *
+ * @return The number of elements used, -1 if the packet has too many segments
+ */
+static int vx_pkt_iovec(vx_conn *vc, vde_pkt *pkt, struct iovec *iov)
+{
+  int iovcnt;
+  vx_tr *tr = (vx_tr *)vde_component_get_priv(vc->transport);
+
+  iov[0].iov_base = tr->hdr;
+  iov[0].iov_len = VXLAN_HDR_LEN;
+  iovcnt = vde_pkt_to_iovec(pkt, iov + 1, SEND_IOV_MAX);
+  return iovcnt < 0 ? -1 : iovcnt + 1;
+}
+
+/**
+ * @brief Send frames to a port one datagram each, e.g. when the kernel
+ * refuses to segment them
+ */
+static void vx_sock_tx_single(vx_sock *sock, vx_conn *vc, vde_pkt **pkts,
+                              unsigned int count)
+{
+  unsigned int i;
+  struct msghdr msg;
+  struct iovec iov[SEND_IOV_MAX + 1];
+
+  for (i = 0; i < count; i++) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &vc->remote;
+    msg.msg_namelen = vc->remote_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = vx_pkt_iovec(vc, pkts[i], iov);
+    if (sendmsg(sock->fd, &msg, MSG_DONTWAIT) < 0) {
+      vc->tx_drops++;
+    }
+  }
+}
+
+/**
+ * @brief Send the deferred frames with sendmmsg(). The consecutive frames of
+ * a port with the same length (the last one can be shorter) make up a
+ * UDP_SEGMENT datagram.
+ *
+ * @param sock The socket
+ */
+static void vx_sock_tx_flush(vx_sock *sock)
+{
+  unsigned int i, j, count, nmsgs = 0, niov = 0, seg_len, len, total;
+  int sent, iovcnt;
+  struct mmsghdr msgs[TX_MAX];
+  struct iovec iov[TX_MAX * (SEND_IOV_MAX + 1)];
+  char cbuf[TX_MAX][CMSG_SPACE(sizeof(uint16_t))];
+  unsigned int first[TX_MAX + 1]; // index of the first frame of each message
+  struct cmsghdr *cmsg;
+  vx_conn *vc;
+
+  count = sock->tx_count;
+  if (count == 0) {
+    return;
+  }
+  sock->tx_count = 0;
+
+  memset(msgs, 0, count * sizeof(struct mmsghdr));
+  for (i = 0; i < count; i = j) {
+    vc = sock->tx_conns[i];
+    seg_len = vde_pkt_len(sock->tx_pkts[i]) + VXLAN_HDR_LEN;
+    total = 0;
+    first[nmsgs] = i;
+    msgs[nmsgs].msg_hdr.msg_name = &vc->remote;
+    msgs[nmsgs].msg_hdr.msg_namelen = vc->remote_len;
+    msgs[nmsgs].msg_hdr.msg_iov = &iov[niov];
+
+    for (j = i; j < count; j++) {
+      len = vde_pkt_len(sock->tx_pkts[j]) + VXLAN_HDR_LEN;
+      if (j > i && (!sock->gso || sock->tx_conns[j] != vc ||
+                    len > seg_len || total + len > UDP_MAX_LEN ||
+                    j - i == UDP_GSO_MAX)) {
+        break;
+      }
+      iovcnt = vx_pkt_iovec(vc, sock->tx_pkts[j], &iov[niov]);
+      niov += iovcnt;
+      total += len;
+      msgs[nmsgs].msg_hdr.msg_iovlen += iovcnt;
+      // a shorter frame ends the datagram
+      if (len < seg_len) {
+        j++;
+        break;
+      }
+    }
+
+    if (j - i > 1) {
+      msgs[nmsgs].msg_hdr.msg_control = cbuf[nmsgs];
+      msgs[nmsgs].msg_hdr.msg_controllen = sizeof(cbuf[nmsgs]);
+      cmsg = CMSG_FIRSTHDR(&msgs[nmsgs].msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      *(uint16_t *)CMSG_DATA(cmsg) = seg_len;
+    }
+    nmsgs++;
+  }
+  first[nmsgs] = count;
+
+  for (i = 0; i < nmsgs; i += sent) {
+    sent = sendmmsg(sock->fd, &msgs[i], nmsgs - i, MSG_DONTWAIT);
+    if (sent > 0) {
+      continue;
+    }
+
+    vc = sock->tx_conns[first[i]];
+    if (errno == EINVAL && msgs[i].msg_hdr.msg_control != NULL) {
+      // e.g. segments longer than the path mtu, which need fragmentation
+      vx_sock_tx_single(sock, vc, &sock->tx_pkts[first[i]],
+                        first[i + 1] - first[i]);
+    } else {
+      // XXX: as a vxlan device a full socket buffer drops the frames
+      if (errno != EAGAIN && errno != ENOBUFS) {
+        vde_warning("%s: cannot send to VTEP: %s", __PRETTY_FUNCTION__,
+                    strerror(errno));
+      }
+      vc->tx_drops += first[i + 1] - first[i];
+    }
+    sent = 1;
+  }
+
+  for (i = 0; i < count; i++) {
+    vde_pkt_put(sock->tx_pkts[i]);
+  }
+}
+
+/**
+ * @brief Defer sending frames to a port
+ *
+ * @param vc The port
+ * @param pkts The packets to send, they are not released
+ * @param count The number of packets
+ *
+ * @return The number of packets deferred or dropped
+ */
+static unsigned int vx_conn_send(vx_conn *vc, vde_pkt **pkts,
+                                 unsigned int count)
+{
+  unsigned int i;
+  vde_pkt *pkt;
+  struct iovec iov[SEND_IOV_MAX];
+  vde_connection *conn = vc->conn;
+  vx_tr *tr = (vx_tr *)vde_component_get_priv(vc->transport);
+  vx_sock *sock = tr->sock;
+  vde_pool *pool = vde_context_get_pool(vde_connection_get_context(conn));
+
+  for (i = 0; i < count; i++) {
+    if (vde_pkt_len(pkts[i]) > vde_connection_max_payload(conn)) {
+      vde_warning("%s: packet larger than mtu, discarding",
+                  __PRETTY_FUNCTION__);
+      vc->tx_drops++;
+      continue;
+    }
+    if (sock->tx_count == TX_MAX) {
+      vx_sock_tx_flush(sock);
+    }
+
+    pkt = vde_pool_pkt_share(pool, pkts[i]);
+    // long chains are copied, a frame takes at most SEND_IOV_MAX elements
+    if (pkt != NULL && vde_pkt_to_iovec(pkt, iov, SEND_IOV_MAX) < 0) {
+      pkt = vde_pkt_linearize(pkt);
+    }
+    if (pkt == NULL) {
+      vde_warning("%s: cannot share pkt, discarding", __PRETTY_FUNCTION__);
+      vc->tx_drops++;
+      continue;
+    }
+    sock->tx_conns[sock->tx_count] = vc;
+    sock->tx_pkts[sock->tx_count] = pkt;
+    sock->tx_count++;
+  }
+
+  if (!sock->tx_cork) {
+    vx_sock_tx_flush(sock);
+  }
+  return count;
+}
+
+int vx_conn_write(vde_connection *conn, vde_pkt *pkt)
+{
+  vx_conn_send(vde_connection_get_priv(conn), &pkt, 1);
+  return 0;
+}
+
+unsigned int vx_conn_write_batch(vde_connection *conn, vde_pkt_batch *batch)
+{
+  return vx_conn_send(vde_connection_get_priv(conn), batch->pkts,
+                      batch->count);
+}
+
+/*
+ * Receiving
+ */
+
+/**
+ * @brief Create a port for a VTEP which sent a frame to a listening transport
+ *
+ * @param component The transport
+ * @param sa The address of the VTEP
+ *
+ * @return The port, NULL on error
+ */
+static vx_conn *vx_tr_accept(vde_component *component,
+                             struct sockaddr_storage *sa);
+
+static void vx_sock_unref(vx_sock *sock);
+
+/**
+ * @brief Hand a run of frames to their port
+ *
+ * @param vc The port
+ * @param frames The frames, the batch is emptied
+ */
+static void vx_conn_deliver(vx_conn *vc, vde_pkt_batch *frames)
+{
+  int cb_errno = 0;
+  vde_connection *conn = vc->conn;
+
+  if (frames->count > 0 && vde_connection_call_read_batch(conn, frames)) {
+    cb_errno = errno;
+  }
+  vde_pkt_batch_put(frames);
+  vde_pkt_batch_init(frames);
+
+  if (cb_errno == EPIPE) {
+    vde_connection_fini(conn);
+    vde_connection_delete(conn);
+  }
+}
+
+/**
+ * @brief Get the port a frame is for
+ *
+ * @param sock The socket
+ * @param frame The VXLAN header followed by the frame
+ * @param sa The sender
+ *
+ * @return The port, NULL if the frame must be dropped
+ */
+static vx_conn *vx_sock_demux(vx_sock *sock, unsigned char *frame,
+                              struct sockaddr_storage *sa)
+{
+  uint32_t vni;
+  vx_conn *vc;
+  vde_component *component;
+  vx_tr *tr;
+
+  if (!(frame[0] & VXLAN_FLAG_VNI)) {
+    return NULL;
+  }
+  vni = (frame[4] << 16) | (frame[5] << 8) | frame[6];
+  component = vde_hash_lookup(sock->vnis, (uintptr_t)vni);
+  if (component == NULL) {
+    return NULL;
+  }
+  tr = (vx_tr *)vde_component_get_priv(component);
+  vc = vx_tr_lookup_conn(tr, sa);
+  if (vc == NULL && tr->listening) {
+    vc = vx_tr_accept(component, sa);
+  }
+  return vc;
+}
+
+void vx_sock_read_event(int fd, short event_type, void *arg)
+{
+  vde_pkt *pkt;
+  vde_pkt_batch frames;
+  struct mmsghdr msgs[RX_SLOTS];
+  struct iovec iov[RX_SLOTS];
+  struct sockaddr_storage names[RX_SLOTS];
+  char cbuf[RX_SLOTS][CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  unsigned char *frame;
+  unsigned int i, off, len, seg_len, frame_len, total = 0;
+  int rcvd;
+  uint64_t now;
+  vx_conn *vc, *next;
+  vx_sock *sock = (vx_sock *)arg;
+  vde_pool *pool = vde_context_get_pool(sock->ctx);
+
+  // the ports written while the frames are handed out are sent together,
+  // the socket is held since the engines may close all of its ports
+  sock->tx_cork++;
+  sock->refcount++;
+
+  while (total < sock->rx_budget) {
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < RX_SLOTS; i++) {
+      iov[i].iov_base = sock->rx_buf + i * RX_SLOT_SIZE;
+      iov[i].iov_len = RX_SLOT_SIZE;
+      msgs[i].msg_hdr.msg_name = &names[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(names[i]);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = cbuf[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof(cbuf[i]);
+    }
+    rcvd = recvmmsg(sock->fd, msgs, RX_SLOTS, MSG_DONTWAIT, NULL);
+    if (rcvd <= 0) {
+      if (rcvd < 0 && errno != EAGAIN) {
+        vde_warning("%s: error reading from socket %d: %s",
+                    __PRETTY_FUNCTION__, sock->fd, strerror(errno));
+      }
+      break;
+    }
+
+    // consecutive frames of a port are handed to it as a batch, the port is
+    // looked up again after each run because the engine may close ports
+    now = vde_clock_ns();
+    vc = NULL;
+    vde_pkt_batch_init(&frames);
+    for (i = 0; i < rcvd; i++) {
+      len = msgs[i].msg_len;
+      seg_len = len;
+      for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+           cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+          seg_len = *(int *)CMSG_DATA(cmsg);
+        }
+      }
+
+      for (off = 0; off < len; off += seg_len, total++) {
+        frame = (unsigned char *)iov[i].iov_base + off;
+        frame_len = len - off < seg_len ? len - off : seg_len;
+        if (frame_len < VXLAN_HDR_LEN + sizeof(struct eth_hdr)) {
+          continue;
+        }
+
+        next = vx_sock_demux(sock, frame, &names[i]);
+        if (vc != NULL && (next != vc || vde_pkt_batch_is_full(&frames))) {
+          vx_conn_deliver(vc, &frames);
+          next = vx_sock_demux(sock, frame, &names[i]);
+        }
+        vc = next;
+        if (vc == NULL) {
+          sock->unknown++;
+          continue;
+        }
+        frame_len -= VXLAN_HDR_LEN;
+        if (frame_len > vde_connection_max_payload(vc->conn)) {
+          vde_warning("%s: frame larger than mtu, dropping",
+                      __PRETTY_FUNCTION__);
+          continue;
+        }
+
+        pkt = vde_pool_pkt_new(pool, frame_len,
+                               vde_connection_get_pkt_headsize(vc->conn),
+                               vde_connection_get_pkt_tailsize(vc->conn));
+        if (pkt == NULL) {
+          vde_warning("%s: cannot allocate packet, dropping: %s",
+                      __PRETTY_FUNCTION__, strerror(errno));
+          continue;
+        }
+        memcpy(pkt->payload, frame + VXLAN_HDR_LEN, frame_len);
+        pkt->hdr->pkt_len = frame_len;
+        vde_pkt_meta_rx(pkt, vde_connection_get_id(vc->conn), now);
+        vde_pkt_batch_add(&frames, pkt);
+      }
+    }
+    if (vc != NULL) {
+      vx_conn_deliver(vc, &frames);
+    }
+
+    if (rcvd < RX_SLOTS) {
+      break; // the socket is empty
+    }
+  }
+
+  sock->tx_cork--;
+  vx_sock_tx_flush(sock);
+  vx_sock_unref(sock);
+}
+
+/*
+ * Shared sockets
+ */
+
+static void vx_sock_unref(vx_sock *sock)
+{
+  if (--sock->refcount > 0) {
+    return;
+  }
+  vx_sock_tx_flush(sock);
+  vde_context_event_del(sock->ctx, sock->ev);
+  close(sock->fd);
+  vde_hash_delete(sock->vnis);
+  vde_free(sock->rx_buf);
+  vx_socks = vde_list_remove(vx_socks, sock);
+  vde_free(sock);
+}
+
+/**
+ * @brief Get the socket of a context bound to the local address of a
+ * transport, creating it if needed, and add the VNI of the transport to it
+ *
+ * @param component The transport
+ *
+ * @return The socket with a reference taken, NULL on error
+ */
+static vx_sock *vx_sock_get(vde_component *component)
+{
+  int fd, on = 1, zero = 0;
+  vde_list *iter;
+  vx_sock *sock = NULL;
+  vde_context *ctx = vde_component_get_context(component);
+  vx_tr *tr = (vx_tr *)vde_component_get_priv(component);
+
+  for (iter = vde_list_first(vx_socks); iter != NULL;
+       iter = vde_list_next(iter)) {
+    sock = vde_list_get_data(iter);
+    if (sock->ctx == ctx && sock->local_len == tr->local_len &&
+        !memcmp(&sock->local, &tr->local, tr->local_len)) {
+      break;
+    }
+    sock = NULL;
+  }
+
+  if (sock != NULL) {
+    if (vde_hash_lookup(sock->vnis, (uintptr_t)tr->vni) != NULL) {
+      vde_error("%s: VNI %u already in use", __PRETTY_FUNCTION__, tr->vni);
+      errno = EADDRINUSE;
+      return NULL;
+    }
+    vde_hash_insert(sock->vnis, (uintptr_t)tr->vni, component);
+    sock->refcount++;
+    return sock;
+  }
+
+  fd = socket(tr->local.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+              0);
+  if (fd < 0) {
+    vde_error("%s: cannot create socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    return NULL;
+  }
+  if (bind(fd, (struct sockaddr *)&tr->local, tr->local_len) < 0) {
+    vde_error("%s: cannot bind socket: %s", __PRETTY_FUNCTION__,
+              strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  sock = (vx_sock *)vde_calloc(sizeof(vx_sock));
+  if (sock == NULL) {
+    vde_error("%s: cannot allocate socket", __PRETTY_FUNCTION__);
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  sock->rx_buf = vde_alloc(RX_SLOTS * RX_SLOT_SIZE);
+  if (sock->rx_buf == NULL) {
+    vde_error("%s: cannot allocate socket", __PRETTY_FUNCTION__);
+    vde_free(sock);
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  // a segment size of zero only tells if the kernel supports UDP_SEGMENT
+  if (tr->gso) {
+    sock->gso = !setsockopt(fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero));
+  }
+  if (tr->gro) {
+    sock->gro = !setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on));
+  }
+  if ((tr->gso && !sock->gso) || (tr->gro && !sock->gro)) {
+    vde_warning("%s: UDP segmentation offloads not available",
+                __PRETTY_FUNCTION__);
+  }
+
+  sock->fd = fd;
+  sock->ctx = ctx;
+  memcpy(&sock->local, &tr->local, tr->local_len);
+  sock->local_len = tr->local_len;
+  sock->rx_budget = tr->rx_budget;
+  sock->vnis = vde_hash_init();
+  vde_hash_insert(sock->vnis, (uintptr_t)tr->vni, component);
+  sock->refcount = 1;
+
+  // XXX: check event NULL
+  sock->ev = vde_context_event_add(ctx, fd, VDE_EV_READ | VDE_EV_PERSIST,
+                                   NULL, &vx_sock_read_event, (void *)sock);
+  // XXX: check error on list
+  vx_socks = vde_list_prepend(vx_socks, sock);
+  return sock;
+}
+
+/*
+ * Ports
+ */
+
+void vx_conn_close(vde_connection *conn)
+{
+  unsigned int i, j;
+  vx_conn *vc = vde_connection_get_priv(conn);
+  vde_context *ctx = vde_connection_get_context(conn);
+  vx_tr *tr = (vx_tr *)vde_component_get_priv(vc->transport);
+  vx_sock *sock = tr->sock;
+
+  if (vc->ready_to != NULL) {
+    vde_context_timeout_del(ctx, vc->ready_to);
+  }
+
+  // drop the frames still deferred for the port
+  for (i = 0, j = 0; i < sock->tx_count; i++) {
+    if (sock->tx_conns[i] == vc) {
+      vde_pkt_put(sock->tx_pkts[i]);
+      continue;
+    }
+    sock->tx_conns[j] = sock->tx_conns[i];
+    sock->tx_pkts[j] = sock->tx_pkts[i];
+    j++;
+  }
+  sock->tx_count = j;
+
+  if (vc->tx_drops > 0) {
+    vde_warning("%s: %lu frames dropped while sending", __PRETTY_FUNCTION__,
+                vc->tx_drops);
+  }
+  tr->conns = vde_list_remove(tr->conns, vc);
+  tr->nports--;
+  vx_sock_unref(sock);
+
+  vde_free(vc);
+}
+
+/**
+ * @brief Create the backend of a port
+ *
+ * @param component The transport
+ * @param conn The connection
+ * @param sa The address of the VTEP
+ * @param sa_len The length of the address
+ *
+ * @return The backend, NULL on error
+ */
+static vx_conn *vx_conn_new(vde_component *component, vde_connection *conn,
+                            struct sockaddr_storage *sa, socklen_t sa_len)
+{
+  vx_conn *vc;
+  vde_context *ctx = vde_component_get_context(component);
+  vx_tr *tr = (vx_tr *)vde_component_get_priv(component);
+
+  vc = (vx_conn *)vde_calloc(sizeof(vx_conn));
+  if (!vc) {
+    vde_error("%s: cannot create connection backend", __PRETTY_FUNCTION__);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memcpy(&vc->remote, sa, sa_len);
+  vc->remote_len = sa_len;
+  vc->conn = conn;
+  vc->transport = component;
+
+  // frames are sent without a queue, UDP drops them as a vxlan device does
+  vde_connection_init(conn, ctx, tr->frame_len, &vx_conn_write,
+                      &vx_conn_close, (void *)vc);
+  vde_connection_set_be_write_batch(conn, &vx_conn_write_batch);
+
+  tr->sock->refcount++;
+  tr->nports++;
+  // XXX: check error on list
+  tr->conns = vde_list_prepend(tr->conns, vc);
+  return vc;
+}
+
+static vx_conn *vx_tr_accept(vde_component *component,
+                             struct sockaddr_storage *sa)
+{
+  unsigned int i;
+  char addr[INET6_ADDRSTRLEN];
+  vde_connection *conn;
+  vx_conn *vc;
+  struct sockaddr_storage remote;
+  vx_tr *tr = (vx_tr *)vde_component_get_priv(component);
+
+  // frames are sent to the standard port of the VTEP, not to the source port
+  // it picks for each flow
+  memcpy(&remote, sa, sizeof(remote));
+  if (remote.ss_family == AF_INET) {
+    ((struct sockaddr_in *)&remote)->sin_port =
+      ((struct sockaddr_in *)&tr->remote)->sin_port;
+    inet_ntop(AF_INET, &((struct sockaddr_in *)&remote)->sin_addr, addr,
+              sizeof(addr));
+  } else {
+    ((struct sockaddr_in6 *)&remote)->sin6_port =
+      ((struct sockaddr_in6 *)&tr->remote)->sin6_port;
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&remote)->sin6_addr, addr,
+              sizeof(addr));
+  }
+
+  // frames of refused VTEPs are counted as unknown by the caller
+  if (tr->allowed != NULL) {
+    for (i = 0; i < tr->allowed_len; i++) {
+      if (vx_same_host(&tr->allowed[i], &remote)) {
+        break;
+      }
+    }
+    if (i == tr->allowed_len) {
+      return NULL;
+    }
+  }
+  if (tr->nports >= tr->max_ports) {
+    return NULL;
+  }
+
+  if (vde_connection_new(&conn)) {
+    vde_error("%s: cannot create connection", __PRETTY_FUNCTION__);
+    return NULL;
+  }
+  vc = vx_conn_new(component, conn, &remote,
+                   remote.ss_family == AF_INET ? sizeof(struct sockaddr_in) :
+                                                 sizeof(struct sockaddr_in6));
+  if (vc == NULL) {
+    vde_connection_delete(conn);
+    return NULL;
+  }
+  vde_info("%s: VTEP %s joined VNI %u", __PRETTY_FUNCTION__, addr, tr->vni);
+  if (tr->nports == tr->max_ports) {
+    vde_warning("%s: VNI %u has %u ports, other VTEPs are refused",
+                __PRETTY_FUNCTION__, tr->vni, tr->max_ports);
+  }
+
+  vde_transport_call_cm_accept_cb(component, conn);
+  // the connection manager may have refused the port
+  return vx_tr_lookup_conn(tr, &remote);
+}
+
+void vx_conn_ready(int fd, short event_type, void *arg)
+{
+  vx_conn *vc = (vx_conn *)arg;
+  vde_context *ctx = vde_component_get_context(vc->transport);
+
+  vde_context_timeout_del(ctx, vc->ready_to);
+  vc->ready_to = NULL;
+
+  vde_transport_call_cm_connect_cb(vc->transport, vc->conn);
+}
+
+/*
+ * The port is plugged right away, the connection manager is called from the
+ * event loop as with other transports.
+ */
+int vx_connect(vde_component *component, vde_connection *conn)
+{
+  struct timeval now = { 0, 0 };
+  vx_conn *vc;
+  vde_context *ctx = vde_component_get_context(component);
+  vx_tr *tr = (vx_tr *)vde_component_get_priv(component);
+
+  if (tr->remote_len == 0) {
+    vde_error("%s: no remote VTEP configured", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+  if (tr->sock == NULL) {
+    tr->sock = vx_sock_get(component);
+    if (tr->sock == NULL) {
+      return -1;
+    }
+  }
+  if (vx_tr_lookup_conn(tr, &tr->remote) != NULL) {
+    vde_error("%s: remote VTEP already connected", __PRETTY_FUNCTION__);
+    errno = EADDRINUSE;
+    return -1;
+  }
+
+  vc = vx_conn_new(component, conn, &tr->remote, tr->remote_len);
+  if (vc == NULL) {
+    return -1;
+  }
+
+  // XXX: check timeout NULL
+  vc->ready_to = vde_context_timeout_add(ctx, VDE_EV_TIMEOUT, &now,
+                                         &vx_conn_ready, (void *)vc);
+  return 0;
+}
+
+int vx_listen(vde_component *component)
+{
+  vx_tr *tr = (vx_tr *)vde_component_get_priv(component);
+
+  if (tr->sock == NULL) {
+    tr->sock = vx_sock_get(component);
+    if (tr->sock == NULL) {
+      return -1;
+    }
+  }
+  tr->listening = 1;
+  return 0;
+}
+
+static int transport_vxlan_init(vde_component *component, vde_sobj *params)
+{
+  vx_tr *tr;
+  vde_sobj *vni_sobj, *local_sobj, *remote_sobj, *allowed_sobj, *addr_sobj;
+  const char *local = "0.0.0.0";
+  int i, vni, port = VXLAN_PORT, remote_port = VXLAN_PORT;
+  int mtu = VXLAN_MTU;
+  int gso = 1, gro = 1;
+  int rx_budget = RX_BUDGET;
+  int max_ports = MAX_PORTS, allowed_len = 0;
+  struct sockaddr_storage local_sa, remote_sa, *allowed = NULL;
+  socklen_t addr_len;
+  socklen_t local_len, remote_len = 0;
+
+  vde_assert(component != NULL);
+
+  if (!params || !vde_sobj_is_type(params, vde_sobj_type_hash)) {
+    vde_error("%s: no parameters hash received", __PRETTY_FUNCTION__);
+    errno = EINVAL;
+    return -1;
+  }
+
+  vni_sobj = vde_sobj_hash_lookup(params, "vni");
+  if (!vni_sobj || !vde_sobj_is_type(vni_sobj, vde_sobj_type_int) ||
+      vde_sobj_get_int(vni_sobj) < 0 ||
+      vde_sobj_get_int(vni_sobj) > VXLAN_VNI_MAX) {
+    vde_error("%s: vni must be an integer between 0 and %d",
+              __PRETTY_FUNCTION__, VXLAN_VNI_MAX);
+    errno = EINVAL;
+    return -1;
+  }
+  vni = vde_sobj_get_int(vni_sobj);
+
+  if (vde_params_get_int(params, "port", 0, 65535, &port) ||
+      vde_params_get_int(params, "remote_port", 1, 65535, &remote_port) ||
+      vde_params_get_int(params, "mtu", ETH_MIN_MTU, ETH_MAX_MTU, &mtu) ||
+      vde_params_get_bool(params, "gso", &gso) ||
+      vde_params_get_bool(params, "gro", &gro) ||
+      vde_params_get_int(params, "rx_budget", 1, INT_MAX, &rx_budget) ||
+      vde_params_get_int(params, "max_ports", 1, INT_MAX, &max_ports)) {
+    return -1;
+  }
+
+  local_sobj = vde_sobj_hash_lookup(params, "local");
+  if (local_sobj) {
+    if (!vde_sobj_is_type(local_sobj, vde_sobj_type_string)) {
+      vde_error("%s: local must be a string", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    local = vde_sobj_get_string(local_sobj);
+  }
+  if (vx_parse_addr(local, port, &local_sa, &local_len)) {
+    vde_error("%s: invalid local address %s", __PRETTY_FUNCTION__, local);
+    errno = EINVAL;
+    return -1;
+  }
+
+  remote_sobj = vde_sobj_hash_lookup(params, "remote");
+  if (remote_sobj) {
+    if (!vde_sobj_is_type(remote_sobj, vde_sobj_type_string) ||
+        vx_parse_addr(vde_sobj_get_string(remote_sobj), remote_port,
+                      &remote_sa, &remote_len)) {
+      vde_error("%s: remote must be an IP address", __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    if (remote_sa.ss_family != local_sa.ss_family) {
+      vde_error("%s: remote and local addresses of different families",
+                __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+  } else {
+    // the port of the VTEPs accepted
+    vx_parse_addr(local_sa.ss_family == AF_INET ? "0.0.0.0" : "::",
+                  remote_port, &remote_sa, &remote_len);
+    remote_len = 0;
+  }
+
+  allowed_sobj = vde_sobj_hash_lookup(params, "allowed");
+  if (allowed_sobj) {
+    if (!vde_sobj_is_type(allowed_sobj, vde_sobj_type_array) ||
+        vde_sobj_array_length(allowed_sobj) < 1) {
+      vde_error("%s: allowed must be an array of IP addresses",
+                __PRETTY_FUNCTION__);
+      errno = EINVAL;
+      return -1;
+    }
+    allowed_len = vde_sobj_array_length(allowed_sobj);
+    allowed = (struct sockaddr_storage *)vde_calloc(
+                allowed_len * sizeof(struct sockaddr_storage));
+    if (allowed == NULL) {
+      vde_error("%s: could not allocate allowed VTEPs", __PRETTY_FUNCTION__);
+      errno = ENOMEM;
+      return -1;
+    }
+    for (i = 0; i < allowed_len; i++) {
+      addr_sobj = vde_sobj_array_get_idx(allowed_sobj, i);
+      if (!vde_sobj_is_type(addr_sobj, vde_sobj_type_string) ||
+          vx_parse_addr(vde_sobj_get_string(addr_sobj), remote_port,
+                        &allowed[i], &addr_len) ||
+          allowed[i].ss_family != local_sa.ss_family) {
+        vde_error("%s: allowed must be an array of IP addresses of the "
+                  "family of local", __PRETTY_FUNCTION__);
+        vde_free(allowed);
+        errno = EINVAL;
+        return -1;
+      }
+    }
+  }
+
+  tr = (vx_tr *)vde_calloc(sizeof(vx_tr));
+  if (tr == NULL) {
+    vde_error("%s: could not allocate private data", __PRETTY_FUNCTION__);
+    vde_free(allowed);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  tr->vni = vni;
+  tr->hdr[0] = VXLAN_FLAG_VNI;
+  tr->hdr[4] = (vni >> 16) & 0xff;
+  tr->hdr[5] = (vni >> 8) & 0xff;
+  tr->hdr[6] = vni & 0xff;
+  memcpy(&tr->local, &local_sa, local_len);
+  tr->local_len = local_len;
+  memcpy(&tr->remote, &remote_sa, sizeof(remote_sa));
+  tr->remote_len = remote_len;
+  tr->gso = gso;
+  tr->gro = gro;
+  tr->frame_len = ETH_FRAME_LEN(mtu);
+  tr->rx_budget = rx_budget;
+  tr->allowed = allowed;
+  tr->allowed_len = allowed_len;
+  tr->max_ports = max_ports;
+
+  vde_component_set_priv(component, (void *)tr);
+  return 0;
+}
+
+void transport_vxlan_fini(vde_component *component)
+{
+  vx_tr *tr = (vx_tr *)vde_component_get_priv(component);
+  vx_conn *vc;
+  vde_connection *conn;
+
+  vde_assert(component != NULL);
+
+  // closing a port removes it from the list and releases the socket
+  while (tr->conns != NULL) {
+    vc = vde_list_get_data(vde_list_first(tr->conns));
+    conn = vc->conn;
+    if (vc->ready_to != NULL) {
+      // not passed to the connection manager yet, which deletes it
+      vde_connection_fini(conn);
+      vde_transport_call_cm_error_cb(component, conn, ECONNABORTED);
+    } else {
+      vde_transport_conn_gone(conn);
+    }
+  }
+  // the VNI is not received anymore, the socket stays open for other VNIs
+  if (tr->sock != NULL) {
+    vde_hash_remove(tr->sock->vnis, (uintptr_t)tr->vni);
+    vx_sock_unref(tr->sock);
+  }
+  vde_free(tr->allowed);
+  vde_free(tr);
+}
+
+component_ops transport_vxlan_component_ops = {
+  .init = transport_vxlan_init,
+  .fini = transport_vxlan_fini,
+  .get_configuration = NULL,
+  .set_configuration = NULL,
+  .get_policy = NULL,
+  .set_policy = NULL,
+};
+
+vde_module VDE_MODULE_START = {
+  .kind = VDE_TRANSPORT,
+  .family = "vxlan",
+  .cops = &transport_vxlan_component_ops,
+  .tr_listen = &vx_listen,
+  .tr_connect = &vx_connect,
+};
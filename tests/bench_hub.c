@@ -0,0 +1,193 @@
+/* Copyright (C) 2009 - Virtualsquare Team
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/*
+ * Microbenchmark of the hub forwarding path: frames are injected into a port
+ * of a hub engine and delivered to the other ports, whose backends just count
+ * them. No socket is involved, this measures packet handling in the engine
+ * and in the connection layer only.
+ *
+ * Usage: bench_hub [packets] [ports] [frame length]
+ * (run from the top build directory so that modules are found in src/.libs)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/engine.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+// frames injected, the ring is larger than caches so that packets are cold
+#define RING_SZ 16384
+
+static unsigned long delivered;
+
+static void *bench_event_add(int fd, short events, const struct timeval *tv,
+                             event_cb cb, void *arg)
+{
+  return NULL;
+}
+
+static void bench_event_del(void *ev)
+{
+}
+
+static void *bench_timeout_add(const struct timeval *tv, short events,
+                               event_cb cb, void *arg)
+{
+  return NULL;
+}
+
+static void bench_timeout_del(void *tout)
+{
+}
+
+static vde_event_handler bench_eh = {
+  bench_event_add, bench_event_del, bench_timeout_add, bench_timeout_del
+};
+
+static int sink_write(vde_connection *conn, vde_pkt *pkt)
+{
+  delivered++;
+  return 0;
+}
+
+static unsigned int sink_write_batch(vde_connection *conn,
+                                     vde_pkt_batch *batch)
+{
+  delivered += batch->count;
+  return batch->count;
+}
+
+static void sink_close(vde_connection *conn)
+{
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9 +
+         (end->tv_nsec - start->tv_nsec);
+}
+
+static void report(const char *name, unsigned long npkts, unsigned int nports,
+                   struct timespec *start, struct timespec *end)
+{
+  double ns = elapsed_ns(start, end);
+
+  printf("%-8s %10lu frames in, %10lu out, %8.1f ns/frame, %6.2f Mfps\n",
+         name, npkts, delivered, ns / npkts, npkts / ns * 1e3);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned long npkts = 1000000, i;
+  unsigned int nports = 8, frame_len = 1514, p;
+  vde_context *ctx;
+  vde_component *hub;
+  vde_connection **ports, *in;
+  static vde_pkt *ring[RING_SZ];
+  vde_pkt_batch batch;
+  struct timespec start, end;
+
+  if (argc > 1) {
+    npkts = strtoul(argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    nports = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    frame_len = atoi(argv[3]);
+  }
+  if (npkts == 0 || nports < 2 || frame_len < sizeof(struct eth_hdr) ||
+      frame_len > ETH_MAX_FRAME_LEN) {
+    fprintf(stderr, "usage: %s [packets] [ports >= 2] [frame length]\n",
+            argv[0]);
+    return 1;
+  }
+
+  if (vde_context_new(&ctx) || vde_context_init(ctx, &bench_eh, NULL, NULL)) {
+    fprintf(stderr, "cannot create context\n");
+    return 1;
+  }
+  if (vde_context_new_component(ctx, VDE_ENGINE, "hub", "bench", &hub,
+                                NULL)) {
+    fprintf(stderr, "cannot create hub, is src/.libs reachable?\n");
+    return 1;
+  }
+
+  ports = vde_calloc(nports * sizeof(vde_connection *));
+  for (p = 0; p < nports; p++) {
+    vde_connection_new(&ports[p]);
+    vde_connection_init(ports[p], ctx, ETH_MAX_FRAME_LEN, &sink_write,
+                        &sink_close, (void *)&delivered);
+    vde_connection_set_be_write_batch(ports[p], &sink_write_batch);
+    if (vde_engine_new_connection(hub, ports[p], NULL)) {
+      fprintf(stderr, "hub refused port %u\n", p);
+      return 1;
+    }
+  }
+  in = ports[0];
+
+  // frames are received by transports into pooled packets
+  for (i = 0; i < RING_SZ; i++) {
+    ring[i] = vde_pool_pkt_new(vde_context_get_pool(ctx), frame_len,
+                               vde_connection_get_pkt_headsize(in),
+                               vde_connection_get_pkt_tailsize(in));
+    ring[i]->hdr->pkt_len = frame_len;
+    memset(ring[i]->payload, (int)i, frame_len);
+  }
+
+  printf("hub with %u ports, %u bytes frames\n", nports, frame_len);
+
+  delivered = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < npkts; i++) {
+    vde_connection_call_read(in, ring[i % RING_SZ]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report("single", npkts, nports, &start, &end);
+
+  delivered = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < npkts; i += batch.count) {
+    vde_pkt_batch_init(&batch);
+    while (!vde_pkt_batch_is_full(&batch) && i + batch.count < npkts) {
+      vde_pkt_batch_add(&batch, ring[(i + batch.count) % RING_SZ]);
+    }
+    vde_connection_call_read_batch(in, &batch);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report("batch", npkts, nports, &start, &end);
+
+  for (i = 0; i < RING_SZ; i++) {
+    vde_pkt_put(ring[i]);
+  }
+  // the hub closes and deletes its ports
+  vde_context_fini(ctx);
+  vde_context_delete(ctx);
+  vde_free(ports);
+
+  return 0;
+}
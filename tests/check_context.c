@@ -24,7 +24,7 @@ void
 setup (void)
 {
   vde_context_new(&f_ctx);
-  vde_context_init(f_ctx, &f_eh, NULL);
+  vde_context_init(f_ctx, &f_eh, NULL, NULL);
 }
 
 void
@@ -63,7 +63,7 @@ V_START_TEST (test_context_init)
   vde_context *ctx;
 
   vde_context_new(&ctx);
-  rv = vde_context_init(ctx, &eh, NULL);
+  rv = vde_context_init(ctx, &eh, NULL, NULL);
   fail_unless (rv == 0, "fail on valid arguments");
 }
 END_TEST
@@ -75,13 +75,13 @@ V_START_TEST (test_context_init_invalid)
   vde_context *ctx;
   char *mpath[] = {"nonexistantpath", NULL};
 
-  rv = vde_context_init(NULL, &eh, NULL);
+  rv = vde_context_init(NULL, &eh, NULL, NULL);
   fail_unless (rv == -1, "success on null ctx");
 
-  rv = vde_context_init(ctx, NULL, NULL);
+  rv = vde_context_init(ctx, NULL, NULL, NULL);
   fail_unless (rv == -1, "success on null eh");
 
-  rv = vde_context_init(ctx, NULL, mpath);
+  rv = vde_context_init(ctx, NULL, mpath, NULL);
   fail_unless (rv == -1, "success on invalid module path");
 }
 END_TEST
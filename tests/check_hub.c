@@ -0,0 +1,260 @@
+/*
+ * A hub engine forwarding TCP bursts received with segmentation offload, as a
+ * tap device with offloads enabled delivers them, to a port which can't take
+ * them whole, like a vde2 one with a 1500 bytes mtu: the bursts must reach it
+ * split in segments.
+ * (run from the top build directory so that modules are found in src/.libs)
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <check.h>
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/engine.h>
+#include <vde3/packet.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+// ethernet, IPv4 and TCP with the timestamp option
+#define HDR_LEN (14 + 20 + 32)
+#define L4_OFF (14 + 20)
+#define MSS 1448
+#define SEGS 10
+
+// a port of the hub, its backend records what is written to it
+typedef struct {
+  vde_connection *conn;
+  unsigned int frames;
+  unsigned int max_len;
+  unsigned int offloaded; // frames written with VDE_PKT_META_GSO
+} f_port;
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_hub;
+f_port f_tap, f_vde2, f_tap2;
+
+void *f_event_add(int fd, short events, const struct timeval *tv,
+                  event_cb cb, void *arg)
+{
+  return NULL;
+}
+
+void f_event_del(void *ev)
+{
+}
+
+void *f_timeout_add(const struct timeval *tv, short events, event_cb cb,
+                    void *arg)
+{
+  return NULL;
+}
+
+void f_timeout_del(void *tout)
+{
+}
+
+vde_event_handler f_eh = {f_event_add, f_event_del, f_timeout_add,
+                          f_timeout_del};
+
+int f_write(vde_connection *conn, vde_pkt *pkt)
+{
+  f_port *port = (f_port *)vde_connection_get_priv(conn);
+
+  port->frames++;
+  if (vde_pkt_len(pkt) > port->max_len) {
+    port->max_len = vde_pkt_len(pkt);
+  }
+  if (pkt->meta.flags & VDE_PKT_META_GSO) {
+    port->offloaded++;
+  }
+  return 0;
+}
+
+void f_close(vde_connection *conn)
+{
+}
+
+void f_port_add(f_port *port, unsigned int max_payload,
+                unsigned int offloads)
+{
+  memset(port, 0, sizeof(*port));
+  vde_connection_new(&port->conn);
+  vde_connection_init(port->conn, f_ctx, max_payload, &f_write, &f_close,
+                      (void *)port);
+  vde_connection_set_offloads(port->conn, offloads);
+  fail_if (vde_engine_new_connection(f_hub, port->conn, NULL),
+           "hub refused port");
+}
+
+// a TCP burst of SEGS full segments of gso_size bytes as received from a tap
+vde_pkt *f_burst_new(unsigned int gso_size)
+{
+  unsigned int len = HDR_LEN + SEGS * gso_size;
+  unsigned char *frame;
+  vde_pkt *pkt = vde_pkt_new(len, 0, 0);
+
+  pkt->hdr->pkt_len = len;
+  frame = (unsigned char *)pkt->payload;
+  memset(frame, 0, len);
+  frame[0] = frame[6] = 0x02;
+  frame[5] = 0x01;
+  frame[11] = 0x02;
+  frame[12] = 0x08; // IPv4
+  frame[14] = 0x45;
+  frame[16] = (len - 14) >> 8;
+  frame[17] = (len - 14) & 0xff;
+  frame[22] = 64;
+  frame[23] = 6; // TCP
+  frame[26] = frame[30] = 10;
+  frame[29] = 1;
+  frame[33] = 2;
+  frame[L4_OFF + 1] = 80;
+  frame[L4_OFF + 3] = 81;
+  frame[L4_OFF + 12] = (32 / 4) << 4;
+  frame[L4_OFF + 13] = 0x18; // PSH, ACK
+  frame[L4_OFF + 20] = frame[L4_OFF + 21] = 0x01; // NOPs before timestamps
+  frame[L4_OFF + 22] = 8;
+  frame[L4_OFF + 23] = 10;
+
+  vde_pkt_meta_rx(pkt, vde_connection_get_id(f_tap.conn), 0);
+  pkt->meta.csum_start = L4_OFF;
+  pkt->meta.csum_off = 16;
+  pkt->meta.gso_type = VDE_PKT_GSO_TCPV4;
+  pkt->meta.gso_size = gso_size;
+  pkt->meta.flags |= VDE_PKT_META_CSUM | VDE_PKT_META_GSO;
+  return pkt;
+}
+
+void
+setup (void)
+{
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &f_eh, NULL, NULL);
+  fail_if (vde_context_new_component(f_ctx, VDE_ENGINE, "hub", "hub", &f_hub,
+                                     NULL),
+           "cannot create hub");
+
+  // the taps get bursts whole, vde2 frames are limited by the mtu
+  f_port_add(&f_tap, ETH_MAX_FRAME_LEN, VDE_PKT_META_OFFLOAD);
+  f_port_add(&f_vde2, ETH_FRAME_LEN(ETH_DATA_LEN), 0);
+  f_port_add(&f_tap2, ETH_MAX_FRAME_LEN, VDE_PKT_META_OFFLOAD);
+}
+
+void
+teardown (void)
+{
+  // the hub closes and deletes its ports
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+
+V_START_TEST (test_hub_gso_segmented)
+{
+  vde_pkt *pkt = f_burst_new(MSS);
+
+  vde_connection_call_read(f_tap.conn, pkt);
+  fail_unless (f_vde2.frames == SEGS, "%u segments sent to vde2",
+               f_vde2.frames);
+  fail_unless (f_vde2.max_len == HDR_LEN + MSS, "segment of %u bytes",
+               f_vde2.max_len);
+  fail_unless (f_vde2.offloaded == 0, "offload left to vde2");
+  fail_unless (f_tap2.frames == 1 && f_tap2.offloaded == 1,
+               "burst not sent whole to the other tap");
+  fail_unless (f_tap.frames == 0, "burst sent back to its port");
+
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_hub_gso_segmented_batch)
+{
+  vde_pkt_batch batch;
+
+  vde_pkt_batch_init(&batch);
+  vde_pkt_batch_add(&batch, f_burst_new(MSS));
+  vde_pkt_batch_add(&batch, f_burst_new(MSS / 2));
+  vde_connection_call_read_batch(f_tap.conn, &batch);
+  fail_unless (f_vde2.frames == 2 * SEGS, "%u segments sent to vde2",
+               f_vde2.frames);
+  fail_unless (f_vde2.max_len == HDR_LEN + MSS, "segment of %u bytes",
+               f_vde2.max_len);
+  fail_unless (f_tap2.frames == 2 && f_tap2.offloaded == 2,
+               "bursts not sent whole to the other tap");
+
+  vde_pkt_batch_put(&batch);
+}
+END_TEST
+
+V_START_TEST (test_hub_gso_too_large)
+{
+  // segments of this burst don't fit the vde2 mtu either
+  vde_pkt *pkt = f_burst_new(ETH_DATA_LEN);
+
+  vde_connection_call_read(f_tap.conn, pkt);
+  fail_unless (f_vde2.frames == 0, "oversized segments sent to vde2");
+  fail_unless (f_tap2.frames == 1, "burst not sent to the other tap");
+
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_hub_oversized)
+{
+  // without offloads a frame must fit as it is
+  vde_pkt *pkt = f_burst_new(MSS);
+
+  pkt->meta.flags &= ~(VDE_PKT_META_CSUM | VDE_PKT_META_GSO);
+  vde_connection_call_read(f_tap.conn, pkt);
+  fail_unless (f_vde2.frames == 0, "oversized frame sent to vde2");
+  fail_unless (f_tap2.frames == 1, "frame not sent to the other tap");
+
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+Suite *
+hub_suite (void)
+{
+  Suite *s = suite_create ("hub");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_hub_gso_segmented);
+  tcase_add_test (tc_core, test_hub_gso_segmented_batch);
+  tcase_add_test (tc_core, test_hub_gso_too_large);
+  tcase_add_test (tc_core, test_hub_oversized);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = hub_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,638 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <check.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define PAYLOAD "0123456789abcdef"
+#define PAYLOAD_SZ sizeof(PAYLOAD)
+
+// fixture packet, always present with a single reference
+vde_pkt *f_pkt;
+
+void
+setup (void)
+{
+  f_pkt = vde_pkt_new(PAYLOAD_SZ, 4, 0);
+  f_pkt->hdr->pkt_len = PAYLOAD_SZ;
+  memcpy(f_pkt->payload, PAYLOAD, PAYLOAD_SZ);
+}
+
+void
+teardown (void)
+{
+  vde_pkt_put(f_pkt);
+}
+
+
+V_START_TEST (test_pkt_new)
+{
+  fail_unless (f_pkt->refcount == 1, "new packet must have one reference");
+  fail_unless (vde_pkt_get_headsize(f_pkt) == 4, "wrong head size");
+  fail_unless (vde_pkt_get_tailsize(f_pkt) == 0, "wrong tail size");
+  fail_unless (!vde_pkt_is_shared(f_pkt), "new packet must not be shared");
+}
+END_TEST
+
+V_START_TEST (test_pkt_share_refcounted)
+{
+  vde_pkt *shared;
+
+  shared = vde_pkt_share(f_pkt);
+  fail_unless (shared == f_pkt, "sharing a refcounted packet must not copy");
+  fail_unless (f_pkt->refcount == 2, "sharing must take a reference");
+  fail_unless (vde_pkt_is_shared(f_pkt), "packet must be shared");
+
+  vde_pkt_put(shared);
+  fail_unless (f_pkt->refcount == 1, "put must drop a reference");
+}
+END_TEST
+
+V_START_TEST (test_pkt_share_borrowed)
+{
+  struct {
+    vde_pkt pkt;
+    char data[sizeof(vde_hdr) + 64];
+  } stack_pkt;
+  vde_pkt *pkt = &stack_pkt.pkt, *shared;
+
+  vde_pkt_init(pkt, sizeof(stack_pkt.data), 0, 0);
+  fail_unless (pkt->refcount == 0, "initialized packet must be borrowed");
+  pkt->hdr->pkt_len = PAYLOAD_SZ;
+  memcpy(pkt->payload, PAYLOAD, PAYLOAD_SZ);
+
+  shared = vde_pkt_share(pkt);
+  fail_unless (shared != pkt, "sharing a borrowed packet must copy");
+  fail_unless (shared->refcount == 1, "copy must have one reference");
+  fail_unless (shared->hdr->pkt_len == PAYLOAD_SZ, "wrong copy length");
+  fail_unless (!memcmp(shared->payload, PAYLOAD, PAYLOAD_SZ),
+               "wrong copy payload");
+  fail_unless (shared->data_size < pkt->data_size,
+               "copy must not keep unused payload space");
+
+  vde_pkt_put(shared);
+}
+END_TEST
+
+V_START_TEST (test_pkt_share_extern)
+{
+  struct {
+    vde_pkt pkt;
+    char data[VDE_PKT_EXTERN_DATA_SZ];
+  } stack_pkt;
+  char frame[PAYLOAD_SZ];
+  vde_pkt *pkt = &stack_pkt.pkt, *shared;
+
+  memcpy(frame, PAYLOAD, PAYLOAD_SZ);
+  vde_pkt_init_extern(pkt, frame, PAYLOAD_SZ);
+  fail_unless (pkt->refcount == 0, "initialized packet must be borrowed");
+  fail_unless (pkt->payload == frame, "payload must not be copied");
+  fail_unless (vde_pkt_get_headsize(pkt) == 0 &&
+               vde_pkt_get_tailsize(pkt) == 0, "no head nor tail space");
+
+  shared = vde_pkt_share(pkt);
+  fail_unless (shared != pkt, "sharing a borrowed packet must copy");
+  fail_unless (shared->hdr->pkt_len == PAYLOAD_SZ, "wrong copy length");
+  fail_unless (!memcmp(shared->payload, PAYLOAD, PAYLOAD_SZ),
+               "wrong copy payload");
+
+  vde_pkt_put(shared);
+}
+END_TEST
+
+V_START_TEST (test_pkt_cow_private)
+{
+  vde_pkt *pkt;
+
+  pkt = vde_pkt_cow(vde_pkt_get(f_pkt), 4, 0);
+  fail_unless (pkt != f_pkt, "cow on a shared packet must copy");
+  fail_unless (f_pkt->refcount == 1, "cow must drop the shared reference");
+  fail_unless (pkt->refcount == 1, "cow copy must have one reference");
+  fail_unless (!memcmp(pkt->payload, PAYLOAD, PAYLOAD_SZ),
+               "wrong cow payload");
+  vde_pkt_put(pkt);
+
+  pkt = vde_pkt_cow(f_pkt, 4, 0);
+  fail_unless (pkt == f_pkt, "cow must not copy a private packet");
+  fail_unless (pkt->refcount == 1, "cow must keep the reference");
+}
+END_TEST
+
+V_START_TEST (test_pkt_cow_headroom)
+{
+  vde_pkt *pkt;
+
+  pkt = vde_pkt_cow(f_pkt, 8, 2);
+  fail_unless (pkt != f_pkt, "cow must copy if head space is too small");
+  fail_unless (vde_pkt_get_headsize(pkt) == 8, "wrong cow head size");
+  fail_unless (vde_pkt_get_tailsize(pkt) == 2, "wrong cow tail size");
+  fail_unless (!memcmp(pkt->payload, PAYLOAD, PAYLOAD_SZ),
+               "wrong cow payload");
+  // f_pkt reference has been consumed by cow
+  f_pkt = pkt;
+}
+END_TEST
+
+V_START_TEST (test_pool_recycle)
+{
+  vde_pool *pool;
+  vde_pool_stats stats;
+  vde_pkt *pkt, *dup;
+
+  pool = vde_pool_new(NULL);
+  fail_if (pool == NULL, "cannot create pool");
+
+  pkt = vde_pool_pkt_new(pool, 1500, 4, 0);
+  fail_if (pkt == NULL, "cannot allocate pooled packet");
+  fail_unless (pkt->refcount == 1, "pooled packet must have one reference");
+  fail_unless (vde_pkt_get_headsize(pkt) == 4, "wrong head size");
+  fail_unless (pkt->tail - pkt->payload >= 1500, "payload space too small");
+
+  vde_pool_get_stats(pool, VDE_POOL_ETH, &stats);
+  fail_unless (stats.misses == 1 && stats.hits == 0, "first alloc must miss");
+  fail_unless (stats.free == stats.total - 1, "wrong free count");
+
+  pkt->hdr->pkt_len = PAYLOAD_SZ;
+  memcpy(pkt->payload, PAYLOAD, PAYLOAD_SZ);
+  dup = vde_pkt_dup(pkt, 0, 0);
+  fail_if (dup == NULL, "cannot dup pooled packet");
+  fail_unless (dup->cache != NULL, "dup of a pooled packet must be pooled");
+
+  vde_pkt_put(dup);
+  vde_pkt_put(pkt);
+  vde_pool_get_stats(pool, VDE_POOL_ETH, &stats);
+  fail_unless (stats.free == stats.total, "packets must return to the pool");
+
+  pkt = vde_pool_pkt_new(pool, 1500, 4, 0);
+  vde_pool_get_stats(pool, VDE_POOL_ETH, &stats);
+  // the small copy has been taken from another size class
+  fail_unless (stats.hits == 1, "free list must be reused");
+  vde_pkt_put(pkt);
+
+  vde_pool_delete(pool);
+}
+END_TEST
+
+V_START_TEST (test_pool_alignment)
+{
+  unsigned int head;
+  vde_pool *pool;
+  vde_pkt *pkt;
+
+  pool = vde_pool_new(NULL);
+  fail_if (pool == NULL, "cannot create pool");
+
+  for (head = 0; head <= 20; head++) {
+    pkt = vde_pool_pkt_new(pool, 1514, head, 4);
+    fail_if (pkt == NULL, "cannot allocate pooled packet");
+    fail_unless ((uintptr_t)pkt % VDE_CACHE_LINE == 0,
+                 "packet metadata must start a cache line");
+    fail_unless ((uintptr_t)pkt->payload % VDE_PKT_PAYLOAD_ALIGN == 0,
+                 "payload not aligned");
+    fail_unless (vde_pkt_get_headsize(pkt) == head, "wrong head size");
+    fail_unless (vde_pkt_get_tailsize(pkt) == 4, "wrong tail size");
+    fail_unless (pkt->tail - pkt->payload >= 1514, "payload space too small");
+    vde_pkt_put(pkt);
+  }
+
+  vde_pool_delete(pool);
+}
+END_TEST
+
+V_START_TEST (test_pool_arena)
+{
+  vde_pool *pool;
+  vde_pool_params params;
+  vde_pool_stats stats;
+  vde_pkt *pkt;
+
+  memset(&params, 0, sizeof(params));
+  params.arena = 1;
+
+  pool = vde_pool_new(&params);
+  fail_if (pool == NULL, "cannot create pool");
+  fail_unless (vde_pool_is_arena(pool), "pool must be in arena mode");
+
+  pkt = vde_pool_pkt_new(pool, 1514, 0, 0);
+  fail_if (pkt == NULL, "cannot allocate packet from arena");
+  fail_unless ((uintptr_t)pkt % VDE_CACHE_LINE == 0,
+               "packet metadata must start a cache line");
+  memset(pkt->payload, 0, 1514);
+
+  vde_pool_get_stats(pool, VDE_POOL_ETH, &stats);
+  fail_unless (stats.mem == VDE_POOL_ARENA_SLAB_SZ, "wrong arena size");
+  fail_unless (stats.mem_hugetlb + stats.mem_thp <= stats.mem,
+               "wrong huge page accounting");
+  fail_unless (stats.total * (sizeof(vde_pkt) + stats.data_size) <= stats.mem,
+               "slab overflow");
+
+  vde_pkt_put(pkt);
+  vde_pool_delete(pool);
+}
+END_TEST
+
+int f_wm_calls, f_wm_over;
+unsigned long f_wm_bytes;
+
+void f_watermark_cb(int over, unsigned long bytes, void *arg)
+{
+  f_wm_calls++;
+  f_wm_over = over;
+  f_wm_bytes = bytes;
+}
+
+V_START_TEST (test_pool_queue)
+{
+  vde_pool *pool;
+  vde_pool_params params;
+  vde_pool_queue_stats stats;
+
+  memset(&params, 0, sizeof(params));
+  params.queue_limit = 8000;
+  params.queue_watermark = 4000;
+
+  pool = vde_pool_new(&params);
+  fail_if (pool == NULL, "cannot create pool");
+  f_wm_calls = 0;
+  vde_pool_set_watermark_cb(pool, &f_watermark_cb, NULL);
+
+  // a slow queue fills above the watermark
+  fail_unless (vde_pool_queue_charge(pool, 3000, 0) == 0, "charge failed");
+  fail_unless (f_wm_calls == 0, "watermark reported before crossing");
+  fail_unless (vde_pool_queue_charge(pool, 1500, 3000) == 0, "charge failed");
+  fail_unless (vde_pool_queue_over_watermark(pool),
+               "watermark must be crossed");
+  fail_unless (f_wm_calls == 1 && f_wm_over && f_wm_bytes == 4500,
+               "crossing not reported");
+
+  // it can't grow beyond its share, a new queue can
+  fail_unless (vde_pool_queue_charge(pool, 100, 4500) == -1 &&
+               errno == ENOBUFS, "slow queue must be dropped early");
+  fail_unless (vde_pool_queue_charge(pool, 100, 0) == 0,
+               "new queue must not be dropped");
+
+  vde_pool_get_queue_stats(pool, &stats);
+  fail_unless (stats.bytes == 4600, "wrong queued bytes");
+  fail_unless (stats.queues == 2, "wrong number of queues");
+  fail_unless (stats.early_drops == 1, "wrong early drops");
+
+  // stop dropping only well below the watermark
+  vde_pool_queue_uncharge(pool, 100, 0);
+  vde_pool_queue_uncharge(pool, 500, 4000);
+  fail_unless (vde_pool_queue_over_watermark(pool), "hysteresis expected");
+  fail_unless (f_wm_calls == 1, "crossing reported more than once");
+  vde_pool_queue_uncharge(pool, 2500, 1500);
+  fail_if (vde_pool_queue_over_watermark(pool), "watermark must be cleared");
+  fail_unless (f_wm_calls == 2 && !f_wm_over && f_wm_bytes == 1500,
+               "clearing not reported");
+
+  vde_pool_queue_uncharge(pool, 1500, 0);
+  vde_pool_get_queue_stats(pool, &stats);
+  fail_unless (stats.bytes == 0 && stats.queues == 0, "queues not empty");
+
+  // the hard limit holds even without the watermark
+  fail_unless (vde_pool_queue_charge(pool, 9000, 0) == -1 &&
+               errno == ENOBUFS, "limit must be enforced");
+  vde_pool_get_queue_stats(pool, &stats);
+  fail_unless (stats.drops == 1, "wrong drops");
+
+  vde_pool_delete(pool);
+}
+END_TEST
+
+V_START_TEST (test_pool_limit)
+{
+  vde_pool *pool;
+  vde_pool_params params;
+  vde_pool_stats stats;
+  vde_pkt *pkt1, *pkt2;
+
+  memset(&params, 0, sizeof(params));
+  params.prewarm = 1;
+  params.prewarm_pkts[VDE_POOL_CTRL] = 1;
+  params.limit[VDE_POOL_CTRL] = 1;
+
+  pool = vde_pool_new(&params);
+  fail_if (pool == NULL, "cannot create pool");
+  vde_pool_get_stats(pool, VDE_POOL_CTRL, &stats);
+  fail_unless (stats.total == 1 && stats.free == 1, "pool not prewarmed");
+
+  pkt1 = vde_pool_pkt_new(pool, PAYLOAD_SZ, 0, 0);
+  fail_if (pkt1 == NULL, "cannot allocate prewarmed packet");
+  pkt2 = vde_pool_pkt_new(pool, PAYLOAD_SZ, 0, 0);
+  fail_unless (pkt2 == NULL && errno == ENOBUFS, "limit not enforced");
+
+  vde_pool_get_stats(pool, VDE_POOL_CTRL, &stats);
+  fail_unless (stats.hits == 1, "wrong hit count");
+  fail_unless (stats.exhausted == 1, "wrong exhausted count");
+
+  vde_pkt_put(pkt1);
+  vde_pool_delete(pool);
+}
+END_TEST
+
+V_START_TEST (test_pool_delete_in_use)
+{
+  vde_pool *pool;
+  vde_pkt *pkt;
+
+  pool = vde_pool_new(NULL);
+  fail_if (pool == NULL, "cannot create pool");
+  pkt = vde_pool_pkt_new(pool, PAYLOAD_SZ, 0, 0);
+  fail_if (pkt == NULL, "cannot allocate packet");
+
+  // the packet stays usable until released, then the pool is freed
+  vde_pool_delete(pool);
+  memset(pkt->payload, 0xaa, PAYLOAD_SZ);
+  pkt->hdr->pkt_len = PAYLOAD_SZ;
+  fail_unless (vde_pkt_len(pkt) == PAYLOAD_SZ, "packet corrupted");
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_pool_share_borrowed)
+{
+  struct {
+    vde_pkt pkt;
+    char data[sizeof(vde_hdr) + 64];
+  } stack_pkt;
+  vde_pkt *pkt = &stack_pkt.pkt, *shared;
+  vde_pool *pool;
+
+  pool = vde_pool_new(NULL);
+  fail_if (pool == NULL, "cannot create pool");
+
+  vde_pkt_init(pkt, sizeof(stack_pkt.data), 8, 0);
+  pkt->hdr->pkt_len = PAYLOAD_SZ;
+  memcpy(pkt->payload, PAYLOAD, PAYLOAD_SZ);
+
+  shared = vde_pool_pkt_share(pool, pkt);
+  fail_if (shared == NULL || shared == pkt, "borrowed packet must be copied");
+  fail_unless (shared->cache != NULL, "copy must come from the pool");
+  fail_unless (!memcmp(shared->payload, PAYLOAD, PAYLOAD_SZ),
+               "wrong copy payload");
+  fail_unless (vde_pool_pkt_share(pool, shared) == shared,
+               "sharing a refcounted packet must not copy");
+  vde_pkt_put(shared);
+  vde_pkt_put(shared);
+
+  // head space beyond a vlan tag is served as well
+  pkt = vde_pool_pkt_new(pool, 1514, 64, 16);
+  fail_if (pkt == NULL, "cannot allocate packet with large head space");
+  fail_unless (vde_pkt_get_headsize(pkt) == 64, "wrong head size");
+  fail_unless (pkt->tail - pkt->payload >= 1514, "payload space too small");
+  vde_pkt_put(pkt);
+
+  vde_pool_delete(pool);
+}
+END_TEST
+
+V_START_TEST (test_pkt_batch)
+{
+  unsigned int i;
+  vde_pkt_batch batch;
+
+  vde_pkt_batch_init(&batch);
+  for (i = 0; i < VDE_PKT_BATCH_MAX; i++) {
+    fail_unless (vde_pkt_batch_add(&batch, vde_pkt_get(f_pkt)) == 0,
+                 "cannot add packet to batch");
+  }
+  fail_unless (vde_pkt_batch_is_full(&batch), "batch must be full");
+  fail_unless (vde_pkt_batch_add(&batch, f_pkt) == -1 && errno == ENOBUFS,
+               "full batch must not take packets");
+  fail_unless (f_pkt->refcount == VDE_PKT_BATCH_MAX + 1, "wrong refcount");
+
+  vde_pkt_batch_put(&batch);
+  fail_unless (batch.count == 0, "batch must be empty after put");
+  fail_unless (f_pkt->refcount == 1, "batch put must drop references");
+}
+END_TEST
+
+#define HEADER "HDR"
+#define HEADER_SZ (sizeof(HEADER) - 1)
+
+V_START_TEST (test_pkt_chain_prepend)
+{
+  vde_pkt *seg, *chain, *linear;
+  struct iovec iov[2];
+
+  seg = vde_pkt_new(HEADER_SZ, 0, 0);
+  seg->hdr->pkt_len = HEADER_SZ;
+  memcpy(seg->payload, HEADER, HEADER_SZ);
+
+  // the chain shares the payload with the fixture
+  chain = vde_pkt_chain_prepend(seg, vde_pkt_get(f_pkt));
+  fail_unless (!vde_pkt_is_linear(chain), "chain must not be linear");
+  fail_unless (vde_pkt_len(chain) == HEADER_SZ + PAYLOAD_SZ,
+               "wrong chain length");
+  fail_unless (vde_pkt_to_iovec(chain, iov, 2) == 2, "wrong iovec count");
+  fail_unless (iov[1].iov_base == f_pkt->payload, "payload must not be copied");
+  fail_unless (vde_pkt_to_iovec(chain, iov, 1) == -1 && errno == EMSGSIZE,
+               "iovec overflow not detected");
+
+  linear = vde_pkt_linearize(chain);
+  fail_unless (vde_pkt_is_linear(linear), "linearized packet must be linear");
+  fail_unless (linear->hdr->pkt_len == HEADER_SZ + PAYLOAD_SZ,
+               "wrong linearized length");
+  fail_unless (!memcmp(linear->payload, HEADER, HEADER_SZ) &&
+               !memcmp(linear->payload + HEADER_SZ, PAYLOAD, PAYLOAD_SZ),
+               "wrong linearized payload");
+  fail_unless (f_pkt->refcount == 1, "chain put must release segments");
+  vde_pkt_put(linear);
+}
+END_TEST
+
+V_START_TEST (test_pkt_chain_append)
+{
+  vde_pkt *seg, *trailer, *chain;
+  char buf[HEADER_SZ + PAYLOAD_SZ + HEADER_SZ];
+
+  seg = vde_pkt_new(HEADER_SZ, 0, 0);
+  seg->hdr->pkt_len = HEADER_SZ;
+  memcpy(seg->payload, HEADER, HEADER_SZ);
+  trailer = vde_pkt_new(HEADER_SZ, 0, 0);
+  trailer->hdr->pkt_len = HEADER_SZ;
+  memcpy(trailer->payload, HEADER, HEADER_SZ);
+
+  chain = vde_pkt_chain_prepend(seg, vde_pkt_get(f_pkt));
+  fail_unless (vde_pkt_chain_append(chain, trailer) == 0, "cannot append");
+  // the fixture is shared, its link can't be changed
+  fail_unless (chain->next != f_pkt, "shared segment must be copied");
+  fail_unless (f_pkt->next == NULL, "shared segment must not be linked");
+  fail_unless (f_pkt->refcount == 1, "copied segment must be released");
+
+  fail_unless (vde_pkt_len(chain) == sizeof(buf), "wrong chain length");
+  vde_pkt_gather(chain, buf);
+  fail_unless (!memcmp(buf + HEADER_SZ, PAYLOAD, PAYLOAD_SZ) &&
+               !memcmp(buf + HEADER_SZ + PAYLOAD_SZ, HEADER, HEADER_SZ),
+               "wrong chain content");
+  vde_pkt_put(chain);
+}
+END_TEST
+
+// tagged ethernet frame with an IPv4/UDP datagram from 10.0.0.1:1000 to
+// 10.0.0.2:53
+static const unsigned char udp_frame[] = {
+  0x02, 0, 0, 0, 0, 0x02, 0x02, 0, 0, 0, 0, 0x01, 0x81, 0x00, 0x00, 0x2a,
+  0x08, 0x00,
+  0x45, 0, 0, 28, 0, 0, 0, 0, 64, 17, 0, 0, 10, 0, 0, 1, 10, 0, 0, 2,
+  0x03, 0xe8, 0x00, 0x35, 0, 8, 0, 0,
+};
+
+static vde_pkt *udp_pkt_new(void)
+{
+  vde_pkt *pkt = vde_pkt_new(sizeof(udp_frame), 0, 0);
+
+  pkt->hdr->pkt_len = sizeof(udp_frame);
+  memcpy(pkt->payload, udp_frame, sizeof(udp_frame));
+  return pkt;
+}
+
+V_START_TEST (test_pkt_meta_parse)
+{
+  vde_pkt *pkt = udp_pkt_new();
+
+  vde_pkt_meta_rx(pkt, 7, 1234);
+  fail_unless (pkt->hdr->type == VDE_PKT_TYPE_ETH, "wrong header type");
+  fail_unless (pkt->meta.conn_id == 7 && pkt->meta.rx_time == 1234,
+               "wrong rx metadata");
+  fail_unless ((pkt->meta.flags & VDE_PKT_META_VLAN) &&
+               pkt->meta.vlan_tci == 42, "wrong vlan");
+  fail_unless ((pkt->meta.flags & VDE_PKT_META_L3) &&
+               pkt->meta.l3_proto == 0x0800 && pkt->meta.l3_off == 18,
+               "wrong L3 metadata");
+  fail_unless ((pkt->meta.flags & VDE_PKT_META_L4) &&
+               pkt->meta.l4_proto == 17 && pkt->meta.l4_off == 38,
+               "wrong L4 metadata");
+  fail_unless (pkt->meta.flags & VDE_PKT_META_HASH, "no flow hash");
+
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_pkt_meta_hash)
+{
+  vde_pkt *pkt = udp_pkt_new(), *reply = udp_pkt_new(), *other;
+  unsigned char tmp[6];
+
+  // swap addresses and ports
+  memcpy(reply->payload + 30, udp_frame + 34, 4);
+  memcpy(reply->payload + 34, udp_frame + 30, 4);
+  memcpy(reply->payload + 38, udp_frame + 40, 2);
+  memcpy(reply->payload + 40, udp_frame + 38, 2);
+  memcpy(tmp, reply->payload, 6);
+  memcpy(reply->payload, reply->payload + 6, 6);
+  memcpy(reply->payload + 6, tmp, 6);
+
+  vde_pkt_meta_parse(pkt);
+  vde_pkt_meta_parse(reply);
+  fail_unless (pkt->meta.flow_hash == reply->meta.flow_hash,
+               "flow hash must not depend on direction");
+
+  other = vde_pkt_dup(reply, 0, 0);
+  other->payload[41]++;
+  vde_pkt_meta_parse(other);
+  fail_if (pkt->meta.flow_hash == other->meta.flow_hash,
+           "different flows with the same hash");
+
+  vde_pkt_put(other);
+  vde_pkt_put(reply);
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+V_START_TEST (test_pkt_meta_copy)
+{
+  vde_pkt *pkt = udp_pkt_new(), *dup, *seg;
+
+  vde_pkt_meta_rx(pkt, 7, 1234);
+  dup = vde_pkt_dup(pkt, 4, 0);
+  fail_unless (!memcmp(&dup->meta, &pkt->meta, sizeof(vde_pkt_meta)),
+               "dup must copy metadata");
+
+  seg = vde_pkt_new(8, 0, 0);
+  seg->hdr->pkt_len = 8;
+  seg = vde_pkt_chain_prepend(seg, dup);
+  fail_unless (seg->meta.conn_id == 7 && seg->meta.rx_time == 1234,
+               "prepend must keep rx metadata");
+  fail_unless (seg->meta.flags == VDE_PKT_META_RX,
+               "prepend must drop parsed metadata");
+
+  vde_pkt_put(seg);
+  vde_pkt_put(pkt);
+}
+END_TEST
+
+Suite *
+packet_suite (void)
+{
+  Suite *s = suite_create ("packet");
+
+  /* Reference counting test case */
+  TCase *tc_refcount = tcase_create ("Refcount");
+  tcase_add_checked_fixture (tc_refcount, setup, teardown);
+  tcase_add_test (tc_refcount, test_pkt_new);
+  tcase_add_test (tc_refcount, test_pkt_share_refcounted);
+  tcase_add_test (tc_refcount, test_pkt_share_borrowed);
+  tcase_add_test (tc_refcount, test_pkt_share_extern);
+  tcase_add_test (tc_refcount, test_pkt_batch);
+  suite_add_tcase (s, tc_refcount);
+
+  /* Copy-on-write test case */
+  TCase *tc_cow = tcase_create ("Cow");
+  tcase_add_checked_fixture (tc_cow, setup, teardown);
+  tcase_add_test (tc_cow, test_pkt_cow_private);
+  tcase_add_test (tc_cow, test_pkt_cow_headroom);
+  suite_add_tcase (s, tc_cow);
+
+  /* Segment chain test case */
+  TCase *tc_chain = tcase_create ("Chain");
+  tcase_add_checked_fixture (tc_chain, setup, teardown);
+  tcase_add_test (tc_chain, test_pkt_chain_prepend);
+  tcase_add_test (tc_chain, test_pkt_chain_append);
+  suite_add_tcase (s, tc_chain);
+
+  /* Packet pool test case */
+  TCase *tc_pool = tcase_create ("Pool");
+  tcase_add_test (tc_pool, test_pool_recycle);
+  tcase_add_test (tc_pool, test_pool_limit);
+  tcase_add_test (tc_pool, test_pool_delete_in_use);
+  tcase_add_test (tc_pool, test_pool_alignment);
+  tcase_add_test (tc_pool, test_pool_arena);
+  tcase_add_test (tc_pool, test_pool_share_borrowed);
+  tcase_add_test (tc_pool, test_pool_queue);
+  suite_add_tcase (s, tc_pool);
+
+  /* Metadata test case */
+  TCase *tc_meta = tcase_create ("Meta");
+  tcase_add_test (tc_meta, test_pkt_meta_parse);
+  tcase_add_test (tc_meta, test_pkt_meta_hash);
+  tcase_add_test (tc_meta, test_pkt_meta_copy);
+  suite_add_tcase (s, tc_meta);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = packet_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include <check.h>
+#include <vde3/ring.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define RING_CAPACITY 4
+
+// fixture components, always present
+vde_ring f_ring;
+
+void
+setup (void)
+{
+  fail_if (vde_ring_init(&f_ring, RING_CAPACITY), "could not init ring");
+}
+
+void
+teardown (void)
+{
+  vde_ring_fini(&f_ring);
+}
+
+
+V_START_TEST (test_ring_init)
+{
+  vde_ring ring;
+
+  fail_unless (vde_ring_is_init(&f_ring), "ring not initialized");
+  fail_unless (vde_ring_is_empty(&f_ring), "new ring not empty");
+  fail_unless (vde_ring_capacity(&f_ring) == RING_CAPACITY,
+               "wrong capacity");
+
+  fail_if (vde_ring_init(&ring, 5), "could not init ring");
+  fail_unless (vde_ring_capacity(&ring) == 8,
+               "capacity not rounded to a power of two");
+  vde_ring_fini(&ring);
+  fail_if (vde_ring_is_init(&ring), "ring still initialized after fini");
+
+  fail_unless (vde_ring_init(&ring, 0) == -1 && errno == EINVAL,
+               "empty ring accepted");
+}
+END_TEST
+
+V_START_TEST (test_ring_fifo)
+{
+  long i;
+
+  for (i = 1; i <= RING_CAPACITY; i++) {
+    fail_if (vde_ring_push_head(&f_ring, (void *)i), "push failed");
+  }
+  fail_unless (vde_ring_is_full(&f_ring), "ring not full");
+  fail_unless (vde_ring_push_head(&f_ring, (void *)i) == -1 &&
+               errno == ENOBUFS, "push on a full ring succeeded");
+  fail_unless (vde_ring_push_tail(&f_ring, (void *)i) == -1 &&
+               errno == ENOBUFS, "push on a full ring succeeded");
+
+  for (i = 1; i <= RING_CAPACITY; i++) {
+    fail_unless (vde_ring_pop_tail(&f_ring) == (void *)i,
+                 "elements out of order");
+  }
+  fail_unless (vde_ring_pop_tail(&f_ring) == NULL,
+               "pop on an empty ring returned an element");
+  fail_unless (vde_ring_pop_head(&f_ring) == NULL,
+               "pop on an empty ring returned an element");
+}
+END_TEST
+
+V_START_TEST (test_ring_both_ends)
+{
+  fail_if (vde_ring_push_head(&f_ring, (void *)2), "push failed");
+  fail_if (vde_ring_push_tail(&f_ring, (void *)1), "push failed");
+  fail_if (vde_ring_push_head(&f_ring, (void *)3), "push failed");
+  fail_unless (vde_ring_get_length(&f_ring) == 3, "wrong length");
+
+  fail_unless (vde_ring_pop_head(&f_ring) == (void *)3, "wrong head");
+  fail_unless (vde_ring_pop_tail(&f_ring) == (void *)1, "wrong tail");
+  fail_unless (vde_ring_pop_tail(&f_ring) == (void *)2, "wrong tail");
+  fail_unless (vde_ring_is_empty(&f_ring), "ring not empty");
+}
+END_TEST
+
+V_START_TEST (test_ring_wraparound)
+{
+  long i, next = 0;
+
+  // keep the ring half full while the counters go around several times
+  for (i = 0; i < RING_CAPACITY * 8; i++) {
+    fail_if (vde_ring_push_head(&f_ring, (void *)i), "push failed");
+    if (i >= RING_CAPACITY / 2) {
+      fail_unless (vde_ring_pop_tail(&f_ring) == (void *)next++,
+                   "elements out of order");
+    }
+  }
+  fail_unless (vde_ring_get_length(&f_ring) == RING_CAPACITY / 2,
+               "wrong length");
+
+  // counters overflowing unsigned int
+  vde_ring_fini(&f_ring);
+  vde_ring_init(&f_ring, RING_CAPACITY);
+  f_ring.head = f_ring.tail = -2;
+  for (i = 0; i < RING_CAPACITY; i++) {
+    fail_if (vde_ring_push_head(&f_ring, (void *)i), "push failed");
+  }
+  fail_unless (vde_ring_is_full(&f_ring), "ring not full");
+  for (i = 0; i < RING_CAPACITY; i++) {
+    fail_unless (vde_ring_pop_tail(&f_ring) == (void *)i,
+                 "elements out of order");
+  }
+}
+END_TEST
+
+V_START_TEST (test_ring_hwm)
+{
+  fail_unless (vde_ring_get_hwm(&f_ring) == 0, "hwm of a new ring not zero");
+
+  vde_ring_push_head(&f_ring, (void *)1);
+  vde_ring_push_head(&f_ring, (void *)2);
+  vde_ring_pop_tail(&f_ring);
+  vde_ring_push_tail(&f_ring, (void *)1);
+  vde_ring_push_head(&f_ring, (void *)3);
+  vde_ring_pop_tail(&f_ring);
+  vde_ring_pop_tail(&f_ring);
+  fail_unless (vde_ring_get_hwm(&f_ring) == 3, "wrong hwm");
+
+  vde_ring_pop_tail(&f_ring);
+  fail_unless (vde_ring_get_hwm(&f_ring) == 3, "hwm decreased");
+}
+END_TEST
+
+Suite *
+vde_ring_suite (void)
+{
+  Suite *s = suite_create ("vde_ring");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_ring_init);
+  tcase_add_test (tc_core, test_ring_fifo);
+  tcase_add_test (tc_core, test_ring_both_ends);
+  tcase_add_test (tc_core, test_ring_wraparound);
+  tcase_add_test (tc_core, test_ring_hwm);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = vde_ring_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
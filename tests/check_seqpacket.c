@@ -0,0 +1,382 @@
+/*
+ * The seqpacket transport driven by a raw SOCK_SEQPACKET peer: the peer does
+ * the hello handshake by hand and then exchanges batches of frames, each
+ * carrying its sequence number.
+ * (run from the top build directory so that modules are found in src/.libs)
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <check.h>
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/transport.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define SOCK_PATH "check_seqpacket.sock"
+
+#define HELLO_MAGIC 0x76646533
+#define HELLO_VERSION 1
+
+#define FRAME_LEN 1000
+#define RX_FRAMES 32
+// more than the socket buffer holds, part of them gets queued
+#define TX_FRAMES 512
+
+#define MAX_EVENTS 16
+#define LOOP_MAX 100
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t status;
+  uint32_t frame_len;
+  char description[8];
+} __attribute__((packed)) f_hello;
+
+typedef struct {
+  vde_hdr hdr;
+  char payload[FRAME_LEN];
+} __attribute__((packed)) f_msg;
+
+// a poll() based event handler
+typedef struct {
+  int fd;
+  short events;
+  event_cb cb;
+  void *arg;
+  int used;
+} f_event;
+
+f_event f_events[MAX_EVENTS];
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_tr;
+vde_connection *f_conn;
+int f_fd;
+f_hello f_reply;
+int f_read, f_batches, f_errors;
+uint32_t f_seqs[TX_FRAMES];
+
+void *f_event_add(int fd, short events, const struct timeval *tv,
+                  event_cb cb, void *arg)
+{
+  int i;
+
+  for (i = 0; i < MAX_EVENTS; i++) {
+    if (!f_events[i].used) {
+      f_events[i].fd = fd;
+      f_events[i].events = events;
+      f_events[i].cb = cb;
+      f_events[i].arg = arg;
+      f_events[i].used = 1;
+      return &f_events[i];
+    }
+  }
+  return NULL;
+}
+
+void f_event_del(void *ev)
+{
+  ((f_event *)ev)->used = 0;
+}
+
+void *f_timeout_add(const struct timeval *tv, short events, event_cb cb,
+                    void *arg)
+{
+  return NULL;
+}
+
+void f_timeout_del(void *tout)
+{
+}
+
+vde_event_handler f_eh = {f_event_add, f_event_del, f_timeout_add,
+                          f_timeout_del};
+
+// dispatch the ready events once, returns zero if none was ready
+int f_loop_once(void)
+{
+  struct pollfd pfd[MAX_EVENTS];
+  int idx[MAX_EVENTS], i, n = 0;
+  f_event *ev;
+
+  for (i = 0; i < MAX_EVENTS; i++) {
+    if (f_events[i].used) {
+      pfd[n].fd = f_events[i].fd;
+      pfd[n].events = f_events[i].events & VDE_EV_WRITE ? POLLOUT : POLLIN;
+      idx[n++] = i;
+    }
+  }
+  if (poll(pfd, n, 10) <= 0) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    ev = &f_events[idx[i]];
+    if (pfd[i].revents && ev->used && ev->fd == pfd[i].fd) {
+      if (!(ev->events & VDE_EV_PERSIST)) {
+        ev->used = 0;
+      }
+      ev->cb(ev->fd, ev->events & (VDE_EV_READ | VDE_EV_WRITE), ev->arg);
+    }
+  }
+  return 1;
+}
+
+int f_read_batch_cb(vde_connection *conn, vde_pkt_batch *batch, void *arg)
+{
+  unsigned int i;
+
+  f_batches++;
+  for (i = 0; i < batch->count && f_read < TX_FRAMES; i++) {
+    fail_unless (vde_pkt_len(batch->pkts[i]) == FRAME_LEN,
+                 "wrong frame length %u", vde_pkt_len(batch->pkts[i]));
+    memcpy(&f_seqs[f_read++], batch->pkts[i]->payload, sizeof(uint32_t));
+  }
+  return 0;
+}
+
+int f_error_cb(vde_connection *conn, vde_pkt *pkt, vde_conn_error err,
+               void *arg)
+{
+  if (err == CONN_WRITE_DELAY) {
+    return 0;
+  }
+  f_errors++;
+  f_conn = NULL;
+  errno = EPIPE;
+  return -1;
+}
+
+void f_accept_cb(vde_connection *conn, void *arg)
+{
+  struct timeval send_timeout = { 1, 0 };
+
+  vde_connection_set_send_properties(conn, 10, &send_timeout);
+  vde_connection_set_callbacks(conn, NULL, NULL, &f_error_cb, NULL);
+  vde_connection_set_read_batch_cb(conn, &f_read_batch_cb);
+  f_conn = conn;
+}
+
+void f_cm_error_cb(vde_connection *conn, int tr_errno, void *arg)
+{
+  vde_connection_delete(conn);
+}
+
+void f_msg_fill(f_msg *msg, uint32_t seq)
+{
+  memset(msg, 0, sizeof(*msg));
+  msg->hdr.version = VDE_HDR_VERSION;
+  msg->hdr.pkt_len = FRAME_LEN;
+  memcpy(msg->payload, &seq, sizeof(seq));
+}
+
+void
+setup (void)
+{
+  int i;
+  f_hello hello;
+  struct sockaddr_un sa;
+
+  memset(f_events, 0, sizeof(f_events));
+  f_conn = NULL;
+  f_read = f_batches = f_errors = 0;
+
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &f_eh, NULL, NULL);
+  fail_if (vde_context_new_component(f_ctx, VDE_TRANSPORT, "seqpacket",
+                                     "sp", &f_tr,
+                                     vde_sobj_from_string(
+                                       "{'path': '" SOCK_PATH "', "
+                                       "'queue_len': 1024, "
+                                       "'queue_size': 4194304}")),
+           "cannot create transport");
+  vde_transport_set_cm_callbacks(f_tr, &f_accept_cb, &f_accept_cb,
+                                 &f_cm_error_cb, NULL);
+  fail_if (vde_transport_listen(f_tr), "cannot listen");
+
+  f_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, SOCK_PATH);
+  fail_if (connect(f_fd, (struct sockaddr *)&sa, sizeof(sa)),
+           "cannot connect");
+
+  // offer jumbo frames, the transport picks its own frame size
+  memset(&hello, 0, sizeof(hello));
+  hello.magic = HELLO_MAGIC;
+  hello.version = HELLO_VERSION;
+  hello.frame_len = 9018;
+  strcpy(hello.description, "check");
+  fail_unless (send(f_fd, &hello, sizeof(hello), 0) == sizeof(hello),
+               "cannot send hello");
+
+  for (i = 0; i < LOOP_MAX && f_conn == NULL; i++) {
+    f_loop_once();
+  }
+  fail_if (f_conn == NULL, "connection not accepted");
+  memset(&f_reply, 0, sizeof(f_reply));
+  fail_unless (recv(f_fd, &f_reply, sizeof(f_reply), MSG_DONTWAIT) == 12,
+               "no reply to hello");
+}
+
+void
+teardown (void)
+{
+  if (f_conn != NULL) {
+    vde_connection_fini(f_conn);
+    vde_connection_delete(f_conn);
+  }
+  close(f_fd);
+  vde_context_component_del(f_ctx, f_tr);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+
+V_START_TEST (test_seqpacket_hello)
+{
+  fail_unless (f_reply.magic == HELLO_MAGIC &&
+               f_reply.version == HELLO_VERSION, "invalid reply");
+  fail_unless (f_reply.status == 0, "refused: %s", strerror(f_reply.status));
+  fail_unless (f_reply.frame_len == ETH_FRAME_LEN(ETH_DATA_LEN),
+               "wrong frame size %u", f_reply.frame_len);
+  fail_unless (vde_connection_max_payload(f_conn) == f_reply.frame_len,
+               "frame size not applied to the connection");
+}
+END_TEST
+
+V_START_TEST (test_seqpacket_rx)
+{
+  int i;
+  f_msg msgs[RX_FRAMES];
+  struct iovec iov[RX_FRAMES];
+  struct mmsghdr mmsgs[RX_FRAMES];
+
+  memset(mmsgs, 0, sizeof(mmsgs));
+  for (i = 0; i < RX_FRAMES; i++) {
+    f_msg_fill(&msgs[i], i);
+    iov[i].iov_base = &msgs[i];
+    iov[i].iov_len = sizeof(msgs[i]);
+    mmsgs[i].msg_hdr.msg_iov = &iov[i];
+    mmsgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  fail_unless (sendmmsg(f_fd, mmsgs, RX_FRAMES, 0) == RX_FRAMES,
+               "cannot send frames");
+
+  for (i = 0; i < LOOP_MAX && f_read < RX_FRAMES; i++) {
+    f_loop_once();
+  }
+  fail_unless (f_read == RX_FRAMES, "received %d frames", f_read);
+  fail_unless (f_batches < RX_FRAMES, "frames not received in batches");
+  for (i = 0; i < RX_FRAMES; i++) {
+    fail_unless (f_seqs[i] == i, "frame %d out of order", i);
+  }
+}
+END_TEST
+
+V_START_TEST (test_seqpacket_tx)
+{
+  int i, len, received = 0;
+  uint32_t seq;
+  unsigned int sent = 0;
+  f_msg msg;
+  vde_pkt_batch batch;
+  vde_pool *pool = vde_context_get_pool(f_ctx);
+
+  while (sent < TX_FRAMES) {
+    vde_pkt_batch_init(&batch);
+    while (!vde_pkt_batch_is_full(&batch) &&
+           sent + batch.count < TX_FRAMES) {
+      vde_pkt_batch_add(&batch, vde_pool_pkt_new(pool, FRAME_LEN, 0, 0));
+      batch.pkts[batch.count - 1]->hdr->pkt_len = FRAME_LEN;
+      seq = sent + batch.count - 1;
+      memcpy(batch.pkts[batch.count - 1]->payload, &seq, sizeof(seq));
+    }
+    fail_unless (vde_connection_write_batch(f_conn, &batch) == batch.count,
+                 "write failed after %u frames", sent);
+    sent += batch.count;
+    vde_pkt_batch_put(&batch);
+  }
+
+  // the socket buffer is full, the rest is sent by the write event
+  for (i = 0; i < LOOP_MAX && received < TX_FRAMES; i++) {
+    while ((len = recv(f_fd, &msg, sizeof(msg), MSG_DONTWAIT)) > 0) {
+      fail_unless (len == sizeof(msg) && msg.hdr.pkt_len == FRAME_LEN,
+                   "wrong message length %d", len);
+      memcpy(&seq, msg.payload, sizeof(seq));
+      fail_unless (seq == received, "frame %u received as %d", seq,
+                   received);
+      received++;
+    }
+    f_loop_once();
+  }
+  fail_unless (received == TX_FRAMES, "received %d frames", received);
+  fail_unless (f_errors == 0, "connection closed");
+}
+END_TEST
+
+V_START_TEST (test_seqpacket_peer_gone)
+{
+  int i;
+
+  close(f_fd);
+  f_fd = -1;
+  for (i = 0; i < LOOP_MAX && f_errors == 0; i++) {
+    f_loop_once();
+  }
+  fail_unless (f_errors == 1, "peer close not reported");
+}
+END_TEST
+
+Suite *
+seqpacket_suite (void)
+{
+  Suite *s = suite_create ("seqpacket");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_seqpacket_hello);
+  tcase_add_test (tc_core, test_seqpacket_rx);
+  tcase_add_test (tc_core, test_seqpacket_tx);
+  tcase_add_test (tc_core, test_seqpacket_peer_gone);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = seqpacket_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,363 @@
+/*
+ * Two shm transports of the same context, one listening and one connecting,
+ * exchanging batches of frames each carrying its sequence number. The rings
+ * are small so that the producer fills them and has to be woken up.
+ * (run from the top build directory so that modules are found in src/.libs)
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <check.h>
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/transport.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define SOCK_PATH "check_shm.sock"
+
+#define FRAME_LEN 1000
+#define RING_SIZE "16"
+#define RX_FRAMES 32
+// many times the ring, the producer waits for the consumer to free slots
+#define TX_FRAMES 512
+
+#define MAX_EVENTS 16
+#define LOOP_MAX 100
+
+// a poll() based event handler
+typedef struct {
+  int fd;
+  short events;
+  event_cb cb;
+  void *arg;
+  int used;
+} f_event;
+
+f_event f_events[MAX_EVENTS];
+
+// an end of the connection
+typedef struct {
+  vde_connection *conn;
+  int read, batches, errors;
+  uint32_t seqs[TX_FRAMES];
+} f_end;
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_srv_tr, *f_cli_tr;
+f_end f_srv, f_cli;
+
+void *f_event_add(int fd, short events, const struct timeval *tv,
+                  event_cb cb, void *arg)
+{
+  int i;
+
+  for (i = 0; i < MAX_EVENTS; i++) {
+    if (!f_events[i].used) {
+      f_events[i].fd = fd;
+      f_events[i].events = events;
+      f_events[i].cb = cb;
+      f_events[i].arg = arg;
+      f_events[i].used = 1;
+      return &f_events[i];
+    }
+  }
+  return NULL;
+}
+
+void f_event_del(void *ev)
+{
+  ((f_event *)ev)->used = 0;
+}
+
+void *f_timeout_add(const struct timeval *tv, short events, event_cb cb,
+                    void *arg)
+{
+  return NULL;
+}
+
+void f_timeout_del(void *tout)
+{
+}
+
+vde_event_handler f_eh = {f_event_add, f_event_del, f_timeout_add,
+                          f_timeout_del};
+
+// dispatch the ready events once, returns zero if none was ready
+int f_loop_once(void)
+{
+  struct pollfd pfd[MAX_EVENTS];
+  int idx[MAX_EVENTS], i, n = 0;
+  f_event *ev;
+
+  for (i = 0; i < MAX_EVENTS; i++) {
+    if (f_events[i].used) {
+      pfd[n].fd = f_events[i].fd;
+      pfd[n].events = f_events[i].events & VDE_EV_WRITE ? POLLOUT : POLLIN;
+      idx[n++] = i;
+    }
+  }
+  if (poll(pfd, n, 10) <= 0) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    ev = &f_events[idx[i]];
+    if (pfd[i].revents && ev->used && ev->fd == pfd[i].fd) {
+      if (!(ev->events & VDE_EV_PERSIST)) {
+        ev->used = 0;
+      }
+      ev->cb(ev->fd, ev->events & (VDE_EV_READ | VDE_EV_WRITE), ev->arg);
+    }
+  }
+  return 1;
+}
+
+int f_read_batch_cb(vde_connection *conn, vde_pkt_batch *batch, void *arg)
+{
+  unsigned int i;
+  f_end *end = (f_end *)arg;
+
+  end->batches++;
+  for (i = 0; i < batch->count && end->read < TX_FRAMES; i++) {
+    fail_unless (vde_pkt_len(batch->pkts[i]) == FRAME_LEN,
+                 "wrong frame length %u", vde_pkt_len(batch->pkts[i]));
+    memcpy(&end->seqs[end->read++], batch->pkts[i]->payload,
+           sizeof(uint32_t));
+  }
+  return 0;
+}
+
+int f_error_cb(vde_connection *conn, vde_pkt *pkt, vde_conn_error err,
+               void *arg)
+{
+  f_end *end = (f_end *)arg;
+
+  if (err == CONN_WRITE_DELAY) {
+    return 0;
+  }
+  end->errors++;
+  end->conn = NULL;
+  errno = EPIPE;
+  return -1;
+}
+
+void f_end_set(f_end *end, vde_connection *conn)
+{
+  struct timeval send_timeout = { 1, 0 };
+
+  vde_connection_set_send_properties(conn, 10, &send_timeout);
+  vde_connection_set_callbacks(conn, NULL, NULL, &f_error_cb, (void *)end);
+  vde_connection_set_read_batch_cb(conn, &f_read_batch_cb);
+  end->conn = conn;
+}
+
+void f_accept_cb(vde_connection *conn, void *arg)
+{
+  f_end_set(&f_srv, conn);
+}
+
+void f_connect_cb(vde_connection *conn, void *arg)
+{
+  f_end_set(&f_cli, conn);
+}
+
+void f_cm_error_cb(vde_connection *conn, int tr_errno, void *arg)
+{
+  vde_connection_delete(conn);
+}
+
+// write count frames numbered from 0 in batches, they can't be refused
+void f_write_frames(vde_connection *conn, unsigned int count)
+{
+  uint32_t seq;
+  unsigned int sent = 0;
+  vde_pkt_batch batch;
+  vde_pool *pool = vde_context_get_pool(f_ctx);
+
+  while (sent < count) {
+    vde_pkt_batch_init(&batch);
+    while (!vde_pkt_batch_is_full(&batch) && sent + batch.count < count) {
+      vde_pkt_batch_add(&batch, vde_pool_pkt_new(pool, FRAME_LEN, 0, 0));
+      batch.pkts[batch.count - 1]->hdr->pkt_len = FRAME_LEN;
+      seq = sent + batch.count - 1;
+      memcpy(batch.pkts[batch.count - 1]->payload, &seq, sizeof(seq));
+    }
+    fail_unless (vde_connection_write_batch(conn, &batch) == batch.count,
+                 "write failed after %u frames", sent);
+    sent += batch.count;
+    vde_pkt_batch_put(&batch);
+  }
+}
+
+void f_check_frames(f_end *end, int count)
+{
+  int i;
+
+  for (i = 0; i < LOOP_MAX && end->read < count; i++) {
+    f_loop_once();
+  }
+  fail_unless (end->read == count, "received %d frames", end->read);
+  for (i = 0; i < count; i++) {
+    fail_unless (end->seqs[i] == i, "frame %d out of order", i);
+  }
+  fail_unless (f_srv.errors == 0 && f_cli.errors == 0, "connection closed");
+}
+
+void
+setup (void)
+{
+  int i;
+  vde_connection *conn;
+
+  memset(f_events, 0, sizeof(f_events));
+  memset(&f_srv, 0, sizeof(f_srv));
+  memset(&f_cli, 0, sizeof(f_cli));
+
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &f_eh, NULL, NULL);
+  fail_if (vde_context_new_component(f_ctx, VDE_TRANSPORT, "shm", "srv",
+                                     &f_srv_tr,
+                                     vde_sobj_from_string(
+                                       "{'path': '" SOCK_PATH "', "
+                                       "'ring_size': " RING_SIZE "}")),
+           "cannot create listening transport");
+  fail_if (vde_context_new_component(f_ctx, VDE_TRANSPORT, "shm", "cli",
+                                     &f_cli_tr,
+                                     vde_sobj_from_string(
+                                       "{'path': '" SOCK_PATH "', "
+                                       "'ring_size': " RING_SIZE ", "
+                                       "'queue_len': 1024, "
+                                       "'queue_size': 4194304}")),
+           "cannot create connecting transport");
+  vde_transport_set_cm_callbacks(f_srv_tr, &f_connect_cb, &f_accept_cb,
+                                 &f_cm_error_cb, NULL);
+  vde_transport_set_cm_callbacks(f_cli_tr, &f_connect_cb, &f_accept_cb,
+                                 &f_cm_error_cb, NULL);
+  fail_if (vde_transport_listen(f_srv_tr), "cannot listen");
+
+  vde_connection_new(&conn);
+  fail_if (vde_transport_connect(f_cli_tr, conn), "cannot connect");
+  for (i = 0; i < LOOP_MAX && (f_srv.conn == NULL || f_cli.conn == NULL);
+       i++) {
+    f_loop_once();
+  }
+}
+
+void
+teardown (void)
+{
+  if (f_cli.conn != NULL) {
+    vde_connection_fini(f_cli.conn);
+    vde_connection_delete(f_cli.conn);
+  }
+  if (f_srv.conn != NULL) {
+    vde_connection_fini(f_srv.conn);
+    vde_connection_delete(f_srv.conn);
+  }
+  vde_context_component_del(f_ctx, f_cli_tr);
+  vde_context_component_del(f_ctx, f_srv_tr);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+
+V_START_TEST (test_shm_connect)
+{
+  fail_if (f_srv.conn == NULL, "connection not accepted");
+  fail_if (f_cli.conn == NULL, "connection not established");
+  fail_unless (vde_connection_max_payload(f_srv.conn) ==
+               ETH_FRAME_LEN(ETH_DATA_LEN), "wrong frame size %u",
+               vde_connection_max_payload(f_srv.conn));
+  fail_unless (vde_connection_max_payload(f_cli.conn) ==
+               vde_connection_max_payload(f_srv.conn),
+               "frame size differs between the ends");
+}
+END_TEST
+
+V_START_TEST (test_shm_tx)
+{
+  f_write_frames(f_cli.conn, RX_FRAMES);
+  f_check_frames(&f_srv, RX_FRAMES);
+  fail_unless (f_srv.batches < RX_FRAMES, "frames not received in batches");
+}
+END_TEST
+
+V_START_TEST (test_shm_rx)
+{
+  f_write_frames(f_srv.conn, RX_FRAMES);
+  f_check_frames(&f_cli, RX_FRAMES);
+  fail_unless (f_cli.batches < RX_FRAMES, "frames not received in batches");
+}
+END_TEST
+
+V_START_TEST (test_shm_ring_full)
+{
+  // all but a ring of frames stay queued until the consumer frees slots
+  f_write_frames(f_cli.conn, TX_FRAMES);
+  f_check_frames(&f_srv, TX_FRAMES);
+}
+END_TEST
+
+V_START_TEST (test_shm_peer_gone)
+{
+  int i;
+
+  vde_connection_fini(f_cli.conn);
+  vde_connection_delete(f_cli.conn);
+  f_cli.conn = NULL;
+  for (i = 0; i < LOOP_MAX && f_srv.errors == 0; i++) {
+    f_loop_once();
+  }
+  fail_unless (f_srv.errors == 1, "peer close not reported");
+}
+END_TEST
+
+Suite *
+shm_suite (void)
+{
+  Suite *s = suite_create ("shm");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_shm_connect);
+  tcase_add_test (tc_core, test_shm_tx);
+  tcase_add_test (tc_core, test_shm_rx);
+  tcase_add_test (tc_core, test_shm_ring_full);
+  tcase_add_test (tc_core, test_shm_peer_gone);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = shm_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,429 @@
+/*
+ * The stream transport driven by a raw unix stream peer which frames and
+ * splits the data by hand: frames cut across reads, a bogus length prefix,
+ * writes the socket takes only in part and the cork.
+ * (run from the top build directory so that modules are found in src/.libs)
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include <check.h>
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/transport.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define SOCK_PATH "check_stream.sock"
+#define CORKED_SOCK_PATH "check_stream_corked.sock"
+
+// a batch of jumbo frames spans several buffers of the socket, which fills
+// up in the middle of a frame
+#define MTU "9000"
+#define FRAME_LEN 9001
+#define PREFIX_LEN 4
+// more than the socket buffer holds, part of them gets queued
+#define TX_FRAMES 512
+// the corked transport writes once this many frames are queued
+#define CORK_FRAMES 4
+
+#define MAX_EVENTS 16
+#define LOOP_MAX 100
+
+typedef struct {
+  uint32_t prefix;
+  char payload[FRAME_LEN];
+} __attribute__((packed)) f_frame;
+
+// a poll() based event handler
+typedef struct {
+  int fd;
+  short events;
+  event_cb cb;
+  void *arg;
+  int used;
+} f_event;
+
+f_event f_events[MAX_EVENTS];
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_tr, *f_corked_tr;
+vde_connection *f_conn;
+int f_fd;
+int f_read, f_errors;
+uint32_t f_seqs[TX_FRAMES];
+
+void *f_event_add(int fd, short events, const struct timeval *tv,
+                  event_cb cb, void *arg)
+{
+  int i;
+
+  for (i = 0; i < MAX_EVENTS; i++) {
+    if (!f_events[i].used) {
+      f_events[i].fd = fd;
+      f_events[i].events = events;
+      f_events[i].cb = cb;
+      f_events[i].arg = arg;
+      f_events[i].used = 1;
+      return &f_events[i];
+    }
+  }
+  return NULL;
+}
+
+void f_event_del(void *ev)
+{
+  ((f_event *)ev)->used = 0;
+}
+
+void *f_timeout_add(const struct timeval *tv, short events, event_cb cb,
+                    void *arg)
+{
+  return NULL;
+}
+
+void f_timeout_del(void *tout)
+{
+}
+
+vde_event_handler f_eh = {f_event_add, f_event_del, f_timeout_add,
+                          f_timeout_del};
+
+// dispatch the ready events once, returns zero if none was ready
+int f_loop_once(void)
+{
+  struct pollfd pfd[MAX_EVENTS];
+  int idx[MAX_EVENTS], i, n = 0;
+  f_event *ev;
+
+  for (i = 0; i < MAX_EVENTS; i++) {
+    if (f_events[i].used) {
+      pfd[n].fd = f_events[i].fd;
+      pfd[n].events = f_events[i].events & VDE_EV_WRITE ? POLLOUT : POLLIN;
+      idx[n++] = i;
+    }
+  }
+  if (poll(pfd, n, 10) <= 0) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    ev = &f_events[idx[i]];
+    if (pfd[i].revents && ev->used && ev->fd == pfd[i].fd) {
+      if (!(ev->events & VDE_EV_PERSIST)) {
+        ev->used = 0;
+      }
+      ev->cb(ev->fd, ev->events & (VDE_EV_READ | VDE_EV_WRITE), ev->arg);
+    }
+  }
+  return 1;
+}
+
+int f_read_batch_cb(vde_connection *conn, vde_pkt_batch *batch, void *arg)
+{
+  unsigned int i;
+
+  for (i = 0; i < batch->count && f_read < TX_FRAMES; i++) {
+    fail_unless (vde_pkt_len(batch->pkts[i]) == FRAME_LEN,
+                 "wrong frame length %u", vde_pkt_len(batch->pkts[i]));
+    memcpy(&f_seqs[f_read++], batch->pkts[i]->payload, sizeof(uint32_t));
+  }
+  return 0;
+}
+
+int f_error_cb(vde_connection *conn, vde_pkt *pkt, vde_conn_error err,
+               void *arg)
+{
+  if (err == CONN_WRITE_DELAY) {
+    return 0;
+  }
+  f_errors++;
+  f_conn = NULL;
+  errno = EPIPE;
+  return -1;
+}
+
+void f_accept_cb(vde_connection *conn, void *arg)
+{
+  struct timeval send_timeout = { 1, 0 };
+
+  vde_connection_set_send_properties(conn, 10, &send_timeout);
+  vde_connection_set_callbacks(conn, NULL, NULL, &f_error_cb, NULL);
+  vde_connection_set_read_batch_cb(conn, &f_read_batch_cb);
+  f_conn = conn;
+}
+
+void f_cm_error_cb(vde_connection *conn, int tr_errno, void *arg)
+{
+  vde_connection_delete(conn);
+}
+
+vde_component *f_transport_new(const char *name, const char *params)
+{
+  vde_component *tr;
+
+  fail_if (vde_context_new_component(f_ctx, VDE_TRANSPORT, "stream", name,
+                                     &tr, vde_sobj_from_string(params)),
+           "cannot create transport");
+  vde_transport_set_cm_callbacks(tr, &f_accept_cb, &f_accept_cb,
+                                 &f_cm_error_cb, NULL);
+  fail_if (vde_transport_listen(tr), "cannot listen");
+  return tr;
+}
+
+// connect the peer to a transport and wait for the connection to be accepted
+void f_peer_connect(const char *path)
+{
+  int i;
+  struct sockaddr_un sa;
+
+  f_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+  fail_if (connect(f_fd, (struct sockaddr *)&sa, sizeof(sa)),
+           "cannot connect");
+
+  for (i = 0; i < LOOP_MAX && f_conn == NULL; i++) {
+    f_loop_once();
+  }
+  fail_if (f_conn == NULL, "connection not accepted");
+}
+
+void f_frame_fill(f_frame *frame, uint32_t seq)
+{
+  memset(frame, 0, sizeof(*frame));
+  frame->prefix = htonl(FRAME_LEN);
+  memcpy(frame->payload, &seq, sizeof(seq));
+}
+
+void f_send(const void *buf, size_t len)
+{
+  fail_unless (send(f_fd, buf, len, 0) == len, "cannot send %zu bytes", len);
+}
+
+// queue count frames numbered from first in batches, they can't be refused
+void f_write_frames(uint32_t first, unsigned int count)
+{
+  uint32_t seq;
+  unsigned int sent = 0;
+  vde_pkt_batch batch;
+  vde_pool *pool = vde_context_get_pool(f_ctx);
+
+  while (sent < count) {
+    vde_pkt_batch_init(&batch);
+    while (!vde_pkt_batch_is_full(&batch) && sent + batch.count < count) {
+      vde_pkt_batch_add(&batch, vde_pool_pkt_new(pool, FRAME_LEN, 0, 0));
+      batch.pkts[batch.count - 1]->hdr->pkt_len = FRAME_LEN;
+      seq = first + sent + batch.count - 1;
+      memcpy(batch.pkts[batch.count - 1]->payload, &seq, sizeof(seq));
+    }
+    fail_unless (vde_connection_write_batch(f_conn, &batch) == batch.count,
+                 "write failed after %u frames", sent);
+    sent += batch.count;
+    vde_pkt_batch_put(&batch);
+  }
+}
+
+// read the frames written to the peer, checking that the stream is intact
+int f_recv_frames(int expected, int loops)
+{
+  int i, len, received = 0;
+  uint32_t seq;
+  unsigned int have = 0;
+  f_frame frame;
+
+  for (i = 0; i < loops && received < expected; i++) {
+    while ((len = recv(f_fd, (char *)&frame + have, sizeof(frame) - have,
+                       MSG_DONTWAIT)) > 0) {
+      have += len;
+      if (have < sizeof(frame)) {
+        continue;
+      }
+      fail_unless (ntohl(frame.prefix) == FRAME_LEN,
+                   "frame %d with length %u", received, ntohl(frame.prefix));
+      memcpy(&seq, frame.payload, sizeof(seq));
+      fail_unless (seq == received, "frame %u received as %d", seq,
+                   received);
+      received++;
+      have = 0;
+    }
+    f_loop_once();
+  }
+  fail_unless (have == 0, "%u bytes of a frame left over", have);
+  return received;
+}
+
+void
+setup (void)
+{
+  memset(f_events, 0, sizeof(f_events));
+  f_conn = NULL;
+  f_corked_tr = NULL;
+  f_read = f_errors = 0;
+
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &f_eh, NULL, NULL);
+  f_tr = f_transport_new("st", "{'path': '" SOCK_PATH "', 'mtu': " MTU ", "
+                         "'queue_len': 1024, 'queue_size': 16777216}");
+  f_peer_connect(SOCK_PATH);
+}
+
+void
+teardown (void)
+{
+  if (f_conn != NULL) {
+    vde_connection_fini(f_conn);
+    vde_connection_delete(f_conn);
+  }
+  close(f_fd);
+  if (f_corked_tr != NULL) {
+    vde_context_component_del(f_ctx, f_corked_tr);
+  }
+  vde_context_component_del(f_ctx, f_tr);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+
+V_START_TEST (test_stream_split_frame)
+{
+  int i;
+  f_frame frames[2];
+
+  f_frame_fill(&frames[0], 0);
+  f_frame_fill(&frames[1], 1);
+
+  // the first frame without its tail
+  f_send(&frames[0], sizeof(frames[0]) - 100);
+  for (i = 0; i < 3; i++) {
+    f_loop_once();
+  }
+  fail_unless (f_read == 0, "partial frame delivered");
+
+  // its tail with half of the prefix of the second one
+  f_send((char *)&frames[0] + sizeof(frames[0]) - 100, 100 + PREFIX_LEN / 2);
+  for (i = 0; i < LOOP_MAX && f_read < 1; i++) {
+    f_loop_once();
+  }
+  fail_unless (f_read == 1 && f_seqs[0] == 0, "first frame not delivered");
+
+  f_send((char *)&frames[1] + PREFIX_LEN / 2,
+         sizeof(frames[1]) - PREFIX_LEN / 2);
+  for (i = 0; i < LOOP_MAX && f_read < 2; i++) {
+    f_loop_once();
+  }
+  fail_unless (f_read == 2 && f_seqs[1] == 1, "second frame not delivered");
+  fail_unless (f_errors == 0, "connection closed");
+}
+END_TEST
+
+V_START_TEST (test_stream_oversized_prefix)
+{
+  int i;
+  f_frame frame;
+
+  // a good frame followed by a length the mtu can't hold
+  f_frame_fill(&frame, 0);
+  f_send(&frame, sizeof(frame));
+  frame.prefix = htonl(ETH_MAX_FRAME_LEN + 1);
+  f_send(&frame, sizeof(frame));
+
+  for (i = 0; i < LOOP_MAX && f_errors == 0; i++) {
+    f_loop_once();
+  }
+  fail_unless (f_read == 1, "frames before the bogus prefix not delivered");
+  fail_unless (f_errors == 1, "stream not closed");
+}
+END_TEST
+
+V_START_TEST (test_stream_short_write)
+{
+  int received;
+
+  // the socket takes part of a frame, the rest is sent by the write event
+  f_write_frames(0, TX_FRAMES);
+  received = f_recv_frames(TX_FRAMES, LOOP_MAX);
+  fail_unless (received == TX_FRAMES, "received %d frames", received);
+  fail_unless (f_errors == 0, "connection closed");
+}
+END_TEST
+
+V_START_TEST (test_stream_cork)
+{
+  int received;
+  char params[160];
+
+  // the corked transport is never flushed by time, its timeout never fires
+  vde_connection_fini(f_conn);
+  vde_connection_delete(f_conn);
+  f_conn = NULL;
+  close(f_fd);
+  snprintf(params, sizeof(params), "{'path': '" CORKED_SOCK_PATH "', "
+           "'mtu': " MTU ", 'cork_usec': 1000000, 'cork_bytes': %d}",
+           CORK_FRAMES * FRAME_LEN);
+  f_corked_tr = f_transport_new("corked", params);
+  f_peer_connect(CORKED_SOCK_PATH);
+
+  f_write_frames(0, CORK_FRAMES - 1);
+  received = f_recv_frames(CORK_FRAMES, 5);
+  fail_unless (received == 0, "%d frames sent while corked", received);
+
+  // cork_bytes reached, everything queued leaves at once
+  f_write_frames(CORK_FRAMES - 1, 1);
+  received = f_recv_frames(CORK_FRAMES, LOOP_MAX);
+  fail_unless (received == CORK_FRAMES, "received %d frames", received);
+  fail_unless (f_errors == 0, "connection closed");
+}
+END_TEST
+
+Suite *
+stream_suite (void)
+{
+  Suite *s = suite_create ("stream");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_stream_split_frame);
+  tcase_add_test (tc_core, test_stream_oversized_prefix);
+  tcase_add_test (tc_core, test_stream_short_write);
+  tcase_add_test (tc_core, test_stream_cork);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = stream_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
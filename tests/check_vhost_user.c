@@ -0,0 +1,577 @@
+/*
+ * The vhost_user transport driven by a minimal frontend: guest memory is a
+ * memfd holding the virtqueues and their buffers, the frontend sets them up
+ * with the vhost-user messages QEMU would send and then plays the virtio-net
+ * driver.
+ * (run from the top build directory so that modules are found in src/.libs)
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include <check.h>
+#include <vde3.h>
+
+#include <vde3/common.h>
+#include <vde3/connection.h>
+#include <vde3/context.h>
+#include <vde3/transport.h>
+#include <vde3/packet.h>
+#include <vde3/pool.h>
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_VALGRIND_VALGRIND_H
+#include <valgrind/valgrind.h>
+#define V_START_TEST(n) START_TEST(n) VALGRIND_PRINTF("starting test "#n"\n");
+#else
+#define V_START_TEST(n) START_TEST(n)
+#endif
+
+#define SOCK_PATH "check_vhost_user.sock"
+
+// guest memory layout, each virtqueue has its rings in a 64k slot and the
+// buffers follow
+#define MEM_SIZE (1 << 20)
+#define VQ_NUM 8
+#define VQ_SLOT 0x10000
+#define AVAIL_OFF 0x1000
+#define USED_OFF 0x2000
+#define BUF_OFF 0x40000
+#define BUF_SIZE 2048
+#define NET_HDR_LEN 12
+
+#define MAX_EVENTS 16
+#define LOOP_MAX 100
+
+// vhost-user requests used by the frontend
+#define GET_FEATURES 1
+#define SET_FEATURES 2
+#define SET_OWNER 3
+#define SET_MEM_TABLE 5
+#define SET_VRING_NUM 8
+#define SET_VRING_ADDR 9
+#define SET_VRING_BASE 10
+#define SET_VRING_KICK 12
+#define SET_VRING_CALL 13
+#define GET_PROTOCOL_FEATURES 15
+#define SET_PROTOCOL_FEATURES 16
+#define SET_VRING_ENABLE 18
+
+#define NEED_REPLY (1 << 3)
+
+typedef struct {
+  uint32_t request;
+  uint32_t flags;
+  uint32_t size;
+  union {
+    uint64_t u64;
+    struct { uint32_t index, num; } state;
+    struct { uint32_t index, flags; uint64_t desc, used, avail, log; } addr;
+    struct {
+      uint32_t nregions, padding;
+      uint64_t gpa, size, uaddr, offset;
+    } mem;
+  } u;
+} __attribute__((packed)) fe_msg;
+
+typedef struct {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} fe_desc;
+
+typedef struct {
+  int kick;
+  int call;
+  fe_desc *desc;
+  uint16_t *avail; // flags, idx, ring
+  uint32_t *used; // flags and idx, then id and len of each element
+} fe_vq;
+
+// a poll() based event handler
+typedef struct {
+  int fd;
+  short events;
+  event_cb cb;
+  void *arg;
+  int used;
+} f_event;
+
+f_event f_events[MAX_EVENTS];
+
+// fixture components, always present
+vde_context *f_ctx;
+vde_component *f_tr;
+vde_connection *f_conn;
+int f_fd;
+char *f_mem;
+fe_vq f_vqs[2];
+int f_read, f_errors;
+char f_frame[BUF_SIZE];
+unsigned int f_frame_len;
+
+void *f_event_add(int fd, short events, const struct timeval *tv,
+                  event_cb cb, void *arg)
+{
+  int i;
+
+  for (i = 0; i < MAX_EVENTS; i++) {
+    if (!f_events[i].used) {
+      f_events[i].fd = fd;
+      f_events[i].events = events;
+      f_events[i].cb = cb;
+      f_events[i].arg = arg;
+      f_events[i].used = 1;
+      return &f_events[i];
+    }
+  }
+  return NULL;
+}
+
+void f_event_del(void *ev)
+{
+  ((f_event *)ev)->used = 0;
+}
+
+void *f_timeout_add(const struct timeval *tv, short events, event_cb cb,
+                    void *arg)
+{
+  return NULL;
+}
+
+void f_timeout_del(void *tout)
+{
+}
+
+vde_event_handler f_eh = {f_event_add, f_event_del, f_timeout_add,
+                          f_timeout_del};
+
+// dispatch the ready events once, returns zero if none was ready
+int f_loop_once(void)
+{
+  struct pollfd pfd[MAX_EVENTS];
+  int idx[MAX_EVENTS], i, n = 0;
+  f_event *ev;
+
+  for (i = 0; i < MAX_EVENTS; i++) {
+    if (f_events[i].used) {
+      pfd[n].fd = f_events[i].fd;
+      pfd[n].events = POLLIN;
+      idx[n++] = i;
+    }
+  }
+  if (poll(pfd, n, 10) <= 0) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    ev = &f_events[idx[i]];
+    if (pfd[i].revents && ev->used && ev->fd == pfd[i].fd) {
+      if (!(ev->events & VDE_EV_PERSIST)) {
+        ev->used = 0;
+      }
+      ev->cb(ev->fd, VDE_EV_READ, ev->arg);
+    }
+  }
+  return 1;
+}
+
+int f_read_cb(vde_connection *conn, vde_pkt *pkt, void *arg)
+{
+  f_read++;
+  f_frame_len = vde_pkt_len(pkt);
+  vde_pkt_gather(pkt, f_frame);
+  return 0;
+}
+
+int f_error_cb(vde_connection *conn, vde_pkt *pkt, vde_conn_error err,
+               void *arg)
+{
+  if (err == CONN_WRITE_DELAY) {
+    return 0;
+  }
+  f_errors++;
+  f_conn = NULL;
+  errno = EPIPE;
+  return -1;
+}
+
+void f_accept_cb(vde_connection *conn, void *arg)
+{
+  vde_connection_set_callbacks(conn, &f_read_cb, NULL, &f_error_cb, NULL);
+  f_conn = conn;
+}
+
+void f_cm_error_cb(vde_connection *conn, int tr_errno, void *arg)
+{
+  vde_connection_delete(conn);
+}
+
+// send a message, passing fd if not -1, and wait for the reply if any
+void fe_send(fe_msg *msg, uint32_t size, int fd, int reply)
+{
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { msg, 12 + size };
+  struct msghdr mh;
+  struct cmsghdr *cmsg;
+  int len, i;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (fd >= 0) {
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  msg->flags |= 0x1;
+  msg->size = size;
+  fail_unless (sendmsg(f_fd, &mh, 0) == 12 + size, "cannot send message");
+  if (!reply) {
+    return;
+  }
+
+  // the backend runs in our event loop
+  for (i = 0; i < LOOP_MAX; i++) {
+    f_loop_once();
+    len = recv(f_fd, msg, sizeof(*msg), MSG_DONTWAIT);
+    if (len > 0) {
+      fail_unless (len == 12 + 8 && (msg->flags & 0x4), "invalid reply");
+      return;
+    }
+  }
+  fail ("no reply to request %u", msg->request);
+}
+
+void fe_setup_vq(unsigned int index)
+{
+  fe_msg msg;
+  fe_vq *vq = &f_vqs[index];
+  char *base = f_mem + index * VQ_SLOT;
+
+  vq->desc = (fe_desc *)base;
+  vq->avail = (uint16_t *)(base + AVAIL_OFF);
+  vq->used = (uint32_t *)(base + USED_OFF);
+  vq->kick = eventfd(0, EFD_NONBLOCK);
+  vq->call = eventfd(0, EFD_NONBLOCK);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.request = SET_VRING_NUM;
+  msg.u.state.index = index;
+  msg.u.state.num = VQ_NUM;
+  fe_send(&msg, sizeof(msg.u.state), -1, 0);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.request = SET_VRING_BASE;
+  msg.u.state.index = index;
+  fe_send(&msg, sizeof(msg.u.state), -1, 0);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.request = SET_VRING_ADDR;
+  msg.u.addr.index = index;
+  msg.u.addr.desc = (uintptr_t)vq->desc;
+  msg.u.addr.avail = (uintptr_t)vq->avail;
+  msg.u.addr.used = (uintptr_t)vq->used;
+  fe_send(&msg, sizeof(msg.u.addr), -1, 0);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.request = SET_VRING_KICK;
+  msg.u.u64 = index;
+  fe_send(&msg, sizeof(msg.u.u64), vq->kick, 0);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.request = SET_VRING_CALL;
+  msg.u.u64 = index;
+  fe_send(&msg, sizeof(msg.u.u64), vq->call, 0);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.request = SET_VRING_ENABLE;
+  msg.flags = NEED_REPLY;
+  msg.u.state.index = index;
+  msg.u.state.num = 1;
+  fe_send(&msg, sizeof(msg.u.state), -1, 1);
+  fail_unless (msg.u.u64 == 0, "enabling virtqueue failed");
+}
+
+// make buffer slot of the virtqueue available, writable for receive buffers
+void fe_add_buf(unsigned int index, unsigned int slot, uint32_t len)
+{
+  fe_vq *vq = &f_vqs[index];
+  uint16_t idx = vq->avail[1];
+
+  vq->desc[slot].addr = BUF_OFF + (index * VQ_NUM + slot) * BUF_SIZE;
+  vq->desc[slot].len = len;
+  vq->desc[slot].flags = index == 0 ? 2 : 0;
+  vq->avail[2 + idx % VQ_NUM] = slot;
+  __atomic_store_n(&vq->avail[1], idx + 1, __ATOMIC_RELEASE);
+}
+
+char *fe_buf(unsigned int index, unsigned int slot)
+{
+  return f_mem + BUF_OFF + (index * VQ_NUM + slot) * BUF_SIZE;
+}
+
+void fe_kick(unsigned int index)
+{
+  uint64_t one = 1;
+
+  fail_unless (write(f_vqs[index].kick, &one, sizeof(one)) == sizeof(one),
+               "cannot kick");
+}
+
+uint16_t fe_used_idx(unsigned int index)
+{
+  return __atomic_load_n((uint16_t *)f_vqs[index].used + 1, __ATOMIC_ACQUIRE);
+}
+
+void
+setup (void)
+{
+  int memfd, i;
+  fe_msg msg;
+  struct sockaddr_un sa;
+
+  memset(f_events, 0, sizeof(f_events));
+  f_conn = NULL;
+  f_read = f_errors = 0;
+
+  vde_context_new(&f_ctx);
+  vde_context_init(f_ctx, &f_eh, NULL, NULL);
+  fail_if (vde_context_new_component(f_ctx, VDE_TRANSPORT, "vhost_user",
+                                     "vu", &f_tr,
+                                     vde_sobj_from_string(
+                                       "{'path': '" SOCK_PATH "'}")),
+           "cannot create transport");
+  vde_transport_set_cm_callbacks(f_tr, &f_accept_cb, &f_accept_cb,
+                                 &f_cm_error_cb, NULL);
+  fail_if (vde_transport_listen(f_tr), "cannot listen");
+
+  memfd = memfd_create("guest", 0);
+  fail_if (memfd < 0 || ftruncate(memfd, MEM_SIZE), "cannot create memory");
+  f_mem = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  fail_if (f_mem == MAP_FAILED, "cannot map memory");
+
+  f_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, SOCK_PATH);
+  fail_if (connect(f_fd, (struct sockaddr *)&sa, sizeof(sa)),
+           "cannot connect");
+
+  memset(&msg, 0, sizeof(msg));
+  msg.request = GET_FEATURES;
+  fe_send(&msg, 0, -1, 1);
+  fail_unless (msg.u.u64 & (1ULL << 30), "no protocol features");
+  msg.request = SET_FEATURES;
+  msg.flags = 0;
+  fe_send(&msg, sizeof(msg.u.u64), -1, 0);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.request = GET_PROTOCOL_FEATURES;
+  fe_send(&msg, 0, -1, 1);
+  fail_unless (msg.u.u64 & (1ULL << 3), "no reply ack");
+  msg.request = SET_PROTOCOL_FEATURES;
+  msg.flags = 0;
+  fe_send(&msg, sizeof(msg.u.u64), -1, 0);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.request = SET_OWNER;
+  fe_send(&msg, 0, -1, 0);
+
+  // guest physical addresses start at zero
+  memset(&msg, 0, sizeof(msg));
+  msg.request = SET_MEM_TABLE;
+  msg.u.mem.nregions = 1;
+  msg.u.mem.size = MEM_SIZE;
+  msg.u.mem.uaddr = (uintptr_t)f_mem;
+  fe_send(&msg, sizeof(msg.u.mem), memfd, 0);
+  close(memfd);
+
+  fe_setup_vq(0);
+  fe_setup_vq(1);
+
+  for (i = 0; i < LOOP_MAX && f_conn == NULL; i++) {
+    f_loop_once();
+  }
+  fail_if (f_conn == NULL, "connection not accepted");
+}
+
+void
+teardown (void)
+{
+  int i;
+
+  if (f_conn != NULL) {
+    vde_connection_fini(f_conn);
+    vde_connection_delete(f_conn);
+  }
+  close(f_fd);
+  for (i = 0; i < 2; i++) {
+    close(f_vqs[i].kick);
+    close(f_vqs[i].call);
+  }
+  munmap(f_mem, MEM_SIZE);
+  // the listening socket is removed while events can still be deleted
+  vde_context_component_del(f_ctx, f_tr);
+  vde_context_fini(f_ctx);
+  vde_context_delete(f_ctx);
+}
+
+
+V_START_TEST (test_vhost_user_tx)
+{
+  int i;
+  char *buf = fe_buf(1, 0);
+
+  memset(buf, 0, NET_HDR_LEN);
+  memset(buf + NET_HDR_LEN, 0x5a, 60);
+  fe_add_buf(1, 0, NET_HDR_LEN + 60);
+  fe_kick(1);
+
+  for (i = 0; i < LOOP_MAX && f_read == 0; i++) {
+    f_loop_once();
+  }
+  fail_unless (f_read == 1, "frame not received");
+  fail_unless (f_frame_len == 60, "wrong frame length %u", f_frame_len);
+  fail_unless (f_frame[0] == 0x5a && f_frame[59] == 0x5a, "wrong frame");
+  fail_unless (fe_used_idx(1) == 1, "buffer not used");
+  fail_unless (f_vqs[1].used[1] == 0, "wrong used buffer");
+}
+END_TEST
+
+V_START_TEST (test_vhost_user_rx)
+{
+  uint64_t calls;
+  uint16_t num_buffers;
+  char *buf = fe_buf(0, 0);
+  vde_pkt *pkt;
+
+  fe_add_buf(0, 0, BUF_SIZE);
+
+  pkt = vde_pool_pkt_new(vde_context_get_pool(f_ctx), 1514, 0, 0);
+  pkt->hdr->pkt_len = 100;
+  memset(pkt->payload, 0xa5, 100);
+  fail_if (vde_connection_write(f_conn, pkt), "write failed");
+  vde_pkt_put(pkt);
+
+  fail_unless (fe_used_idx(0) == 1, "buffer not used");
+  fail_unless (f_vqs[0].used[2] == NET_HDR_LEN + 100, "wrong used length");
+  memcpy(&num_buffers, buf + 10, sizeof(num_buffers));
+  fail_unless (num_buffers == 1, "wrong num_buffers");
+  fail_unless (buf[NET_HDR_LEN] == (char)0xa5 &&
+               buf[NET_HDR_LEN + 99] == (char)0xa5, "wrong frame");
+  fail_unless (read(f_vqs[0].call, &calls, sizeof(calls)) == sizeof(calls),
+               "guest not called");
+}
+END_TEST
+
+V_START_TEST (test_vhost_user_rx_queue)
+{
+  int i;
+  char *buf = fe_buf(0, 1);
+  vde_pkt *pkt;
+
+  // no receive buffers yet, the packet is queued
+  pkt = vde_pool_pkt_new(vde_context_get_pool(f_ctx), 1514, 0, 0);
+  pkt->hdr->pkt_len = 60;
+  memset(pkt->payload, 0x3c, 60);
+  fail_if (vde_connection_write(f_conn, pkt), "write failed");
+  vde_pkt_put(pkt);
+  f_loop_once();
+  fail_unless (fe_used_idx(0) == 0, "buffer used");
+
+  fe_add_buf(0, 1, BUF_SIZE);
+  fe_kick(0);
+  for (i = 0; i < LOOP_MAX && fe_used_idx(0) == 0; i++) {
+    f_loop_once();
+  }
+  fail_unless (fe_used_idx(0) == 1, "queued packet not sent");
+  fail_unless (f_vqs[0].used[1] == 1, "wrong used buffer");
+  fail_unless (buf[NET_HDR_LEN] == 0x3c, "wrong frame");
+}
+END_TEST
+
+V_START_TEST (test_vhost_user_rx_bad_desc)
+{
+  int i;
+  char *buf = fe_buf(0, 1);
+  vde_pkt *pkt;
+
+  // the first buffer is not writable, it is given back and the packet dropped
+  fe_add_buf(0, 0, BUF_SIZE);
+  f_vqs[0].desc[0].flags = 0;
+  fe_add_buf(0, 1, BUF_SIZE);
+
+  for (i = 0; i < 2; i++) {
+    pkt = vde_pool_pkt_new(vde_context_get_pool(f_ctx), 1514, 0, 0);
+    pkt->hdr->pkt_len = 60;
+    memset(pkt->payload, 0x11 * (i + 1), 60);
+    fail_if (vde_connection_write(f_conn, pkt), "write failed");
+    vde_pkt_put(pkt);
+  }
+
+  fail_unless (fe_used_idx(0) == 2, "buffers not used");
+  fail_unless (f_vqs[0].used[1] == 0 && f_vqs[0].used[2] == 0,
+               "invalid buffer not given back");
+  fail_unless (f_vqs[0].used[3] == 1 &&
+               f_vqs[0].used[4] == NET_HDR_LEN + 60, "wrong used buffer");
+  fail_unless (buf[NET_HDR_LEN] == 0x22, "wrong frame");
+}
+END_TEST
+
+V_START_TEST (test_vhost_user_frontend_gone)
+{
+  int i;
+
+  shutdown(f_fd, SHUT_RDWR);
+  for (i = 0; i < LOOP_MAX && f_errors == 0; i++) {
+    f_loop_once();
+  }
+  fail_unless (f_errors == 1, "frontend close not reported");
+}
+END_TEST
+
+Suite *
+vhost_user_suite (void)
+{
+  Suite *s = suite_create ("vhost_user");
+
+  /* Core test case */
+  TCase *tc_core = tcase_create ("Core");
+  tcase_add_checked_fixture (tc_core, setup, teardown);
+  tcase_add_test (tc_core, test_vhost_user_tx);
+  tcase_add_test (tc_core, test_vhost_user_rx);
+  tcase_add_test (tc_core, test_vhost_user_rx_queue);
+  tcase_add_test (tc_core, test_vhost_user_rx_bad_desc);
+  tcase_add_test (tc_core, test_vhost_user_frontend_gone);
+  suite_add_tcase (s, tc_core);
+  return s;
+}
+
+int
+main (void)
+{
+  int number_failed;
+  Suite *s = vhost_user_suite ();
+  SRunner *sr = srunner_create (s);
+  srunner_run_all (sr, CK_NORMAL);
+  number_failed = srunner_ntests_failed (sr);
+  srunner_free (sr);
+  return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}